@@ -19,6 +19,8 @@
 #endif
 
 #include "common.c"
+#include "arena.c"
+#include "sync.c"
 #include "ape.c"
 #include "id3.c"
 
@@ -36,9 +38,12 @@
 #include "wavpack.c"
 #include "dsf.c"
 #include "dsdiff.c"
+#include "detect.c"
 
 #include "md5.c"
 #include "jenkins_hash.c"
+#include "cache.c"
+#include "seek.c"
 
 #define FILTER_TYPE_INFO 0x01
 #define FILTER_TYPE_TAGS 0x02
@@ -80,7 +85,7 @@ struct _types audio_types[] = {
 
 static taghandler taghandlers[] = {
   { "mp4", get_mp4tags, 0, mp4_find_frame, mp4_find_frame_return_info },
-  { "aac", get_aacinfo, 0, 0, 0 },
+  { "aac", get_aacinfo, 0, aac_find_frame, 0 },
   { "mp3", get_mp3tags, get_mp3fileinfo, mp3_find_frame, 0 },
   { "ogg", get_ogg_metadata, 0, ogg_find_frame, 0 },
   { "ogf", get_ogf_metadata, 0, ogf_find_frame, ogf_find_frame_return_info },
@@ -96,32 +101,125 @@ static taghandler taghandlers[] = {
   { NULL, 0, 0, 0 }
 };
 
+static seekhandler seekhandlers[] = {
+  { "mp4", mp4_seek_open, mp4_seek },
+  { "aac", aac_seek_open, aac_seek },
+  { "mp3", mp3_seek_open, mp3_seek },
+  { "ogg", ogg_seek_open, ogg_seek },
+  { "ogf", ogf_seek_open, ogf_seek },
+  { "opus", opus_seek_open, opus_seek },
+  { "flc", flac_seek_open, flac_seek },
+  { "asf", asf_seek_open, asf_seek },
+  { NULL, 0, 0 }
+};
+
+// Open-addressed index from suffix to handler, built once from audio_types
+#define SUFFIX_INDEX_BITS 6
+#define SUFFIX_INDEX_SIZE (1 << SUFFIX_INDEX_BITS)
+
+static uint64_t suffix_keys[SUFFIX_INDEX_SIZE];
+static taghandler *suffix_handlers[SUFFIX_INDEX_SIZE];
+static int suffix_index_ready = 0;
+
+// Packs a lowercased suffix of up to 8 ASCII characters into an integer,
+// or returns 0 if it is too long or not ASCII and so can't be known
+static uint64_t
+_suffix_key(const char *suffix)
+{
+  uint64_t key = 0;
+  int i;
+
+  for (i = 0; suffix[i]; i++) {
+    unsigned char c = (unsigned char)suffix[i];
+
+    if (i == 8 || c >= 0x80)
+      return 0;
+
+    if (c >= 'A' && c <= 'Z')
+      c += 'a' - 'A';
+
+    key = (key << 8) | c;
+  }
+
+  return key;
+}
+
+static int
+_suffix_slot(uint64_t key)
+{
+  return (int)((key * UINT64_C(0x9E3779B97F4A7C15)) >> (64 - SUFFIX_INDEX_BITS));
+}
+
 static taghandler *
-_get_taghandler(char *suffix)
+_type_taghandler(const char *type)
 {
-  int typeindex = -1;
-  int i, j;
-  taghandler *hdl = NULL;
-  
-  for (i=0; typeindex==-1 && audio_types[i].type; i++) {
-    for (j=0; typeindex==-1 && audio_types[i].suffix[j]; j++) {
-#ifdef _MSC_VER
-      if (!stricmp(audio_types[i].suffix[j], suffix)) {
-#else
-      if (!strcasecmp(audio_types[i].suffix[j], suffix)) {
-#endif
-        typeindex = i;
-        break;
-      }
+  taghandler *hdl;
+
+  for (hdl = taghandlers; hdl->type; ++hdl)
+    if (!strcmp(hdl->type, type))
+      return hdl;
+
+  return NULL;
+}
+
+static void
+_suffix_index_init(void)
+{
+  int i, j, slot;
+  uint64_t key;
+
+  if (suffix_index_ready)
+    return;
+
+  for (i = 0; audio_types[i].type; i++) {
+    for (j = 0; audio_types[i].suffix[j]; j++) {
+      key = _suffix_key(audio_types[i].suffix[j]);
+
+      for (slot = _suffix_slot(key); suffix_keys[slot]; slot = (slot + 1) & (SUFFIX_INDEX_SIZE - 1)) ;
+
+      suffix_keys[slot] = key;
+      suffix_handlers[slot] = _type_taghandler(audio_types[i].type);
     }
   }
-    
-  if (typeindex > -1) {
-    for (hdl = taghandlers; hdl->type; ++hdl)
-      if (!strcmp(hdl->type, audio_types[typeindex].type))
-        break;
+
+  suffix_index_ready = 1;
+}
+
+static taghandler *
+_get_taghandler(char *suffix)
+{
+  uint64_t key = _suffix_key(suffix);
+  int slot;
+
+  if (!key)
+    return NULL;
+
+  for (slot = _suffix_slot(key); suffix_keys[slot]; slot = (slot + 1) & (SUFFIX_INDEX_SIZE - 1)) {
+    if (suffix_keys[slot] == key)
+      return suffix_handlers[slot];
   }
-  
+
+  return NULL;
+}
+
+static seekctx *
+_seek_context_from(SV *self)
+{
+  if ( !sv_isobject(self) || !sv_derived_from(self, "Audio::Scan::SeekContext") )
+    croak("Audio::Scan::SeekContext method called without an object");
+
+  return INT2PTR(seekctx *, SvIV(SvRV(self)));
+}
+
+// The handler for the file's content, or hdl if it isn't recognised
+static taghandler *
+_detect_taghandler(PerlIO *infile, taghandler *hdl)
+{
+  const char *type = detect_type(infile);
+
+  if (type != NULL)
+    return _type_taghandler(type);
+
   return hdl;
 }
 
@@ -183,117 +281,645 @@ out:
   buffer_free(&buf);
 }
 
-static uint32_t
-_generate_hash(const char *file)
+static int
+_stat_file(const char *file, int64_t *mtime, uint64_t *size)
 {
-  char hashstr[MAX_PATH_STR_LEN];
-  int mtime = 0;
-  uint64_t size = 0;
-  uint32_t hash;
-
 #ifdef _MSC_VER
-  BOOL fOk;
   WIN32_FILE_ATTRIBUTE_DATA fileInfo;
 
-  fOk = GetFileAttributesEx(file, GetFileExInfoStandard, (void *)&fileInfo);
-  mtime = fileInfo.ftLastWriteTime.dwLowDateTime;
-  size = (uint64_t)fileInfo.nFileSizeLow;
+  if ( !GetFileAttributesEx(file, GetFileExInfoStandard, (void *)&fileInfo) )
+    return 0;
+
+  *mtime = fileInfo.ftLastWriteTime.dwLowDateTime;
+  *size = (uint64_t)fileInfo.nFileSizeLow;
 #else
   struct stat buf;
 
-  if (stat(file, &buf) != -1) {
-    mtime = (int)buf.st_mtime;
-    size = (uint64_t)buf.st_size;
-  }
+  if (stat(file, &buf) == -1)
+    return 0;
+
+  *mtime = (int64_t)buf.st_mtime;
+  *size = (uint64_t)buf.st_size;
 #endif
 
+  return 1;
+}
+
+static uint32_t
+_hash_file(const char *file, int64_t mtime, uint64_t size)
+{
+  char hashstr[MAX_PATH_STR_LEN];
+
   memset(hashstr, 0, sizeof(hashstr));
-  snprintf(hashstr, sizeof(hashstr) - 1, "%s%d%llu", file, mtime, size);
-  hash = hashlittle(hashstr, strlen(hashstr), 0);
-  
-  return hash;
+  snprintf(hashstr, sizeof(hashstr) - 1, "%s%d%llu", file, (int)mtime, size);
+
+  return hashlittle(hashstr, strlen(hashstr), 0);
 }
 
-MODULE = Audio::Scan		PACKAGE = Audio::Scan
+static uint32_t
+_generate_hash(const char *file)
+{
+  int64_t mtime = 0;
+  uint64_t size = 0;
 
-HV *
-_scan( char *dummy, char *suffix, PerlIO *infile, SV *path, int filter, int md5_size, int md5_offset )
-CODE:
+  _stat_file(file, &mtime, &size);
+
+  return _hash_file(file, mtime, size);
+}
+
+// Everything besides the file itself that changes a scan result,
+// cached results are only used for scans with the same signature
+static void
+_append_projection(SV *sig, const char *name, HV *want)
 {
-  taghandler *hdl;
-  RETVAL = newHV();
-  
-  // don't leak
-  sv_2mortal( (SV*)RETVAL );
-  
-  hdl = _get_taghandler(suffix);
-  
-  if (hdl) {
-    HV *info = newHV();
+  AV *keys;
+  HE *he;
+  SSize_t i;
+
+  if (want == NULL)
+    return;
+
+  keys = (AV *)sv_2mortal( (SV *)newAV() );
+
+  hv_iterinit(want);
+  while ( (he = hv_iternext(want)) != NULL ) {
+    I32 klen;
+    char *key = hv_iterkey(he, &klen);
+    SV *k = newSVpvn(key, klen);
+
+    sv_catpv( k, SvTRUE( hv_iterval(want, he) ) ? "=1" : "=0" );
+    av_push(keys, k);
+  }
+
+  sortsv( AvARRAY(keys), av_len(keys) + 1, Perl_sv_cmp );
+
+  sv_catpv(sig, name);
+  for (i = 0; i <= av_len(keys); i++) {
+    sv_catpvn(sig, "\0", 1);
+    sv_catsv(sig, *av_fetch(keys, i, 0));
+  }
+  sv_catpvn(sig, "\n", 1);
+}
+
+// 1 for vbr_scan => 'sample', 0 for the default 'full'
+static int
+_vbr_scan_option(SV *mode)
+{
+  const char *str;
+
+  if ( mode == NULL || !SvOK(mode) )
+    return 0;
+
+  str = SvPV_nolen(mode);
+
+  if ( !strcmp(str, "sample") )
+    return 1;
+
+  if ( strcmp(str, "full") )
+    croak("Audio::Scan vbr_scan must be 'full' or 'sample'");
+
+  return 0;
+}
+
+static SV *
+_scan_signature(int filter, int md5_size, int md5_offset, int frame_index, int vbr_sample, int offsets, HV *want_fields, HV *want_tags)
+{
+  SV *sig = sv_2mortal( newSVpvf( "filter=%d md5=%d,%d no_artwork=%d\n",
+    filter, md5_size, md5_offset, _env_true("AUDIO_SCAN_NO_ARTWORK") ) );
+
+  // Only added when set, so results cached before the option existed stay valid
+  if (frame_index)
+    sv_catpv(sig, "frame_index=1\n");
+  if (vbr_sample)
+    sv_catpv(sig, "vbr_scan=sample\n");
+  if (offsets)
+    sv_catpv(sig, "offsets=1\n");
+
+  _append_projection(sig, "fields", want_fields);
+  _append_projection(sig, "tags", want_tags);
+
+  return sig;
+}
+
+// Returns a mortal hash, so nothing leaks if a parser croaks.  With detect
+// set, hdl comes from the file's extension and the content is only looked
+// at if that parser finds no audio.
+static HV *
+_scan_file(taghandler *hdl, int detect, PerlIO *infile, char *path, int filter, int md5_size, int md5_offset, int frame_index, int vbr_sample, int offsets, HV *want_fields, HV *want_tags)
+{
+  dMY_CXT;
+  HV *ret = (HV *)sv_2mortal( (SV *)newHV() );
+  HV *info = (HV *)sv_2mortal( (SV *)newHV() );
+  HV *tags = NULL;
+  taghandler *found;
+  int wanted = filter;
+
+  ENTER;
+  _scan_enter();
+
+  // Parsers consult the tags projection through _tag_wanted
+  SAVEVPTR(MY_CXT.want_tags);
+  MY_CXT.want_tags = want_tags;
+
+  // The MP3 parser walks all frames for frame_index, and only reads parts of
+  // VBR files without a Xing header for vbr_scan => 'sample'
+  SAVEVPTR(MY_CXT.frame_index);
+  MY_CXT.frame_index = frame_index ? &PL_sv_yes : NULL;
+  SAVEINT(MY_CXT.vbr_sample);
+  MY_CXT.vbr_sample = vbr_sample;
+
+  // Parsers list where tag fields are stored with _store_tag_offset
+  SAVEINT(MY_CXT.offsets);
+  MY_CXT.offsets = offsets;
+
+  for (;;) {
+    filter = wanted;
 
     // Ignore filter if a file type has only one function (FLAC/Ogg)
     if ( !hdl->get_fileinfo ) {
       filter = FILTER_TYPE_INFO | FILTER_TYPE_TAGS;
     }
+    else {
+      // An empty projection works like a filter
+      if ( want_fields != NULL && !HvUSEDKEYS(want_fields) )
+        filter &= ~FILTER_TYPE_INFO;
+      if ( want_tags != NULL && !HvUSEDKEYS(want_tags) )
+        filter &= ~FILTER_TYPE_TAGS;
+    }
 
     if ( hdl->get_fileinfo && (filter & FILTER_TYPE_INFO) ) {
-      hdl->get_fileinfo(infile, SvPVX(path), info);
+      hdl->get_fileinfo(infile, path, info);
     }
 
     if ( hdl->get_tags && (filter & FILTER_TYPE_TAGS) ) {
-      HV *tags = newHV();
-      hdl->get_tags(infile, SvPVX(path), info, tags);
-      hv_store( RETVAL, "tags", 4, newRV_noinc( (SV *)tags ), 0 );
+      if (tags == NULL)
+        tags = (HV *)sv_2mortal( (SV *)newHV() );
+      hdl->get_tags(infile, path, info, tags);
     }
-    
-    // Generate audio MD5 value
-    if ( md5_size > 0
-      && my_hv_exists(info, "audio_offset")
-      && my_hv_exists(info, "audio_size")
-      && !my_hv_exists(info, "audio_md5")
-    ) {
-      _generate_md5(infile, SvPVX(path), md5_size, md5_offset, info);
+
+    if ( !detect || my_hv_exists(info, "audio_offset") )
+      break;
+
+    // No audio where the extension said, try the parser for the content
+    detect = 0;
+
+    if ( (found = _detect_taghandler(infile, hdl)) == hdl )
+      break;
+
+    DEBUG_TRACE("%s is not %s but %s, scanning again\n", path, hdl->type, found->type);
+
+    hdl = found;
+    hv_clear(info);
+    if (tags != NULL)
+      hv_clear(tags);
+    PerlIO_seek(infile, 0, SEEK_SET);
+  }
+
+  if (tags != NULL) {
+    _projection_prune(tags, want_tags);
+    hv_store( ret, "tags", 4, newRV_inc( (SV *)tags ), 0 );
+  }
+
+  // Generate audio MD5 value
+  if ( md5_size > 0
+    && my_hv_exists(info, "audio_offset")
+    && my_hv_exists(info, "audio_size")
+    && !my_hv_exists(info, "audio_md5")
+  ) {
+    _generate_md5(infile, path, md5_size, md5_offset, info);
+  }
+
+  // Generate hash value
+  if ( _projection_has(want_fields, "jenkins_hash", 12) ) {
+    my_hv_store(info, "jenkins_hash", newSVuv( _generate_hash(path) ));
+  }
+
+  _projection_prune(info, want_fields);
+
+  // Info may be used in tag function, i.e. to find tag version
+  hv_store( ret, "info", 4, newRV_inc( (SV *)info ), 0 );
+
+  LEAVE;
+
+  return ret;
+}
+
+static void
+_close_infile(pTHX_ void *infile)
+{
+  PerlIO_close((PerlIO *)infile);
+}
+
+// Open and scan path, or return the result stored in the cache when the
+// file hasn't changed.  Returns a mortal hash, or NULL if the file can't
+// be opened.
+static HV *
+_scan_path(scancache *cache, SV *sig, taghandler *hdl, char *path, int filter, int md5_size, int md5_offset, int frame_index, int vbr_sample, int offsets, HV *want_fields, HV *want_tags)
+{
+  PerlIO *infile;
+  HV *ret = NULL;
+  int64_t mtime = 0;
+  uint64_t size = 0;
+  uint32_t hash = 0;
+
+  // Stat before scanning, so a file changed while being read isn't
+  // stored under its new mtime
+  if ( cache != NULL ) {
+    if ( _stat_file(path, &mtime, &size) ) {
+      hash = _hash_file(path, mtime, size);
+
+      if ( (ret = cache_fetch(cache, hash, path, mtime, size, SvPVX(sig), SvCUR(sig))) != NULL ) {
+        DEBUG_TRACE("Using cached result for %s\n", path);
+        return ret;
+      }
     }
-    
-    // Generate hash value
-    my_hv_store(info, "jenkins_hash", newSVuv( _generate_hash(SvPVX(path)) ));
+    else {
+      cache = NULL;
+    }
+  }
 
-    // Info may be used in tag function, i.e. to find tag version
-    hv_store( RETVAL, "info", 4, newRV_noinc( (SV *)info ), 0 );
+  if ( (infile = PerlIO_open(path, "rb")) == NULL ) {
+    warn("Could not open %s for reading: %s\n", path, strerror(errno));
+    return NULL;
   }
-  else {
+
+  ENTER;
+
+  // Closed at LEAVE, even if a parser croaks
+  SAVEDESTRUCTOR_X(_close_infile, infile);
+
+  // The content is only looked at if the extension's parser finds no audio
+  ret = _scan_file(hdl, 1, infile, path, filter, md5_size, md5_offset, frame_index, vbr_sample, offsets, want_fields, want_tags);
+
+  LEAVE;
+
+  if (cache != NULL) {
+    cache_store(cache, hash, path, mtime, size, SvPVX(sig), SvCUR(sig), ret);
+  }
+
+  return ret;
+}
+
+// Same as the /\.(\w+)$/ match done in Audio::Scan->scan
+static char *
+_path_suffix(char *path)
+{
+  char *suffix = strrchr(path, '.');
+  char *p;
+
+  if (suffix == NULL || *++suffix == '\0')
+    return NULL;
+
+  for (p = suffix; *p; p++) {
+    if ( !isALNUM(*p) )
+      return NULL;
+  }
+
+  return suffix;
+}
+
+// Run when an interpreter is destroyed, including each exiting thread's, to
+// release what is kept between scans
+static void
+_interp_cleanup(pTHX_ void *unused)
+{
+  dMY_CXT;
+
+  cache_close_all();
+  buffer_free(&MY_CXT.id3_buf);
+  buffer_free(&MY_CXT.id3_utf8);
+  arena_free(&MY_CXT.scan_arena);
+}
+
+MODULE = Audio::Scan		PACKAGE = Audio::Scan
+
+BOOT:
+{
+  MY_CXT_INIT;
+  MY_CXT.mmaps = NULL;
+  arena_init(&MY_CXT.scan_arena);
+  MY_CXT.scan_depth = 0;
+  MY_CXT.seek_arena = NULL;
+  MY_CXT.want_tags = NULL;
+  MY_CXT.frame_index = NULL;
+  MY_CXT.vbr_sample = 0;
+  MY_CXT.offsets = 0;
+  MY_CXT.caches = NULL;
+  Zero(&MY_CXT.id3_buf, 1, Buffer);
+  Zero(&MY_CXT.id3_utf8, 1, Buffer);
+  _suffix_index_init();
+  // Cloned interpreters inherit the exit list, so this covers threads too
+  call_atexit(_interp_cleanup, NULL);
+}
+
+void
+CLONE(...)
+CODE:
+{
+  MY_CXT_CLONE;
+  // Mappings belong to the parent's filehandles
+  MY_CXT.mmaps = NULL;
+  arena_init(&MY_CXT.scan_arena);
+  MY_CXT.scan_depth = 0;
+  MY_CXT.seek_arena = NULL;
+  MY_CXT.want_tags = NULL;
+  MY_CXT.frame_index = NULL;
+  MY_CXT.vbr_sample = 0;
+  MY_CXT.offsets = 0;
+  // Each interpreter opens its own caches
+  MY_CXT.caches = NULL;
+  Zero(&MY_CXT.id3_buf, 1, Buffer);
+  Zero(&MY_CXT.id3_utf8, 1, Buffer);
+}
+
+HV *
+_scan( char *dummy, char *suffix, PerlIO *infile, SV *path, int filter, int md5_size, int md5_offset, SV *fields = NULL, SV *tags = NULL, int frame_index = 0, SV *vbr_scan = NULL, int offsets = 0, int detect = 0 )
+CODE:
+{
+  // Either a file extension or one of the types from detect_type
+  taghandler *hdl = _get_taghandler(suffix);
+  HV *want_fields;
+  HV *want_tags;
+  int vbr_sample;
+
+  // The extension decides whether a file is supported, as in _scan_cached
+  // and scan_many
+  if (!hdl) {
+    hdl = _type_taghandler(suffix);
+    detect = 0;
+  }
+
+  if (!hdl) {
     croak("Audio::Scan unsupported file type: %s (%s)", suffix, SvPVX(path));
   }
+
+  want_fields = _projection_new(fields, "fields");
+  want_tags   = _projection_new(tags, "tags");
+  vbr_sample  = _vbr_scan_option(vbr_scan);
+
+  // Already mortal, the typemap takes a new reference
+  RETVAL = _scan_file(hdl, detect, infile, SvPVX(path), filter, md5_size, md5_offset, frame_index, vbr_sample, offsets, want_fields, want_tags);
+}
+OUTPUT:
+  RETVAL
+
+SV *
+_scan_cached( char *dummy, char *cache_path, char *suffix, char *path, int filter, int md5_size, int md5_offset, SV *fields = NULL, SV *tags = NULL, int frame_index = 0, SV *vbr_scan = NULL, int offsets = 0 )
+CODE:
+{
+  taghandler *hdl = _get_taghandler(suffix);
+  scancache *cache;
+  HV *want_fields;
+  HV *want_tags;
+  int vbr_sample;
+  HV *ret;
+
+  if (!hdl) {
+    croak("Audio::Scan unsupported file type: %s (%s)", suffix, path);
+  }
+
+  want_fields = _projection_new(fields, "fields");
+  want_tags   = _projection_new(tags, "tags");
+  vbr_sample  = _vbr_scan_option(vbr_scan);
+
+  cache = cache_get(cache_path);
+
+  ret = _scan_path(
+    cache, _scan_signature(filter, md5_size, md5_offset, frame_index, vbr_sample, offsets, want_fields, want_tags),
+    hdl, path, filter, md5_size, md5_offset, frame_index, vbr_sample, offsets, want_fields, want_tags
+  );
+
+  RETVAL = ret ? newRV_inc( (SV *)ret ) : newSV(0);
+}
+OUTPUT:
+  RETVAL
+
+SV *
+scan_many( char *dummy, AV *paths, HV *opts = NULL )
+CODE:
+{
+  int filter = FILTER_TYPE_INFO | FILTER_TYPE_TAGS;
+  int md5_size = 0;
+  int md5_offset = 0;
+  int frame_index = 0;
+  int vbr_sample = 0;
+  int offsets = 0;
+  SV *callback = NULL;
+  HV *want_fields = NULL;
+  HV *want_tags = NULL;
+  scancache *cache = NULL;
+  SV *sig;
+  AV *results = NULL;
+  SV **entry;
+  SSize_t i;
+
+  if (opts != NULL) {
+    if ( (entry = my_hv_fetch(opts, "filter")) != NULL && SvTRUE(*entry) )
+      filter = SvIV(*entry);
+    if ( (entry = my_hv_fetch(opts, "md5_size")) != NULL && SvOK(*entry) )
+      md5_size = SvIV(*entry);
+    if ( (entry = my_hv_fetch(opts, "md5_offset")) != NULL && SvOK(*entry) )
+      md5_offset = SvIV(*entry);
+    if ( (entry = my_hv_fetch(opts, "frame_index")) != NULL )
+      frame_index = SvTRUE(*entry) ? 1 : 0;
+    if ( (entry = my_hv_fetch(opts, "vbr_scan")) != NULL )
+      vbr_sample = _vbr_scan_option(*entry);
+    if ( (entry = my_hv_fetch(opts, "offsets")) != NULL )
+      offsets = SvTRUE(*entry) ? 1 : 0;
+    if ( (entry = my_hv_fetch(opts, "callback")) != NULL && SvOK(*entry) ) {
+      if ( !SvROK(*entry) || SvTYPE(SvRV(*entry)) != SVt_PVCV )
+        croak("Audio::Scan::scan_many callback must be a code reference");
+      callback = *entry;
+    }
+    if ( (entry = my_hv_fetch(opts, "fields")) != NULL )
+      want_fields = _projection_new(*entry, "fields");
+    if ( (entry = my_hv_fetch(opts, "tags")) != NULL )
+      want_tags = _projection_new(*entry, "tags");
+    if ( (entry = my_hv_fetch(opts, "cache")) != NULL && SvTRUE(*entry) )
+      cache = cache_get( SvPV_nolen(*entry) );
+  }
+
+  sig = _scan_signature(filter, md5_size, md5_offset, frame_index, vbr_sample, offsets, want_fields, want_tags);
+
+  if (!callback) {
+    results = (AV *)sv_2mortal( (SV *)newAV() );
+    av_extend(results, av_len(paths));
+  }
+
+  for (i = 0; i <= av_len(paths); i++) {
+    SV **p = av_fetch(paths, i, 0);
+    SV *result = &PL_sv_undef;
+    char *path;
+    char *suffix;
+    taghandler *hdl;
+    HV *ret;
+
+    ENTER;
+    SAVETMPS;
+
+    if (p == NULL || !SvOK(*p))
+      goto next;
+
+    path = SvPV_nolen(*p);
+
+    if ( (suffix = _path_suffix(path)) == NULL ) {
+      warn("Audio::Scan unsupported file type: no extension (%s)\n", path);
+      goto next;
+    }
+
+    if ( (hdl = _get_taghandler(suffix)) == NULL ) {
+      warn("Audio::Scan unsupported file type: %s (%s)\n", suffix, path);
+      goto next;
+    }
+
+    if ( (ret = _scan_path(cache, sig, hdl, path, filter, md5_size, md5_offset, frame_index, vbr_sample, offsets, want_fields, want_tags)) != NULL )
+      result = sv_2mortal( newRV_inc( (SV *)ret ) );
+
+  next:
+    if (callback) {
+      dSP;
+      PUSHMARK(SP);
+      XPUSHs(p != NULL ? *p : &PL_sv_undef);
+      XPUSHs(result);
+      PUTBACK;
+      call_sv(callback, G_DISCARD);
+    }
+    else {
+      av_store(results, i, result == &PL_sv_undef ? newSV(0) : SvREFCNT_inc_simple_NN(result));
+    }
+
+    FREETMPS;
+    LEAVE;
+  }
+
+  RETVAL = results ? newRV_inc( (SV *)results ) : newSV(0);
 }
 OUTPUT:
   RETVAL
   
 IV
-_find_frame( char *dummy, char *suffix, PerlIO *infile, SV *path, int offset )
+_find_frame( char *dummy, char *suffix, PerlIO *infile, SV *path, int offset, UV track = 0, SV *frame_index = NULL )
 CODE:
 {
+  dMY_CXT;
   taghandler *hdl;
   
   RETVAL = -1;
   hdl = _get_taghandler(suffix);
   
   if (hdl && hdl->find_frame) {
-    RETVAL = hdl->find_frame(infile, SvPVX(path), offset);
+    ENTER;
+    _scan_enter();
+    SAVEVPTR(MY_CXT.frame_index);
+    MY_CXT.frame_index = frame_index;
+    // Only MP4 files have more than one track to choose from
+    if ( track && !strcmp(hdl->type, "mp4") )
+      RETVAL = mp4_find_frame_track(infile, SvPVX(path), offset, track);
+    else
+      RETVAL = hdl->find_frame(infile, SvPVX(path), offset);
+    LEAVE;
   }
 }
 OUTPUT:
   RETVAL
 
 HV *
-_find_frame_return_info( char *dummy, char *suffix, PerlIO *infile, SV *path, int offset )
+_find_frame_return_info( char *dummy, char *suffix, PerlIO *infile, SV *path, int offset, UV track = 0, SV *frame_index = NULL )
 CODE:
 {
+  dMY_CXT;
   taghandler *hdl = _get_taghandler(suffix);
   RETVAL = newHV();
   sv_2mortal((SV*)RETVAL);
   
   if (hdl && hdl->find_frame_return_info) {
-    hdl->find_frame_return_info(infile, SvPVX(path), offset, RETVAL);
+    ENTER;
+    _scan_enter();
+    SAVEVPTR(MY_CXT.frame_index);
+    MY_CXT.frame_index = frame_index;
+    if ( track && !strcmp(hdl->type, "mp4") )
+      mp4_find_frame_track_return_info(infile, SvPVX(path), offset, track, RETVAL);
+    else
+      hdl->find_frame_return_info(infile, SvPVX(path), offset, RETVAL);
+    LEAVE;
+  }
+}
+OUTPUT:
+  RETVAL
+
+SV *
+_get_artwork( char *dummy, char *suffix, PerlIO *infile, SV *path, int index )
+CODE:
+{
+  dMY_CXT;
+  taghandler *hdl = _get_taghandler(suffix);
+  HV *want_tags = (HV *)sv_2mortal( (SV *)newHV() );
+
+  // Only cover art is looked at, other tags are skipped undecoded
+  my_hv_store( want_tags, "COVR", newSVuv(1) );
+
+  if ( hdl && !strcmp(hdl->type, "mp4") ) {
+    ENTER;
+    _scan_enter();
+    SAVEVPTR(MY_CXT.want_tags);
+    MY_CXT.want_tags = want_tags;
+    RETVAL = mp4_get_artwork(infile, SvPVX(path), index);
+    LEAVE;
+  }
+  else {
+    RETVAL = newSV(0);
+  }
+}
+OUTPUT:
+  RETVAL
+
+SV *
+_detect_type( char *dummy, PerlIO *infile )
+CODE:
+{
+  const char *type = detect_type(infile);
+
+  RETVAL = type ? newSVpv(type, 0) : newSV(0);
+}
+OUTPUT:
+  RETVAL
+
+SV *
+_seek_context( char *dummy, char *suffix, char *path, SV *frame_index = NULL )
+CODE:
+{
+  dMY_CXT;
+  taghandler *hdl = _get_taghandler(suffix);
+  seekhandler *shdl = NULL;
+  seekctx *ctx;
+  PerlIO *infile;
+
+  RETVAL = newSV(0);
+
+  if ( (infile = PerlIO_open(path, "rb")) == NULL ) {
+    warn("Could not open %s for reading: %s\n", path, strerror(errno));
+  }
+  else {
+    if ( (hdl = _detect_taghandler(infile, hdl)) != NULL ) {
+      for (shdl = seekhandlers; shdl->type; ++shdl)
+        if (!strcmp(shdl->type, hdl->type))
+          break;
+    }
+
+    if (shdl == NULL || shdl->type == NULL) {
+      PerlIO_close(infile);
+    }
+    else {
+      ENTER;
+      SAVEVPTR(MY_CXT.frame_index);
+      MY_CXT.frame_index = frame_index;
+
+      if ( (ctx = seek_context_new(shdl, infile, path)) != NULL ) {
+        sv_setref_pv(RETVAL, "Audio::Scan::SeekContext", (void *)ctx);
+      }
+
+      LEAVE;
+    }
   }
 }
 OUTPUT:
@@ -388,3 +1014,21 @@ CODE:
 }
 OUTPUT:
   RETVAL
+
+MODULE = Audio::Scan		PACKAGE = Audio::Scan::SeekContext
+
+IV
+find_frame( SV *self, int offset )
+CODE:
+{
+  RETVAL = seek_context_find( _seek_context_from(self), offset );
+}
+OUTPUT:
+  RETVAL
+
+void
+DESTROY( SV *self )
+CODE:
+{
+  seek_context_free( _seek_context_from(self) );
+}
@@ -16,6 +16,12 @@
 
 #define AAC_BLOCK_SIZE 4096
 
+// Frames between entries of the seek index, about 1.5 seconds at 44.1kHz
+#define AAC_INDEX_INTERVAL 64
+
+// ADTS headers are 7 bytes, 9 with a CRC
+#define ADTS_HEADER_SIZE 7
+
 static int adts_sample_rates[] = {
   96000,
   88200,
@@ -42,6 +48,53 @@ const char *aac_profiles[] = {
   "reserved"
 };
 
+// One entry of the sparse seek index
+struct aac_index {
+  uint64_t sample;  // first sample of the frame
+  off_t offset;
+};
+
+typedef struct aacinfo {
+  PerlIO *infile;
+  char *file;
+  Buffer *buf;
+  HV *info;
+
+  off_t file_size;
+  off_t audio_offset;
+
+  // Fixed header fields of the first frame, every frame must match them
+  uint8_t profile;
+  uint8_t sr_index;
+  uint8_t channels;
+  uint32_t samplerate;
+
+  // Totals of the frame walk
+  uint32_t frames;
+  uint64_t total_samples;
+  uint64_t total_bytes;
+
+  // ADTS headers are read straight from the file's mapping if there is one,
+  // else through a window of the file starting at win_offset
+  unsigned char *map;
+  off_t map_size;
+  Buffer *win;
+  off_t win_offset;
+
+  uint8_t seeking;
+  struct aac_index *index;
+  uint32_t num_index;
+  uint32_t max_index;
+} aacinfo;
+
 static int get_aacinfo(PerlIO *infile, char *file, HV *info, HV *tags);
+off_t aac_find_frame(PerlIO *infile, char *file, int offset);
+void * aac_seek_open(PerlIO *infile, char *file, HV *info, HV *tags);
+off_t aac_seek(void *state, PerlIO *infile, char *file, HV *info, int offset);
 
-int aac_parse_adts(PerlIO *infile, char *file, off_t audio_size, Buffer *buf, HV *info);
+aacinfo * _aac_parse(PerlIO *infile, char *file, HV *info, HV *tags, uint8_t seeking);
+int aac_parse_adts(aacinfo *aac);
+void _aac_walk(aacinfo *aac);
+static unsigned char * _aac_header_at(aacinfo *aac, off_t offset);
+static uint32_t _aac_frame_at(aacinfo *aac, off_t offset, uint32_t *samples);
+static off_t _aac_next_frame(aacinfo *aac, off_t offset, uint32_t *frame_length, uint32_t *samples);
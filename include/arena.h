@@ -0,0 +1,46 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#define ARENA_CHUNK_SIZE 8192
+#define ARENA_ALIGN      8
+#define ARENA_KEEP       8   // chunks kept by arena_reset for reuse
+#define ARENA_MAX_ALLOC  0x40000000
+
+/*
+ * Bump allocator: many small allocations carved out of a few large
+ * chunks, all released together by arena_reset() or arena_free().
+ */
+typedef struct arena_chunk {
+  struct arena_chunk *next;
+  size_t size;        // usable bytes following the header
+  size_t used;
+} arena_chunk;
+
+typedef struct {
+  arena_chunk *head;  // chunk currently being filled
+  arena_chunk *spare; // empty chunks kept by arena_reset
+} Arena;
+
+void arena_init(Arena *arena);
+void * arena_alloc(Arena *arena, size_t size);
+char * arena_strndup(Arena *arena, const char *s, uint32_t len);
+void arena_reset(Arena *arena);
+void arena_free(Arena *arena);
+
+#endif
@@ -217,6 +217,9 @@ void _parse_index(asfinfo *asf, uint64_t size);
 void _parse_content_encryption(asfinfo *asf);
 void _parse_extended_content_encryption(asfinfo *asf);
 void _parse_script_command(asfinfo *asf);
+void _asf_object_offset(asfinfo *asf, GUID *id, uint64_t size);
 SV *_parse_picture(asfinfo *asf, uint32_t picture_offset);
 off_t asf_find_frame(PerlIO *infile, char *file, int offset);
+void * asf_seek_open(PerlIO *infile, char *file, HV *info, HV *tags);
+off_t asf_seek(void *state, PerlIO *infile, char *file, HV *info, int time_offset);
 int _timestamp(asfinfo *asf, int offset, int *duration);
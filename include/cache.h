@@ -0,0 +1,60 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#if defined(AUDIO_SCAN_MMAP)
+# define AUDIO_SCAN_CACHE
+# include <fcntl.h>
+# include <unistd.h>
+#endif
+
+#define CACHE_HEADER_SIZE  32
+#define CACHE_RECORD_MAGIC 0x41534352  // "ASCR"
+#define CACHE_RECORD_SIZE  40          // fixed part of a record, see cache.c
+#define CACHE_MAX_DEPTH    32          // nesting limit for stored results
+
+/*
+ * A persistent cache of scan results.  The file is append-only: each
+ * record holds the path, mtime and size of the scanned file, a signature
+ * of the scan options and the serialized result.  Records are found
+ * through an in-memory index keyed by the same Jenkins hash returned as
+ * jenkins_hash, built from a read-only mapping of the file and extended
+ * whenever the file grows.  Writes are serialized with an fcntl lock so
+ * several processes on one machine can share a cache.
+ */
+typedef struct cache_entry {
+  uint32_t hash;
+  off_t offset;
+  struct cache_entry *next;
+} cache_entry;
+
+typedef struct scancache {
+  char *path;
+  int fd;
+  int broken;          // damaged record found, stop using the file
+  unsigned char *map;
+  off_t mapped;
+  off_t indexed;       // end of the last indexed record
+  cache_entry **buckets;
+  uint32_t nbuckets;
+  uint32_t count;
+  struct scancache *next;
+} scancache;
+
+scancache * cache_get(const char *path);
+HV * cache_fetch(scancache *c, uint32_t hash, const char *path, int64_t mtime, uint64_t size, const char *sig, uint32_t sig_len);
+void cache_store(scancache *c, uint32_t hash, const char *path, int64_t mtime, uint64_t size, const char *sig, uint32_t sig_len, HV *result);
+void cache_close_all(void);
@@ -50,8 +50,67 @@ typedef struct _GUID {
 #include <inttypes.h>
 #endif
 
+// SSE2 and NEON are part of the baseline of the 64-bit targets that have them,
+// so the vector code paths are picked at compile time and need no extra flags
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# define AUDIO_SCAN_SSE2
+# include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+# define AUDIO_SCAN_NEON
+# include <arm_neon.h>
+#endif
+
 #define HAS_GUID
 #include "buffer.h"
+#include "arena.h"
+#include "sync.h"
+
+#if defined(HAS_MMAP) && !defined(_WIN32)
+# define AUDIO_SCAN_MMAP
+# include <sys/mman.h>
+#endif
+
+// A read-only mapping of a regular file, see _mmap_attach
+typedef struct mmapinfo {
+  PerlIO *infile;
+  unsigned char *map;
+  off_t size;
+  struct mmapinfo *next;
+} mmapinfo;
+
+// Where the bytes of a buffer assembled from several places in a file came
+// from, for the offsets option.  Each run maps positions from pos on to the
+// file, up to the next run, see _offset_map_add
+typedef struct offsetrun {
+  uint32_t pos;
+  off_t offset;
+} offsetrun;
+
+typedef struct offsetmap {
+  offsetrun *runs;
+  uint32_t num;
+  uint32_t max;
+  uint32_t len;       // positions mapped so far, owners add to it as they go
+} offsetmap;
+
+// Per-interpreter state
+#define MY_CXT_KEY "Audio::Scan::_guts" XS_VERSION
+
+typedef struct {
+  mmapinfo *mmaps;    // active file mappings, see _mmap_attach
+  Arena scan_arena;   // parser allocations, see _scan_alloc
+  Arena *seek_arena;  // used instead while a seek context is built
+  int scan_depth;
+  HV *want_tags;      // tags projection of the current scan, see _tag_wanted
+  SV *frame_index;    // frame_index option of the current call, see _frame_index_option
+  int vbr_sample;     // vbr_scan => 'sample' for the current scan
+  int offsets;        // offsets option of the current scan, see _store_tag_offset
+  struct scancache *caches; // open result caches, see cache_get
+  Buffer id3_buf;     // ID3 tag and UTF-8 scratch buffers kept between files, see parse_id3
+  Buffer id3_utf8;
+} my_cxt_t;
+
+START_MY_CXT
 
 /* strlen the length automatically */
 #define my_hv_store(a,b,c)     hv_store(a,b,strlen(b),c,0)
@@ -61,6 +120,9 @@ typedef struct _GUID {
 #define my_hv_exists_ent(a,b)  hv_exists_ent(a,b,0)
 #define my_hv_delete(a,b)      hv_delete(a,b,strlen(b),0)
 
+// Like Newz, but from the scan arena and never freed individually, see _scan_alloc
+#define scan_newz(p, n, t) ((p) = (t *)_scan_alloc((n), sizeof(t)))
+
 #define GET_INT32BE(b) \
 (i = (b[0] << 24) | (b[1] << 16) | b[2] << 8 | b[3], b += 4, i)
 
@@ -74,6 +136,22 @@ typedef struct _GUID {
 (i = (b[1] << 8) | b[0], i)
 
 int _check_buf(PerlIO *infile, Buffer *buf, int size, int min_size);
+mmapinfo * _mmap_attach(PerlIO *infile);
+void _mmap_detach(PerlIO *infile);
+void _mmap_release(pTHX_ void *infile);
+void _scan_enter(void);
+Arena * _scan_arena(void);
+void * _scan_alloc(size_t count, size_t size);
+HV * _projection_new(SV *list, const char *name);
+int _projection_has(HV *want, const char *key, int len);
+void _projection_prune(HV *hv, HV *want);
+int _tag_wanted(const char *key, int len);
+SV * _frame_index_option(void);
+int _vbr_sample_option(void);
+int _offsets_option(void);
+void _offset_map_add(offsetmap *map, uint32_t pos, off_t offset);
+int _offset_map_range(offsetmap *map, uint32_t pos, uint32_t len, off_t *offset, uint64_t *length);
+void _store_tag_offset(HV *info, const char *name, off_t offset, uint64_t length, const char *encoding);
 void _split_vorbis_comment(char* comment, HV* tags);
 int32_t skip_id3v2(PerlIO *infile);
 uint32_t _bitrate(uint32_t audio_size, uint32_t song_length_ms);
@@ -0,0 +1,26 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define DETECT_BLOCK_SIZE   4096
+#define DETECT_MAX_ID3_TAGS 4     // leading ID3v2 tags to skip over
+
+/*
+ * Content sniffing: works out the file type from the magic bytes at the
+ * start of a file, looking past any ID3v2 tags.  Returns one of the types
+ * in audio_types, or NULL if the data isn't recognised, in which case the
+ * caller falls back to the file's extension.
+ */
+const char * detect_type(PerlIO *infile);
@@ -66,6 +66,8 @@ typedef struct flacinfo {
 
 int get_flac_metadata(PerlIO *infile, char *file, HV *info, HV *tags);
 flacinfo * _flac_parse(PerlIO *infile, char *file, HV *info, HV *tags, uint8_t seeking);
+void * flac_seek_open(PerlIO *infile, char *file, HV *info, HV *tags);
+off_t flac_seek(void *state, PerlIO *infile, char *file, HV *info, int offset);
 void _flac_parse_streaminfo(flacinfo *flac);
 void _flac_parse_application(flacinfo *flac, int len);
 void _flac_parse_seektable(flacinfo *flac, int len);
@@ -22,6 +22,9 @@
 
 #define ID3_BLOCK_SIZE 4096
 
+// Largest tag or UTF-8 buffer kept for the next file, see parse_id3
+#define ID3_BUFFER_RETAIN (256 * 1024)
+
 // ID3v1 field frames
 
 #define ID3_FRAME_TITLE    "TIT2"
@@ -97,6 +100,22 @@ typedef struct id3info {
   uint32_t size;
   uint32_t size_remain;
   off_t offset; // For non-MP3, offset into file where tag begins
+
+  // Raw bytes of an unsynchronised v2.2/v2.3 tag still to be read, see _id3_check_buf
+  uint32_t unsync_remain;
+  uint8_t unsync_ff;
+  uint8_t unsync_stream;
+
+  // With the offsets option, where the tag body after un-synchronization lies
+  // in the file, and size_remain just after the tag header
+  offsetmap *map;
+  uint32_t size_body;
+
+  // The last frame seen, stored by _id3_frame_offset_flush
+  char offset_id[5];
+  uint32_t offset_pos;
+  uint32_t offset_len;
+  uint16_t offset_flags;
 } id3info;
 
 typedef struct id3_compat {
@@ -132,6 +151,11 @@ uint32_t _id3_parse_sylt(id3info *id3, uint8_t encoding, uint32_t len, AV *frame
 uint32_t _id3_parse_etco(id3info *id3, uint32_t len, AV *framedata);
 void _id3_convert_tdrc(id3info *id3);
 uint32_t _id3_deunsync(unsigned char *data, uint32_t length);
+int _id3_deunsync_start(id3info *id3);
+uint32_t _id3_deunsync_block(unsigned char *data, uint32_t length, uint8_t *ff, uint8_t keep_last, offsetmap *map, off_t raw_offset);
+void _id3_frame_offset(id3info *id3, char const *id, uint32_t size, uint16_t flags);
+void _id3_frame_offset_flush(id3info *id3);
+int _id3_check_buf(id3info *id3, uint32_t min_wanted);
 void _id3_skip(id3info *id3, uint32_t size);
 char const * _id3_genre_index(unsigned int index);
 char const * _id3_genre_name(char const *string);
@@ -21,6 +21,13 @@
 
 #define MP3_BLOCK_SIZE 4096
 
+// Frames between entries of the frame index, about 1.7 seconds at 44.1kHz
+#define MP3_INDEX_INTERVAL 64
+
+// Windows read by vbr_scan => 'sample', files smaller than all of them are read in full
+#define MP3_SAMPLE_WINDOWS     16
+#define MP3_SAMPLE_WINDOW_SIZE 65536
+
 #define XING_FRAMES  0x01
 #define XING_BYTES   0x02
 #define XING_TOC     0x04
@@ -108,6 +115,12 @@ typedef struct xingframe {
   int lame_tag_ofs;
 } xingframe;
 
+// One entry of the sparse frame index
+struct mp3_index {
+  uint64_t sample;  // first sample of the frame, not counting a Xing/Info/VBRI frame
+  off_t offset;
+};
+
 typedef struct mp3info {
   PerlIO *infile;
   char *file;
@@ -127,6 +140,19 @@ typedef struct mp3info {
 
   mp3frame *first_frame;
   xingframe *xing_frame;
+
+  // Frame index, walked or passed in with the frame_index option
+  uint8_t indexing;
+  struct mp3_index *index;
+  uint32_t num_index;
+  uint32_t max_index;
+  uint32_t walked_frames;
+  uint64_t walked_samples;
+
+  // Extrapolated by vbr_scan => 'sample'
+  uint8_t sampling;
+  double sampled_frames;
+  double sampled_error;     // relative
 } mp3info;
 
 // LAME lookup tables
@@ -226,9 +252,16 @@ static int sample_rate_tbl[ ] = {
 int get_mp3tags(PerlIO *infile, char *file, HV *info, HV *tags);
 int get_mp3fileinfo(PerlIO *infile, char *file, HV *info);
 off_t mp3_find_frame(PerlIO *infile, char *file, int offset);
+void * mp3_seek_open(PerlIO *infile, char *file, HV *info, HV *tags);
+off_t mp3_seek(void *state, PerlIO *infile, char *file, HV *info, int offset);
 
 mp3info * _mp3_parse(PerlIO *infile, char *file, HV *info);
 int _decode_mp3_frame(unsigned char *bptr, struct mp3frame *frame);
 int _is_ape_header(char *bptr);
 int _has_ape(PerlIO *infile, off_t file_size, HV *info);
 void _mp3_skip(mp3info *mp3, uint32_t size);
+off_t _mp3_index_seek(mp3info *mp3, PerlIO *infile, uint64_t target);
+off_t _mp3_next_frame(mp3info *mp3, PerlIO *infile, Buffer *win, off_t *win_offset, off_t offset, struct mp3frame *frame);
+void _mp3_index_frame(mp3info *mp3, off_t offset, int samples);
+void _mp3_load_index(mp3info *mp3, AV *list);
+void _mp3_store_index(mp3info *mp3);
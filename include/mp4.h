@@ -16,7 +16,11 @@
 
 #define MP4_BLOCK_SIZE 4096
 
-#define FOURCC_EQ(a, b) ((a)[0] == (b)[0] && (a)[1] == (b)[1] && (a)[2] && (b)[2] && (a)[3] == (b)[3])
+// _mp4_parse flags
+#define MP4_SEEK       0x01 // read the sample tables for seeking
+#define MP4_COVER_POS  0x02 // record where cover art is instead of reading it
+
+#define FOURCC_EQ(a, b) ((a)[0] == (b)[0] && (a)[1] == (b)[1] && (a)[2] == (b)[2] && (a)[3] == (b)[3])
 
 typedef enum {
   AAC_INVALID   =  0,
@@ -69,6 +73,72 @@ typedef struct stc {
   uint32_t samples_per_chunk;
 } stc;
 
+// A top-level box, from the map made before parsing
+struct mp4_box {
+  char type[4];
+  uint64_t offset;
+  uint64_t size;
+};
+
+// Cover art image in ilst, for get_artwork
+struct mp4_cover {
+  uint64_t offset; // of the image data
+  uint32_t length;
+};
+
+// A fragment (moof) of a fragmented file and the decode time it starts at
+struct mp4_frag {
+  uint64_t time;   // in the timescale of frag_track
+  uint64_t offset; // of the moof box
+};
+
+// Where a seek lands, found from the sample tables
+struct mp4_seek_pos {
+  uint32_t sample;          // first sample to play
+  uint32_t chunk;           // chunk containing it, starting from 1
+  uint32_t skipped_samples; // samples before it in that chunk
+  uint64_t file_offset;
+  uint32_t trim;            // time from the start of that sample to the target
+  uint64_t consumed;        // media time seeked over, excluding the priming samples
+};
+
+// Sample tables of one track, read for every trak when seeking
+typedef struct mp4_track {
+  uint32_t id;
+  uint32_t timescale;  // from mdhd
+  uint8_t is_audio;    // soun handler
+  uint64_t trak_size;  // size of the trak box
+
+  // First non-empty edit of the edit list, if there is one
+  uint8_t has_edit;
+  uint32_t edit_delay;     // media_time, the priming samples skipped
+  uint64_t edit_duration;  // segment_duration, in mv_timescale
+  uint32_t st_size;    // size of its st* boxes
+
+  // stsc
+  uint32_t num_sample_to_chunks;
+  struct stc *sample_to_chunk;
+  uint32_t *stsc_first_sample; // first sample of each entry's first chunk
+
+  // stco or co64, only one of the arrays is used
+  uint32_t *chunk_offset;
+  uint64_t *chunk_offset64;
+  uint32_t num_chunk_offsets;
+
+  // stts
+  struct tts *time_to_sample;
+  uint32_t num_time_to_samples;
+  uint32_t *stts_first_sample; // running totals at the start of each entry,
+  uint64_t *stts_first_time;   // with the track totals in the extra last slot
+
+  // stsz, kept in the smallest form that holds every size: a single
+  // value if all samples are the same size, else 16 or 32-bit entries
+  uint32_t sample_size;
+  uint16_t *sample_byte_size;
+  uint32_t *sample_byte_size32;
+  uint32_t num_sample_byte_sizes;
+} mp4_track;
+
 typedef struct mp4info {
   PerlIO *infile;
   char *file;
@@ -85,6 +155,39 @@ typedef struct mp4info {
   uint32_t track_count;
   uint8_t seen_moov;
   uint8_t dlna_invalid;
+  uint32_t mv_timescale;
+  uint64_t media_duration; // mdhd duration of the trak being read
+
+  // Gapless info, from the edit list of the first audio track or
+  // else from iTunSMPB. The edit list of each trak is held until hdlr
+  // says whether it is audio
+  uint8_t has_edit;
+  int64_t edit_media_time;
+  uint64_t edit_duration;
+  uint8_t has_gapless;
+  uint32_t encoder_delay;
+  uint32_t encoder_padding;
+  uint64_t original_samples;
+  uint8_t has_smpb;
+  uint32_t smpb_delay;
+  uint32_t smpb_padding;
+  uint64_t smpb_samples;
+
+  // Top-level boxes
+  struct mp4_box *boxes;
+  uint32_t num_boxes;
+  uint32_t max_boxes;
+  uint64_t boxes_end;   // where the map stopped, at the file size or the first moof
+  uint32_t num_mdats;
+  uint64_t first_mdat;
+  uint64_t audio_end;   // end of the last mdat
+
+  // Cover art is skipped and only its position recorded, for
+  // AUDIO_SCAN_NO_ARTWORK or get_artwork
+  uint8_t no_artwork;
+  struct mp4_cover *covers;
+  uint32_t num_covers;
+  uint32_t max_covers;
 
   // Things needed for DLNA detection
   uint8_t audio_object_type;
@@ -96,41 +199,73 @@ typedef struct mp4info {
   // Based on code from Rockbox
 
   uint8_t seeking;      // flag if we're seeking
-  uint32_t old_st_size; // size of original st* boxes
+  uint32_t seek_track;  // id of the track to seek in, 0 for the first audio track
+  mp4_track **tracks;   // every trak, in file order
+  uint32_t num_tracks;
+  uint32_t max_tracks;
+  mp4_track *trk;       // track being read, then the one chosen for seeking
+  uint64_t dropped_size; // size of the other traks, left out of the seek header
   uint32_t new_st_size; // size of rewritten st* boxes
   uint32_t meta_size;   // size of variable meta box
-  SV *seekhdr;          // rewritten header during second seek pass
-
-  // stsc
-  uint32_t num_sample_to_chunks;
-  struct stc *sample_to_chunk;
-  SV *new_stsc;
+  SV *seekhdr;          // rewritten header during second seek pass, sized up front
+  struct mp4_seek_pos seek_pos; // where the rewritten st* boxes start
+  uint64_t new_chunk_offset;    // offset of the audio after the rewritten header
+  struct stc *new_sample_to_chunk;
+  uint32_t num_new_sample_to_chunks;
+  struct tts *new_time_to_sample;
+  uint32_t num_new_time_to_samples;
 
-  // stco
-  uint32_t *chunk_offset;
-  uint32_t num_chunk_offsets;
-  SV *new_stco;
-
-  // stts
-  struct tts *time_to_sample;
-  uint32_t num_time_to_samples;
-  SV *new_stts;
-
-  // stsz
-  uint16_t *sample_byte_size;
-  uint32_t num_sample_byte_sizes;
-  SV *new_stsz;
+  // Fragmented files, where moov is followed by moof/mdat pairs
+  uint8_t fragmented;
+  uint32_t frag_track;      // track the fragments are indexed for, the first one
+  uint32_t frag_timescale;  // mdhd timescale of frag_track
+  uint32_t frag_delay;      // priming samples of frag_track, from its edit list
+  uint32_t trex_duration;   // default sample duration of frag_track
+  uint64_t mehd_duration;   // duration of all fragments from mehd, in mv_timescale
+  uint64_t first_moof;
+  uint64_t frags_end;       // end of the last fragment's mdat
+  uint64_t moof_offset;     // moof being read
+  uint8_t moof_has_track;   // moof being read had a trun for frag_track
+  uint32_t traf_track;      // track of the traf being read
+  uint32_t traf_duration;   // default sample duration of the traf being read
+  uint64_t frag_time;       // decode time reached by the fragments read so far
+  struct mp4_frag *frags;   // seek index, from mfra/tfra or built while reading
+  uint32_t num_frags;
+  uint32_t max_frags;
+  uint8_t frags_from_mfra;
 } mp4info;
 
 static int get_mp4tags(PerlIO *infile, char *file, HV *info, HV *tags);
 off_t mp4_find_frame(PerlIO *infile, char *file, int offset);
+off_t mp4_find_frame_track(PerlIO *infile, char *file, int offset, uint32_t track);
 int mp4_find_frame_return_info(PerlIO *infile, char *file, int offset, HV *info);
+int mp4_find_frame_track_return_info(PerlIO *infile, char *file, int offset, uint32_t track, HV *info);
+void * mp4_seek_open(PerlIO *infile, char *file, HV *info, HV *tags);
+off_t mp4_seek(void *state, PerlIO *infile, char *file, HV *info, int offset);
+static int _mp4_seek_position(mp4info *mp4, int offset, struct mp4_seek_pos *pos);
+static int _mp4_seek_fragment(mp4info *mp4, int offset, struct mp4_seek_pos *pos);
+static unsigned char * _mp4_seekhdr_reserve(mp4info *mp4, uint32_t len);
+static void _mp4_seekhdr_put(mp4info *mp4, const void *data, uint32_t len);
+static unsigned char * _mp4_seekhdr_put_box(mp4info *mp4, const char *type, uint32_t size);
+static uint32_t _mp4_new_stsz_size(mp4info *mp4);
+static uint32_t _mp4_new_stco_size(mp4info *mp4);
+static void _mp4_put_new_stts(mp4info *mp4);
+static void _mp4_put_new_stsc(mp4info *mp4);
+static void _mp4_put_new_stsz(mp4info *mp4);
+static void _mp4_put_new_stco(mp4info *mp4);
+static uint8_t _mp4_put_new_elst(mp4info *mp4, uint32_t size);
+static uint32_t _mp4_seek_delay(mp4info *mp4);
+
+SV * mp4_get_artwork(PerlIO *infile, char *file, int index);
 
-mp4info * _mp4_parse(PerlIO *infile, char *file, HV *info, HV *tags, uint8_t seeking);
+mp4info * _mp4_parse(PerlIO *infile, char *file, HV *info, HV *tags, uint8_t flags, uint32_t track);
+void _mp4_add_track(mp4info *mp4);
+mp4_track * _mp4_select_track(mp4info *mp4);
 int _mp4_read_box(mp4info *mp4);
 uint8_t _mp4_parse_ftyp(mp4info *mp4);
 uint8_t _mp4_parse_mvhd(mp4info *mp4);
 uint8_t _mp4_parse_tkhd(mp4info *mp4);
+uint8_t _mp4_parse_elst(mp4info *mp4);
 uint8_t _mp4_parse_mdhd(mp4info *mp4);
 uint8_t _mp4_parse_hdlr(mp4info *mp4);
 uint8_t _mp4_parse_stsd(mp4info *mp4);
@@ -141,13 +276,30 @@ uint8_t _mp4_parse_stts(mp4info *mp4);
 uint8_t _mp4_parse_stsc(mp4info *mp4);
 uint8_t _mp4_parse_stsz(mp4info *mp4);
 uint8_t _mp4_parse_stco(mp4info *mp4);
+uint8_t _mp4_parse_co64(mp4info *mp4);
+uint8_t _mp4_parse_mehd(mp4info *mp4);
+uint8_t _mp4_parse_trex(mp4info *mp4);
+uint8_t _mp4_parse_tfhd(mp4info *mp4);
+uint8_t _mp4_parse_tfdt(mp4info *mp4);
+uint8_t _mp4_parse_trun(mp4info *mp4);
+void _mp4_load_mfra(mp4info *mp4);
+void _mp4_add_frag(mp4info *mp4, uint64_t time, uint64_t offset);
 uint8_t _mp4_parse_meta(mp4info *mp4);
 uint8_t _mp4_parse_ilst(mp4info *mp4);
 uint8_t _mp4_parse_ilst_data(mp4info *mp4, uint32_t size, SV *key);
 uint8_t _mp4_parse_ilst_custom(mp4info *mp4, uint32_t size);
+uint8_t _mp4_ilst_offset(mp4info *mp4, char const *name, uint64_t offset, uint32_t size);
+void _mp4_parse_smpb(mp4info *mp4, uint32_t size);
+void _mp4_add_cover(mp4info *mp4, uint64_t offset, uint32_t length);
+void _mp4_found_mdat(mp4info *mp4, uint64_t offset, uint64_t size);
+void _mp4_map_boxes(mp4info *mp4);
 HV * _mp4_get_current_trackinfo(mp4info *mp4);
 uint32_t _mp4_descr_length(Buffer *buf);
 void _mp4_skip(mp4info *mp4, uint32_t size);
 uint32_t _mp4_samples_in_chunk(mp4info *mp4, uint32_t chunk);
 uint32_t _mp4_total_samples(mp4info *mp4);
 uint32_t _mp4_get_sample_duration(mp4info *mp4, uint32_t sample);
+uint32_t _mp4_stts_entry(mp4info *mp4, uint32_t sample);
+uint32_t _mp4_stsc_entry(mp4info *mp4, uint32_t chunk);
+uint32_t _mp4_sample_size(mp4info *mp4, uint32_t sample);
+uint64_t _mp4_chunk_offset(mp4info *mp4, uint32_t chunk);
@@ -17,6 +17,8 @@
 int get_ogf_metadata(PerlIO *infile, char *file, HV *info, HV *tags);
 int ogf_find_frame_return_info(PerlIO *infile, char *file, int offset, HV *info);
 off_t ogf_find_frame(PerlIO *infile, char *file, int offset);
+void * ogf_seek_open(PerlIO *infile, char *file, HV *info, HV *tags);
+off_t ogf_seek(void *state, PerlIO *infile, char *file, HV *info, int offset);
 
 static int _ogf_parse(PerlIO *infile, char *file, HV *info, HV *tags, uint8_t seeking);
 static off_t _ogf_find_frame(PerlIO *infile, char *file, int offset, HV *info, HV *tags);
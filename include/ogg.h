@@ -21,5 +21,7 @@
 int get_ogg_metadata(PerlIO *infile, char *file, HV *info, HV *tags);
 int _ogg_parse(PerlIO *infile, char *file, HV *info, HV *tags, uint8_t seeking);
 static off_t ogg_find_frame(PerlIO *infile, char *file, int offset);
-void _parse_vorbis_comments(PerlIO *infile, Buffer *vorbis_buf, HV *tags, int has_framing);
+void * ogg_seek_open(PerlIO *infile, char *file, HV *info, HV *tags);
+off_t ogg_seek(void *state, PerlIO *infile, char *file, HV *info, int offset);
+void _parse_vorbis_comments(PerlIO *infile, Buffer *vorbis_buf, HV *tags, int has_framing, offsetmap *map, HV *info);
 int _ogg_binary_search_sample(PerlIO *infile, char *file, HV *info, uint64_t target_sample);
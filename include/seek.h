@@ -0,0 +1,45 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Seek contexts: the state a format's find_frame builds from the file's
+ * metadata (sample tables, seektables, indexes), kept along with the open
+ * file so repeated seeks in the same file don't parse it again.
+ *
+ * A format supports this by splitting its find_frame into an open function,
+ * which parses the file and returns the state, and a seek function using it.
+ * Everything the open function allocates with scan_newz goes to the
+ * context's own arena and lives as long as the context; seeks allocate from
+ * the usual per-call arena.
+ */
+typedef struct {
+  char *type;
+  void * (*open)(PerlIO *infile, char *file, HV *info, HV *tags);
+  off_t (*seek)(void *state, PerlIO *infile, char *file, HV *info, int offset);
+} seekhandler;
+
+typedef struct {
+  seekhandler *hdl;
+  Arena arena;      // parser state, see above
+  PerlIO *infile;   // open for the life of the context
+  char *file;
+  HV *info;         // metadata found by the open function
+  void *state;
+} seekctx;
+
+seekctx * seek_context_new(seekhandler *hdl, PerlIO *infile, char *file);
+off_t seek_context_find(seekctx *ctx, int offset);
+void seek_context_free(seekctx *ctx);
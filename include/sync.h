@@ -0,0 +1,34 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _SYNC_H_
+#define _SYNC_H_
+
+// Bits of the second byte that complete a sync word after 0xFF
+#define MPEG_SYNC_MASK 0xE0   // 11 bits, MP3 and other MPEG audio frames
+#define ADTS_SYNC_MASK 0xF0   // 12 bits, AAC ADTS frames
+
+/*
+ * Frame sync search shared by the frame based parsers: finds a 0xFF byte
+ * followed by a byte with all bits of mask set, 16 positions at a time where
+ * the CPU allows.  Returns the offset of the first one in buf, or if there is
+ * none the offset of a trailing 0xFF that may start one, or len.  Everything
+ * before the returned offset can be skipped, headers found still need to be
+ * checked by the parser.
+ */
+uint32_t sync_find(const unsigned char *buf, uint32_t len, uint8_t mask);
+
+#endif
@@ -31,7 +31,22 @@ sub scan_tags {
 sub scan {
     my ( $class, $path, $opts ) = @_;
 
-    my ($filter, $md5_size, $md5_offset);
+    my ($filter, $md5_size, $md5_offset, $fields, $tags, $frame_index, $vbr_scan, $offsets);
+
+    if ( ref $opts && $opts->{cache} ) {
+        # Opens the file itself, and only if there is no cached result
+        my ($suffix) = $path =~ /\.(\w+)$/;
+
+        return if !$suffix;
+
+        return $class->_scan_cached(
+            $opts->{cache}, $suffix, $path,
+            $opts->{filter} || FILTER_INFO_ONLY | FILTER_TAGS_ONLY,
+            $opts->{md5_size} || 0, $opts->{md5_offset} || 0,
+            $opts->{fields}, $opts->{tags}, $opts->{frame_index} ? 1 : 0, $opts->{vbr_scan},
+            $opts->{offsets} ? 1 : 0,
+        );
+    }
 
     open my $fh, '<', $path or do {
         warn "Could not open $path for reading: $!\n";
@@ -54,6 +69,11 @@ sub scan {
             $filter     = $opts->{filter} || FILTER_INFO_ONLY | FILTER_TAGS_ONLY;
             $md5_size   = $opts->{md5_size};
             $md5_offset = $opts->{md5_offset};
+            $fields     = $opts->{fields};
+            $tags       = $opts->{tags};
+            $frame_index = $opts->{frame_index};
+            $vbr_scan   = $opts->{vbr_scan};
+            $offsets    = $opts->{offsets};
         }
     }
 
@@ -61,7 +81,8 @@ sub scan {
         $filter = FILTER_INFO_ONLY | FILTER_TAGS_ONLY;
     }
 
-    my $ret = $class->_scan( $suffix, $fh, $path, $filter, $md5_size || 0, $md5_offset || 0 );
+    # The content is only looked at when the extension doesn't lead to any audio
+    my $ret = $class->_scan( $suffix, $fh, $path, $filter, $md5_size || 0, $md5_offset || 0, $fields, $tags, $frame_index ? 1 : 0, $vbr_scan, $offsets ? 1 : 0, 1 );
 
     close $fh;
 
@@ -71,10 +92,17 @@ sub scan {
 sub scan_fh {
     my ( $class, $suffix, $fh, $opts ) = @_;
 
-    my ($filter, $md5_size, $md5_offset);
+    my ($filter, $md5_size, $md5_offset, $fields, $tags, $frame_index, $vbr_scan, $offsets);
 
     binmode $fh;
 
+    if ( !defined $suffix ) {
+        $suffix = $class->_detect_type($fh) or do {
+            warn "Could not detect the file type of filehandle\n";
+            return;
+        };
+    }
+
     if ( defined $opts ) {
         if ( !ref $opts ) {
             # Back-compat to support filter as normal argument
@@ -85,6 +113,11 @@ sub scan_fh {
             $filter     = $opts->{filter} || FILTER_INFO_ONLY | FILTER_TAGS_ONLY;
             $md5_size   = $opts->{md5_size};
             $md5_offset = $opts->{md5_offset};
+            $fields     = $opts->{fields};
+            $tags       = $opts->{tags};
+            $frame_index = $opts->{frame_index};
+            $vbr_scan   = $opts->{vbr_scan};
+            $offsets    = $opts->{offsets};
         }
     }
 
@@ -92,11 +125,19 @@ sub scan_fh {
         $filter = FILTER_INFO_ONLY | FILTER_TAGS_ONLY;
     }
 
-    return $class->_scan( $suffix, $fh, '(filehandle)', $filter, $md5_size || 0, $md5_offset || 0 );
+    return $class->_scan( $suffix, $fh, '(filehandle)', $filter, $md5_size || 0, $md5_offset || 0, $fields, $tags, $frame_index ? 1 : 0, $vbr_scan, $offsets ? 1 : 0 );
+}
+
+sub detect_type {
+    my ( $class, $fh ) = @_;
+
+    binmode $fh;
+
+    return $class->_detect_type($fh);
 }
 
 sub find_frame {
-    my ( $class, $path, $offset ) = @_;
+    my ( $class, $path, $offset, $opts ) = @_;
 
     open my $fh, '<', $path or do {
         warn "Could not open $path for reading: $!\n";
@@ -109,7 +150,7 @@ sub find_frame {
 
     return -1 if !$suffix;
 
-    my $ret = $class->_find_frame( $suffix, $fh, $path, $offset );
+    my $ret = $class->_find_frame( $suffix, $fh, $path, $offset, _track($opts), _frame_index($opts) );
 
     close $fh;
 
@@ -117,15 +158,15 @@ sub find_frame {
 }
 
 sub find_frame_fh {
-    my ( $class, $suffix, $fh, $offset ) = @_;
+    my ( $class, $suffix, $fh, $offset, $opts ) = @_;
 
     binmode $fh;
 
-    return $class->_find_frame( $suffix, $fh, '(filehandle)', $offset );
+    return $class->_find_frame( $suffix, $fh, '(filehandle)', $offset, _track($opts), _frame_index($opts) );
 }
 
 sub find_frame_return_info {
-    my ( $class, $path, $offset ) = @_;
+    my ( $class, $path, $offset, $opts ) = @_;
 
     open my $fh, '<', $path or do {
         warn "Could not open $path for reading: $!\n";
@@ -138,7 +179,7 @@ sub find_frame_return_info {
 
     return if !$suffix;
 
-    my $ret = $class->_find_frame_return_info( $suffix, $fh, $path, $offset );
+    my $ret = $class->_find_frame_return_info( $suffix, $fh, $path, $offset, _track($opts), _frame_index($opts) );
 
     close $fh;
 
@@ -146,13 +187,63 @@ sub find_frame_return_info {
 }
 
 sub find_frame_fh_return_info {
-    my ( $class, $suffix, $fh, $offset ) = @_;
+    my ( $class, $suffix, $fh, $offset, $opts ) = @_;
 
     binmode $fh;
 
-    return $class->_find_frame_return_info( $suffix, $fh, '(filehandle)', $offset );
+    return $class->_find_frame_return_info( $suffix, $fh, '(filehandle)', $offset, _track($opts), _frame_index($opts) );
+}
+
+# Track id from the find_frame options, 0 for the default track
+sub _track {
+    my $opts = shift;
+
+    return ( ref $opts && $opts->{track} ) ? $opts->{track} : 0;
+}
+
+# MP3 frame index from the options: true to build one, or one returned by scan
+sub _frame_index {
+    my $opts = shift;
+
+    return ref $opts ? $opts->{frame_index} : undef;
+}
+
+sub get_artwork {
+    my ( $class, $path, $index ) = @_;
+
+    open my $fh, '<', $path or do {
+        warn "Could not open $path for reading: $!\n";
+        return;
+    };
+
+    binmode $fh;
+
+    my ($suffix) = $path =~ /\.(\w+)$/;
+
+    return if !$suffix;
+
+    my $ret = $class->_get_artwork( $suffix, $fh, $path, $index || 0 );
+
+    close $fh;
+
+    return $ret;
+}
+
+sub seek_context {
+    my ( $class, $path, $opts ) = @_;
+
+    my ($suffix) = $path =~ /\.(\w+)$/;
+
+    return if !$suffix;
+
+    return $class->_seek_context( $suffix, $path, _frame_index($opts) );
 }
 
+package Audio::Scan::SeekContext;
+
+# Contexts own C state and an open file, new threads don't get a copy
+sub CLONE_SKIP { 1 }
+
 1;
 __END__
 
@@ -179,6 +270,9 @@ Audio::Scan - Fast C metadata and tag reader for all common audio file formats
         my $data = Audio::Scan->scan('/path/to/file.mp3');
     }
 
+    # Scan many files at once
+    my $results = Audio::Scan->scan_many( [ '/path/to/a.mp3', '/path/to/b.flac' ] );
+
     # Scan a filehandle
     open my $fh, '<', 'my.mp3';
     my $data = Audio::Scan->scan_fh( mp3 => $fh );
@@ -200,7 +294,10 @@ See below for specific details about each file format.
 =head2 scan( $path, [ \%OPTIONS ] )
 
 Scans $path for both metadata and tag information.  The type of scan performed is
-determined by the file's extension.  Supported extensions are:
+determined by the file's extension. If that parser finds no audio, the file's content
+picks the parser instead (see C<detect_type>). The first parser may still warn about
+such a file. Only files with one of the supported extensions are scanned, others
+croak with "unsupported file type":
 
     MP3:  mp3, mp2
     MP4:  mp4, m4a, m4b, m4p, m4v, m4r, k3g, skm, 3gp, 3g2, mov
@@ -235,6 +332,70 @@ of calculating a new one.
 Begin computing the audio_md5 value starting at $offset.  If this value is not specified,
 $offset defaults to a point in the middle of the file.
 
+    cache => $cache_file
+
+Keep results in $cache_file, which is created if needed, and return the stored result
+without opening the file again as long as the file's path, size and modification time
+and the other options are unchanged. Results are looked up by the same hash returned as
+jenkins_hash. The cache only grows; delete the file to start over, which also happens
+automatically when it was written by a different version of this module. Several
+processes on the same machine may share a cache file, writes to it are serialized with
+an fcntl lock. Keep the cache on a local disk, appends to a file shared over NFS are not
+reliable. Ignored by C<scan_fh> and on Windows.
+
+    frame_index => 1
+
+MP3 only. Read every audio frame instead of estimating from the Xing header or the
+bitrate, and return frame_index (see L</"MP3">), a sparse index of where the frames are.
+This reads the whole file, but song_length_ms of files without a Xing or VBRI header
+becomes exact, and the index can be passed to C<find_frame> and C<seek_context> to make
+later seeks exact without reading the file again.
+
+    vbr_scan => 'sample'
+
+MP3 only. The bitrate and duration of VBR files without a Xing or VBRI header are
+normally found by reading every frame of the file ('full', the default). With 'sample'
+only 16 evenly spaced 64KB windows are read and the number of frames is extrapolated
+from them, returned as estimated_frames along with song_length_error_ms, a bound on the
+error of song_length_ms. Files under 1MB are still read in full, and frame_index always
+reads every frame.
+
+    offsets => 1
+
+Also return tag_offsets in the info hash, listing where each tag field is stored in the
+file so a tag can later be read again, or rewritten in place, without parsing the whole
+file. Covers ID3v2 frames, FLAC metadata blocks, Vorbis and Opus comments, MP4 ilst atoms,
+ASF header objects and ASF extended content description attributes. Each name maps to a
+list, as names may repeat:
+
+    tag_offsets => {
+        TIT2  => [ { offset => 20, length => 15, encoding => 'binary' } ],
+        TITLE => [ { offset => 155, length => 19, encoding => 'utf8' } ],
+        ...
+    }
+
+The range is the field's value, without the frame, comment or atom header, and all
+fields are listed whether or not they are requested with C<tags>. encoding says how to
+turn the bytes into the value: 'binary' (as in the file, such as a whole ID3 frame
+body), 'utf8', 'utf16le' or 'base64' (Vorbis picture comments). ID3 frames may need
+one or more of 'unsync', 'zlib' and 'encrypted' undone, joined with '+'. Vorbis comments
+split across Ogg pages are prefixed with 'ogg+', the range then includes the Ogg page
+headers in between. ID3v1 and APE tags are not listed.
+
+    fields => [ 'song_length_ms', 'bitrate', 'samplerate', 'audio_offset' ]
+    tags   => [ 'TIT2', 'TPE1', 'TALB', 'TITLE', 'ARTIST', 'ALBUM' ]
+
+Only return these info and tag keys. Names are matched against the keys described for
+each format below, ignoring the case of ASCII letters, so a single list can cover several
+formats. Unwanted ID3 frames, APE items, Vorbis comments, MP4 ilst atoms and ASF
+attributes are skipped without being decoded, which saves most of the work when only a
+few tags are needed. Keys such as COVR_offset are returned along with the tag they
+belong to or may be requested on their own, and requesting TDRC also reads the ID3v2.3
+TYER, TDAT and TIME frames it is built from. The jenkins_hash value is only computed if
+it is listed in C<fields>. For formats with separate info and tag parsers (MP3,
+Musepack, Monkey's Audio, WavPack) an empty list skips that parser entirely, like
+C<scan_info> and C<scan_tags>.
+
 =head2 scan_info( $path, [ \%OPTIONS ] )
 
 If you only need file metadata and don't care about tags, you can use this method.
@@ -248,19 +409,53 @@ If you only need the tags and don't care about the metadata, use this method.
 Scans a filehandle. $type is the type of file to scan as, i.e. "mp3" or "ogg".
 Note that FLAC does not support reading from a filehandle.
 
-=head2 find_frame( $path, $timestamp_in_ms )
+If $type is undef the type is worked out from the content with C<detect_type>.
+
+=head2 scan_many( \@paths, [ \%OPTIONS ] )
+
+Scans a list of files in a single call. Opening each file, picking the parser and
+building the results is all done in C, which avoids the per-file overhead of calling
+C<scan> in a loop when scanning large libraries.
+
+Returns an arrayref of results in the same order as @paths, each in the same format
+returned by C<scan>. Files that can't be opened or have an unsupported extension
+produce a warning and an undef entry.
+
+The options are the same as for C<scan>, plus:
+
+    callback => sub { my ( $path, $result ) = @_; ... }
+
+Instead of collecting all results, call this sub after each file is scanned, with
+$result being undef for files that could not be scanned. Memory used by each result
+is released once the callback returns, and C<scan_many> returns undef.
+
+=head2 detect_type( $fh )
+
+Returns the type of the file open on $fh, as in C<get_types>, by looking at the magic
+bytes at its start, past any ID3v2 tags. Returns undef if the content isn't recognised.
+The filehandle's position is left unchanged.
+
+C<scan> and C<scan_many> use this when the parser for a file's extension finds no
+audio, so a file with the wrong extension is still scanned correctly. A file whose
+extension fits, such as an MP3 in a RIFF wrapper named .mp3, keeps that parser, and
+the extension still decides whether a path is supported at all.
+
+=head2 find_frame( $path, $timestamp_in_ms, [ \%OPTIONS ] )
 
 Returns the byte offset to the first audio frame starting from the given timestamp
 (in milliseconds).
 
 =over 4
 
-=item MP3, Ogg, FLAC, ASF, MP4
+=item MP3, Ogg, FLAC, ASF, MP4, AAC
 
 The byte offset to the data packet containing this timestamp will be returned. For
 file formats that don't provide timestamp information such as MP3, the best estimate for
 the location of the timestamp will be returned.  This will be more accurate if the
-file has a Xing header or is CBR for example.
+file has a Xing header or is CBR for example, and exact with the frame_index option.
+
+In MP4 files with an encoder delay, from the edit list or iTunSMPB, the timestamp
+is counted from the end of the priming samples.
 
 =item WAV, AIFF, Musepack, Monkey's Audio, WavPack
 
@@ -268,7 +463,30 @@ Not yet supported by find_frame.
 
 =back
 
-=head2 find_frame_return_info( $path, $timestamp_in_ms )
+Options:
+
+=over 4
+
+=item track
+
+MP4 only. The id of the track to seek in, as found in the C<tracks> list of the scan
+results. The default is the first audio track. Useful for files with several audio
+tracks such as HD-AAC, where the second track has the lossless version.
+
+=item frame_index
+
+MP3 only. Either 1 to read every frame of the file first, or the frame_index returned
+by C<scan> with the C<frame_index> option to reuse it. The offset is then found by
+hopping over the frames from the index entry before the timestamp, so it is exact even
+for VBR files without a Xing header, such as many podcasts and audiobooks. Timestamps
+past the last frame return -1.
+
+    my $info = Audio::Scan->scan_info( $file, { frame_index => 1 } )->{info};
+    my $offset = Audio::Scan->find_frame( $file, 30000, { frame_index => $info->{frame_index} } );
+
+=back
+
+=head2 find_frame_return_info( $path, $timestamp_in_ms, [ \%OPTIONS ] )
 
 The header of an MP4/OggFlac file contains various metadata that refers to the structure of
 the audio data, making seeking more difficult to perform. This method will return
@@ -280,6 +498,16 @@ the usual $info hash with 2 additional keys:
                   the following boxes are rewritten: stts, stsc, stsz, stco. For FLAC, the
                   number of samples and md5 in STREAMINFO are zero'd 
 
+Takes the same options as C<find_frame>. The rewritten MP4 header only keeps the track
+that was seeked in, other tracks are left out.
+
+For fragmented MP4 files, seek_offset is the start of the fragment (moof box) holding
+the timestamp, and seek_header is the unchanged initialization segment (ftyp and moov).
+
+For MP4 files with an encoder delay, seek_skip_samples is also returned: the number of
+samples to drop from the start of the seeked stream to reach the timestamp. An edit
+list in the header is rewritten to start there and end with the original audio.
+
 For example, to seek 30 seconds into a file and write out a new MP4 file seeked to
 this point:
 
@@ -298,14 +526,43 @@ this point:
     close $f;
     close $fh;
 
-=head2 find_frame_fh( $type => $fh, $offset )
+=head2 find_frame_fh( $type => $fh, $offset, [ \%OPTIONS ] )
 
 Same as C<find_frame>, but with a filehandle.
 
-=head2 find_frame_fh_return_info( $type => $fh, $offset )
+=head2 find_frame_fh_return_info( $type => $fh, $offset, [ \%OPTIONS ] )
 
 Same as C<find_frame_return_info>, but with a filehandle.
 
+=head2 get_artwork( $path, [ $index ] )
+
+Returns the image data of embedded cover art number $index (starting from 0, the
+default), or undef if there is no such image. Only the other tags' headers and the
+image itself are read, so this is much cheaper than a full scan of a file with large
+artwork. Pair it with C<AUDIO_SCAN_NO_ARTWORK> (see L</"SKIPPING ARTWORK">) to read tags
+for many files and fetch artwork only for the ones that need it. Files with several
+images return only the first one as a tag, the others are available here.
+
+Currently supported for MP4 files, returns undef for other types.
+
+=head2 seek_context( $path, [ \%OPTIONS ] )
+
+Parses $path once and returns an Audio::Scan::SeekContext object holding what
+C<find_frame> needs: the sample tables, seektable or index, depending on the format.
+Its C<find_frame( $timestamp_in_ms )> method returns the same offsets as C<find_frame>
+without reading the file's metadata again, which makes repeated seeks in the same file
+(for example while scrubbing through a track) far cheaper. Tags are not decoded.
+
+    my $ctx = Audio::Scan->seek_context('/path/to/file.m4a');
+    my $offset = $ctx->find_frame(30_000);
+
+The context keeps the file open until it goes out of scope, and reflects the file as it
+was when the context was created. Returns undef if the file can't be opened or its
+type doesn't support C<find_frame> (MP3, MP4, AAC, Ogg Vorbis, Opus, FLAC, Ogg FLAC
+and ASF do). Contexts are not copied into new threads. The C<frame_index> option of
+C<find_frame> is also supported, the frames are then read once when the context is
+created.
+
 =head2 has_flac()
 
 Deprecated.  Always returns 1 now that FLAC is always enabled.
@@ -358,6 +615,8 @@ MP4:
     $tags->{COVR}: image length
     $tags->{COVR_offset}: image offset (always available)
 
+The image itself can then be read with C<get_artwork>.
+
 Ogg Vorbis:
 
     $tags->{ALLPICTURES}->[0]->{image_data}: image length
@@ -398,6 +657,15 @@ The following metadata about a file may be returned:
     vbr (1 if file is VBR)
     dlna_profile (if file is compliant)
 
+    With vbr_scan => 'sample', for VBR files without a Xing or VBRI header:
+    estimated_frames
+    song_length_error_ms (about twice the standard error of song_length_ms)
+
+    With the frame_index option:
+    frame_index (list of [ sample, offset ] pairs for every 64th audio frame, where
+                 sample is the number of samples before the frame, not counting a
+                 Xing/Info/VBRI frame)
+
     If a Xing header is found:
     xing_frames
     xing_bytes
@@ -474,16 +742,20 @@ Sample tag data:
 
 The following metadata about a file may be returned:
 
-    audio_offset (byte offset to start of mdat)
-    audio_size
+    audio_offset (byte offset to start of the first mdat)
+    audio_size (total size of all mdat boxes)
     compatible_brands
     file_size
     leading_mdat (if file has mdat before moov)
     major_brand
+    mdat_boxes (if file has more than one mdat, array of hashes with offset and size)
     minor_version
     song_length_ms
     timescale
     dlna_profile (if file is compliant)
+    encoder_delay (priming samples, from the edit list or iTunSMPB)
+    encoder_padding (if known, samples added at the end)
+    original_samples (if known, length in samples without delay and padding)
     tracks (array of tracks in the file)
         Each track may contain:
 
@@ -554,6 +826,14 @@ The following metadata about a file is returned:
     song_length_ms (duration in milliseconds)
     dlna_profile (if file is compliant)
 
+The duration and bitrate come from the headers of every frame. Regular files are walked
+through a read-only memory mapping, so only the pages holding headers are touched.
+Pipes, sockets and platforms without mmap, such as Windows, read the headers through a
+4KB window instead, which with typical frames of a few hundred bytes still reads the
+whole file. Note that truncating a file while it is being scanned may crash the process. Anything that isn't
+a frame, such as a glitch in a radio capture, is skipped. C<find_frame> returns the start of the frame holding the
+timestamp.
+
 =head1 OGG VORBIS
 
 =head2 INFO
@@ -18,26 +18,53 @@
 
 static int
 get_aacinfo(PerlIO *infile, char *file, HV *info, HV *tags)
+{
+  aacinfo *aac = _aac_parse(infile, file, info, tags, 0);
+
+  if (!aac) return -1;
+
+  return 0;
+}
+
+aacinfo *
+_aac_parse(PerlIO *infile, char *file, HV *info, HV *tags, uint8_t seeking)
 {
   off_t file_size;
-  Buffer buf;
   unsigned char *bptr;
-  int err = 0;
   unsigned int id3_size = 0;
   unsigned int audio_offset = 0;
+  aacinfo *aac;
+  mmapinfo *m;
+
+  scan_newz(aac, 1, aacinfo);
+  scan_newz(aac->buf, 1, Buffer);
+  scan_newz(aac->win, 1, Buffer);
+
+  aac->infile  = infile;
+  aac->file    = file;
+  aac->info    = info;
+  aac->seeking = seeking;
+
+  // ADTS headers are read straight from a mapping of the file where possible
+  if ( (m = _mmap_attach(infile)) != NULL ) {
+    aac->map      = m->map;
+    aac->map_size = m->size;
+  }
 
-  buffer_init(&buf, AAC_BLOCK_SIZE);
+  buffer_init(aac->buf, AAC_BLOCK_SIZE);
+  buffer_init(aac->win, AAC_BLOCK_SIZE);
 
   file_size = _file_size(infile);
+  aac->file_size = file_size;
 
   my_hv_store( info, "file_size", newSVuv(file_size) );
 
-  if ( !_check_buf(infile, &buf, 10, AAC_BLOCK_SIZE) ) {
-    err = -1;
+  if ( !_check_buf(infile, aac->buf, 10, AAC_BLOCK_SIZE) ) {
+    aac = NULL;
     goto out;
   }
 
-  bptr = buffer_ptr(&buf);
+  bptr = buffer_ptr(aac->buf);
 
   // Check for ID3 tag
   if (
@@ -58,27 +85,37 @@ get_aacinfo(PerlIO *infile, char *file, HV *info, HV *tags)
     DEBUG_TRACE("Found ID3 tag of size %d\n", id3_size);
 
     // Seek past ID3 and clear buffer
-    buffer_clear(&buf);
+    buffer_clear(aac->buf);
     PerlIO_seek(infile, id3_size, SEEK_SET);
 
     // Read start of AAC data
-    if ( !_check_buf(infile, &buf, 10, AAC_BLOCK_SIZE) ) {
-      err = -1;
+    if ( !_check_buf(infile, aac->buf, 10, AAC_BLOCK_SIZE) ) {
+      aac = NULL;
       goto out;
     }
   }
 
   // Find 0xFF sync
-  while ( buffer_len(&buf) >= 6 ) {
-    bptr = buffer_ptr(&buf);
+  while ( buffer_len(aac->buf) >= 6 ) {
+    uint32_t skip = sync_find(buffer_ptr(aac->buf), buffer_len(aac->buf) - 5, ADTS_SYNC_MASK);
+
+    buffer_consume(aac->buf, skip);
+    audio_offset += skip;
+
+    if ( buffer_len(aac->buf) < 6 ) {
+      break;
+    }
+
+    bptr = buffer_ptr(aac->buf);
+    aac->audio_offset = audio_offset;
 
     if ( (bptr[0] == 0xFF) && ((bptr[1] & 0xF6) == 0xF0)
-      && aac_parse_adts(infile, file, file_size - audio_offset, &buf, info))
+      && aac_parse_adts(aac))
     {
       break;
     }
     else {
-      buffer_consume(&buf, 1);
+      buffer_consume(aac->buf, 1);
       audio_offset++;
     }
   }
@@ -90,6 +127,8 @@ get_aacinfo(PerlIO *infile, char *file, HV *info, HV *tags)
   }
 */
 
+  aac->audio_offset = audio_offset;
+
   my_hv_store( info, "audio_offset", newSVuv(audio_offset) );
   my_hv_store( info, "audio_size", newSVuv(file_size - audio_offset) );
 
@@ -99,113 +138,279 @@ get_aacinfo(PerlIO *infile, char *file, HV *info, HV *tags)
   }
 
 out:
-  buffer_free(&buf);
+  if (aac) {
+    buffer_free(aac->buf);
+    buffer_free(aac->win);
+  }
 
-  if (err) return err;
+  return aac;
+}
 
-  return 0;
+// Reads the ADTS header at offset, from the mapping or the window.
+// Returns NULL past the end of the file
+static unsigned char *
+_aac_header_at(aacinfo *aac, off_t offset)
+{
+  if (offset + ADTS_HEADER_SIZE > aac->file_size) {
+    return NULL;
+  }
+
+  if (aac->map) {
+    return offset + ADTS_HEADER_SIZE <= aac->map_size ? aac->map + offset : NULL;
+  }
+
+  if ( offset < aac->win_offset || offset + ADTS_HEADER_SIZE > aac->win_offset + (off_t)buffer_len(aac->win) ) {
+    // Move the window, a block holds the headers of several frames
+    buffer_clear(aac->win);
+    aac->win_offset = offset;
+
+    if ( PerlIO_seek(aac->infile, offset, SEEK_SET) != 0 ) {
+      return NULL;
+    }
+
+    if ( !_check_buf(aac->infile, aac->win, ADTS_HEADER_SIZE, AAC_BLOCK_SIZE) ) {
+      return NULL;
+    }
+  }
+
+  return (unsigned char *)buffer_ptr(aac->win) + (offset - aac->win_offset);
+}
+
+// Returns the length of the frame at offset and its number of samples,
+// or 0 if there is no frame there matching the first one
+static uint32_t
+_aac_frame_at(aacinfo *aac, off_t offset, uint32_t *samples)
+{
+  unsigned char *bptr = _aac_header_at(aac, offset);
+  uint32_t frame_length;
+
+  if ( !bptr || !((bptr[0] == 0xFF) && ((bptr[1] & 0xF6) == 0xF0)) ) {
+    return 0;
+  }
+
+  if (
+       aac->profile != (bptr[2] & 0xc0) >> 6
+    || aac->sr_index != (bptr[2] & 0x3c) >> 2
+    || aac->channels != (((bptr[2] & 0x1) << 2) | ((bptr[3] & 0xc0) >> 6))
+  ) {
+    return 0;
+  }
+
+  frame_length = ((((unsigned int)bptr[3] & 0x3)) << 11)
+    | (((unsigned int)bptr[4]) << 3) | (bptr[5] >> 5);
+
+  // Header plus CRC if there is one
+  if ( frame_length < (uint32_t)((bptr[1] & 0x1) ? ADTS_HEADER_SIZE : ADTS_HEADER_SIZE + 2) ) {
+    return 0;
+  }
+
+  // Raw data blocks of 1024 samples
+  *samples = 1024 * ((bptr[6] & 0x3) + 1);
+
+  return frame_length;
+}
+
+// Returns the offset of the first possible ADTS sync word at or after offset,
+// or -1 if there is none before the end of the file
+static off_t
+_aac_sync_search(aacinfo *aac, off_t offset)
+{
+  unsigned char *bptr;
+  uint32_t avail;
+  uint32_t skip;
+
+  while ( (bptr = _aac_header_at(aac, offset)) != NULL ) {
+    avail = aac->map
+      ? (uint32_t)MIN(aac->map_size - offset, AAC_BLOCK_SIZE)
+      : (uint32_t)(aac->win_offset + buffer_len(aac->win) - offset);
+
+    skip = sync_find(bptr, avail, ADTS_SYNC_MASK);
+
+    if (skip + 1 < avail) {
+      return offset + skip;
+    }
+
+    // Nothing whole in the data at hand, a trailing 0xFF is checked again
+    offset += skip;
+  }
+
+  return -1;
+}
+
+// Returns the offset of the first whole frame at or after offset, skipping
+// anything that isn't audio such as a glitch in a radio capture. A frame
+// found by resyncing must be followed by another one or the end of the file.
+// Returns -1 if there are no more frames
+static off_t
+_aac_next_frame(aacinfo *aac, off_t offset, uint32_t *frame_length, uint32_t *samples)
+{
+  uint32_t next_samples;
+
+  *frame_length = _aac_frame_at(aac, offset, samples);
+
+  if (*frame_length) {
+    return offset + *frame_length <= aac->file_size ? offset : -1;
+  }
+
+  DEBUG_TRACE("Lost ADTS sync at %llu\n", (uint64_t)offset);
+
+  for (offset++; offset + ADTS_HEADER_SIZE <= aac->file_size; offset++) {
+    if ( (offset = _aac_sync_search(aac, offset)) < 0 ) {
+      break;
+    }
+
+    *frame_length = _aac_frame_at(aac, offset, samples);
+
+    if ( !*frame_length || offset + *frame_length > aac->file_size ) {
+      continue;
+    }
+
+    if ( offset + *frame_length == aac->file_size
+      || _aac_frame_at(aac, offset + *frame_length, &next_samples) )
+    {
+      DEBUG_TRACE("Resynced at %llu\n", (uint64_t)offset);
+      return offset;
+    }
+  }
+
+  return -1;
+}
+
+// Hops from frame to frame reading only the headers, for the exact number
+// of samples. Also builds the seek index when seeking
+void
+_aac_walk(aacinfo *aac)
+{
+  off_t offset = aac->audio_offset;
+  uint32_t frame_length;
+  uint32_t samples;
+
+  while ( (offset = _aac_next_frame(aac, offset, &frame_length, &samples)) >= 0 ) {
+    if ( aac->seeking && aac->frames % AAC_INDEX_INTERVAL == 0 ) {
+      if (aac->num_index == aac->max_index) {
+        struct aac_index *index;
+
+        aac->max_index = aac->max_index ? aac->max_index * 2 : 64;
+        scan_newz(index, aac->max_index, struct aac_index);
+
+        if (aac->num_index) {
+          memcpy(index, aac->index, aac->num_index * sizeof(struct aac_index));
+        }
+
+        aac->index = index;
+      }
+
+      aac->index[aac->num_index].sample = aac->total_samples;
+      aac->index[aac->num_index].offset = offset;
+      aac->num_index++;
+    }
+
+    aac->frames++;
+    aac->total_samples += samples;
+    aac->total_bytes   += frame_length;
+
+    offset += frame_length;
+  }
 }
 
 // ADTS parser adapted from faad
 
 int
-aac_parse_adts(PerlIO *infile, char *file, off_t audio_size, Buffer *buf, HV *info)
+aac_parse_adts(aacinfo *aac)
 {
-  int frames, frame_length;
-  int t_framelength = 0;
+  Buffer *buf = aac->buf;
+  off_t audio_size = aac->file_size - aac->audio_offset;
+  off_t pos;
+  int frame_length;
   int samplerate = 0;
   int bitrate;
   uint8_t profile = 0;
+  uint8_t sr_index = 0;
   uint8_t channels = 0;
-  float frames_per_sec, bytes_per_frame, length;
+  float frames_per_sec, bytes_per_frame;
+  uint32_t song_length_ms;
 
   unsigned char *bptr;
 
-  /* Read all frames to ensure correct time and bitrate */
-  for (frames = 1; /* */; frames++) {
-    if ( !_check_buf(infile, buf, audio_size > AAC_BLOCK_SIZE ? AAC_BLOCK_SIZE : audio_size, AAC_BLOCK_SIZE) ) {
-      if (frames < 2)
-        return 0;
-      else
-        break;
-    }
+  if ( !_check_buf(aac->infile, buf, audio_size > AAC_BLOCK_SIZE ? AAC_BLOCK_SIZE : audio_size, AAC_BLOCK_SIZE) ) {
+    return 0;
+  }
 
-    bptr = buffer_ptr(buf);
+  bptr = buffer_ptr(buf);
 
-    /* check syncword */
-    if (!((bptr[0] == 0xFF)&&((bptr[1] & 0xF6) == 0xF0)))
-      break;
+  /* check syncword */
+  if (!((bptr[0] == 0xFF)&&((bptr[1] & 0xF6) == 0xF0)))
+    return 0;
 
-    if (frames == 1) {
-      profile = (bptr[2] & 0xc0) >> 6;
-      samplerate = adts_sample_rates[(bptr[2]&0x3c)>>2];
-      channels = ((bptr[2] & 0x1) << 2) | ((bptr[3] & 0xc0) >> 6);
+  // Everything needed from the first header is taken now, the look-ahead
+  // _check_buf calls below may move the buffer
+  profile = (bptr[2] & 0xc0) >> 6;
+  sr_index = (bptr[2] & 0x3c) >> 2;
+  samplerate = adts_sample_rates[sr_index];
+  channels = ((bptr[2] & 0x1) << 2) | ((bptr[3] & 0xc0) >> 6);
+
+  frame_length = ((((unsigned int)bptr[3] & 0x3)) << 11)
+    | (((unsigned int)bptr[4]) << 3) | (bptr[5] >> 5);
+
+  /* The next two frames must match this one */
+  if (_check_buf(aac->infile, buf, frame_length + 10, AAC_BLOCK_SIZE)) {
+    unsigned char *bptr2 = (unsigned char *)buffer_ptr(buf) + frame_length;
+    int frame_length2;
+    if (!((bptr2[0] == 0xFF)&&((bptr2[1] & 0xF6) == 0xF0))
+      || profile != (bptr2[2] & 0xc0) >> 6
+      || samplerate != adts_sample_rates[(bptr2[2]&0x3c)>>2]
+      || channels != (((bptr2[2] & 0x1) << 2) | ((bptr2[3] & 0xc0) >> 6)))
+    {
+      DEBUG_TRACE("False sync at frame 1+1\n");
+      return 0;
     }
 
-    frame_length = ((((unsigned int)bptr[3] & 0x3)) << 11)
-      | (((unsigned int)bptr[4]) << 3) | (bptr[5] >> 5);
+    frame_length2 = ((((unsigned int)bptr2[3] & 0x3)) << 11)
+      | (((unsigned int)bptr2[4]) << 3) | (bptr2[5] >> 5);
 
-    if (frames == 1 && _check_buf(infile, buf, frame_length + 10, AAC_BLOCK_SIZE)) {
-      unsigned char *bptr2 = (unsigned char *)buffer_ptr(buf) + frame_length;
-      int frame_length2;
+    if (_check_buf(aac->infile, buf, frame_length + frame_length2 + 10, AAC_BLOCK_SIZE)) {
+      bptr2 = (unsigned char *)buffer_ptr(buf) + frame_length + frame_length2;
       if (!((bptr2[0] == 0xFF)&&((bptr2[1] & 0xF6) == 0xF0))
         || profile != (bptr2[2] & 0xc0) >> 6
         || samplerate != adts_sample_rates[(bptr2[2]&0x3c)>>2]
         || channels != (((bptr2[2] & 0x1) << 2) | ((bptr2[3] & 0xc0) >> 6)))
       {
-        DEBUG_TRACE("False sync at frame %d+1\n", frames);
+        DEBUG_TRACE("False sync at frame 1+2\n");
         return 0;
       }
-
-      frame_length2 = ((((unsigned int)bptr2[3] & 0x3)) << 11)
-        | (((unsigned int)bptr2[4]) << 3) | (bptr2[5] >> 5);
-
-      if (_check_buf(infile, buf, frame_length + frame_length2 + 10, AAC_BLOCK_SIZE)) {
-        bptr2 = (unsigned char *)buffer_ptr(buf) + frame_length + frame_length2;
-        if (!((bptr2[0] == 0xFF)&&((bptr2[1] & 0xF6) == 0xF0))
-          || profile != (bptr2[2] & 0xc0) >> 6
-          || samplerate != adts_sample_rates[(bptr2[2]&0x3c)>>2]
-          || channels != (((bptr2[2] & 0x1) << 2) | ((bptr2[3] & 0xc0) >> 6)))
-        {
-          DEBUG_TRACE("False sync at frame %d+2\n", frames);
-          return 0;
-        }
-      }
     }
+  }
 
-    t_framelength += frame_length;
-
-    if (frame_length > buffer_len(buf))
-      break;
+  aac->profile    = profile;
+  aac->sr_index   = sr_index;
+  aac->channels   = channels;
+  aac->samplerate = samplerate;
 
-    buffer_consume(buf, frame_length);
-    audio_size -= frame_length;
+  /* Read all frame headers to ensure correct time and bitrate. The sync
+     search carries on from where it was if this isn't really a frame */
+  pos = PerlIO_tell(aac->infile);
+  _aac_walk(aac);
+  PerlIO_seek(aac->infile, pos, SEEK_SET);
 
-    // Avoid looping again if we have a partial frame header
-    if (audio_size < 6)
-      break;
-  }
-
-  if (frames < 2) {
+  if (aac->frames < 2) {
     DEBUG_TRACE("False sync\n");
+    aac->frames = 0;
+    aac->total_samples = 0;
+    aac->total_bytes = 0;
+    aac->num_index = 0;
     return 0;
   }
 
+  // Frames of 1024 samples, there may be several raw data blocks in one
   frames_per_sec = (float)samplerate/1024.0f;
-  if (frames != 0)
-    bytes_per_frame = (float)t_framelength/(float)(frames*1000);
-  else
-    bytes_per_frame = 0;
+  bytes_per_frame = (float)aac->total_bytes/(float)(aac->total_samples/1024.0f*1000);
 
   bitrate = (int)(8. * bytes_per_frame * frames_per_sec + 0.5);
 
-  if (frames_per_sec != 0)
-    length = (float)frames/frames_per_sec;
-  else
-    length = 1;
+  song_length_ms = samplerate ? aac->total_samples * 1000 / samplerate : 1000;
 
-  DEBUG_TRACE("ADTS frames=%d, frames_per_sec=%f, bytes_per_frame=%f, length=%f\n",
-    frames, frames_per_sec, bytes_per_frame, length);
+  DEBUG_TRACE("ADTS frames=%d, samples=%llu, bytes_per_frame=%f, length=%d\n",
+    aac->frames, aac->total_samples, bytes_per_frame, song_length_ms);
 
   // DLNA profile detection
   // XXX Does not detect HEAAC_L3_ADTS
@@ -214,28 +419,28 @@ aac_parse_adts(PerlIO *infile, char *file, off_t audio_size, Buffer *buf, HV *in
       if (channels <= 2) {
         if (bitrate <= 192) {
           if (samplerate <= 24000)
-            my_hv_store( info, "dlna_profile", newSVpv("HEAAC_L2_ADTS_320", 0) ); // XXX shouldn't really use samplerate for AAC vs AACplus
+            my_hv_store( aac->info, "dlna_profile", newSVpv("HEAAC_L2_ADTS_320", 0) ); // XXX shouldn't really use samplerate for AAC vs AACplus
           else
-            my_hv_store( info, "dlna_profile", newSVpv("AAC_ADTS_192", 0) );
+            my_hv_store( aac->info, "dlna_profile", newSVpv("AAC_ADTS_192", 0) );
         }
         else if (bitrate <= 320) {
           if (samplerate <= 24000)
-            my_hv_store( info, "dlna_profile", newSVpv("HEAAC_L2_ADTS_320", 0) );
+            my_hv_store( aac->info, "dlna_profile", newSVpv("HEAAC_L2_ADTS_320", 0) );
           else
-            my_hv_store( info, "dlna_profile", newSVpv("AAC_ADTS_320", 0) );
+            my_hv_store( aac->info, "dlna_profile", newSVpv("AAC_ADTS_320", 0) );
         }
         else {
           if (samplerate <= 24000)
-            my_hv_store( info, "dlna_profile", newSVpv("HEAAC_L2_ADTS", 0) );
+            my_hv_store( aac->info, "dlna_profile", newSVpv("HEAAC_L2_ADTS", 0) );
           else
-            my_hv_store( info, "dlna_profile", newSVpv("AAC_ADTS", 0) );
+            my_hv_store( aac->info, "dlna_profile", newSVpv("AAC_ADTS", 0) );
         }
       }
       else if (channels <= 6) {
         if (samplerate <= 24000)
-          my_hv_store( info, "dlna_profile", newSVpv("HEAAC_MULT5_ADTS", 0) );
+          my_hv_store( aac->info, "dlna_profile", newSVpv("HEAAC_MULT5_ADTS", 0) );
         else
-          my_hv_store( info, "dlna_profile", newSVpv("AAC_MULT5_ADTS", 0) );
+          my_hv_store( aac->info, "dlna_profile", newSVpv("AAC_MULT5_ADTS", 0) );
       }
     }
   }
@@ -244,11 +449,102 @@ aac_parse_adts(PerlIO *infile, char *file, off_t audio_size, Buffer *buf, HV *in
   if (samplerate <= 24000)
     samplerate *= 2;
 
-  my_hv_store( info, "bitrate", newSVuv(bitrate * 1000) );
-  my_hv_store( info, "song_length_ms", newSVuv(length * 1000) );
-  my_hv_store( info, "samplerate", newSVuv(samplerate) );
-  my_hv_store( info, "profile", newSVpv( aac_profiles[profile], 0 ) );
-  my_hv_store( info, "channels", newSVuv(channels) );
+  my_hv_store( aac->info, "bitrate", newSVuv(bitrate * 1000) );
+  my_hv_store( aac->info, "song_length_ms", newSVuv(song_length_ms) );
+  my_hv_store( aac->info, "samplerate", newSVuv(samplerate) );
+  my_hv_store( aac->info, "profile", newSVpv( aac_profiles[profile], 0 ) );
+  my_hv_store( aac->info, "channels", newSVuv(channels) );
 
   return 1;
 }
+
+off_t
+aac_find_frame(PerlIO *infile, char *file, int offset)
+{
+  HV *info = newHV();
+  HV *tags = newHV();
+  off_t frame_offset;
+  aacinfo *aac = aac_seek_open(infile, file, info, tags);
+
+  frame_offset = aac ? aac_seek(aac, infile, file, info, offset) : -1;
+
+  // Don't leak
+  SvREFCNT_dec(info);
+  SvREFCNT_dec(tags);
+
+  return frame_offset;
+}
+
+// Walk the frames once, the returned state with its index can be used for
+// any number of seeks
+void *
+aac_seek_open(PerlIO *infile, char *file, HV *info, HV *tags)
+{
+  return _aac_parse(infile, file, info, tags, 1);
+}
+
+// Returns the offset of the frame holding offset ms, found from the nearest
+// index entry before it by hopping over the frames in between
+off_t
+aac_seek(void *state, PerlIO *infile, char *file, HV *info, int offset)
+{
+  aacinfo *aac = (aacinfo *)state;
+  Buffer win;
+  mmapinfo *m;
+  uint64_t target;
+  uint64_t sample;
+  off_t frame_offset = -1;
+  uint32_t frame_length;
+  uint32_t samples;
+  uint32_t lo = 0;
+  uint32_t hi = aac->num_index;
+
+  if ( !aac->num_index || !aac->samplerate || offset < 0 ) {
+    return -1;
+  }
+
+  target = (uint64_t)offset * aac->samplerate / 1000;
+
+  if (target >= aac->total_samples) {
+    return -1;
+  }
+
+  // The mapping and window of the parse are gone
+  aac->map = NULL;
+  if ( (m = _mmap_lookup(infile)) != NULL ) {
+    aac->map      = m->map;
+    aac->map_size = m->size;
+  }
+
+  buffer_init(&win, AAC_BLOCK_SIZE);
+  aac->win        = &win;
+  aac->win_offset = 0;
+
+  while (hi - lo > 1) {
+    uint32_t mid = lo + (hi - lo) / 2;
+
+    if (aac->index[mid].sample <= target)
+      lo = mid;
+    else
+      hi = mid;
+  }
+
+  sample       = aac->index[lo].sample;
+  frame_offset = aac->index[lo].offset;
+
+  DEBUG_TRACE("find_frame: target sample %llu, index entry %d at %llu\n", target, lo, (uint64_t)frame_offset);
+
+  while ( (frame_offset = _aac_next_frame(aac, frame_offset, &frame_length, &samples)) >= 0 ) {
+    if (sample + samples > target) {
+      break;
+    }
+
+    sample       += samples;
+    frame_offset += frame_length;
+  }
+
+  buffer_free(&win);
+  aac->win = NULL;
+
+  return frame_offset;
+}
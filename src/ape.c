@@ -316,6 +316,26 @@ int _ape_parse_field(ApeTag* tag) {
 
   DEBUG_TRACE("key_length: %d / val_length: %d / size: %d / flags %x @ %d\n", key_length, val_length, size, flags, tag->offset);
 
+  if ( !_tag_wanted(SvPVX(key), key_length) ) {
+    // Keep offsets in step with the parsing below
+    if (flags & APE_TAG_TYPE_BINARY)
+      tag->offset += val_length + 1;
+    else if (val_length >= size - 1)
+      tag->offset += val_length < size ? val_length : size;
+    else
+      tag->offset += size;
+
+    DEBUG_TRACE("  %s not requested, skipping\n", SvPVX(key));
+    buffer_consume(&tag->tag_data, size);
+    SvREFCNT_dec(key);
+
+    if (size + buffer_len(&tag->tag_data) + APE_ITEM_MINIMUM_SIZE > data_size) {
+      return _ape_error(tag, "Impossible item length (greater than remaining space)", -3);
+    }
+
+    return 0;
+  }
+
   if (flags & APE_TAG_TYPE_BINARY) {
     // Binary data, just copy it as-is
 
@@ -352,6 +372,8 @@ int _ape_parse_field(ApeTag* tag) {
     // Don't add invalid items
     if (_ape_check_validity(tag, flags, SvPVX(key), SvPVX(value)) != 0) {
       // skip this item
+      SvREFCNT_dec(key);
+      SvREFCNT_dec(value);
       return 0;
     }
     else {
@@ -385,6 +407,9 @@ int _ape_parse_field(ApeTag* tag) {
       if (_ape_check_validity(tag, flags, SvPVX(key), SvPVX(tmp_val)) != 0) {
         // skip this item
         buffer_consume(&tag->tag_data, size - done);
+        SvREFCNT_dec(key);
+        SvREFCNT_dec(tmp_val);
+        SvREFCNT_dec( (SV *)av );
         return 0;
       }
       else {
@@ -408,6 +433,8 @@ int _ape_parse_field(ApeTag* tag) {
 
   /* Find and check start of value */
   if (size + buffer_len(&tag->tag_data) + APE_ITEM_MINIMUM_SIZE > data_size) {
+    SvREFCNT_dec(key);
+    SvREFCNT_dec(value);
     return _ape_error(tag, "Impossible item length (greater than remaining space)", -3);
   }
 
@@ -486,7 +513,7 @@ get_ape_metadata(PerlIO *infile, char *file, HV *info, HV *tags)
   int status = -1;
   ApeTag* tag;
 
-  Newz(0, tag, sizeof(ApeTag), ApeTag);
+  scan_newz(tag, 1, ApeTag);
 
   if (tag == NULL) {
     PerlIO_printf(PerlIO_stderr(), "APE: [Couldn't allocate memory (ApeTag)] %s\n", file);
@@ -508,7 +535,6 @@ get_ape_metadata(PerlIO *infile, char *file, HV *info, HV *tags)
   buffer_free(&tag->tag_header);
   buffer_free(&tag->tag_footer);
   buffer_free(&tag->tag_data);
-  Safefree(tag);
 
   return status;
 }
@@ -0,0 +1,150 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "arena.h"
+
+#define ARENA_HEADER_SIZE ((sizeof(arena_chunk) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+#define ARENA_CHUNK_DATA(c) ((unsigned char *)(c) + ARENA_HEADER_SIZE)
+
+void
+arena_init(Arena *arena)
+{
+  arena->head  = NULL;
+  arena->spare = NULL;
+}
+
+static arena_chunk *
+_arena_new_chunk(size_t size)
+{
+  arena_chunk *chunk;
+  char *mem;
+
+  New(0, mem, ARENA_HEADER_SIZE + size, char);
+  chunk = (arena_chunk *)mem;
+  chunk->next = NULL;
+  chunk->size = size;
+  chunk->used = 0;
+
+  return chunk;
+}
+
+// Returns size bytes aligned to ARENA_ALIGN, valid until arena_free
+void *
+arena_alloc(Arena *arena, size_t size)
+{
+  arena_chunk *chunk = arena->head;
+  void *p;
+
+  if (size > ARENA_MAX_ALLOC)
+    croak("arena_alloc: size %lu too large (max %u)", (unsigned long)size, ARENA_MAX_ALLOC);
+
+  size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+  if (chunk == NULL || chunk->size - chunk->used < size) {
+    if (size > ARENA_CHUNK_SIZE / 4) {
+      // Large allocations get their own chunk, linked behind the current
+      // one so the remaining space in it is not wasted
+      chunk = _arena_new_chunk(size);
+
+      if (arena->head != NULL) {
+        chunk->next = arena->head->next;
+        arena->head->next = chunk;
+      }
+      else {
+        arena->head = chunk;
+      }
+
+      chunk->used = size;
+      return ARENA_CHUNK_DATA(chunk);
+    }
+
+    if (arena->spare != NULL) {
+      chunk = arena->spare;
+      arena->spare = chunk->next;
+    }
+    else {
+      chunk = _arena_new_chunk(ARENA_CHUNK_SIZE);
+    }
+
+    chunk->next = arena->head;
+    arena->head = chunk;
+  }
+
+  p = ARENA_CHUNK_DATA(chunk) + chunk->used;
+  chunk->used += size;
+
+  return p;
+}
+
+// Copies len bytes of s and adds a null terminator
+char *
+arena_strndup(Arena *arena, const char *s, uint32_t len)
+{
+  char *p = (char *)arena_alloc(arena, len + 1);
+
+  Copy(s, p, len, char);
+  p[len] = '\0';
+
+  return p;
+}
+
+// Releases all allocations, but keeps up to ARENA_KEEP regular chunks
+// so the next user of the arena does not have to allocate again
+void
+arena_reset(Arena *arena)
+{
+  arena_chunk *chunk;
+  int kept = 0;
+
+  for (chunk = arena->spare; chunk != NULL; chunk = chunk->next)
+    kept++;
+
+  chunk = arena->head;
+  while (chunk != NULL) {
+    arena_chunk *next = chunk->next;
+
+    if (chunk->size == ARENA_CHUNK_SIZE && kept < ARENA_KEEP) {
+      chunk->used = 0;
+      chunk->next = arena->spare;
+      arena->spare = chunk;
+      kept++;
+    }
+    else {
+      Safefree(chunk);
+    }
+
+    chunk = next;
+  }
+
+  arena->head = NULL;
+}
+
+void
+arena_free(Arena *arena)
+{
+  arena_chunk *chunk;
+
+  arena_reset(arena);
+
+  chunk = arena->spare;
+  while (chunk != NULL) {
+    arena_chunk *next = chunk->next;
+    Safefree(chunk);
+    chunk = next;
+  }
+
+  arena->spare = NULL;
+}
@@ -52,12 +52,39 @@ print_guid(GUID guid)
   );
 }
 
+// Header object names for the offsets option
+static struct {
+  GUID *guid;
+  char const *name;
+} asf_object_names[] = {
+  { &ASF_Content_Description, "Content_Description" },
+  { &ASF_File_Properties, "File_Properties" },
+  { &ASF_Stream_Properties, "Stream_Properties" },
+  { &ASF_Header_Extension, "Header_Extension" },
+  { &ASF_Compatibility, "Compatibility" },
+  { &ASF_Metadata, "Metadata" },
+  { &ASF_Padding, "Padding" },
+  { &ASF_Extended_Stream_Properties, "Extended_Stream_Properties" },
+  { &ASF_Extended_Content_Description, "Extended_Content_Description" },
+  { &ASF_Language_List, "Language_List" },
+  { &ASF_Advanced_Mutual_Exclusion, "Advanced_Mutual_Exclusion" },
+  { &ASF_Index_Parameters, "Index_Parameters" },
+  { &ASF_Codec_List, "Codec_List" },
+  { &ASF_Stream_Bitrate_Properties, "Stream_Bitrate_Properties" },
+  { &ASF_Metadata_Library, "Metadata_Library" },
+  { &ASF_Content_Encryption, "Content_Encryption" },
+  { &ASF_Extended_Content_Encryption, "Extended_Content_Encryption" },
+  { &ASF_Script_Command, "Script_Command" },
+  { &ASF_Digital_Signature, "Digital_Signature" },
+  { &ASF_Index_Placeholder, "Index_Placeholder" },
+  { &ASF_Error_Correction, "Error_Correction" },
+  { NULL, NULL }
+};
+
 int
 get_asf_metadata(PerlIO *infile, char *file, HV *info, HV *tags)
 {
-  asfinfo *asf = _asf_parse(infile, file, info, tags, 0);
-
-  Safefree(asf);
+  _asf_parse(infile, file, info, tags, 0);
 
   return 0;
 }
@@ -70,9 +97,9 @@ _asf_parse(PerlIO *infile, char *file, HV *info, HV *tags, uint8_t seeking)
   ASF_Object tmp;
   asfinfo *asf;
 
-  Newz(0, asf, sizeof(asfinfo), asfinfo);
-  Newz(0, asf->buf, sizeof(Buffer), Buffer);
-  Newz(0, asf->scratch, sizeof(Buffer), Buffer);
+  scan_newz(asf, 1, asfinfo);
+  scan_newz(asf->buf, 1, Buffer);
+  scan_newz(asf->scratch, 1, Buffer);
 
   asf->file_size     = _file_size(infile);
   asf->audio_offset  = 0;
@@ -129,6 +156,8 @@ _asf_parse(PerlIO *infile, char *file, HV *info, HV *tags, uint8_t seeking)
 
     DEBUG_TRACE("object_offset %d\n", asf->object_offset);
 
+    _asf_object_offset(asf, &tmp.ID, tmp.size);
+
     if ( IsEqualGUID(&tmp.ID, &ASF_Content_Description) ) {
       DEBUG_TRACE("Content_Description\n");
       _parse_content_description(asf);
@@ -241,11 +270,9 @@ _asf_parse(PerlIO *infile, char *file, HV *info, HV *tags, uint8_t seeking)
 
 out:
   buffer_free(asf->buf);
-  Safefree(asf->buf);
 
   if (asf->scratch->alloc)
     buffer_free(asf->scratch);
-  Safefree(asf->scratch);
 
   return asf;
 }
@@ -272,7 +299,10 @@ _parse_content_description(asfinfo *asf)
   for (i = 0; i < 5; i++) {
     SV *value;
 
-    if ( len[i] ) {
+    if ( len[i] && !_tag_wanted(fields[i], -1) ) {
+      buffer_consume(asf->buf, len[i]);
+    }
+    else if ( len[i] ) {
       buffer_clear(asf->scratch);
       buffer_get_utf16_as_utf8(asf->buf, asf->scratch, len[i], UTF16_BYTEORDER_LE);
       value = newSVpv( buffer_ptr(asf->scratch), 0 );
@@ -285,6 +315,37 @@ _parse_content_description(asfinfo *asf)
   }
 }
 
+// With the offsets option, record where the data of the object whose header
+// was just read lies in the file
+void
+_asf_object_offset(asfinfo *asf, GUID *id, uint64_t size)
+{
+  int i;
+
+  if ( !_offsets_option() || size < 24 )
+    return;
+
+  for (i = 0; asf_object_names[i].guid; i++) {
+    if ( IsEqualGUID(id, asf_object_names[i].guid) ) {
+      _store_tag_offset(asf->info, asf_object_names[i].name, asf->object_offset, size - 24, "binary");
+      return;
+    }
+  }
+
+  {
+    char name[37];
+
+    sprintf(name,
+      "%08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+      id->Data1, id->Data2, id->Data3,
+      id->Data4[0], id->Data4[1], id->Data4[2], id->Data4[3],
+      id->Data4[4], id->Data4[5], id->Data4[6], id->Data4[7]
+    );
+
+    _store_tag_offset(asf->info, name, asf->object_offset, size - 24, "binary");
+  }
+}
+
 void
 _parse_extended_content_description(asfinfo *asf)
 {
@@ -304,14 +365,27 @@ _parse_extended_content_description(asfinfo *asf)
 
     buffer_clear(asf->scratch);
     buffer_get_utf16_as_utf8(asf->buf, asf->scratch, name_len, UTF16_BYTEORDER_LE);
-    key = newSVpv( buffer_ptr(asf->scratch), 0 );
-    sv_utf8_decode(key);
 
     data_type = buffer_get_short_le(asf->buf);
     value_len = buffer_get_short_le(asf->buf);
 
     picture_offset += 2 + name_len + 4;
 
+    _store_tag_offset(
+      asf->info, (char *)buffer_ptr(asf->scratch), asf->object_offset + 2 + picture_offset, value_len,
+      data_type == TYPE_UNICODE ? "utf16le" : "binary"
+    );
+
+    if ( !_tag_wanted( (char *)buffer_ptr(asf->scratch), -1 ) ) {
+      DEBUG_TRACE("  %s not requested, skipping\n", (char *)buffer_ptr(asf->scratch));
+      buffer_consume(asf->buf, value_len);
+      picture_offset += value_len;
+      continue;
+    }
+
+    key = newSVpv( buffer_ptr(asf->scratch), 0 );
+    sv_utf8_decode(key);
+
     if (data_type == TYPE_UNICODE) {
       buffer_clear(asf->scratch);
       buffer_get_utf16_as_utf8(asf->buf, asf->scratch, value_len, UTF16_BYTEORDER_LE);
@@ -656,6 +730,8 @@ _parse_header_extension(asfinfo *asf, uint64_t len)
 
     DEBUG_TRACE("  object_offset %d\n", asf->object_offset);
 
+    _asf_object_offset(asf, &hdr, hdr_size);
+
     if ( IsEqualGUID(&hdr, &ASF_Metadata) ) {
       DEBUG_TRACE("  Metadata\n");
       _parse_metadata(asf);
@@ -1054,11 +1130,20 @@ _parse_metadata_library(asfinfo *asf)
 
     buffer_clear(asf->scratch);
     buffer_get_utf16_as_utf8(asf->buf, asf->scratch, name_len, UTF16_BYTEORDER_LE);
-    key = newSVpv( buffer_ptr(asf->scratch), 0 );
-    sv_utf8_decode(key);
 
     picture_offset += 12 + name_len;
 
+    // Stream-specific entries go to info, only tags are projected
+    if ( stream_number == 0 && !_tag_wanted( (char *)buffer_ptr(asf->scratch), -1 ) ) {
+      DEBUG_TRACE("    %s not requested, skipping\n", (char *)buffer_ptr(asf->scratch));
+      buffer_consume(asf->buf, data_len);
+      picture_offset += data_len;
+      continue;
+    }
+
+    key = newSVpv( buffer_ptr(asf->scratch), 0 );
+    sv_utf8_decode(key);
+
     if (data_type == TYPE_UNICODE) {
       buffer_clear(asf->scratch);
       buffer_get_utf16_as_utf8(asf->buf, asf->scratch, data_len, UTF16_BYTEORDER_LE);
@@ -1305,7 +1390,7 @@ _parse_index(asfinfo *asf, uint64_t size)
 
   asf->spec_count = spec_count;
 
-  New(0, asf->specs, spec_count * sizeof(*asf->specs), struct asf_index_specs);
+  scan_newz(asf->specs, spec_count, struct asf_index_specs);
 
   DEBUG_TRACE("  Index Specifiers:\n");
   for (i = 0; i < spec_count; i++) {
@@ -1325,7 +1410,7 @@ _parse_index(asfinfo *asf, uint64_t size)
     DEBUG_TRACE("  specs[%d].block_pos %llu\n", i, asf->specs[i].block_pos);
 
     // allocate space for this spec's offsets
-    New(0, asf->specs[i].offsets, entry_count * sizeof(uint32_t), uint32_t);
+    scan_newz(asf->specs[i].offsets, entry_count, uint32_t);
   }
 
   for (ec = 0; ec < entry_count; ec++) {
@@ -1498,19 +1583,43 @@ _parse_picture(asfinfo *asf, uint32_t picture_offset)
 off_t
 asf_find_frame(PerlIO *infile, char *file, int time_offset)
 {
-  int frame_offset = -1;
-  uint32_t song_length_ms;
-  int32_t offset_index = 0;
-  uint32_t min_packet_size, max_packet_size;
-  uint8_t found = 0;
+  off_t frame_offset;
 
   // We need to read all info first to get some data we need to calculate
   HV *info = newHV();
   HV *tags = newHV();
+  asfinfo *asf = asf_seek_open(infile, file, info, tags);
+
+  frame_offset = asf_seek(asf, infile, file, info, time_offset);
+
+  // Don't leak
+  SvREFCNT_dec(info);
+  SvREFCNT_dec(tags);
+
+  return frame_offset;
+}
+
+// Parse what asf_seek needs, the returned state can be used for any number of seeks
+void *
+asf_seek_open(PerlIO *infile, char *file, HV *info, HV *tags)
+{
   asfinfo *asf = _asf_parse(infile, file, info, tags, 1);
 
-  // We'll need to reuse the scratch buffer
-  Newz(0, asf->scratch, sizeof(Buffer), Buffer);
+  // We'll need to reuse the scratch buffer, its data is freed after each seek
+  scan_newz(asf->scratch, 1, Buffer);
+
+  return asf;
+}
+
+off_t
+asf_seek(void *state, PerlIO *infile, char *file, HV *info, int time_offset)
+{
+  asfinfo *asf = (asfinfo *)state;
+  int frame_offset = -1;
+  uint32_t song_length_ms;
+  int32_t offset_index = 0;
+  uint32_t min_packet_size, max_packet_size;
+  uint8_t found = 0;
 
   // No seeking without at least 1 stream
   if ( !my_hv_exists(info, "streams") ) {
@@ -1528,6 +1637,12 @@ asf_find_frame(PerlIO *infile, char *file, int time_offset)
     goto out;
   }
 
+  // Broadcast streams have no duration to seek in
+  if ( !my_hv_exists(info, "song_length_ms") ) {
+    DEBUG_TRACE("No song_length_ms, cannot seek\n");
+    goto out;
+  }
+
   song_length_ms = SvIV( *(my_hv_fetch( info, "song_length_ms" )) );
 
   if (time_offset > song_length_ms)
@@ -1624,26 +1739,8 @@ asf_find_frame(PerlIO *infile, char *file, int time_offset)
   }
 
 out:
-  // Don't leak
-  SvREFCNT_dec(info);
-  SvREFCNT_dec(tags);
-
-  if (asf->spec_count) {
-    int i;
-    for (i = 0; i < asf->spec_count; i++) {
-      DEBUG_TRACE("Freeing specs[%d] offsets\n", i);
-      Safefree(asf->specs[i].offsets);
-    }
-
-    DEBUG_TRACE("Freeing specs\n");
-    Safefree(asf->specs);
-  }
-
   if (asf->scratch->alloc)
     buffer_free(asf->scratch);
-  Safefree(asf->scratch);
-
-  Safefree(asf);
 
   return frame_offset;
 }
@@ -677,6 +677,69 @@ buffer_get_utf8(Buffer *buffer, Buffer *utf8, uint32_t len_hint)
   return i;
 }
 
+#define UTF16_UNIT(p, le) ( (le) ? ((p)[0] | ((p)[1] << 8)) : (((p)[0] << 8) | (p)[1]) )
+
+#if defined(AUDIO_SCAN_SSE2)
+// Copy 16 bytes if none of them has the high bit set
+static int
+_latin1_ascii16(const unsigned char *src, unsigned char *dst)
+{
+  __m128i v = _mm_loadu_si128( (const __m128i *)src );
+
+  if ( _mm_movemask_epi8(v) )
+    return 0;
+
+  _mm_storeu_si128( (__m128i *)dst, v );
+  return 1;
+}
+
+// Narrow 8 UTF-16 code units to 8 bytes if they are all in U+0001 ~ U+007F
+static int
+_utf16_ascii8(const unsigned char *src, int le, unsigned char *dst)
+{
+  const __m128i zero = _mm_setzero_si128();
+  __m128i v = _mm_loadu_si128( (const __m128i *)src );
+
+  if (!le)
+    v = _mm_or_si128( _mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8) );
+
+  if ( _mm_movemask_epi8( _mm_cmpeq_epi16( _mm_and_si128( v, _mm_set1_epi16((short)0xFF80) ), zero ) ) != 0xFFFF
+    || _mm_movemask_epi8( _mm_cmpeq_epi16(v, zero) ) )
+    return 0;
+
+  _mm_storel_epi64( (__m128i *)dst, _mm_packus_epi16(v, v) );
+  return 1;
+}
+#elif defined(AUDIO_SCAN_NEON)
+static int
+_latin1_ascii16(const unsigned char *src, unsigned char *dst)
+{
+  uint8x16_t v = vld1q_u8(src);
+  uint8x8_t high = vand_u8( vorr_u8( vget_low_u8(v), vget_high_u8(v) ), vdup_n_u8(0x80) );
+
+  if ( vget_lane_u64( vreinterpret_u64_u8(high), 0 ) )
+    return 0;
+
+  vst1q_u8(dst, v);
+  return 1;
+}
+
+static int
+_utf16_ascii8(const unsigned char *src, int le, unsigned char *dst)
+{
+  uint8x8x2_t p = vld2_u8(src);
+  uint8x8_t lo  = le ? p.val[0] : p.val[1];
+  uint8x8_t hi  = le ? p.val[1] : p.val[0];
+  uint8x8_t bad = vorr_u8( hi, vorr_u8( vtst_u8( lo, vdup_n_u8(0x80) ), vceq_u8( lo, vdup_n_u8(0) ) ) );
+
+  if ( vget_lane_u64( vreinterpret_u64_u8(bad), 0 ) )
+    return 0;
+
+  vst1_u8(dst, lo);
+  return 1;
+}
+#endif
+
 // Read a null-terminated latin1 string, converting to UTF-8 in supplied buffer
 // len_hint is the length of the latin1 string, utf8 may end up being larger
 // or possibly less if we hit a null.
@@ -684,40 +747,56 @@ buffer_get_utf8(Buffer *buffer, Buffer *utf8, uint32_t len_hint)
 uint32_t
 buffer_get_latin1_as_utf8(Buffer *buffer, Buffer *utf8, uint32_t len_hint)
 {
-  int i = 0;
+  uint32_t i = 0;
+  uint32_t len;
   unsigned char *bptr = buffer_ptr(buffer);
-  uint8_t is_utf8;
+  unsigned char *nul;
+  unsigned char *out;
+  unsigned char *dst;
 
   if (!len_hint) return 0;
 
+  // The string ends after the first null, or at len_hint
+  nul = memchr(bptr, 0, len_hint);
+  len = nul ? nul - bptr + 1 : len_hint;
+
+  // Reserve the worst case of 2 bytes per character and the null once,
+  // the unused part is given back below
+  out = dst = buffer_append_space(utf8, len * 2 + 1);
+
   // We may get a valid UTF-8 string in here from ID3v1 or
   // elsewhere, if so we don't want to translate from ISO-8859-1
-  is_utf8 = is_utf8_string(bptr, len_hint);
+  if ( is_utf8_string(bptr, len_hint) ) {
+    memcpy(dst, bptr, len);
+    dst += len;
+    i = len;
+  }
 
-  for (i = 0; i < len_hint; i++) {
-    uint8_t c = bptr[i];
+  while (i < len) {
+    uint8_t c;
 
-    if (is_utf8) {
-      buffer_put_char(utf8, c);
-    }
-    else {
-      // translate high chars from ISO-8859-1 to UTF-8
-      if (c < 0x80) {
-        buffer_put_char(utf8, c);
-      }
-      else if (c < 0xc0) {
-        buffer_put_char(utf8, 0xc2);
-        buffer_put_char(utf8, c);
-      }
-      else {
-        buffer_put_char(utf8, 0xc3);
-        buffer_put_char(utf8, c - 64);
-      }
+#if defined(AUDIO_SCAN_SSE2) || defined(AUDIO_SCAN_NEON)
+    // ASCII runs, including the null, are copied 16 bytes at a time
+    if ( len - i >= 16 && _latin1_ascii16(bptr + i, dst) ) {
+      i += 16;
+      dst += 16;
+      continue;
     }
+#endif
 
-    if (c == 0) {
-      i++;
-      break;
+    c = bptr[i++];
+
+    // translate high chars from ISO-8859-1 to UTF-8
+    if (c < 0x80) {
+      *dst++ = c;
+    }
+    else if (c < 0xc0) {
+      *dst++ = 0xc2;
+      *dst++ = c;
+    }
+    else {
+      *dst++ = 0xc3;
+      *dst++ = c - 64;
     }
   }
 
@@ -725,10 +804,12 @@ buffer_get_latin1_as_utf8(Buffer *buffer, Buffer *utf8, uint32_t len_hint)
   buffer_consume(buffer, i);
 
   // Add null if one wasn't provided
-  if ( (utf8->buf + utf8->end - 1)[0] != 0 ) {
-    buffer_put_char(utf8, 0);
+  if ( dst[-1] != 0 ) {
+    *dst++ = 0;
   }
 
+  utf8->end -= (out + len * 2 + 1) - dst;
+
 #ifdef AUDIO_SCAN_DEBUG
   //DEBUG_TRACE("utf8 buffer:\n");
   //buffer_dump(utf8, 0);
@@ -737,54 +818,114 @@ buffer_get_latin1_as_utf8(Buffer *buffer, Buffer *utf8, uint32_t len_hint)
   return i;
 }
 
-// Read a null-terminated UTF-16 string, converting to UTF-8 in the supplied buffer
+// Read a null-terminated UTF-16 string, converting to UTF-8 in the supplied buffer.
+// Surrogate pairs are combined, an unpaired surrogate becomes U+FFFD.
 // Caller must manage utf8 buffer (init/free)
-// XXX supports U+0000 ~ U+FFFF only.
 uint32_t
 buffer_get_utf16_as_utf8(Buffer *buffer, Buffer *utf8, uint32_t len, uint8_t byteorder)
 {
-  int i = 0;
-  uint16_t wc = 0;
+  uint32_t i = 0;
+  uint32_t end;
+  uint32_t stop;
+  uint32_t wc;
+  uint32_t wc2;
+  uint32_t reserved;
+  int le = (byteorder == UTF16_BYTEORDER_LE);
+  int terminated = 0;
+  unsigned char *src = buffer_ptr(buffer);
+  unsigned char *out;
+  unsigned char *dst;
 
   if (!len) return 0;
 
-  for (i = 0; i < len; i += 2) {
-    // Check that we are not reading past the end of the buffer
-    if (len - i >= 2) {
-      wc = (byteorder == UTF16_BYTEORDER_LE)
-        ? buffer_get_short_le(buffer)
-        : buffer_get_short(buffer);
-    }
-    else {
-      DEBUG_TRACE("    UTF-16 text has an odd number of bytes, skipping final byte\n");
-      buffer_consume(buffer, 1);
-      wc = 0;
+  // Don't read past the end of the buffer
+  end = len < buffer_len(buffer) ? len : buffer_len(buffer);
+
+  // Reserve the worst case once: 3 bytes per code unit (a surrogate pair is
+  // 4 bytes for 2 units) and the null, the unused part is given back below
+  reserved = (len / 2) * 3 + 1;
+  out = dst = buffer_append_space(utf8, reserved);
+
+  while ( !terminated && i + 2 <= end ) {
+#if defined(AUDIO_SCAN_SSE2) || defined(AUDIO_SCAN_NEON)
+    // ASCII runs are narrowed 8 code units at a time, a run that stops early
+    // leaves the next 8 units to the loop below
+    while ( end - i >= 16 && _utf16_ascii8(src + i, le, dst) ) {
+      i += 16;
+      dst += 8;
     }
 
-    if (wc < 0x80) {
-      buffer_put_char(utf8, wc & 0xff);
-    }
-    else if (wc < 0x800) {
-      buffer_put_char(utf8, 0xc0 | (wc>>6));
-      buffer_put_char(utf8, 0x80 | (wc & 0x3f));
-    }
-    else {
-      buffer_put_char(utf8, 0xe0 | (wc>>12));
-      buffer_put_char(utf8, 0x80 | ((wc>>6) & 0x3f));
-      buffer_put_char(utf8, 0x80 | (wc & 0x3f));
+    stop = end - i > 16 ? i + 16 : end;
+#else
+    stop = end;
+#endif
+
+    while ( i + 2 <= stop ) {
+      wc = UTF16_UNIT(src + i, le);
+      i += 2;
+
+      if (wc == 0) {
+        *dst++ = 0;
+        terminated = 1;
+        break;
+      }
+
+      if (wc < 0x80) {
+        *dst++ = wc;
+      }
+      else if (wc < 0x800) {
+        *dst++ = 0xc0 | (wc >> 6);
+        *dst++ = 0x80 | (wc & 0x3f);
+      }
+      else {
+        if (wc >= 0xd800 && wc < 0xe000) {
+          if ( wc < 0xdc00 && i + 2 <= end
+            && (wc2 = UTF16_UNIT(src + i, le)) >= 0xdc00 && wc2 < 0xe000
+          ) {
+            i += 2;
+            wc = 0x10000 + ((wc - 0xd800) << 10) + (wc2 - 0xdc00);
+
+            *dst++ = 0xf0 | (wc >> 18);
+            *dst++ = 0x80 | ((wc >> 12) & 0x3f);
+            *dst++ = 0x80 | ((wc >> 6) & 0x3f);
+            *dst++ = 0x80 | (wc & 0x3f);
+            continue;
+          }
+
+          DEBUG_TRACE("    UTF-16 text has an unpaired surrogate %04x\n", wc);
+          wc = 0xfffd;
+        }
+
+        *dst++ = 0xe0 | (wc >> 12);
+        *dst++ = 0x80 | ((wc >> 6) & 0x3f);
+        *dst++ = 0x80 | (wc & 0x3f);
+      }
     }
+  }
 
-    if (wc == 0) {
+  buffer_consume(buffer, i);
+
+  if ( !terminated && i < len ) {
+    if (len - i == 1 && end == len) {
+      // Counted as a whole code unit like a null
+      DEBUG_TRACE("    UTF-16 text has an odd number of bytes, skipping final byte\n");
+      buffer_consume(buffer, 1);
+      *dst++ = 0;
       i += 2;
-      break;
+    }
+    else {
+      utf8->end -= reserved - (dst - out);
+      croak("buffer_get_utf16_as_utf8: buffer error");
     }
   }
 
   // Add null if one wasn't provided
-  if ( (utf8->buf + utf8->end - 1)[0] != 0 ) {
-    buffer_put_char(utf8, 0);
+  if ( dst[-1] != 0 ) {
+    *dst++ = 0;
   }
 
+  utf8->end -= reserved - (dst - out);
+
 #ifdef AUDIO_SCAN_DEBUG
   //DEBUG_TRACE("utf8 buffer:\n");
   //buffer_dump(utf8, 0);
@@ -0,0 +1,665 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include "cache.h"
+
+#ifdef AUDIO_SCAN_CACHE
+
+/*
+ * File layout, all integers big-endian:
+ *
+ * header: "ASCACHE1" followed by XS_VERSION, zero padded to CACHE_HEADER_SIZE
+ *
+ * record:
+ *   0  magic
+ *   4  record length, including this fixed part
+ *   8  hash (jenkins_hash of the scanned file)
+ *  12  checksum of everything from offset 16 to the end of the record
+ *  16  mtime (64-bit)
+ *  24  size (64-bit)
+ *  32  path length
+ *  36  signature length
+ *  40  path, signature, serialized result
+ *
+ * Creating or clearing the file and appending a record are done under an
+ * fcntl write lock, so writers in other processes don't interleave. A
+ * record that is still being written is simply not indexed until it is
+ * complete, reading needs no lock.
+ */
+
+static void
+_cache_header(char *header)
+{
+  Zero(header, CACHE_HEADER_SIZE, char);
+  strcpy(header, "ASCACHE1");
+  strncpy(header + 8, XS_VERSION, CACHE_HEADER_SIZE - 9);
+}
+
+// Take (F_WRLCK) or release (F_UNLCK) the write lock on the whole file
+static int
+_cache_lock(scancache *c, short type)
+{
+  struct flock fl;
+
+  Zero(&fl, 1, struct flock);
+  fl.l_type   = type;
+  fl.l_whence = SEEK_SET;
+
+  while ( fcntl(c->fd, F_SETLKW, &fl) != 0 ) {
+    if (errno != EINTR) {
+      warn("Audio::Scan unable to lock cache %s: %s\n", c->path, strerror(errno));
+      c->broken = 1;
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+// Write the header unless the file already starts with the current one,
+// clearing anything written by another version first
+static int
+_cache_init(scancache *c)
+{
+  char header[CACHE_HEADER_SIZE];
+  char current[CACHE_HEADER_SIZE];
+  int ok = 1;
+
+  if ( !_cache_lock(c, F_WRLCK) )
+    return 0;
+
+  // Checked again under the lock, another process may have just done it
+  _cache_header(header);
+  if ( pread(c->fd, current, CACHE_HEADER_SIZE, 0) != CACHE_HEADER_SIZE
+    || memcmp(current, header, CACHE_HEADER_SIZE) != 0 )
+  {
+    DEBUG_TRACE("Initializing cache %s\n", c->path);
+    if ( ftruncate(c->fd, 0) != 0 || write(c->fd, header, CACHE_HEADER_SIZE) != CACHE_HEADER_SIZE )
+      ok = 0;
+  }
+
+  _cache_lock(c, F_UNLCK);
+
+  return ok;
+}
+
+static void
+_cache_put_int(Buffer *buf, uint32_t value)
+{
+  put_u32( buffer_append_space(buf, 4), value );
+}
+
+static void
+_cache_put_int64(Buffer *buf, uint64_t value)
+{
+  _cache_put_int(buf, (uint32_t)(value >> 32));
+  _cache_put_int(buf, (uint32_t)value);
+}
+
+static void
+_cache_put_string(Buffer *buf, char type, const char *s, uint32_t len)
+{
+  buffer_put_char(buf, type);
+  _cache_put_int(buf, len);
+  buffer_append(buf, s, len);
+}
+
+static void _cache_put_sv(Buffer *buf, SV *sv, int depth);
+
+static void
+_cache_put_hv(Buffer *buf, HV *hv, int depth)
+{
+  HE *he;
+  uint32_t pos;
+  uint32_t count = 0;
+
+  buffer_put_char(buf, 'H');
+  pos = buffer_len(buf);
+  _cache_put_int(buf, 0);
+
+  hv_iterinit(hv);
+  while ( (he = hv_iternext(hv)) != NULL ) {
+    I32 klen;
+    char *key = hv_iterkey(he, &klen);
+
+    _cache_put_string(buf, HeKUTF8(he) ? 'K' : 'k', key, klen);
+    _cache_put_sv(buf, hv_iterval(hv, he), depth + 1);
+    count++;
+  }
+
+  put_u32( (unsigned char *)buffer_ptr(buf) + pos, count );
+}
+
+static void
+_cache_put_sv(Buffer *buf, SV *sv, int depth)
+{
+  if (depth > CACHE_MAX_DEPTH || !SvOK(sv)) {
+    buffer_put_char(buf, 'U');
+  }
+  else if ( SvROK(sv) ) {
+    SV *rv = SvRV(sv);
+
+    if ( SvTYPE(rv) == SVt_PVHV ) {
+      _cache_put_hv(buf, (HV *)rv, depth);
+    }
+    else if ( SvTYPE(rv) == SVt_PVAV ) {
+      AV *av = (AV *)rv;
+      SSize_t i;
+
+      buffer_put_char(buf, 'A');
+      _cache_put_int(buf, av_len(av) + 1);
+
+      for (i = 0; i <= av_len(av); i++) {
+        SV **entry = av_fetch(av, i, 0);
+        _cache_put_sv(buf, entry != NULL ? *entry : &PL_sv_undef, depth + 1);
+      }
+    }
+    else {
+      buffer_put_char(buf, 'U');
+    }
+  }
+  else if ( SvPOK(sv) ) {
+    STRLEN len;
+    char *s = SvPV(sv, len);
+
+    _cache_put_string(buf, SvUTF8(sv) ? 'T' : 'S', s, len);
+  }
+  else if ( SvIOK(sv) ) {
+    if ( SvIsUV(sv) ) {
+      buffer_put_char(buf, 'J');
+      _cache_put_int64(buf, (uint64_t)SvUVX(sv));
+    }
+    else {
+      buffer_put_char(buf, 'I');
+      _cache_put_int64(buf, (uint64_t)(int64_t)SvIVX(sv));
+    }
+  }
+  else if ( SvNOK(sv) ) {
+    double nv = (double)SvNVX(sv);
+    uint64_t bits;
+
+    Copy(&nv, &bits, 1, uint64_t);
+    buffer_put_char(buf, 'N');
+    _cache_put_int64(buf, bits);
+  }
+  else {
+    buffer_put_char(buf, 'U');
+  }
+}
+
+// Reading a stored result, bounds are checked since the file may be damaged
+typedef struct {
+  unsigned char *ptr;
+  unsigned char *end;
+} cache_reader;
+
+#define CACHE_NEED(r, n) ( (uint64_t)((r)->end - (r)->ptr) >= (uint64_t)(n) )
+
+static SV *
+_cache_get_sv(cache_reader *r, int depth)
+{
+  char type;
+  uint32_t len, i;
+
+  if ( depth > CACHE_MAX_DEPTH || !CACHE_NEED(r, 1) )
+    return NULL;
+
+  type = *r->ptr++;
+
+  switch (type) {
+    case 'U':
+      return newSV(0);
+
+    case 'I':
+    case 'J':
+    case 'N':
+    {
+      uint64_t v;
+
+      if ( !CACHE_NEED(r, 8) )
+        return NULL;
+
+      v = get_u64(r->ptr);
+      r->ptr += 8;
+
+      if (type == 'I')
+        return newSViv( (IV)(int64_t)v );
+
+      if (type == 'J')
+        return newSVuv( (UV)v );
+
+      {
+        double nv;
+        Copy(&v, &nv, 1, double);
+        return newSVnv(nv);
+      }
+    }
+
+    case 'S':
+    case 'T':
+    {
+      SV *sv;
+
+      if ( !CACHE_NEED(r, 4) )
+        return NULL;
+
+      len = get_u32(r->ptr);
+      r->ptr += 4;
+
+      if ( !CACHE_NEED(r, len) )
+        return NULL;
+
+      sv = newSVpvn( (char *)r->ptr, len );
+      if (type == 'T')
+        SvUTF8_on(sv);
+      r->ptr += len;
+
+      return sv;
+    }
+
+    case 'A':
+    {
+      AV *av;
+
+      if ( !CACHE_NEED(r, 4) )
+        return NULL;
+
+      len = get_u32(r->ptr);
+      r->ptr += 4;
+
+      av = newAV();
+      for (i = 0; i < len; i++) {
+        SV *item = _cache_get_sv(r, depth + 1);
+        if (item == NULL) {
+          SvREFCNT_dec(av);
+          return NULL;
+        }
+        av_push(av, item);
+      }
+
+      return newRV_noinc( (SV *)av );
+    }
+
+    case 'H':
+    {
+      HV *hv;
+
+      if ( !CACHE_NEED(r, 4) )
+        return NULL;
+
+      len = get_u32(r->ptr);
+      r->ptr += 4;
+
+      hv = newHV();
+      for (i = 0; i < len; i++) {
+        char ktype;
+        uint32_t klen;
+        char *key;
+        SV *value;
+
+        if ( !CACHE_NEED(r, 5) )
+          goto bad_hv;
+
+        ktype = *r->ptr++;
+        klen  = get_u32(r->ptr);
+        r->ptr += 4;
+
+        if ( (ktype != 'k' && ktype != 'K') || klen > I32_MAX || !CACHE_NEED(r, klen) )
+          goto bad_hv;
+
+        key = (char *)r->ptr;
+        r->ptr += klen;
+
+        if ( (value = _cache_get_sv(r, depth + 1)) == NULL )
+          goto bad_hv;
+
+        // A negative length marks a UTF-8 key
+        hv_store( hv, key, ktype == 'K' ? -(I32)klen : (I32)klen, value, 0 );
+      }
+
+      return newRV_noinc( (SV *)hv );
+
+    bad_hv:
+      SvREFCNT_dec(hv);
+      return NULL;
+    }
+
+    default:
+      return NULL;
+  }
+}
+
+static void
+_cache_index_reset(scancache *c)
+{
+  uint32_t i;
+
+  for (i = 0; i < c->nbuckets; i++) {
+    cache_entry *e = c->buckets[i];
+    while (e != NULL) {
+      cache_entry *next = e->next;
+      Safefree(e);
+      e = next;
+    }
+    c->buckets[i] = NULL;
+  }
+
+  c->count = 0;
+  c->indexed = CACHE_HEADER_SIZE;
+  c->broken = 0;
+}
+
+static void
+_cache_index_add(scancache *c, uint32_t hash, off_t offset)
+{
+  cache_entry *e;
+
+  // Keep chains short, rehash when the table is twice full
+  if (c->count >= c->nbuckets * 2) {
+    uint32_t nbuckets = c->nbuckets * 4;
+    cache_entry **buckets;
+    uint32_t i;
+
+    Newz(0, buckets, nbuckets, cache_entry *);
+
+    // Walk each chain backwards so newer records stay in front
+    for (i = 0; i < c->nbuckets; i++) {
+      cache_entry *rev = NULL;
+
+      for (e = c->buckets[i]; e != NULL; ) {
+        cache_entry *next = e->next;
+        e->next = rev;
+        rev = e;
+        e = next;
+      }
+
+      for (e = rev; e != NULL; ) {
+        cache_entry *next = e->next;
+        e->next = buckets[e->hash & (nbuckets - 1)];
+        buckets[e->hash & (nbuckets - 1)] = e;
+        e = next;
+      }
+    }
+
+    Safefree(c->buckets);
+    c->buckets  = buckets;
+    c->nbuckets = nbuckets;
+  }
+
+  New(0, e, 1, cache_entry);
+  e->hash   = hash;
+  e->offset = offset;
+  e->next   = c->buckets[hash & (c->nbuckets - 1)];
+  c->buckets[hash & (c->nbuckets - 1)] = e;
+  c->count++;
+}
+
+// Map any data appended since the last call and index its records
+static int
+_cache_refresh(scancache *c)
+{
+  struct stat st;
+
+  if (fstat(c->fd, &st) != 0)
+    return 0;
+
+  if (c->map != NULL && st.st_size == c->mapped)
+    return !c->broken;
+
+  if (c->map != NULL) {
+    munmap(c->map, c->mapped);
+    c->map = NULL;
+    c->mapped = 0;
+  }
+
+  // Created or replaced by someone else, or a new file
+  if (st.st_size < c->indexed || st.st_size < CACHE_HEADER_SIZE) {
+    _cache_index_reset(c);
+
+    if (st.st_size < CACHE_HEADER_SIZE) {
+      if ( !_cache_init(c) || fstat(c->fd, &st) != 0 )
+        return 0;
+    }
+  }
+
+  c->map = (unsigned char *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, c->fd, 0);
+  if (c->map == MAP_FAILED) {
+    c->map = NULL;
+    return 0;
+  }
+  c->mapped = st.st_size;
+
+  if (c->indexed == CACHE_HEADER_SIZE) {
+    char header[CACHE_HEADER_SIZE];
+
+    _cache_header(header);
+    if ( memcmp(c->map, header, CACHE_HEADER_SIZE) != 0 ) {
+      // Written by another version, start over
+      DEBUG_TRACE("Cache %s has a different version, clearing\n", c->path);
+      munmap(c->map, c->mapped);
+      c->map = NULL;
+      c->mapped = 0;
+      _cache_index_reset(c);
+      if ( !_cache_init(c) )
+        return 0;
+      return _cache_refresh(c);
+    }
+  }
+
+  while ( !c->broken && c->indexed + CACHE_RECORD_SIZE <= c->mapped ) {
+    unsigned char *rec = c->map + c->indexed;
+    uint32_t len = get_u32(rec + 4);
+
+    // Still being written, the file is extended before the data lands
+    if ( get_u32(rec) == 0 || c->indexed + len > c->mapped )
+      break;
+
+    if ( get_u32(rec) != CACHE_RECORD_MAGIC || len < CACHE_RECORD_SIZE ) {
+      warn("Audio::Scan cache %s is damaged, remove it to start over\n", c->path);
+      c->broken = 1;
+      break;
+    }
+
+    _cache_index_add(c, get_u32(rec + 8), c->indexed);
+    c->indexed += len;
+  }
+
+  return !c->broken;
+}
+
+// Open caches are kept for the life of the interpreter
+scancache *
+cache_get(const char *path)
+{
+  dMY_CXT;
+  scancache *c;
+  int fd;
+
+  for (c = MY_CXT.caches; c != NULL; c = c->next) {
+    if ( !strcmp(c->path, path) )
+      return c;
+  }
+
+  fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (fd < 0) {
+    warn("Audio::Scan unable to open cache %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+
+  Newz(0, c, 1, scancache);
+  c->path = savepv(path);
+  c->fd = fd;
+  c->nbuckets = 1024;
+  Newz(0, c->buckets, c->nbuckets, cache_entry *);
+  c->indexed = CACHE_HEADER_SIZE;
+
+  // Not used where it can't be locked, such as NFS without a lock daemon
+  if ( !_cache_lock(c, F_WRLCK) ) {
+    close(fd);
+    Safefree(c->buckets);
+    Safefree(c->path);
+    Safefree(c);
+    return NULL;
+  }
+  _cache_lock(c, F_UNLCK);
+
+  c->next = MY_CXT.caches;
+  MY_CXT.caches = c;
+
+  return c;
+}
+
+// Close every cache of the interpreter, when it is destroyed
+void
+cache_close_all(void)
+{
+  dMY_CXT;
+  scancache *c;
+
+  while ( (c = MY_CXT.caches) != NULL ) {
+    MY_CXT.caches = c->next;
+
+    _cache_index_reset(c);
+    if (c->map != NULL)
+      munmap(c->map, c->mapped);
+    close(c->fd);
+    Safefree(c->buckets);
+    Safefree(c->path);
+    Safefree(c);
+  }
+}
+
+HV *
+cache_fetch(scancache *c, uint32_t hash, const char *path, int64_t mtime, uint64_t size, const char *sig, uint32_t sig_len)
+{
+  cache_entry *e;
+  uint32_t path_len = strlen(path);
+
+  if ( !_cache_refresh(c) )
+    return NULL;
+
+  // Newest record first
+  for (e = c->buckets[hash & (c->nbuckets - 1)]; e != NULL; e = e->next) {
+    unsigned char *rec = c->map + e->offset;
+    uint32_t len = get_u32(rec + 4);
+    cache_reader r;
+    SV *result;
+
+    if (
+      e->hash != hash
+      || (int64_t)get_u64(rec + 16) != mtime
+      || get_u64(rec + 24) != size
+      || get_u32(rec + 32) != path_len
+      || get_u32(rec + 36) != sig_len
+      || (uint64_t)CACHE_RECORD_SIZE + path_len + sig_len > len
+      || memcmp(rec + CACHE_RECORD_SIZE, path, path_len) != 0
+      || memcmp(rec + CACHE_RECORD_SIZE + path_len, sig, sig_len) != 0
+    ) {
+      continue;
+    }
+
+    if ( hashlittle(rec + 16, len - 16, 0) != get_u32(rec + 12) ) {
+      DEBUG_TRACE("Cache record for %s has a bad checksum\n", path);
+      return NULL;
+    }
+
+    r.ptr = rec + CACHE_RECORD_SIZE + path_len + sig_len;
+    r.end = rec + len;
+
+    result = _cache_get_sv(&r, 0);
+    if (result == NULL || !SvROK(result) || SvTYPE(SvRV(result)) != SVt_PVHV) {
+      if (result != NULL)
+        SvREFCNT_dec(result);
+      return NULL;
+    }
+
+    // Return the hash itself, mortal like the result of _scan_file
+    {
+      HV *hv = (HV *)sv_2mortal( SvREFCNT_inc( SvRV(result) ) );
+      SvREFCNT_dec(result);
+      return hv;
+    }
+  }
+
+  return NULL;
+}
+
+void
+cache_store(scancache *c, uint32_t hash, const char *path, int64_t mtime, uint64_t size, const char *sig, uint32_t sig_len, HV *result)
+{
+  Buffer rec;
+  uint32_t path_len = strlen(path);
+  unsigned char *ptr;
+
+  if ( !_cache_refresh(c) )
+    return;
+
+  buffer_init(&rec, 4096);
+
+  _cache_put_int(&rec, CACHE_RECORD_MAGIC);
+  _cache_put_int(&rec, 0);
+  _cache_put_int(&rec, hash);
+  _cache_put_int(&rec, 0);
+  _cache_put_int64(&rec, (uint64_t)mtime);
+  _cache_put_int64(&rec, size);
+  _cache_put_int(&rec, path_len);
+  _cache_put_int(&rec, sig_len);
+  buffer_append(&rec, path, path_len);
+  buffer_append(&rec, sig, sig_len);
+  _cache_put_hv(&rec, result, 0);
+
+  ptr = (unsigned char *)buffer_ptr(&rec);
+  put_u32( ptr + 4, buffer_len(&rec) );
+  put_u32( ptr + 12, hashlittle(ptr + 16, buffer_len(&rec) - 16, 0) );
+
+  // O_APPEND, so this lands after anything written by other processes
+  if ( _cache_lock(c, F_WRLCK) ) {
+    if ( write(c->fd, ptr, buffer_len(&rec)) != (ssize_t)buffer_len(&rec) ) {
+      warn("Audio::Scan unable to write cache %s: %s\n", c->path, strerror(errno));
+    }
+
+    _cache_lock(c, F_UNLCK);
+  }
+
+  buffer_free(&rec);
+}
+
+#else
+
+scancache *
+cache_get(const char *path)
+{
+  return NULL;
+}
+
+HV *
+cache_fetch(scancache *c, uint32_t hash, const char *path, int64_t mtime, uint64_t size, const char *sig, uint32_t sig_len)
+{
+  return NULL;
+}
+
+void
+cache_store(scancache *c, uint32_t hash, const char *path, int64_t mtime, uint64_t size, const char *sig, uint32_t sig_len, HV *result)
+{
+}
+
+void
+cache_close_all(void)
+{
+}
+
+#endif
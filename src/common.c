@@ -17,6 +17,20 @@
 #include "common.h"
 #include "buffer.c"
 
+static mmapinfo *
+_mmap_lookup(PerlIO *infile)
+{
+  dMY_CXT;
+  mmapinfo *m;
+
+  for (m = MY_CXT.mmaps; m != NULL; m = m->next) {
+    if (m->infile == infile)
+      return m;
+  }
+
+  return NULL;
+}
+
 int
 _check_buf(PerlIO *infile, Buffer *buf, int min_wanted, int max_wanted)
 {
@@ -25,7 +39,7 @@ _check_buf(PerlIO *infile, Buffer *buf, int min_wanted, int max_wanted)
   // Do we have enough data?
   if ( buffer_len(buf) < min_wanted ) {
     // Read more data
-    uint32_t read;
+    int read;
     uint32_t actual_wanted;
     unsigned char *tmp;
 
@@ -40,13 +54,16 @@ _check_buf(PerlIO *infile, Buffer *buf, int min_wanted, int max_wanted)
     // Adjust actual amount to read by the amount we already have in the buffer
     actual_wanted = max_wanted - buffer_len(buf);
 
-    New(0, tmp, actual_wanted, unsigned char);
-
     DEBUG_TRACE("Buffering from file @ %d (min_wanted %d, max_wanted %d, adjusted to %d)\n",
       (int)PerlIO_tell(infile), min_wanted, max_wanted, actual_wanted
     );
 
+    // Read directly into the buffer, then give back whatever we didn't get
+    tmp = (unsigned char *)buffer_append_space(buf, actual_wanted);
+
     if ( (read = PerlIO_read(infile, tmp, actual_wanted)) <= 0 ) {
+      buf->end -= actual_wanted;
+
       if ( PerlIO_error(infile) ) {
 #ifdef _WIN32
         // Show windows specific error message as Win32 PerlIO_read does not set errno
@@ -67,7 +84,7 @@ _check_buf(PerlIO *infile, Buffer *buf, int min_wanted, int max_wanted)
       goto out;
     }
 
-    buffer_append(buf, tmp, read);
+    buf->end -= actual_wanted - read;
 
     // Make sure we got enough
     if ( buffer_len(buf) < min_wanted ) {
@@ -85,12 +102,135 @@ _check_buf(PerlIO *infile, Buffer *buf, int min_wanted, int max_wanted)
 #endif
 
     DEBUG_TRACE("Buffered %d bytes, new pos %d\n", read, (int)PerlIO_tell(infile));
+  }
 
 out:
-    Safefree(tmp);
+  return ret;
+}
+
+// Map a regular file for a parser that indexes the mapping directly instead
+// of going through _check_buf.  The mapping is released when the enclosing
+// scope exits, or on croak.  Returns NULL for pipes, sockets, empty files or
+// on platforms without mmap, in which case the parser reads as usual.
+mmapinfo *
+_mmap_attach(PerlIO *infile)
+{
+#ifdef AUDIO_SCAN_MMAP
+  dMY_CXT;
+  struct stat st;
+  void *map;
+  mmapinfo *m;
+  int fd = PerlIO_fileno(infile);
+
+  if ( fd < 0 )
+    return NULL;
+
+  if ( (m = _mmap_lookup(infile)) != NULL )
+    return m;
+
+  if ( fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 )
+    return NULL;
+
+  if ( (uint64_t)st.st_size > (uint64_t)((size_t)-1) )
+    return NULL;
+
+  map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
+    DEBUG_TRACE("mmap failed: %s\n", strerror(errno));
+    return NULL;
   }
 
-  return ret;
+  New(0, m, 1, mmapinfo);
+  m->infile = infile;
+  m->map    = (unsigned char *)map;
+  m->size   = st.st_size;
+  m->next   = MY_CXT.mmaps;
+  MY_CXT.mmaps = m;
+
+  SAVEDESTRUCTOR_X(_mmap_release, infile);
+
+  DEBUG_TRACE("Mapped %llu bytes\n", (uint64_t)m->size);
+
+  return m;
+#else
+  return NULL;
+#endif
+}
+
+void
+_mmap_detach(PerlIO *infile)
+{
+#ifdef AUDIO_SCAN_MMAP
+  dMY_CXT;
+  mmapinfo **mp;
+
+  for (mp = &MY_CXT.mmaps; *mp != NULL; mp = &(*mp)->next) {
+    mmapinfo *m = *mp;
+
+    if (m->infile == infile) {
+      *mp = m->next;
+      munmap(m->map, (size_t)m->size);
+      Safefree(m);
+      return;
+    }
+  }
+#endif
+}
+
+// SAVEDESTRUCTOR_X wrapper so mappings are released even if a parser croaks
+void
+_mmap_release(pTHX_ void *infile)
+{
+  _mmap_detach((PerlIO *)infile);
+}
+
+// Parser state lives in a per-interpreter arena instead of being
+// allocated and freed piece by piece.  Entry points call _scan_enter()
+// inside an ENTER/LEAVE pair; when the outermost one leaves, everything
+// allocated with _scan_alloc() is released in one go and the arena's
+// chunks are kept for the next file.
+static void
+_scan_leave(pTHX_ void *unused)
+{
+  dMY_CXT;
+
+  if (--MY_CXT.scan_depth == 0) {
+    arena_reset(&MY_CXT.scan_arena);
+  }
+}
+
+void
+_scan_enter(void)
+{
+  dMY_CXT;
+
+  MY_CXT.scan_depth++;
+  SAVEDESTRUCTOR_X(_scan_leave, NULL);
+}
+
+Arena *
+_scan_arena(void)
+{
+  dMY_CXT;
+
+  return MY_CXT.seek_arena ? MY_CXT.seek_arena : &MY_CXT.scan_arena;
+}
+
+// Zeroed memory for count items of size bytes, valid until the outermost
+// entry point returns.  Counts often come straight from the file, so
+// check for overflow.
+void *
+_scan_alloc(size_t count, size_t size)
+{
+  void *p;
+
+  if (size && count > ARENA_MAX_ALLOC / size)
+    croak("_scan_alloc: %lu items of %lu bytes too large", (unsigned long)count, (unsigned long)size);
+
+  p = arena_alloc(_scan_arena(), count * size);
+  Zero(p, count * size, char);
+
+  return p;
 }
 
 char* upcase(char *s) {
@@ -104,6 +244,236 @@ char* upcase(char *s) {
   return s;
 }
 
+// The fields/tags scan options: a set of uppercased keys, or NULL
+// when the option was not given and everything is wanted.  Asking for
+// a companion key such as COVR_offset also parses, but doesn't return,
+// the key it belongs to.
+HV *
+_projection_new(SV *list, const char *name)
+{
+  AV *av;
+  HV *want;
+  SSize_t i;
+
+  if (list == NULL || !SvOK(list))
+    return NULL;
+
+  if ( !SvROK(list) || SvTYPE(SvRV(list)) != SVt_PVAV )
+    croak("Audio::Scan %s option must be an array reference", name);
+
+  av = (AV *)SvRV(list);
+  want = (HV *)sv_2mortal( (SV *)newHV() );
+
+  for (i = 0; i <= av_len(av); i++) {
+    SV **entry = av_fetch(av, i, 0);
+    SV *key;
+
+    if (entry == NULL || !SvOK(*entry))
+      continue;
+
+    // Parsers produce UTF-8 keys
+    key = sv_2mortal( newSVsv(*entry) );
+    upcase( SvPVutf8_nolen(key) );
+    hv_store( want, SvPVX(key), SvCUR(key), newSViv(1), 0 );
+
+    if ( SvCUR(key) > 7 && !strcmp(SvPVX(key) + SvCUR(key) - 7, "_OFFSET") ) {
+      if ( !hv_exists(want, SvPVX(key), SvCUR(key) - 7) )
+        hv_store( want, SvPVX(key), SvCUR(key) - 7, newSViv(0), 0 );
+    }
+  }
+
+  return want;
+}
+
+// Keys are compared ignoring ASCII case
+static SV **
+_projection_fetch(HV *want, const char *key, int len)
+{
+  char ukey[256];
+  char *p = ukey;
+  int i;
+
+  if (len < 0)
+    len = strlen(key);
+
+  if (len >= (int)sizeof(ukey))
+    p = (char *)_scan_alloc(len + 1, 1);
+
+  for (i = 0; i < len; i++)
+    p[i] = toUPPER(key[i]);
+
+  return hv_fetch(want, p, len, 0);
+}
+
+// Whether key needs to be parsed
+int
+_projection_has(HV *want, const char *key, int len)
+{
+  if (want == NULL)
+    return 1;
+
+  return _projection_fetch(want, key, len) != NULL;
+}
+
+// Drop everything not in the projection.  Companion keys such as
+// COVR_offset are kept along with the key they belong to.
+void
+_projection_prune(HV *hv, HV *want)
+{
+  HE *he;
+
+  if (want == NULL)
+    return;
+
+  hv_iterinit(hv);
+  while ( (he = hv_iternext(hv)) != NULL ) {
+    I32 klen;
+    char *key = hv_iterkey(he, &klen);
+    SV **entry = _projection_fetch(want, key, klen);
+
+    if ( entry != NULL && SvTRUE(*entry) )
+      continue;
+
+    if ( klen > 7 && !strcmp(key + klen - 7, "_offset") ) {
+      entry = _projection_fetch(want, key, klen - 7);
+      if ( entry != NULL && SvTRUE(*entry) )
+        continue;
+    }
+
+    hv_delete(hv, key, klen, G_DISCARD);
+  }
+}
+
+// Parsers call this before decoding a tag so unrequested tags cost
+// as little as possible
+int
+_tag_wanted(const char *key, int len)
+{
+  dMY_CXT;
+
+  return _projection_has(MY_CXT.want_tags, key, len);
+}
+
+// The frame_index option of the current scan, find_frame or seek context:
+// NULL if not set, otherwise true or a previously returned index
+SV *
+_frame_index_option(void)
+{
+  dMY_CXT;
+
+  if ( MY_CXT.frame_index == NULL || !SvTRUE(MY_CXT.frame_index) )
+    return NULL;
+
+  return MY_CXT.frame_index;
+}
+
+// Whether the current scan asked for vbr_scan => 'sample'
+int
+_vbr_sample_option(void)
+{
+  dMY_CXT;
+
+  return MY_CXT.vbr_sample;
+}
+
+// Whether the current scan asked for the offsets of tag fields
+int
+_offsets_option(void)
+{
+  dMY_CXT;
+
+  return MY_CXT.offsets;
+}
+
+// Bytes from pos on come from offset in the file. Runs are added in order
+void
+_offset_map_add(offsetmap *map, uint32_t pos, off_t offset)
+{
+  if (map->num == map->max) {
+    offsetrun *runs;
+
+    map->max = map->max ? map->max * 2 : 16;
+    scan_newz(runs, map->max, offsetrun);
+    if (map->num) {
+      memcpy(runs, map->runs, map->num * sizeof(offsetrun));
+    }
+    map->runs = runs;
+  }
+
+  map->runs[map->num].pos    = pos;
+  map->runs[map->num].offset = offset;
+  map->num++;
+}
+
+// File offset and length covering len bytes from pos.  Returns 0 if they
+// aren't contiguous in the file, in which case the length includes whatever
+// lies between them
+int
+_offset_map_range(offsetmap *map, uint32_t pos, uint32_t len, off_t *offset, uint64_t *length)
+{
+  uint32_t first;
+  uint32_t last;
+  uint32_t lo = 0;
+  uint32_t hi = map->num;
+  uint32_t end = len ? pos + len - 1 : pos;
+
+  // Last run starting at or before pos
+  while (hi - lo > 1) {
+    uint32_t mid = (lo + hi) / 2;
+    if (map->runs[mid].pos <= pos)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  first = last = lo;
+
+  while (last + 1 < map->num && map->runs[last + 1].pos <= end) {
+    last++;
+  }
+
+  *offset = map->runs[first].offset + (pos - map->runs[first].pos);
+  *length = len ? map->runs[last].offset + (end - map->runs[last].pos) + 1 - *offset : 0;
+
+  return first == last;
+}
+
+// With the offsets option, add { offset, length, encoding } to the list
+// info->{tag_offsets}->{name}
+void
+_store_tag_offset(HV *info, const char *name, off_t offset, uint64_t length, const char *encoding)
+{
+  HV *offsets;
+  HV *entry;
+  AV *list;
+  SV **svp;
+
+  if ( !_offsets_option() )
+    return;
+
+  if ( (svp = my_hv_fetch(info, "tag_offsets")) != NULL ) {
+    offsets = (HV *)SvRV(*svp);
+  }
+  else {
+    offsets = newHV();
+    my_hv_store( info, "tag_offsets", newRV_noinc( (SV *)offsets ) );
+  }
+
+  if ( (svp = my_hv_fetch(offsets, name)) != NULL ) {
+    list = (AV *)SvRV(*svp);
+  }
+  else {
+    list = newAV();
+    my_hv_store( offsets, name, newRV_noinc( (SV *)list ) );
+  }
+
+  entry = newHV();
+  my_hv_store( entry, "offset", newSVuv(offset) );
+  my_hv_store( entry, "length", newSVuv(length) );
+  my_hv_store( entry, "encoding", newSVpv(encoding, 0) );
+
+  av_push( list, newRV_noinc( (SV *)entry ) );
+}
+
 void _split_vorbis_comment(char* comment, HV* tags) {
   char *half;
   char *key;
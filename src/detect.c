@@ -0,0 +1,208 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "detect.h"
+
+static const unsigned char asf_header_guid[16] = {
+  0x30, 0x26, 0xB2, 0x75, 0x8E, 0x66, 0xCF, 0x11,
+  0xA6, 0xD9, 0x00, 0xAA, 0x00, 0x62, 0xCE, 0x6C
+};
+
+static int
+_detect_id3v2(unsigned char *bptr, int len)
+{
+  int size;
+
+  if ( len < 10 || memcmp(bptr, "ID3", 3) ) {
+    return 0;
+  }
+
+  if ( bptr[3] == 0xff || bptr[4] == 0xff || ((bptr[6] | bptr[7] | bptr[8] | bptr[9]) & 0x80) ) {
+    return 0;
+  }
+
+  size = 10 + (bptr[6]<<21) + (bptr[7]<<14) + (bptr[8]<<7) + bptr[9];
+
+  if (bptr[5] & 0x10) {
+    // footer present
+    size += 10;
+  }
+
+  return size;
+}
+
+static const char *
+_detect_ogg(unsigned char *bptr, int len)
+{
+  // The first page holds only the codec identification packet
+  int packet = 27 + bptr[26];
+
+  if (len < packet + 8) {
+    return NULL;
+  }
+
+  bptr += packet;
+
+  if ( bptr[0] == 0x01 && !memcmp(bptr + 1, "vorbis", 6) ) {
+    return "ogg";
+  }
+  if ( !memcmp(bptr, "OpusHead", 8) ) {
+    return "opus";
+  }
+  if ( bptr[0] == 0x7F && !memcmp(bptr + 1, "FLAC", 4) ) {
+    return "ogf";
+  }
+
+  return NULL;
+}
+
+static const char *
+_detect_riff(unsigned char *bptr, int len)
+{
+  // WavPack before version 4 keeps the RIFF header and puts its
+  // own blocks in place of the data chunk's samples
+  int offset = 12;
+  uint32_t size;
+
+  while (offset + 12 <= len) {
+    size = bptr[offset + 4] | (bptr[offset + 5] << 8) | (bptr[offset + 6] << 16) | ((uint32_t)bptr[offset + 7] << 24);
+
+    if ( !memcmp(bptr + offset, "data", 4) ) {
+      if ( !memcmp(bptr + offset + 8, "wvpk", 4) ) {
+        return "wvp";
+      }
+      break;
+    }
+
+    if (size > (uint32_t)len) {
+      break;
+    }
+
+    offset += 8 + size + (size & 1);
+  }
+
+  return "wav";
+}
+
+static const char *
+_detect_magic(unsigned char *bptr, int len)
+{
+  struct mp3frame frame;
+
+  if (len < 4) {
+    return NULL;
+  }
+
+  if ( len >= 16 && !memcmp(bptr, asf_header_guid, 16) ) {
+    return "asf";
+  }
+
+  if (len >= 12) {
+    if ( !memcmp(bptr, "RIFF", 4) && !memcmp(bptr + 8, "WAVE", 4) ) {
+      return _detect_riff(bptr, len);
+    }
+    if ( !memcmp(bptr, "FORM", 4) && (!memcmp(bptr + 8, "AIFF", 4) || !memcmp(bptr + 8, "AIFC", 4)) ) {
+      return "wav";
+    }
+    if ( !memcmp(bptr + 4, "ftyp", 4) ) {
+      return "mp4";
+    }
+  }
+
+  if ( len >= 27 && !memcmp(bptr, "OggS", 4) ) {
+    return _detect_ogg(bptr, len);
+  }
+
+  if ( !memcmp(bptr, "fLaC", 4) ) {
+    return "flc";
+  }
+  if ( !memcmp(bptr, "MAC ", 4) ) {
+    return "ape";
+  }
+  if ( !memcmp(bptr, "MPCK", 4) || !memcmp(bptr, "MP+", 3) ) {
+    return "mpc";
+  }
+  if ( !memcmp(bptr, "wvpk", 4) ) {
+    return "wvp";
+  }
+  if ( !memcmp(bptr, "DSD ", 4) ) {
+    return "dsf";
+  }
+  if ( !memcmp(bptr, "FRM8", 4) ) {
+    return "dff";
+  }
+
+  if ( bptr[0] == 0xFF && (bptr[1] & 0xE0) == 0xE0 ) {
+    // ADTS uses the layer bits of an MPEG audio header as 00
+    if ( (bptr[1] & 0xF6) == 0xF0 ) {
+      if ( len >= 7 && ((bptr[2] >> 2) & 0x0F) < 13 ) {
+        return "aac";
+      }
+    }
+    else if ( _decode_mp3_frame(bptr, &frame) == 0 ) {
+      return "mp3";
+    }
+  }
+
+  return NULL;
+}
+
+const char *
+detect_type(PerlIO *infile)
+{
+  unsigned char bptr[DETECT_BLOCK_SIZE];
+  const char *type = NULL;
+  off_t pos = PerlIO_tell(infile);
+  off_t offset = 0;
+  int tags = 0;
+  int len;
+  int i;
+  int id3_size;
+
+  if (pos < 0) {
+    return NULL;
+  }
+
+  while ( PerlIO_seek(infile, offset, SEEK_SET) == 0 ) {
+    if ( (len = PerlIO_read(infile, bptr, DETECT_BLOCK_SIZE)) <= 0 ) {
+      break;
+    }
+
+    i = 0;
+
+    if (tags) {
+      // Some taggers leave padding after the tag instead of inside it
+      while (i < len && bptr[i] == 0)
+        i++;
+    }
+
+    if ( tags < DETECT_MAX_ID3_TAGS && (id3_size = _detect_id3v2(bptr + i, len - i)) ) {
+      DEBUG_TRACE("detect_type: skipping ID3v2 tag of size %d at %d\n", id3_size, (int)(offset + i));
+      offset += i + id3_size;
+      tags++;
+      continue;
+    }
+
+    type = _detect_magic(bptr + i, len - i);
+    break;
+  }
+
+  DEBUG_TRACE("detect_type: %s\n", type ? type : "unknown");
+
+  PerlIO_seek(infile, pos, SEEK_SET);
+
+  return type;
+}
@@ -16,12 +16,15 @@
 
 #include "flac.h"
 
+// Metadata block names for the offsets option, indexed by block type
+static char const *flac_block_names[] = {
+  "STREAMINFO", "PADDING", "APPLICATION", "SEEKTABLE", "VORBIS_COMMENT", "CUESHEET", "PICTURE"
+};
+
 int
 get_flac_metadata(PerlIO *infile, char *file, HV *info, HV *tags)
 {
-  flacinfo *flac = _flac_parse(infile, file, info, tags, 0);
-
-  Safefree(flac);
+  _flac_parse(infile, file, info, tags, 0);
 
   return 0;
 }
@@ -36,8 +39,8 @@ _flac_parse(PerlIO *infile, char *file, HV *info, HV *tags, uint8_t seeking)
   uint32_t song_length_ms;
 
   flacinfo *flac;
-  Newz(0, flac, sizeof(flacinfo), flacinfo);
-  Newz(0, flac->buf, sizeof(Buffer), Buffer);
+  scan_newz(flac, 1, flacinfo);
+  scan_newz(flac->buf, 1, Buffer);
 
   flac->infile         = infile;
   flac->file           = file;
@@ -144,6 +147,11 @@ _flac_parse(PerlIO *infile, char *file, HV *info, HV *tags, uint8_t seeking)
       }
     }
 
+    _store_tag_offset(
+      info, type <= FLAC_TYPE_PICTURE ? flac_block_names[type] : "UNKNOWN",
+      flac->audio_offset + 4, len, "binary"
+    );
+
     flac->audio_offset += 4 + len;
 
     switch (type) {
@@ -153,8 +161,17 @@ _flac_parse(PerlIO *infile, char *file, HV *info, HV *tags, uint8_t seeking)
 
       case FLAC_TYPE_VORBIS_COMMENT:
         if ( !flac->seeking ) {
-          // Vorbis comment parsing code from ogg.c
-          _parse_vorbis_comments(flac->infile, flac->buf, tags, 0);
+          // Vorbis comment parsing code from ogg.c, the block data is at the
+          // front of the buffer and is all in one piece in the file
+          offsetmap *map = NULL;
+
+          if ( _offsets_option() ) {
+            scan_newz(map, 1, offsetmap);
+            _offset_map_add(map, 0, flac->audio_offset - len);
+            map->len = buffer_len(flac->buf);
+          }
+
+          _parse_vorbis_comments(flac->infile, flac->buf, tags, 0, map, info);
         }
         else {
           DEBUG_TRACE("  seeking, not parsing comments\n");
@@ -193,13 +210,13 @@ _flac_parse(PerlIO *infile, char *file, HV *info, HV *tags, uint8_t seeking)
         break;
 
       case FLAC_TYPE_PICTURE:
-        if ( !flac->seeking ) {
+        if ( !flac->seeking && _tag_wanted("ALLPICTURES", 11) ) {
           if ( !_flac_parse_picture(flac) ) {
             goto out;
           }
         }
         else {
-          DEBUG_TRACE("  seeking, skipping picture\n");
+          DEBUG_TRACE("  seeking or not requested, skipping picture\n");
           _flac_skip(flac, len);
         }
         break;
@@ -226,7 +243,7 @@ _flac_parse(PerlIO *infile, char *file, HV *info, HV *tags, uint8_t seeking)
 
       DEBUG_TRACE("Manually determining duration/bitrate\n");
 
-      Newz(0, flac->scratch, sizeof(Buffer), Buffer);
+      scan_newz(flac->scratch, 1, Buffer);
 
       if ( _flac_first_last_sample(flac, flac->audio_offset, &frame_offset, &first_sample, &tmp, 0) ) {
         DEBUG_TRACE("  First sample: %llu (offset %llu)\n", first_sample, frame_offset);
@@ -247,7 +264,6 @@ _flac_parse(PerlIO *infile, char *file, HV *info, HV *tags, uint8_t seeking)
       }
 
       buffer_free(flac->scratch);
-      Safefree(flac->scratch);
     }
   }
 
@@ -263,7 +279,6 @@ _flac_parse(PerlIO *infile, char *file, HV *info, HV *tags, uint8_t seeking)
 
 out:
   buffer_free(flac->buf);
-  Safefree(flac->buf);
 
   return flac;
 }
@@ -273,20 +288,44 @@ out:
 static off_t
 flac_find_frame(PerlIO *infile, char *file, int offset)
 {
-  off_t frame_offset = -1;
-  uint64_t target_sample;
-  uint32_t approx_bytes_per_frame;
-  uint64_t lower_bound, upper_bound, lower_bound_sample, upper_bound_sample;
-  int64_t pos = -1;
-  int8_t max_tries = 100;
+  off_t frame_offset;
 
   // We need to read all metadata first to get some data we need to calculate
   HV *info = newHV();
   HV *tags = newHV();
+  flacinfo *flac = flac_seek_open(infile, file, info, tags);
+
+  frame_offset = flac_seek(flac, infile, file, info, offset);
+
+  // Don't leak
+  SvREFCNT_dec(info);
+  SvREFCNT_dec(tags);
+
+  return frame_offset;
+}
+
+// Parse what flac_seek needs, the returned state can be used for any number of seeks
+void *
+flac_seek_open(PerlIO *infile, char *file, HV *info, HV *tags)
+{
   flacinfo *flac = _flac_parse(infile, file, info, tags, 1);
 
-  // Allocate scratch buffer
-  Newz(0, flac->scratch, sizeof(Buffer), Buffer);
+  // Allocate scratch buffer, its data is freed after each seek
+  scan_newz(flac->scratch, 1, Buffer);
+
+  return flac;
+}
+
+off_t
+flac_seek(void *state, PerlIO *infile, char *file, HV *info, int offset)
+{
+  flacinfo *flac = (flacinfo *)state;
+  off_t frame_offset = -1;
+  uint64_t target_sample;
+  uint32_t approx_bytes_per_frame;
+  uint64_t lower_bound, upper_bound, lower_bound_sample, upper_bound_sample;
+  int64_t pos = -1;
+  int8_t max_tries = 100;
 
   if ( !flac->samplerate || !flac->total_samples ) {
     // Can't seek in file without samplerate
@@ -456,19 +495,9 @@ flac_find_frame(PerlIO *infile, char *file, int offset)
   DEBUG_TRACE("max_tries: %d\n", max_tries);
 
 out:
-  // Don't leak
-  SvREFCNT_dec(info);
-  SvREFCNT_dec(tags);
-
-  // free seek struct
-  Safefree(flac->seekpoints);
-
   // free scratch buffer
   if (flac->scratch->alloc)
     buffer_free(flac->scratch);
-  Safefree(flac->scratch);
-
-  Safefree(flac);
 
   return frame_offset;
 }
@@ -754,11 +783,7 @@ _flac_parse_seektable(flacinfo *flac, int len)
 
   flac->num_seekpoints = count;
 
-  New(0,
-    flac->seekpoints,
-    count * sizeof(*flac->seekpoints),
-    struct seekpoint
-  );
+  scan_newz(flac->seekpoints, count, struct seekpoint);
 
   for (i = 0; i < count; i++) {
     flac->seekpoints[i].sample_number = buffer_get_int64(flac->buf);
@@ -39,6 +39,23 @@ _varint(unsigned char *buf, int length)
   }
 }
 
+// Whether a frame can produce a tag in the requested projection
+static int
+_id3_frame_wanted(char const *id)
+{
+  // TXXX/WXXX are keyed by their description, checked once it's read
+  if ( !strcmp(id, "TXXX") || !strcmp(id, "WXXX") )
+    return 1;
+
+  // v2.3 date frames are converted to TDRC
+  if ( !strcmp(id, "TYER") || !strcmp(id, "TDAT") || !strcmp(id, "TIME") ) {
+    if ( _tag_wanted("TDRC", 4) )
+      return 1;
+  }
+
+  return _tag_wanted(id, 4);
+}
+
 int
 parse_id3(PerlIO *infile, char *file, HV *info, HV *tags, off_t seek, off_t file_size)
 {
@@ -46,9 +63,14 @@ parse_id3(PerlIO *infile, char *file, HV *info, HV *tags, off_t seek, off_t file
   unsigned char *bptr;
 
   id3info *id3;
-  Newz(0, id3, sizeof(id3info), id3info);
-  Newz(0, id3->buf, sizeof(Buffer), Buffer);
-  Newz(0, id3->utf8, sizeof(Buffer), Buffer);
+  dMY_CXT;
+
+  scan_newz(id3, 1, id3info);
+
+  // The buffers are kept for the next file instead of being allocated and
+  // freed for every tag, parse_id3 never runs nested so one pair is enough
+  id3->buf  = &MY_CXT.id3_buf;
+  id3->utf8 = &MY_CXT.id3_utf8;
 
   id3->infile = infile;
   id3->file   = file;
@@ -56,7 +78,9 @@ parse_id3(PerlIO *infile, char *file, HV *info, HV *tags, off_t seek, off_t file
   id3->tags   = tags;
   id3->offset = seek;
 
-  buffer_init(id3->buf, ID3_BLOCK_SIZE);
+  buffer_init_or_clear(id3->buf, ID3_BLOCK_SIZE);
+  if (id3->utf8->alloc)
+    buffer_clear(id3->utf8);
 
   if ( !seek ) {
     // Check for ID3v1 tag first
@@ -88,14 +112,12 @@ parse_id3(PerlIO *infile, char *file, HV *info, HV *tags, off_t seek, off_t file
   }
 
 out:
-  buffer_free(id3->buf);
-  Safefree(id3->buf);
+  // Don't hold on to the memory of an unusually large tag
+  if (id3->buf->alloc > ID3_BUFFER_RETAIN)
+    buffer_free(id3->buf);
 
-  if (id3->utf8->alloc)
+  if (id3->utf8->alloc > ID3_BUFFER_RETAIN)
     buffer_free(id3->utf8);
-  Safefree(id3->utf8);
-
-  Safefree(id3);
 
   return err;
 }
@@ -238,22 +260,25 @@ _id3_parse_v2(id3info *id3)
 
   DEBUG_TRACE("Parsing ID3v2.%d.%d tag, flags %x, size %d\n", id3->version_major, id3->version_minor, id3->flags, id3->size);
 
+  if ( _offsets_option() ) {
+    scan_newz(id3->map, 1, offsetmap);
+    _offset_map_add(id3->map, 0, id3->offset + 10);
+  }
+
   if (id3->flags & ID3_TAG_FLAG_UNSYNCHRONISATION) {
     if (id3->version_major < 4) {
       // It's unclear but the v2.4.0-changes document seems to say that v2.4 should
       // ignore the tag-level unsync flag and only worry about frame-level unsync
 
-      // For v2.2/v2.3, unsync the entire tag.  This is unfortunate due to
-      // increased memory usage but the only way to do it, as frame size values only
-      // indicate the post-unsync size, so it's not possible to unsync each frame individually
-      // tested with v2.3-unsync.mp3
-      if ( !_check_buf(id3->infile, id3->buf, id3->size, id3->size) ) {
+      // For v2.2/v2.3, unsync the entire tag.  Frame size values only indicate
+      // the post-unsync size, so it's not possible to unsync each frame individually,
+      // instead the tag is un-synchronized as it is read, see _id3_check_buf
+      // tested with v2.3-unsync.mp3 & v2.3-unsync-apic-bad-offset.mp3
+      if ( !_id3_deunsync_start(id3) ) {
         ret = 0;
         goto out;
       }
 
-      id3->size_remain = _id3_deunsync( buffer_ptr(id3->buf), id3->size );
-
       DEBUG_TRACE("    Un-synchronized tag, new_size %d\n", id3->size_remain);
 
       my_hv_store( id3->info, "id3_was_unsynced", newSVuv(1) );
@@ -263,6 +288,10 @@ _id3_parse_v2(id3info *id3)
     }
   }
 
+  // Frame positions in the offset map count from the end of the tag header,
+  // so this is taken before any extended header is skipped
+  id3->size_body = id3->size_remain;
+
   if (id3->flags & ID3_TAG_FLAG_EXTENDEDHEADER) {
     uint32_t ehsize;
 
@@ -301,7 +330,7 @@ _id3_parse_v2(id3info *id3)
 
     DEBUG_TRACE("  Skipping extended header, size %d\n", ehsize);
 
-    if ( !_check_buf(id3->infile, id3->buf, ehsize, ID3_BLOCK_SIZE) ) {
+    if ( !_id3_check_buf(id3, ehsize) ) {
       ret = 0;
       goto out;
     }
@@ -318,6 +347,8 @@ _id3_parse_v2(id3info *id3)
     }
   }
 
+  _id3_frame_offset_flush(id3);
+
   if (id3->version_major < 4) {
     // map old year/date/time (TYER/TDAT/TIME) frames to TDRC
     // tested in v2.3-xsop.mp3
@@ -361,7 +392,7 @@ _id3_parse_v2_frame(id3info *id3)
   // tag_data_safe flag is used if skipping artwork and artwork is not raw image data (needs unsync)
   id3->tag_data_safe = 1;
 
-  if ( !_check_buf(id3->infile, id3->buf, 10, ID3_BLOCK_SIZE) ) {
+  if ( !_id3_check_buf(id3, 10) ) {
     ret = 0;
     goto out;
   }
@@ -411,6 +442,15 @@ _id3_parse_v2_frame(id3info *id3)
       ret = 0;
       goto out;
     }
+
+    _id3_frame_offset(id3, id, size, 0);
+
+    if ( !_id3_frame_wanted(id) ) {
+      DEBUG_TRACE("    not requested, skipping frame\n");
+      _id3_skip(id3, size);
+      id3->size_remain -= size;
+      goto out;
+    }
   }
   else {
     // Read 4-letter id
@@ -459,6 +499,15 @@ _id3_parse_v2_frame(id3info *id3)
         goto out;
       }
 
+      _id3_frame_offset(id3, id, size, flags);
+
+      if ( !_id3_frame_wanted(id) ) {
+        DEBUG_TRACE("    not requested, skipping frame\n");
+        _id3_skip(id3, size);
+        id3->size_remain -= size;
+        goto out;
+      }
+
       if (flags & ID3_FRAME_FLAG_V23_COMPRESSION) {
         // tested with v2.3-compressed-frame.mp3
         decoded_size = buffer_get_int(id3->buf);
@@ -500,14 +549,14 @@ _id3_parse_v2_frame(id3info *id3)
       if (flags & ID3_FRAME_FLAG_V23_COMPRESSION && decoded_size) {
         unsigned long tmp_size;
 
-        if ( !_check_buf(id3->infile, id3->buf, size, ID3_BLOCK_SIZE) ) {
+        if ( !_id3_check_buf(id3, size) ) {
           ret = 0;
           goto out;
         }
 
         DEBUG_TRACE("    decompressing, decoded_size %d\n", decoded_size);
 
-        Newz(0, decompressed, sizeof(Buffer), Buffer);
+        scan_newz(decompressed, 1, Buffer);
         buffer_init(decompressed, decoded_size);
 
         tmp_size = decoded_size;
@@ -518,7 +567,6 @@ _id3_parse_v2_frame(id3info *id3)
     	  ) {
           DEBUG_TRACE("    unable to decompress frame\n");
           buffer_free(decompressed);
-          Safefree(decompressed);
           decompressed = 0;
         }
         else {
@@ -564,6 +612,15 @@ _id3_parse_v2_frame(id3info *id3)
         }
       }
 
+      _id3_frame_offset(id3, id, size, flags);
+
+      if ( !_id3_frame_wanted(id) ) {
+        DEBUG_TRACE("    not requested, skipping frame\n");
+        _id3_skip(id3, size);
+        id3->size_remain -= size;
+        goto out;
+      }
+
       if (flags & ID3_FRAME_FLAG_V24_GROUPINGIDENTITY) {
         // tested with v2.4-group-id.mp3
 #ifdef AUDIO_SCAN_DEBUG
@@ -614,7 +671,7 @@ _id3_parse_v2_frame(id3info *id3)
         }
         else {
           // tested with v2.4-unsync.mp3
-          if ( !_check_buf(id3->infile, id3->buf, size, ID3_BLOCK_SIZE) ) {
+          if ( !_id3_check_buf(id3, size) ) {
             ret = 0;
             goto out;
           }
@@ -632,14 +689,14 @@ _id3_parse_v2_frame(id3info *id3)
         // XXX need test for compressed + unsync
         unsigned long tmp_size;
 
-        if ( !_check_buf(id3->infile, id3->buf, size, ID3_BLOCK_SIZE) ) {
+        if ( !_id3_check_buf(id3, size) ) {
           ret = 0;
           goto out;
         }
 
         DEBUG_TRACE("    decompressing\n");
 
-        Newz(0, decompressed, sizeof(Buffer), Buffer);
+        scan_newz(decompressed, 1, Buffer);
         buffer_init(decompressed, decoded_size);
 
         tmp_size = decoded_size;
@@ -650,7 +707,6 @@ _id3_parse_v2_frame(id3info *id3)
     	  ) {
           DEBUG_TRACE("    unable to decompress frame\n");
           buffer_free(decompressed);
-          Safefree(decompressed);
           decompressed = 0;
         }
         else {
@@ -736,7 +792,6 @@ out:
     buffer_consume(id3->buf, size);
 
     buffer_free(decompressed);
-    Safefree(decompressed);
   }
 
   return ret;
@@ -759,7 +814,7 @@ _id3_parse_v2_frame_data(id3info *id3, char const *id, uint32_t size, id3_framet
   if (skip_art) {
     // Only buffer enough for the APIC header fields, this is only a rough guess
     // because the description could technically be very long
-    if ( !_check_buf(id3->infile, id3->buf, 128, ID3_BLOCK_SIZE) ) {
+    if ( !_id3_check_buf(id3, MIN(size, 128)) ) {
       return 0;
     }
     DEBUG_TRACE("    partial read due to AUDIO_SCAN_NO_ARTWORK\n");
@@ -769,13 +824,13 @@ _id3_parse_v2_frame_data(id3info *id3, char const *id, uint32_t size, id3_framet
     // using 2x the memory of the APIC frame (once for buffer, once for SV)
     if (buffer_art) {
       // Buffer enough for encoding/MIME/picture type/description
-      if ( !_check_buf(id3->infile, id3->buf, 128, ID3_BLOCK_SIZE) ) {
+      if ( !_id3_check_buf(id3, MIN(size, 128)) ) {
         return 0;
       }
     }
     else {
       // Buffer the entire frame
-      if ( !_check_buf(id3->infile, id3->buf, size, ID3_BLOCK_SIZE) ) {
+      if ( !_id3_check_buf(id3, size) ) {
         return 0;
       }
     }
@@ -806,6 +861,12 @@ _id3_parse_v2_frame_data(id3info *id3, char const *id, uint32_t size, id3_framet
     if (key != NULL && SvPOK(key) && sv_len(key)) {
       upcase(SvPVX(key));
 
+      if ( !_tag_wanted(SvPVX(key), sv_len(key)) ) {
+        DEBUG_TRACE("    %s not requested, skipping frame\n", SvPVX(key));
+        SvREFCNT_dec(key);
+        goto out;
+      }
+
       // Read value(s)
       if (frametype->fields[2] == ID3_FIELD_TYPE_LATIN1) {
         // WXXX frames have a latin1 value field regardless of encoding byte
@@ -1222,7 +1283,7 @@ _id3_parse_v2_frame_data(id3info *id3, char const *id, uint32_t size, id3_framet
             SV *artwork = newSVpv("", 0);
 
             while (read < size) {
-              if ( !_check_buf(id3->infile, id3->buf, 1, ID3_BLOCK_SIZE) ) {
+              if ( !_id3_check_buf(id3, 1) ) {
                 return 0;
               }
 
@@ -1363,9 +1424,10 @@ _id3_get_utf8_string(id3info *id3, SV **string, uint32_t len, uint8_t encoding)
 
   // Init scratch buffer if necessary
   if ( !id3->utf8->alloc ) {
-    // Use a larger initial buffer if reading ISO-8859-1 to avoid
-    // always having to allocate a second time
-    buffer_init( id3->utf8, encoding == ISO_8859_1 ? len * 2 : len );
+    // Size it for the worst case the transcoders reserve, 2 bytes per
+    // ISO-8859-1 character or 3 per UTF-16 code unit, to avoid always
+    // having to allocate a second time
+    buffer_init( id3->utf8, (encoding == ISO_8859_1 ? len * 2 : encoding == UTF_8 ? len : len / 2 * 3) + 1 );
   }
   else {
     // Reset scratch buffer
@@ -1724,6 +1786,177 @@ _id3_deunsync(unsigned char *data, uint32_t length)
   return new - data;
 }
 
+// deunsync in-place a block of a tag that is read in pieces, ff carries whether
+// the previous block ended with 0xff.  keep_last keeps a final 0x00 after 0xff
+// as _id3_deunsync does at the end of its data
+uint32_t
+_id3_deunsync_block(unsigned char *data, uint32_t length, uint8_t *ff, uint8_t keep_last, offsetmap *map, off_t raw_offset)
+{
+  unsigned char *old;
+  unsigned char *end = data + length;
+  unsigned char *new = data;
+
+  for (old = data; old < end; ++old) {
+    if (*ff && *old == 0x00 && !(keep_last && old == end - 1)) {
+      *ff = 0;
+
+      // With a map, note that the bytes after this one are one further on in the file
+      if (map)
+        _offset_map_add(map, map->len + (new - data), raw_offset + (old - data) + 1);
+
+      continue;
+    }
+
+    *ff = (*old == 0xff);
+    *new++ = *old;
+  }
+
+  if (map)
+    map->len += new - data;
+
+  return new - data;
+}
+
+// Set up un-synchronization of a v2.2/v2.3 tag, covering the same id3->size bytes
+// after the header that used to be buffered whole.  If they are already in the
+// buffer they are un-synchronized in place, otherwise the rest is streamed through
+// _id3_check_buf a block at a time.  Until then size_remain counts the raw bytes
+// still to be read, and shrinks as _id3_check_buf finds how many are dropped
+int
+_id3_deunsync_start(id3info *id3)
+{
+  uint32_t have = buffer_len(id3->buf);
+  uint8_t ff = 0;
+
+  if (have >= id3->size) {
+    if (id3->map) {
+      id3->size_remain = _id3_deunsync_block( buffer_ptr(id3->buf), id3->size, &ff, 1, id3->map, id3->offset + 10 );
+    }
+    else {
+      id3->size_remain = _id3_deunsync( buffer_ptr(id3->buf), id3->size );
+    }
+    return 1;
+  }
+
+  // Un-synchronize what is already buffered
+  id3->buf->end -= have - _id3_deunsync_block( buffer_ptr(id3->buf), have, &ff, 0, id3->map, id3->offset + 10 );
+  id3->unsync_remain = id3->size - have;
+  id3->unsync_ff     = ff;
+  id3->unsync_stream = 1;
+  id3->size_remain   = buffer_len(id3->buf) + id3->unsync_remain;
+
+  return 1;
+}
+
+// Buffer at least min_wanted bytes of tag data.  Unsynchronised v2.2/v2.3 tag
+// data is un-synchronized as it is appended, so only the data the frame parser
+// asks for is held in memory, not the whole tag, and each byte is read once
+int
+_id3_check_buf(id3info *id3, uint32_t min_wanted)
+{
+  uint32_t have;
+  uint32_t chunk;
+  uint32_t dropped;
+  off_t pos;
+
+  while ( buffer_len(id3->buf) < min_wanted && id3->unsync_remain ) {
+    have  = buffer_len(id3->buf);
+    chunk = id3->unsync_remain < ID3_BLOCK_SIZE ? id3->unsync_remain : ID3_BLOCK_SIZE;
+    pos   = id3->map ? PerlIO_tell(id3->infile) : 0;
+
+    if ( !_check_buf(id3->infile, id3->buf, have + chunk, have + chunk) ) {
+      return 0;
+    }
+
+    dropped = chunk - _id3_deunsync_block(
+      buffer_ptr(id3->buf) + have, chunk, &id3->unsync_ff, chunk == id3->unsync_remain, id3->map, pos
+    );
+    id3->buf->end -= dropped;
+    id3->unsync_remain -= chunk;
+
+    // The dropped bytes were counted in size_remain, but take up no room in
+    // the tag body the frames are positioned in
+    id3->size_remain -= dropped < id3->size_remain ? dropped : id3->size_remain;
+    id3->size_body   -= dropped;
+  }
+
+  // Once a streamed tag is used up, what follows in the file isn't tag data
+  if (id3->unsync_stream && !id3->unsync_remain)
+    return buffer_len(id3->buf) >= min_wanted;
+
+  return _check_buf(id3->infile, id3->buf, min_wanted, ID3_BLOCK_SIZE);
+}
+
+// With the offsets option, record where the data of the frame whose header was
+// just read lies in the file, after any extra bytes the frame flags add.  A
+// streamed unsynchronised tag only maps the data as it is read, so the frame is
+// stored by _id3_frame_offset_flush once the next one starts or the tag ends
+void
+_id3_frame_offset(id3info *id3, char const *id, uint32_t size, uint16_t flags)
+{
+  uint32_t extra = 0;
+
+  if ( !id3->map )
+    return;
+
+  _id3_frame_offset_flush(id3);
+
+  if (id3->version_major == 3) {
+    if (flags & ID3_FRAME_FLAG_V23_COMPRESSION)
+      extra += 4;
+    if (flags & ID3_FRAME_FLAG_V23_ENCRYPTION)
+      extra++;
+    if (flags & ID3_FRAME_FLAG_V23_GROUPINGIDENTITY)
+      extra++;
+  }
+  else if (id3->version_major == 4) {
+    if (flags & ID3_FRAME_FLAG_V24_GROUPINGIDENTITY)
+      extra++;
+    if (flags & ID3_FRAME_FLAG_V24_ENCRYPTION)
+      extra++;
+    if (flags & ID3_FRAME_FLAG_V24_DATALENGTHINDICATOR)
+      extra += 4;
+  }
+
+  if (extra > size)
+    extra = size;
+
+  strcpy(id3->offset_id, id);
+  id3->offset_pos   = id3->size_body - id3->size_remain + extra;
+  id3->offset_len   = size - extra;
+  id3->offset_flags = flags;
+}
+
+void
+_id3_frame_offset_flush(id3info *id3)
+{
+  uint16_t flags = id3->offset_flags;
+  off_t offset;
+  uint64_t length;
+  int contiguous;
+  char encoding[32];
+
+  if ( !id3->map || !id3->offset_id[0] )
+    return;
+
+  contiguous = _offset_map_range(id3->map, id3->offset_pos, id3->offset_len, &offset, &length);
+
+  // What has to be undone to get the frame data back from the bytes in the file
+  encoding[0] = 0;
+  if ( !contiguous || (id3->version_major == 4 && flags & ID3_FRAME_FLAG_V24_UNSYNCHRONISATION) )
+    strcat(encoding, "+unsync");
+  if ( (id3->version_major == 3 && flags & ID3_FRAME_FLAG_V23_COMPRESSION)
+    || (id3->version_major == 4 && flags & ID3_FRAME_FLAG_V24_COMPRESSION) )
+    strcat(encoding, "+zlib");
+  if ( (id3->version_major == 3 && flags & ID3_FRAME_FLAG_V23_ENCRYPTION)
+    || (id3->version_major == 4 && flags & ID3_FRAME_FLAG_V24_ENCRYPTION) )
+    strcat(encoding, "+encrypted");
+
+  _store_tag_offset(id3->info, id3->offset_id, offset, length, encoding[0] ? encoding + 1 : "binary");
+
+  id3->offset_id[0] = 0;
+}
+
 void
 _id3_skip(id3info *id3, uint32_t size)
 {
@@ -1732,6 +1965,19 @@ _id3_skip(id3info *id3, uint32_t size)
 
     DEBUG_TRACE("  skipped buffer data size %d\n", size);
   }
+  else if (id3->unsync_remain) {
+    // Skipped data still has to go through un-synchronization to know where it ends
+    while ( size > buffer_len(id3->buf) && id3->unsync_remain ) {
+      size -= buffer_len(id3->buf);
+      buffer_clear(id3->buf);
+
+      if ( !_id3_check_buf(id3, 1) ) {
+        return;
+      }
+    }
+
+    _id3_skip(id3, size);
+  }
   else {
     PerlIO_seek(id3->infile, size - buffer_len(id3->buf), SEEK_CUR);
     buffer_clear(id3->buf);
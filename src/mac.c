@@ -9,7 +9,7 @@ get_macfileinfo(PerlIO *infile, char *file, HV *info)
   int32_t header_end;
 
   mac_streaminfo *si;
-  Newz(0, si, sizeof(mac_streaminfo), mac_streaminfo);
+  scan_newz(si, 1, mac_streaminfo);
 
   /*
     There are two possible variations here.
@@ -21,14 +21,12 @@ get_macfileinfo(PerlIO *infile, char *file, HV *info)
   */
   if ((header_end = skip_id3v2(infile)) < 0) {
     PerlIO_printf(PerlIO_stderr(), "MAC: [Couldn't skip ID3v2]: %s\n", file);
-    Safefree(si);
     return -1;
   }
 
   // seek to first byte of MAC data
   if (PerlIO_seek(infile, header_end, SEEK_SET) < 0) {
     PerlIO_printf(PerlIO_stderr(), "MAC: [Couldn't seek to offset %d]: %s\n", header_end, file);
-    Safefree(si);
     return -1;
   }
 
@@ -160,7 +158,6 @@ get_macfileinfo(PerlIO *infile, char *file, HV *info)
 
 out:
   buffer_free(&header);
-  Safefree(si);
 
   return ret;
 }
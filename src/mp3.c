@@ -26,10 +26,10 @@ get_mp3fileinfo(PerlIO *infile, char *file, HV *info)
  mp3info *mp3 = _mp3_parse(infile, file, info);
 
  buffer_free(mp3->buf);
- Safefree(mp3->buf);
- Safefree(mp3->first_frame);
- Safefree(mp3->xing_frame);
- Safefree(mp3);
+
+ if (mp3->indexing) {
+   _mp3_store_index(mp3);
+ }
 
  return 0;
 }
@@ -220,11 +220,115 @@ _decode_mp3_frame(unsigned char *bptr, struct mp3frame *frame)
   return 0;
 }
 
+// Whether frame belongs to the same stream as the first frame
+static int
+_mp3_same_stream(mp3info *mp3, struct mp3frame *frame)
+{
+  return frame->mpegID == mp3->first_frame->mpegID
+    && frame->layerID == mp3->first_frame->layerID
+    && frame->samplerate == mp3->first_frame->samplerate;
+}
+
+// Average bitrate of a VBR file from MP3_SAMPLE_WINDOWS evenly spaced windows
+// instead of all of it. The number of frames is extrapolated from the average
+// frame size, and twice the standard error of the windows' average frame sizes
+// is kept as the error bound
+static short
+_mp3_sample_bitrate(mp3info *mp3, uint32_t offset, uint32_t audio_size)
+{
+  struct mp3frame frame;
+  struct mp3frame next;
+  Buffer win;
+  double window_avg[MP3_SAMPLE_WINDOWS];
+  double avg;
+  double var = 0;
+  uint64_t frames = 0;
+  uint64_t bytes = 0;
+  uint64_t bitrate_total = 0;
+  int windows = 0;
+  int k;
+
+  buffer_init(&win, MP3_SAMPLE_WINDOW_SIZE);
+
+  for (k = 0; k < MP3_SAMPLE_WINDOWS; k++) {
+    off_t start = offset + (off_t)(audio_size - MP3_SAMPLE_WINDOW_SIZE) * k / (MP3_SAMPLE_WINDOWS - 1);
+    unsigned char *bptr;
+    uint32_t len;
+    uint32_t pos = 0;
+    uint32_t wframes = 0;
+    uint32_t wbytes = 0;
+
+    buffer_clear(&win);
+    PerlIO_seek(mp3->infile, start, SEEK_SET);
+
+    if ( !_check_buf(mp3->infile, &win, MP3_SAMPLE_WINDOW_SIZE, MP3_SAMPLE_WINDOW_SIZE) ) {
+      break;
+    }
+
+    bptr = (unsigned char *)buffer_ptr(&win);
+    len  = buffer_len(&win);
+
+    // Resync on a frame followed by another one of the same stream
+    for ( ; pos + 4 <= len; pos++) {
+      pos += sync_find(bptr + pos, len - pos, MPEG_SYNC_MASK);
+
+      if ( pos + 4 <= len && !_decode_mp3_frame(bptr + pos, &frame) && _mp3_same_stream(mp3, &frame)
+        && pos + frame.frame_size + 4 <= len
+        && !_decode_mp3_frame(bptr + pos + frame.frame_size, &next) && _mp3_same_stream(mp3, &next)
+      ) {
+        break;
+      }
+    }
+
+    // Count the whole frames up to the end of the window or any junk
+    while ( pos + 4 <= len
+      && bptr[pos] == 0xFF && !_decode_mp3_frame(bptr + pos, &frame) && _mp3_same_stream(mp3, &frame)
+      && pos + frame.frame_size <= len
+    ) {
+      wframes++;
+      wbytes        += frame.frame_size;
+      bitrate_total += frame.bitrate_kbps;
+      pos           += frame.frame_size;
+    }
+
+    DEBUG_TRACE("Sample window %d @ %llu: %d frames, %d bytes\n", k, (uint64_t)start, wframes, wbytes);
+
+    if (wframes) {
+      window_avg[windows++] = (double)wbytes / wframes;
+      frames += wframes;
+      bytes  += wbytes;
+    }
+  }
+
+  buffer_free(&win);
+
+  if (windows < 2) {
+    return -1;
+  }
+
+  avg = (double)bytes / frames;
+
+  for (k = 0; k < windows; k++) {
+    var += (window_avg[k] - avg) * (window_avg[k] - avg);
+  }
+  var /= windows - 1;
+
+  mp3->sampled_frames = audio_size / avg;
+  mp3->sampled_error  = 2 * sqrt(var / windows) / avg;
+
+  DEBUG_TRACE("Sampled %d frames in %d windows: %.1f bytes per frame, about %.0f frames (+/- %.2f%%)\n",
+    (int)frames, windows, avg, mp3->sampled_frames, mp3->sampled_error * 100);
+
+  return bitrate_total / frames;
+}
+
 // _mp3_get_average_bitrate
 // average bitrate by averaging all the frames in the file.  This used
 // to seek to the middle of the file and take a 32K chunk but this was
 // found to have bugs if it seeked near invalid FF sync bytes that could
-// be detected as a real frame
+// be detected as a real frame.  When indexing, every frame is read and
+// the frame index is built on the way.  When sampling, a large VBR file
+// is handed over to _mp3_sample_bitrate
 static short _mp3_get_average_bitrate(mp3info *mp3, uint32_t offset, uint32_t audio_size)
 {
   struct mp3frame frame;
@@ -260,19 +364,26 @@ static short _mp3_get_average_bitrate(mp3info *mp3, uint32_t offset, uint32_t au
     }
 
     while ( buffer_len(mp3->buf) >= 4 ) {
-      bptr = buffer_ptr(mp3->buf);
-      while ( *bptr != 0xFF ) {
-        buffer_consume(mp3->buf, 1);
+      buffer_consume( mp3->buf, sync_find(buffer_ptr(mp3->buf), buffer_len(mp3->buf), MPEG_SYNC_MASK) );
 
-        if ( buffer_len(mp3->buf) < 4 ) {
-          // ran out of data
-          goto out;
-        }
-
-        bptr = buffer_ptr(mp3->buf);
+      if ( buffer_len(mp3->buf) < 4 ) {
+        // ran out of data
+        goto out;
       }
 
       if ( !_decode_mp3_frame( buffer_ptr(mp3->buf), &frame ) ) {
+        if (mp3->indexing) {
+          off_t frame_offset = PerlIO_tell(mp3->infile) - buffer_len(mp3->buf);
+
+          // Frames of another stream or past the audio are stray syncs
+          if ( !_mp3_same_stream(mp3, &frame) || frame_offset >= mp3->audio_offset + mp3->audio_size ) {
+            buffer_consume(mp3->buf, 1);
+            continue;
+          }
+
+          _mp3_index_frame(mp3, frame_offset, frame.samples_per_frame);
+        }
+
         // Found a valid frame
         frame_count++;
         bitrate_total += frame.bitrate_kbps;
@@ -284,9 +395,22 @@ static short _mp3_get_average_bitrate(mp3info *mp3, uint32_t offset, uint32_t au
           if (prev_bitrate > 0 && prev_bitrate != frame.bitrate_kbps) {
             DEBUG_TRACE("Bitrate changed, assuming file is VBR\n");
             vbr = TRUE;
+
+            if ( mp3->sampling && audio_size > MP3_SAMPLE_WINDOWS * MP3_SAMPLE_WINDOW_SIZE ) {
+              off_t pos = PerlIO_tell(mp3->infile);
+              short bitrate = _mp3_sample_bitrate(mp3, offset, audio_size);
+
+              if (bitrate > 0) {
+                buffer_clear(mp3->buf);
+                return bitrate;
+              }
+
+              // Too little audio found, read all of it after all
+              PerlIO_seek(mp3->infile, pos, SEEK_SET);
+            }
           }
           else {
-            if (frame_count > 20) {
+            if (frame_count > 20 && !mp3->indexing) {
               DEBUG_TRACE("Found 20 frames with same bitrate, assuming CBR\n");
               goto out;
             }
@@ -578,14 +702,15 @@ _mp3_parse(PerlIO *infile, char *file, HV *info)
   uint32_t song_length_ms = 0;
   uint64_t total_samples = 0;
   struct mp3frame frame;
+  SV *frame_index = _frame_index_option();
 
   bool found_first_frame = FALSE;
 
   mp3info *mp3;
-  Newz(0, mp3, sizeof(mp3info), mp3info);
-  Newz(0, mp3->buf, sizeof(Buffer), Buffer);
-  Newz(0, mp3->first_frame, sizeof(mp3frame), mp3frame);
-  Newz(0, mp3->xing_frame, sizeof(xingframe), xingframe);
+  scan_newz(mp3, 1, mp3info);
+  scan_newz(mp3->buf, 1, Buffer);
+  scan_newz(mp3->first_frame, 1, mp3frame);
+  scan_newz(mp3->xing_frame, 1, xingframe);
 
   mp3->infile       = infile;
   mp3->file         = file;
@@ -634,27 +759,26 @@ _mp3_parse(PerlIO *infile, char *file, HV *info)
 
   // Find an MP3 frame
   while ( !found_first_frame && buffer_len(mp3->buf) ) {
-    bptr = buffer_ptr(mp3->buf);
+    while (1) {
+      uint32_t skip = sync_find(buffer_ptr(mp3->buf), buffer_len(mp3->buf), MPEG_SYNC_MASK);
 
-    while ( *bptr != 0xFF ) {
-      buffer_consume(mp3->buf, 1);
+      buffer_consume(mp3->buf, skip);
+      mp3->audio_offset += skip;
 
-      mp3->audio_offset++;
-
-      if ( !buffer_len(mp3->buf) ) {
-        if (mp3->audio_offset >= mp3->file_size - 4) {
-          // No audio frames in file
-          warn("Unable to find any MP3 frames in file: %s\n", file);
-          goto out;
-        }
+      if ( buffer_len(mp3->buf) ) {
+        break;
+      }
 
-        if ( !_check_buf(mp3->infile, mp3->buf, 4, MP3_BLOCK_SIZE) ) {
-          warn("Unable to find any MP3 frames in file: %s\n", file);
-          goto out;
-        }
+      if (mp3->audio_offset >= mp3->file_size - 4) {
+        // No audio frames in file
+        warn("Unable to find any MP3 frames in file: %s\n", file);
+        goto out;
       }
 
-      bptr = buffer_ptr(mp3->buf);
+      if ( !_check_buf(mp3->infile, mp3->buf, 4, MP3_BLOCK_SIZE) ) {
+        warn("Unable to find any MP3 frames in file: %s\n", file);
+        goto out;
+      }
     }
 
     DEBUG_TRACE("Found FF sync at offset %d\n", (int)mp3->audio_offset);
@@ -763,6 +887,19 @@ _mp3_parse(PerlIO *infile, char *file, HV *info)
     }
   }
 
+  // An index from an earlier scan saves walking the frames again
+  if (frame_index != NULL) {
+    if ( SvROK(frame_index) && SvTYPE(SvRV(frame_index)) == SVt_PVAV ) {
+      _mp3_load_index(mp3, (AV *)SvRV(frame_index));
+    }
+    else {
+      mp3->indexing = 1;
+    }
+  }
+
+  // The index needs every frame, so it wins over sampling
+  mp3->sampling = !mp3->indexing && _vbr_sample_option();
+
   // If we don't know the bitrate from Xing/LAME/VBRI, calculate average
   if ( !mp3->bitrate ) {
     DEBUG_TRACE("Calculating average bitrate starting from %d...\n", (int)mp3->audio_offset);
@@ -775,6 +912,10 @@ _mp3_parse(PerlIO *infile, char *file, HV *info)
       mp3->bitrate = frame.bitrate_kbps;
     }
   }
+  else if (mp3->indexing) {
+    DEBUG_TRACE("Walking frames for the frame index starting from %d...\n", (int)mp3->audio_offset);
+    _mp3_get_average_bitrate(mp3, mp3->audio_offset, mp3->audio_size);
+  }
 
   if (mp3->xing_frame->xing_frames) {
     total_samples = mp3->xing_frame->xing_frames * frame.samples_per_frame;
@@ -791,6 +932,14 @@ _mp3_parse(PerlIO *infile, char *file, HV *info)
 			(double) frame.samplerate);
     total_samples = mp3->xing_frame->vbri_frames * frame.samples_per_frame;
 	}
+  else if (mp3->walked_samples) {
+    // Counted every frame for the index, no need to estimate
+    total_samples = mp3->walked_samples;
+    song_length_ms = (int) ((double)(total_samples * 1000.) / (double) frame.samplerate);
+  }
+  else if (mp3->sampled_frames) {
+    song_length_ms = (int) (mp3->sampled_frames * frame.samples_per_frame * 1000. / (double) frame.samplerate);
+  }
   else {
     song_length_ms = (int) ((double)mp3->audio_size * 8. /
 			(double)mp3->bitrate);
@@ -892,6 +1041,11 @@ _mp3_parse(PerlIO *infile, char *file, HV *info)
     my_hv_store( info, "vbr", newSViv(1) );
   }
 
+  if (mp3->sampled_frames) {
+    my_hv_store( info, "estimated_frames", newSVuv( (uint32_t)(mp3->sampled_frames + 0.5) ) );
+    my_hv_store( info, "song_length_error_ms", newSVuv( (uint32_t)(song_length_ms * mp3->sampled_error + 0.5) ) );
+  }
+
   // DLNA profile detection
   if (_is_mp3x_profile(mp3))
     my_hv_store( info, "dlna_profile", newSVpvn( "MP3X", 4 ) );
@@ -906,14 +1060,37 @@ out:
 off_t
 mp3_find_frame(PerlIO *infile, char *file, int offset)
 {
+  HV *info = newHV();
+  off_t frame_offset;
+  mp3info *mp3 = mp3_seek_open(infile, file, info, NULL);
+
+  frame_offset = mp3_seek(mp3, infile, file, info, offset);
+
+  SvREFCNT_dec(info);
+
+  return frame_offset;
+}
+
+// Parse what mp3_seek needs, the returned state can be used for any number of seeks
+void *
+mp3_seek_open(PerlIO *infile, char *file, HV *info, HV *tags)
+{
+  mp3info *mp3 = _mp3_parse(infile, file, info);
+
+  buffer_free(mp3->buf);
+
+  return mp3;
+}
+
+off_t
+mp3_seek(void *state, PerlIO *infile, char *file, HV *info, int offset)
+{
+  mp3info *mp3 = (mp3info *)state;
   Buffer mp3_buf;
   unsigned char *bptr;
   unsigned int buf_size;
   struct mp3frame frame;
   int frame_offset = -1;
-  HV *info = newHV();
-
-  mp3info *mp3 = _mp3_parse(infile, file, info);
 
   buffer_init(&mp3_buf, MP3_BLOCK_SIZE);
 
@@ -930,6 +1107,11 @@ mp3_find_frame(PerlIO *infile, char *file, int offset)
     }
     DEBUG_TRACE("find_frame: using absolute offset value %d\n", frame_offset);
   }
+  else if (mp3->num_index) {
+    // Exact from the frame index, which knows where the audio ends
+    frame_offset = _mp3_index_seek(mp3, infile, (uint64_t)offset * mp3->first_frame->samplerate / 1000);
+    goto out;
+  }
   else {
     if (offset >= mp3->song_length_ms) {
       goto out;
@@ -1008,11 +1190,12 @@ mp3_find_frame(PerlIO *infile, char *file, int offset)
 
   // Find 0xFF sync and verify it's a valid mp3 frame header
   while (1) {
-    if (
-      buf_size < 4
-      ||
-      ( bptr[0] == 0xFF && !_decode_mp3_frame( bptr, &frame ) )
-    ) {
+    unsigned int skip = sync_find(bptr, buf_size, MPEG_SYNC_MASK);
+
+    bptr     += skip;
+    buf_size -= skip;
+
+    if ( buf_size < 4 || !_decode_mp3_frame( bptr, &frame ) ) {
       break;
     }
 
@@ -1032,17 +1215,179 @@ mp3_find_frame(PerlIO *infile, char *file, int offset)
 
 out:
   buffer_free(&mp3_buf);
-  SvREFCNT_dec(info);
 
-  buffer_free(mp3->buf);
-  Safefree(mp3->buf);
-  Safefree(mp3->first_frame);
-  Safefree(mp3->xing_frame);
-  Safefree(mp3);
+  return frame_offset;
+}
+
+// Returns the offset of the frame holding sample target, found from the nearest
+// index entry before it by hopping over the frames in between
+off_t
+_mp3_index_seek(mp3info *mp3, PerlIO *infile, uint64_t target)
+{
+  Buffer win;
+  off_t win_offset = 0;
+  struct mp3frame frame;
+  uint64_t sample;
+  off_t frame_offset;
+  uint32_t lo = 0;
+  uint32_t hi = mp3->num_index;
+
+  while (hi - lo > 1) {
+    uint32_t mid = lo + (hi - lo) / 2;
+
+    if (mp3->index[mid].sample <= target)
+      lo = mid;
+    else
+      hi = mid;
+  }
+
+  sample       = mp3->index[lo].sample;
+  frame_offset = mp3->index[lo].offset;
+
+  DEBUG_TRACE("find_frame: target sample %llu, index entry %d at %llu\n", target, lo, (uint64_t)frame_offset);
+
+  buffer_init(&win, MP3_BLOCK_SIZE);
+
+  while ( (frame_offset = _mp3_next_frame(mp3, infile, &win, &win_offset, frame_offset, &frame)) >= 0 ) {
+    if (sample + frame.samples_per_frame > target) {
+      break;
+    }
+
+    sample       += frame.samples_per_frame;
+    frame_offset += frame.frame_size;
+  }
+
+  buffer_free(&win);
 
   return frame_offset;
 }
 
+// Returns the offset of the first frame of the stream at or after offset,
+// skipping junk the same way as the walk does, or -1 at the end of the audio.
+// win holds the data from win_offset on
+off_t
+_mp3_next_frame(mp3info *mp3, PerlIO *infile, Buffer *win, off_t *win_offset, off_t offset, struct mp3frame *frame)
+{
+  off_t end = mp3->audio_offset + mp3->audio_size;
+  unsigned char *bptr;
+
+  while ( offset + 4 <= end ) {
+    if ( offset < *win_offset || offset + 4 > *win_offset + buffer_len(win) ) {
+      buffer_clear(win);
+      *win_offset = offset;
+
+      PerlIO_seek(infile, offset, SEEK_SET);
+
+      if ( !_check_buf(infile, win, 4, MP3_BLOCK_SIZE) ) {
+        return -1;
+      }
+    }
+
+    bptr    = (unsigned char *)buffer_ptr(win) + (offset - *win_offset);
+    offset += sync_find(bptr, *win_offset + buffer_len(win) - offset, MPEG_SYNC_MASK);
+
+    // A sync word at the end of the window is looked at once the window has moved
+    if ( offset + 4 > *win_offset + buffer_len(win) ) {
+      continue;
+    }
+
+    bptr = (unsigned char *)buffer_ptr(win) + (offset - *win_offset);
+
+    if ( offset + 4 <= end && !_decode_mp3_frame(bptr, frame) && _mp3_same_stream(mp3, frame) ) {
+      return offset;
+    }
+
+    offset++;
+  }
+
+  return -1;
+}
+
+// Counts a frame found by the walk, every MP3_INDEX_INTERVAL frames go into
+// the index. A Xing/Info/VBRI frame has no audio and isn't counted
+void
+_mp3_index_frame(mp3info *mp3, off_t offset, int samples)
+{
+  if ( offset == mp3->audio_offset
+    && (mp3->xing_frame->xing_tag || mp3->xing_frame->info_tag || mp3->xing_frame->vbri_tag)
+  ) {
+    return;
+  }
+
+  if (mp3->walked_frames % MP3_INDEX_INTERVAL == 0) {
+    if (mp3->num_index == mp3->max_index) {
+      struct mp3_index *index;
+
+      mp3->max_index = mp3->max_index ? mp3->max_index * 2 : 64;
+      scan_newz(index, mp3->max_index, struct mp3_index);
+
+      if (mp3->num_index) {
+        memcpy(index, mp3->index, mp3->num_index * sizeof(struct mp3_index));
+      }
+
+      mp3->index = index;
+    }
+
+    mp3->index[mp3->num_index].sample = mp3->walked_samples;
+    mp3->index[mp3->num_index].offset = offset;
+    mp3->num_index++;
+  }
+
+  mp3->walked_frames++;
+  mp3->walked_samples += samples;
+}
+
+// Takes the frame_index returned by an earlier scan, a list of
+// [ sample, offset ] pairs
+void
+_mp3_load_index(mp3info *mp3, AV *list)
+{
+  SSize_t i;
+
+  mp3->num_index = mp3->max_index = av_len(list) + 1;
+  scan_newz(mp3->index, mp3->max_index + 1, struct mp3_index);
+
+  for (i = 0; i < mp3->num_index; i++) {
+    SV **entry = av_fetch(list, i, 0);
+    AV *pair;
+
+    if ( entry == NULL || !SvROK(*entry) || SvTYPE(SvRV(*entry)) != SVt_PVAV || av_len((AV *)SvRV(*entry)) != 1 ) {
+      croak("Audio::Scan frame_index must be a list of [ sample, offset ] pairs");
+    }
+
+    pair = (AV *)SvRV(*entry);
+
+    mp3->index[i].sample = (uint64_t)SvNV( *av_fetch(pair, 0, 0) );
+    mp3->index[i].offset = (off_t)SvNV( *av_fetch(pair, 1, 0) );
+
+    if ( i && (mp3->index[i].sample <= mp3->index[i - 1].sample || mp3->index[i].offset <= mp3->index[i - 1].offset) ) {
+      croak("Audio::Scan frame_index must be in file order");
+    }
+  }
+
+  DEBUG_TRACE("Loaded frame index of %d entries\n", mp3->num_index);
+}
+
+// Returns the walked frame index in info as frame_index
+void
+_mp3_store_index(mp3info *mp3)
+{
+  AV *list = newAV();
+  uint32_t i;
+
+  av_extend(list, mp3->num_index);
+
+  for (i = 0; i < mp3->num_index; i++) {
+    AV *pair = newAV();
+
+    av_push( pair, newSVuv(mp3->index[i].sample) );
+    av_push( pair, newSVuv(mp3->index[i].offset) );
+    av_push( list, newRV_noinc( (SV *)pair ) );
+  }
+
+  my_hv_store( mp3->info, "frame_index", newRV_noinc( (SV *)list ) );
+}
+
 void
 _mp3_skip(mp3info *mp3, uint32_t size)
 {
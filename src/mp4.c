@@ -19,404 +19,750 @@
 static int
 get_mp4tags(PerlIO *infile, char *file, HV *info, HV *tags)
 {
-  mp4info *mp4 = _mp4_parse(infile, file, info, tags, 0);
-
-  Safefree(mp4);
+  _mp4_parse(infile, file, info, tags, 0, 0);
 
   return 0;
 }
 
+// Read the image data of cover number index, without reading the others.
+// Returns undef if there is no such cover
+SV *
+mp4_get_artwork(PerlIO *infile, char *file, int index)
+{
+  SV *image = newSV(0);
+  HV *info = newHV();
+  HV *tags = newHV();
+  mp4info *mp4 = _mp4_parse(infile, file, info, tags, MP4_COVER_POS, 0);
+
+  if ( index >= 0 && index < mp4->num_covers ) {
+    struct mp4_cover *cover = &mp4->covers[index];
+
+    sv_grow(image, cover->length + 1);
+    sv_setpvn(image, "", 0);
+
+    PerlIO_seek(infile, cover->offset, SEEK_SET);
+
+    if ( PerlIO_read(infile, SvPVX(image), cover->length) != cover->length ) {
+      PerlIO_printf(PerlIO_stderr(), "Unable to read artwork: %s\n", file);
+      sv_setsv(image, &PL_sv_undef);
+    }
+    else {
+      SvCUR_set(image, cover->length);
+    }
+  }
+
+  // Don't leak
+  SvREFCNT_dec(info);
+  SvREFCNT_dec(tags);
+
+  return image;
+}
+
 // wrapper to return just the file offset
 off_t
 mp4_find_frame(PerlIO *infile, char *file, int offset)
 {
-  HV *info = newHV();
-  int frame_offset = -1;
+  return mp4_find_frame_track(infile, file, offset, 0);
+}
 
-  mp4_find_frame_return_info(infile, file, offset, info);
+// Same, seeking in the track with the given id, or the first audio track if 0
+off_t
+mp4_find_frame_track(PerlIO *infile, char *file, int offset, uint32_t track)
+{
+  off_t frame_offset;
+  HV *info = newHV();
+  HV *tags = newHV();
+  mp4info *mp4 = _mp4_parse(infile, file, info, tags, MP4_SEEK, track);
 
-  if ( my_hv_exists(info, "seek_offset") ) {
-    frame_offset = SvIV( *(my_hv_fetch(info, "seek_offset") ) );
-  }
+  frame_offset = mp4_seek(mp4, infile, file, info, offset);
 
+  // Don't leak
   SvREFCNT_dec(info);
+  SvREFCNT_dec(tags);
 
   return frame_offset;
 }
 
-// offset is in ms
+// Parse what mp4_seek needs, the returned state can be used for any number of seeks
+void *
+mp4_seek_open(PerlIO *infile, char *file, HV *info, HV *tags)
+{
+  mp4info *mp4 = _mp4_parse(infile, file, info, tags, MP4_SEEK, 0);
+
+  // Only the sample tables are used from here on
+  mp4->tags = NULL;
+
+  return mp4;
+}
+
+off_t
+mp4_seek(void *state, PerlIO *infile, char *file, HV *info, int offset)
+{
+  struct mp4_seek_pos pos;
+
+  if ( _mp4_seek_position((mp4info *)state, offset, &pos) != 0 ) {
+    return -1;
+  }
+
+  return pos.file_offset;
+}
+
+// Find the sample at offset ms from the sample tables and where it starts
+// in the file. Returns 0 on success.
 // This is based on code from Rockbox
-int
-mp4_find_frame_return_info(PerlIO *infile, char *file, int offset, HV *info)
+static int
+_mp4_seek_position(mp4info *mp4, int offset, struct mp4_seek_pos *pos)
 {
-  int ret = 1;
   uint32_t samplerate = 0;
   uint32_t sound_sample_loc;
   uint32_t i = 0;
-  uint32_t j = 0;
   uint32_t new_sample = 0;
-  uint32_t new_sound_sample = 0;
 
   uint32_t chunk = 1;
-  uint32_t range_samples = 0;
-  uint32_t total_samples = 0;
+  uint32_t samples_per_chunk;
   uint32_t skipped_samples = 0;
   uint32_t chunk_sample;
-  uint32_t prev_chunk;
-  uint32_t prev_chunk_samples;
-  uint32_t file_offset;
-  uint32_t chunk_offset;
-
-  uint32_t box_size = 0;
-  Buffer tmp_buf;
-  char tmp_size[4];
+  uint64_t file_offset;
+  uint64_t total_time;
+  uint64_t sample_time;
+  uint32_t delay;
 
-  // We need to read all info first to get some data we need to calculate
-  HV *tags = newHV();
-  mp4info *mp4 = _mp4_parse(infile, file, info, tags, 1);
-
-  // Init seek buffer
-  //  Newz(0, &tmp_buf, sizeof(Buffer), Buffer);
-  buffer_init(&tmp_buf, MP4_BLOCK_SIZE);
-
-  // Seeking not yet supported for files with multiple tracks
-  if (mp4->track_count > 1) {
-    ret = -1;
-    goto out;
+  if (mp4->fragmented) {
+    return _mp4_seek_fragment(mp4, offset, pos);
   }
 
-  if ( !my_hv_exists(info, "samplerate") ) {
-    PerlIO_printf(PerlIO_stderr(), "find_frame: unknown sample rate\n");
-    ret = -1;
-    goto out;
+  if ( !mp4->trk ) {
+    if (mp4->seek_track) {
+      PerlIO_printf(PerlIO_stderr(), "find_frame: No track with id %u: %s\n", mp4->seek_track, mp4->file);
+    }
+    else {
+      PerlIO_printf(PerlIO_stderr(), "find_frame: File does not contain seek metadata: %s\n", mp4->file);
+    }
+    return -1;
   }
 
-  // Pull out the samplerate
-  samplerate = SvIV( *( my_hv_fetch( info, "samplerate" ) ) );
+  // The track's own timescale, tracks may differ (HD-AAC)
+  samplerate = mp4->trk->timescale;
 
+  if ( !samplerate ) {
+    PerlIO_printf(PerlIO_stderr(), "find_frame: unknown sample rate\n");
+    return -1;
+  }
   // convert offset to sound_sample_loc
   sound_sample_loc = (offset / 10) * (samplerate / 100);
   DEBUG_TRACE("Looking for target sample %u\n", sound_sample_loc);
 
   // Make sure we have the necessary metadata
   if (
-       !mp4->num_time_to_samples
-    || !mp4->num_sample_byte_sizes
-    || !mp4->num_sample_to_chunks
-    || !mp4->num_chunk_offsets
+       !mp4->trk->num_time_to_samples
+    || !mp4->trk->num_sample_byte_sizes
+    || !mp4->trk->num_sample_to_chunks
+    || !mp4->trk->num_chunk_offsets
   ) {
-    PerlIO_printf(PerlIO_stderr(), "find_frame: File does not contain seek metadata: %s\n", file);
-    ret = -1;
-    goto out;
+    PerlIO_printf(PerlIO_stderr(), "find_frame: File does not contain seek metadata: %s\n", mp4->file);
+    return -1;
   }
 
-  // Find the destination block from time_to_sample array
-  while ( (i < mp4->num_time_to_samples) &&
-      (new_sound_sample < sound_sample_loc)
-  ) {
-      j = (sound_sample_loc - new_sound_sample) / mp4->time_to_sample[i].sample_duration;
-
-      DEBUG_TRACE(
-        "i = %d / j = %d, sample_count[i]: %d, sample_duration[i]: %d\n",
-        i, j,
-        mp4->time_to_sample[i].sample_count,
-        mp4->time_to_sample[i].sample_duration
-      );
-
-      if (j <= mp4->time_to_sample[i].sample_count) {
-        new_sample += j;
-        new_sound_sample += j * mp4->time_to_sample[i].sample_duration;
-        break;
-      }
-      else {
-        // XXX need test for this bit of code (variable stts)
-        new_sound_sample += (mp4->time_to_sample[i].sample_duration
-            * mp4->time_to_sample[i].sample_count);
-        new_sample += mp4->time_to_sample[i].sample_count;
-        i++;
-      }
-  }
-
-  if ( new_sample >= mp4->num_sample_byte_sizes ) {
-    PerlIO_printf(PerlIO_stderr(), "find_frame: Offset out of range (%d >= %d)\n", new_sample, mp4->num_sample_byte_sizes);
-    ret = -1;
-    goto out;
-  }
+  // Time 0 is after the encoder delay. A target inside the track is never
+  // pushed past its end by it
+  total_time = mp4->trk->stts_first_time[mp4->trk->num_time_to_samples];
+  delay = _mp4_seek_delay(mp4);
 
-  DEBUG_TRACE("new_sample: %d, new_sound_sample: %d\n", new_sample, new_sound_sample);
-
-  // Write new stts box
-  {
-    int i;
-    uint32_t total_sample_count = _mp4_total_samples(mp4);
-    uint32_t stts_entries = total_sample_count - new_sample;
-    uint32_t cur_duration = 0;
-    struct tts *stts;
-    int32_t stts_index = -1;
+  pos->consumed = sound_sample_loc;
 
-    Newz(0, stts, stts_entries * sizeof(*stts), struct tts);
+  if (delay) {
+    if (sound_sample_loc < total_time && sound_sample_loc + delay >= total_time) {
+      sound_sample_loc = total_time - 1;
+    }
+    else {
+      sound_sample_loc += delay;
+    }
 
-    for (i = new_sample; i < total_sample_count; i++) {
-      uint32_t duration = _mp4_get_sample_duration(mp4, i);
+    DEBUG_TRACE("Skipping %u priming samples, target sample %u\n", delay, sound_sample_loc);
+  }
 
-      if (cur_duration && cur_duration == duration) {
-        // same as previous entry, combine together
-        stts_entries--;
-        stts[stts_index].sample_count++;
-      }
-      else {
-        stts_index++;
-        stts[stts_index].sample_count = 1;
-        stts[stts_index].sample_duration = duration;
-        cur_duration = duration;
-      }
-    }
+  // Find the destination block from the stts running totals: the last
+  // entry starting at or before the target time, then the sample within it
+  if ( sound_sample_loc >= total_time ) {
+    new_sample = _mp4_total_samples(mp4);
+    sample_time = total_time;
+  }
+  else {
+    uint32_t hi = mp4->trk->num_time_to_samples;
 
-    DEBUG_TRACE("Writing new stts (entries: %d)\n", stts_entries);
-    buffer_put_int(&tmp_buf, stts_entries);
+    while (hi - i > 1) {
+      uint32_t mid = i + (hi - i) / 2;
 
-    for (i = 0; i < stts_entries; i++) {
-      DEBUG_TRACE("  sample_count %d, sample_duration %d\n", stts[i].sample_count, stts[i].sample_duration);
-      buffer_put_int(&tmp_buf, stts[i].sample_count);
-      buffer_put_int(&tmp_buf, stts[i].sample_duration);
+      if (mp4->trk->stts_first_time[mid] <= sound_sample_loc)
+        i = mid;
+      else
+        hi = mid;
     }
 
-    mp4->new_stts = newSVpv("", 0);
-    put_u32( tmp_size, buffer_len(&tmp_buf) + 12 );
-    sv_catpvn( mp4->new_stts, tmp_size, 4 );
-    sv_catpvn( mp4->new_stts, "stts", 4 );
-    sv_catpvn( mp4->new_stts, "\0\0\0\0", 4 );
-    sv_catpvn( mp4->new_stts, (char *)buffer_ptr(&tmp_buf), buffer_len(&tmp_buf) );
-    //buffer_dump(&tmp_buf, 0);
-    buffer_clear(&tmp_buf);
+    // Never an empty entry, they start where the next one does
+    new_sample = mp4->trk->stts_first_sample[i]
+      + (sound_sample_loc - mp4->trk->stts_first_time[i]) / mp4->trk->time_to_sample[i].sample_duration;
+    sample_time = mp4->trk->stts_first_time[i]
+      + (uint64_t)(new_sample - mp4->trk->stts_first_sample[i]) * mp4->trk->time_to_sample[i].sample_duration;
+  }
 
-    Safefree(stts);
+  if ( new_sample >= mp4->trk->num_sample_byte_sizes ) {
+    PerlIO_printf(PerlIO_stderr(), "find_frame: Offset out of range (%d >= %d)\n", new_sample, mp4->trk->num_sample_byte_sizes);
+    return -1;
   }
 
-  // We know the new block, now calculate the file position
+  DEBUG_TRACE("new_sample: %d (stts entry %d)\n", new_sample, i);
 
-  /* Locate the chunk containing the sample */
-  prev_chunk         = mp4->sample_to_chunk[0].first_chunk;
-  prev_chunk_samples = mp4->sample_to_chunk[0].samples_per_chunk;
+  // We know the new block, now calculate the file position
 
-  for (i = 1; i < mp4->num_sample_to_chunks; i++) {
-    chunk = mp4->sample_to_chunk[i].first_chunk;
-    range_samples = (chunk - prev_chunk) * prev_chunk_samples;
+  /* Locate the chunk containing the sample, from the stsc running totals */
+  {
+    uint32_t hi = mp4->trk->num_sample_to_chunks;
 
-    DEBUG_TRACE("prev_chunk: %d, prev_chunk_samples: %d, chunk: %d, range_samples: %d\n",
-      prev_chunk, prev_chunk_samples, chunk, range_samples);
+    i = 0;
+    while (hi - i > 1) {
+      uint32_t mid = i + (hi - i) / 2;
 
-    if (new_sample < total_samples + range_samples)
-      break;
-
-    total_samples += range_samples;
-    prev_chunk = mp4->sample_to_chunk[i].first_chunk;
-    prev_chunk_samples = mp4->sample_to_chunk[i].samples_per_chunk;
+      if (mp4->trk->stsc_first_sample[mid] <= new_sample)
+        i = mid;
+      else
+        hi = mid;
+    }
   }
 
-  DEBUG_TRACE("prev_chunk: %d, prev_chunk_samples: %d, total_samples: %d\n", prev_chunk, prev_chunk_samples, total_samples);
+  samples_per_chunk = mp4->trk->sample_to_chunk[i].samples_per_chunk;
 
-  if (new_sample >= mp4->sample_to_chunk[0].samples_per_chunk) {
-    chunk = prev_chunk + (new_sample - total_samples) / prev_chunk_samples;
-  }
-  else {
-    chunk = 1;
+  DEBUG_TRACE("stsc entry %d: first_chunk: %d, samples_per_chunk: %d, first_sample: %d\n",
+    i, mp4->trk->sample_to_chunk[i].first_chunk, samples_per_chunk, mp4->trk->stsc_first_sample[i]);
+
+  if ( !samples_per_chunk || !mp4->trk->sample_to_chunk[i].first_chunk ) {
+    PerlIO_printf(PerlIO_stderr(), "find_frame: Invalid stsc entry: %s\n", mp4->file);
+    return -1;
   }
 
+  chunk = mp4->trk->sample_to_chunk[i].first_chunk
+    + (new_sample - mp4->trk->stsc_first_sample[i]) / samples_per_chunk;
+
   DEBUG_TRACE("chunk: %d\n", chunk);
 
   /* Get sample of the first sample in the chunk */
-  chunk_sample = total_samples + (chunk - prev_chunk) * prev_chunk_samples;
+  chunk_sample = mp4->trk->stsc_first_sample[i]
+    + (chunk - mp4->trk->sample_to_chunk[i].first_chunk) * samples_per_chunk;
 
   DEBUG_TRACE("chunk_sample: %d\n", chunk_sample);
 
   /* Get offset in file */
 
-  if (chunk > mp4->num_chunk_offsets) {
-    file_offset = mp4->chunk_offset[mp4->num_chunk_offsets - 1];
+  if (chunk > mp4->trk->num_chunk_offsets) {
+    file_offset = _mp4_chunk_offset(mp4, mp4->trk->num_chunk_offsets - 1);
   }
   else {
-    file_offset = mp4->chunk_offset[chunk - 1];
+    file_offset = _mp4_chunk_offset(mp4, chunk - 1);
   }
 
-  DEBUG_TRACE("file_offset: %d\n", file_offset);
+  DEBUG_TRACE("file_offset: %llu\n", file_offset);
 
   if (chunk_sample > new_sample) {
     PerlIO_printf(PerlIO_stderr(), "find_frame: sample out of range (%d > %d)\n", chunk_sample, new_sample);
-    ret = -1;
-    goto out;
+    return -1;
   }
 
   // Move offset within the chunk to the correct sample range
-  for (i = chunk_sample; i < new_sample; i++) {
-    file_offset += mp4->sample_byte_size[i];
-    skipped_samples++;
-    DEBUG_TRACE("  file_offset + %d: %d\n", mp4->sample_byte_size[i], file_offset);
+  skipped_samples = new_sample - chunk_sample;
+
+  if (mp4->trk->sample_size) {
+    file_offset += (uint64_t)mp4->trk->sample_size * skipped_samples;
+  }
+  else {
+    for (i = chunk_sample; i < new_sample; i++) {
+      file_offset += _mp4_sample_size(mp4, i);
+      DEBUG_TRACE("  file_offset + %d: %llu\n", _mp4_sample_size(mp4, i), file_offset);
+    }
   }
 
-  if (file_offset > mp4->audio_offset + mp4->audio_size) {
-    PerlIO_printf(PerlIO_stderr(), "find_frame: file offset out of range (%d > %lld)\n", file_offset, mp4->audio_offset + mp4->audio_size);
-    ret = -1;
-    goto out;
+  // Allow offsets up to the end of the last mdat, or of the file if the mdat is short
+  if (file_offset > mp4->audio_end && file_offset > mp4->file_size) {
+    PerlIO_printf(PerlIO_stderr(), "find_frame: file offset out of range (%llu > %llu)\n", (unsigned long long)file_offset, mp4->audio_end);
+    return -1;
   }
 
-  // Write new stsc box
-  {
-    int i;
-    uint32_t stsc_entries = mp4->num_chunk_offsets - chunk + 1;
-    uint32_t cur_samples_per_chunk = 0;
-    struct stc *stsc;
-    int32_t stsc_index = -1;
-    uint32_t chunk_delta = 1;
-    j = 1;
+  pos->sample          = new_sample;
+  pos->chunk           = chunk;
+  pos->skipped_samples = skipped_samples;
+  pos->file_offset     = file_offset;
+  pos->trim            = sound_sample_loc - sample_time;
+
+  return 0;
+}
 
-    Newz(0, stsc, stsc_entries * sizeof(*stsc), struct stc);
+// Priming samples at the start of the seek track, from its edit list or
+// else iTunSMPB
+static uint32_t
+_mp4_seek_delay(mp4info *mp4)
+{
+  if (mp4->trk->has_edit) {
+    return mp4->trk->edit_delay;
+  }
 
-    for (i = chunk; i <= mp4->num_chunk_offsets; i++) {
-      // Find the number of samples in chunk i
-      uint32_t samples_in_chunk = _mp4_samples_in_chunk(mp4, i);
+  if (mp4->trk->is_audio && mp4->has_smpb) {
+    return mp4->smpb_delay;
+  }
 
-      if (cur_samples_per_chunk && cur_samples_per_chunk == samples_in_chunk) {
-        // same as previous entry, combine together
-        stsc_entries--;
+  return 0;
+}
+
+// Reserves len bytes at the end of the seek header and returns them
+static unsigned char *
+_mp4_seekhdr_reserve(mp4info *mp4, uint32_t len)
+{
+  STRLEN cur = SvCUR(mp4->seekhdr);
+  unsigned char *p;
+
+  // No-op unless the up front size was wrong
+  p = (unsigned char *)SvGROW(mp4->seekhdr, cur + len + 1) + cur;
+  SvCUR_set(mp4->seekhdr, cur + len);
+  p[len] = '\0';
+
+  return p;
+}
+
+static void
+_mp4_seekhdr_put(mp4info *mp4, const void *data, uint32_t len)
+{
+  memcpy( _mp4_seekhdr_reserve(mp4, len), data, len );
+}
+
+// Reserves a box of size bytes at the end of the seek header, writes its
+// size, type and empty version/flags and returns where the contents go
+static unsigned char *
+_mp4_seekhdr_put_box(mp4info *mp4, const char *type, uint32_t size)
+{
+  unsigned char *p = _mp4_seekhdr_reserve(mp4, size);
+
+  put_u32(p, size);
+  memcpy(p + 4, type, 4);
+  put_u32(p + 8, 0);
+
+  return p + 12;
+}
+
+static uint32_t
+_mp4_new_stsz_size(mp4info *mp4)
+{
+  // A constant sample size is written back as-is, with no table
+  if (mp4->trk->sample_size)
+    return 20;
+
+  return 20 + 4 * (mp4->trk->num_sample_byte_sizes - mp4->seek_pos.sample);
+}
+
+static uint32_t
+_mp4_new_stco_size(mp4info *mp4)
+{
+  uint32_t entries = mp4->trk->num_chunk_offsets - mp4->seek_pos.chunk + 1;
+
+  return 16 + (mp4->trk->chunk_offset64 ? 8 : 4) * entries;
+}
+
+static void
+_mp4_put_new_stts(mp4info *mp4)
+{
+  uint32_t i;
+  unsigned char *p = _mp4_seekhdr_put_box(mp4, "stts", 16 + 8 * mp4->num_new_time_to_samples);
+
+  DEBUG_TRACE("Writing new stts (entries: %d)\n", mp4->num_new_time_to_samples);
+
+  put_u32(p, mp4->num_new_time_to_samples);
+  p += 4;
+
+  for (i = 0; i < mp4->num_new_time_to_samples; i++) {
+    DEBUG_TRACE("  sample_count %d, sample_duration %d\n",
+      mp4->new_time_to_sample[i].sample_count, mp4->new_time_to_sample[i].sample_duration);
+    put_u32(p, mp4->new_time_to_sample[i].sample_count);
+    put_u32(p + 4, mp4->new_time_to_sample[i].sample_duration);
+    p += 8;
+  }
+}
+
+static void
+_mp4_put_new_stsc(mp4info *mp4)
+{
+  uint32_t i;
+  unsigned char *p = _mp4_seekhdr_put_box(mp4, "stsc", 16 + 12 * mp4->num_new_sample_to_chunks);
+
+  DEBUG_TRACE("Writing new stsc (entries: %d)\n", mp4->num_new_sample_to_chunks);
+
+  put_u32(p, mp4->num_new_sample_to_chunks);
+  p += 4;
+
+  for (i = 0; i < mp4->num_new_sample_to_chunks; i++) {
+    DEBUG_TRACE("  first_chunk %d, samples_per_chunk %d\n",
+      mp4->new_sample_to_chunk[i].first_chunk, mp4->new_sample_to_chunk[i].samples_per_chunk);
+    put_u32(p, mp4->new_sample_to_chunk[i].first_chunk);
+    put_u32(p + 4, mp4->new_sample_to_chunk[i].samples_per_chunk);
+    put_u32(p + 8, 1); // XXX sample description index, is this OK?
+    p += 12;
+  }
+}
+
+// num_sample_byte_sizes -= $new_sample, skip $new_sample items
+static void
+_mp4_put_new_stsz(mp4info *mp4)
+{
+  uint32_t i;
+  unsigned char *p = _mp4_seekhdr_put_box(mp4, "stsz", _mp4_new_stsz_size(mp4));
+
+  DEBUG_TRACE("Writing new stsz: %d items\n", mp4->trk->num_sample_byte_sizes - mp4->seek_pos.sample);
+
+  put_u32(p, mp4->trk->sample_size);
+  put_u32(p + 4, mp4->trk->num_sample_byte_sizes - mp4->seek_pos.sample);
+  p += 8;
+
+  if ( !mp4->trk->sample_size ) {
+    for (i = mp4->seek_pos.sample; i < mp4->trk->num_sample_byte_sizes; i++) {
+      put_u32(p, _mp4_sample_size(mp4, i));
+      p += 4;
+    }
+  }
+}
+
+// num_chunk_offsets -= $chunk, skip $chunk items
+static void
+_mp4_put_new_stco(mp4info *mp4)
+{
+  uint32_t i;
+  uint32_t chunk = mp4->seek_pos.chunk;
+  unsigned char *p = _mp4_seekhdr_put_box(mp4, mp4->trk->chunk_offset64 ? "co64" : "stco", _mp4_new_stco_size(mp4));
+
+  DEBUG_TRACE("Writing new stco: %d items\n", mp4->trk->num_chunk_offsets - chunk + 1);
+
+  put_u32(p, mp4->trk->num_chunk_offsets - chunk + 1);
+  p += 4;
+
+  for (i = chunk - 1; i < mp4->trk->num_chunk_offsets; i++) {
+    uint64_t new_offset;
+
+    if (i == chunk - 1) {
+      // The first chunk offset is the start of mdat (chunk_offset)
+      new_offset = mp4->new_chunk_offset;
+    }
+    else {
+      new_offset = _mp4_chunk_offset(mp4, i) - mp4->seek_pos.file_offset + mp4->new_chunk_offset;
+    }
+
+    DEBUG_TRACE( "  offset %llu (orig %llu)\n", new_offset, _mp4_chunk_offset(mp4, i) );
+
+    if (mp4->trk->chunk_offset64) {
+      put_u32(p, (uint32_t)(new_offset >> 32));
+      p += 4;
+    }
+    put_u32(p, (uint32_t)new_offset);
+    p += 4;
+  }
+}
+
+// The edit list with its first non-empty edit starting at the seek target
+// instead of after the priming samples, so the decoder still trims the
+// samples before it. Same size as the old box, nothing else moves
+static uint8_t
+_mp4_put_new_elst(mp4info *mp4, uint32_t size)
+{
+  unsigned char *p;
+  unsigned char *end;
+  uint8_t version;
+  uint32_t entry_size;
+  uint64_t consumed = 0;
+
+  if ( !_check_buf(mp4->infile, mp4->buf, size - 8, MP4_BLOCK_SIZE) ) {
+    return 0;
+  }
+
+  p = _mp4_seekhdr_reserve(mp4, size);
+  end = p + size;
+  put_u32(p, size);
+  memcpy(p + 4, "elst", 4);
+  memcpy(p + 8, buffer_ptr(mp4->buf), size - 8);
+
+  if ( !mp4->trk->has_edit || size < 16 ) {
+    return 1;
+  }
+
+  // Skip version/flags and entry_count, the count was checked by _mp4_parse_elst
+  version    = p[8];
+  entry_size = version == 1 ? 20 : 12;
+  p += 16;
+
+  // The seeked over part of the edit, in mv_timescale
+  if (mp4->trk->timescale) {
+    consumed = mp4->seek_pos.consumed * mp4->mv_timescale / mp4->trk->timescale;
+  }
+
+  for ( ; p + entry_size <= end; p += entry_size) {
+    uint64_t segment_duration;
+
+    if (version == 1) {
+      if (p[8] & 0x80) {
+        continue; // empty edit
       }
-      else {
-        stsc_index++;
 
-        stsc[stsc_index].first_chunk = chunk_delta;
+      segment_duration = ((uint64_t)get_u32(p) << 32) | get_u32(p + 4);
+      segment_duration = segment_duration > consumed ? segment_duration - consumed : 0;
 
-        if (j == 1) {
-          // The first chunk may have less samples in it due to seeking within a chunk
-          stsc[stsc_index].samples_per_chunk = samples_in_chunk - skipped_samples;
-          cur_samples_per_chunk = samples_in_chunk - skipped_samples;
-          j++;
-        }
-        else {
-          stsc[stsc_index].samples_per_chunk = samples_in_chunk;
-          cur_samples_per_chunk = samples_in_chunk;
-        }
+      put_u32(p, (uint32_t)(segment_duration >> 32));
+      put_u32(p + 4, (uint32_t)segment_duration);
+      put_u32(p + 8, 0);
+      put_u32(p + 12, mp4->seek_pos.trim);
+    }
+    else {
+      if (p[4] & 0x80) {
+        continue;
       }
 
-      chunk_delta++;
+      segment_duration = get_u32(p);
+      segment_duration = segment_duration > consumed ? segment_duration - consumed : 0;
+
+      put_u32(p, (uint32_t)segment_duration);
+      put_u32(p + 4, mp4->seek_pos.trim);
     }
 
-    DEBUG_TRACE("Writing new stsc (entries: %d)\n", stsc_entries);
-    buffer_put_int(&tmp_buf, stsc_entries);
+    DEBUG_TRACE("Writing new elst: media_time %u, duration %llu\n", mp4->seek_pos.trim, segment_duration);
+    break;
+  }
+
+  return 1;
+}
+
+// Find the fragment holding offset ms, seeking in a fragmented file lands
+// on the start of a moof box. Returns 0 on success.
+static int
+_mp4_seek_fragment(mp4info *mp4, int offset, struct mp4_seek_pos *pos)
+{
+  uint64_t target;
+  uint32_t lo = 0;
+  uint32_t hi = mp4->num_frags;
+
+  if ( !mp4->num_frags || !mp4->frag_timescale ) {
+    PerlIO_printf(PerlIO_stderr(), "find_frame: File does not contain seek metadata: %s\n", mp4->file);
+    return -1;
+  }
+
+  target = offset < 0 ? mp4->frag_time : (uint64_t)offset * mp4->frag_timescale / 1000;
 
-    for (i = 0; i < stsc_entries; i++) {
-      DEBUG_TRACE("  first_chunk %d, samples_per_chunk %d\n", stsc[i].first_chunk, stsc[i].samples_per_chunk);
-      buffer_put_int(&tmp_buf, stsc[i].first_chunk);
-      buffer_put_int(&tmp_buf, stsc[i].samples_per_chunk);
-      buffer_put_int(&tmp_buf, 1); // XXX sample description index, is this OK?
+  // Time 0 is after the encoder delay, as with the sample tables
+  if (mp4->frag_delay && target < mp4->frag_time) {
+    target += mp4->frag_delay;
+    if (target >= mp4->frag_time) {
+      target = mp4->frag_time - 1;
     }
+  }
 
-    mp4->new_stsc = newSVpv("", 0);
-    put_u32( tmp_size, buffer_len(&tmp_buf) + 12 );
-    sv_catpvn( mp4->new_stsc, tmp_size, 4 );
-    sv_catpvn( mp4->new_stsc, "stsc", 4 );
-    sv_catpvn( mp4->new_stsc, "\0\0\0\0", 4 );
-    sv_catpvn( mp4->new_stsc, (char *)buffer_ptr(&tmp_buf), buffer_len(&tmp_buf) );
-    DEBUG_TRACE("Created new stsc\n");
-    //buffer_dump(&tmp_buf, 0);
-    buffer_clear(&tmp_buf);
+  if (target >= mp4->frag_time) {
+    PerlIO_printf(PerlIO_stderr(), "find_frame: Offset out of range (%llu >= %llu)\n", target, mp4->frag_time);
+    return -1;
+  }
+
+  // Last fragment starting at or before the target
+  while (hi - lo > 1) {
+    uint32_t mid = lo + (hi - lo) / 2;
 
-    Safefree(stsc);
+    if (mp4->frags[mid].time <= target)
+      lo = mid;
+    else
+      hi = mid;
   }
 
-  // Write new stsz box, num_sample_byte_sizes -= $new_sample, skip $new_sample items
-  buffer_put_int(&tmp_buf, 0);
-  buffer_put_int(&tmp_buf, mp4->num_sample_byte_sizes - new_sample);
-  DEBUG_TRACE("Writing new stsz: %d items\n", mp4->num_sample_byte_sizes - new_sample);
-  j = 1;
-  for (i = new_sample; i < mp4->num_sample_byte_sizes; i++) {
-    DEBUG_TRACE("  sample %d sample_byte_size %d\n", j++, mp4->sample_byte_size[i]);
-    buffer_put_int(&tmp_buf, mp4->sample_byte_size[i]);
+  DEBUG_TRACE("find_frame: fragment %d of %d at %llu, time %llu\n",
+    lo, mp4->num_frags, mp4->frags[lo].offset, mp4->frags[lo].time);
+
+  pos->sample          = 0;
+  pos->chunk           = 0;
+  pos->skipped_samples = 0;
+  pos->file_offset     = mp4->frags[lo].offset;
+
+  return 0;
+}
+
+// offset is in ms
+int
+mp4_find_frame_return_info(PerlIO *infile, char *file, int offset, HV *info)
+{
+  return mp4_find_frame_track_return_info(infile, file, offset, 0, info);
+}
+
+// The seek header keeps only the chosen track, the others are left out
+int
+mp4_find_frame_track_return_info(PerlIO *infile, char *file, int offset, uint32_t track, HV *info)
+{
+  int ret = 1;
+  uint32_t i = 0;
+  uint32_t new_sample;
+  uint32_t chunk;
+  uint32_t skipped_samples;
+  uint64_t chunk_offset;
+  struct mp4_seek_pos pos;
+
+  uint32_t box_size = 0;
+
+  // We need to read all info first to get some data we need to calculate
+  HV *tags = newHV();
+  mp4info *mp4 = _mp4_parse(infile, file, info, tags, MP4_SEEK, track);
+
+  if ( _mp4_seek_position(mp4, offset, &pos) != 0 ) {
+    ret = -1;
+    goto out;
   }
 
-  mp4->new_stsz = newSVpv("", 0);
-  put_u32( tmp_size, buffer_len(&tmp_buf) + 12 );
-  sv_catpvn( mp4->new_stsz, tmp_size, 4 );
-  sv_catpvn( mp4->new_stsz, "stsz", 4 );
-  sv_catpvn( mp4->new_stsz, "\0\0\0\0", 4 );
-  sv_catpvn( mp4->new_stsz, (char *)buffer_ptr(&tmp_buf), buffer_len(&tmp_buf) );
-  DEBUG_TRACE("Created new stsz\n");
-  //buffer_dump(&tmp_buf, 0);
-  buffer_clear(&tmp_buf);
+  if (mp4->fragmented) {
+    // Fragments carry their own sample tables, so the header is the init
+    // segment (everything before the first moof) unchanged
+    mp4->seekhdr = newSV(mp4->first_moof);
+    sv_setpvn(mp4->seekhdr, "", 0);
 
-  // Total up size of 4 new st* boxes
-  // stco is calculated directly since we can't write it without offsets
-  mp4->new_st_size
-    = sv_len(mp4->new_stts)
-    + sv_len(mp4->new_stsc)
-    + sv_len(mp4->new_stsz)
-    + 12 + ( 4 * (mp4->num_chunk_offsets - chunk + 2) ); // stco size
+    PerlIO_seek(mp4->infile, 0, SEEK_SET);
+    if ( PerlIO_read(mp4->infile, SvPVX(mp4->seekhdr), mp4->first_moof) != mp4->first_moof ) {
+      PerlIO_printf(PerlIO_stderr(), "find_frame: Unable to read header: %s\n", mp4->file);
+      SvREFCNT_dec(mp4->seekhdr);
+      ret = -1;
+      goto out;
+    }
+    SvCUR_set(mp4->seekhdr, mp4->first_moof);
 
-  DEBUG_TRACE("new_st_size: %d, old_st_size: %d\n", mp4->new_st_size, mp4->old_st_size);
+    my_hv_store( info, "seek_offset", newSVuv(pos.file_offset) );
+    my_hv_store( info, "seek_header", mp4->seekhdr );
+    goto out;
+  }
 
-  // Calculate offset for each chunk
-  chunk_offset = SvIV( *( my_hv_fetch(info, "audio_offset") ) );
-  chunk_offset -= ( mp4->old_st_size - mp4->new_st_size );
-  chunk_offset += 8; // mdat size + fourcc
+  mp4->seek_pos   = pos;
+  new_sample      = pos.sample;
+  chunk           = pos.chunk;
+  skipped_samples = pos.skipped_samples;
 
-  DEBUG_TRACE("chunk_offset: %d\n", chunk_offset);
+  // Plan the new stts box, walking the remaining entries as runs starting
+  // with the rest of the one holding new_sample. stts and stsc are small,
+  // stsz and stco are written straight from the sample tables later
+  {
+    uint32_t first_entry = _mp4_stts_entry(mp4, new_sample);
+    uint32_t cur_duration = 0;
+    struct tts *stts;
 
-  // Write new stco box, num_chunk_offsets -= $chunk, skip $chunk items
-  buffer_put_int(&tmp_buf, mp4->num_chunk_offsets - chunk + 1);
-  DEBUG_TRACE("Writing new stco: %d items\n", mp4->num_chunk_offsets - chunk + 1);
-  for (i = chunk - 1; i < mp4->num_chunk_offsets; i++) {
-    if (i == chunk - 1) {
-      // The first chunk offset is the start of mdat (chunk_offset)
-      buffer_put_int( &tmp_buf, chunk_offset );
-      DEBUG_TRACE( "  offset %d (orig %d)\n", chunk_offset, mp4->chunk_offset[i] );
+    scan_newz(stts, mp4->trk->num_time_to_samples - first_entry, struct tts);
+    mp4->new_time_to_sample = stts;
+    mp4->num_new_time_to_samples = 0;
+
+    for (i = first_entry; i < mp4->trk->num_time_to_samples; i++) {
+      uint32_t count    = mp4->trk->time_to_sample[i].sample_count;
+      uint32_t duration = mp4->trk->time_to_sample[i].sample_duration;
+
+      if (i == first_entry) {
+        count = mp4->trk->stts_first_sample[i + 1] - new_sample;
+      }
+
+      if (!count) {
+        continue;
+      }
+
+      if (cur_duration && cur_duration == duration) {
+        // same as previous entry, combine together
+        stts[mp4->num_new_time_to_samples - 1].sample_count += count;
+      }
+      else {
+        stts[mp4->num_new_time_to_samples].sample_count = count;
+        stts[mp4->num_new_time_to_samples].sample_duration = duration;
+        mp4->num_new_time_to_samples++;
+        cur_duration = duration;
+      }
     }
-    else {
-      buffer_put_int( &tmp_buf, mp4->chunk_offset[i] - file_offset + chunk_offset );
-      DEBUG_TRACE( "  offset %d (orig %d)\n", mp4->chunk_offset[i] - file_offset + chunk_offset, mp4->chunk_offset[i] );
+  }
+
+  // Plan the new stsc box, walking the runs of chunks between stsc entries
+  {
+    uint32_t entry = _mp4_stsc_entry(mp4, chunk);
+    uint32_t cur_samples_per_chunk = 0;
+    uint32_t c = chunk;
+    struct stc *stsc;
+
+    // At most one per remaining stsc entry, plus the first chunk on its own
+    scan_newz(stsc, mp4->trk->num_sample_to_chunks - entry + 1, struct stc);
+    mp4->new_sample_to_chunk = stsc;
+    mp4->num_new_sample_to_chunks = 0;
+
+    while (c <= mp4->trk->num_chunk_offsets) {
+      uint32_t next_chunk = mp4->trk->num_chunk_offsets + 1;
+      uint32_t samples_in_chunk = mp4->trk->sample_to_chunk[entry].samples_per_chunk;
+      uint32_t run_end = next_chunk;
+
+      if ( entry + 1 < mp4->trk->num_sample_to_chunks && mp4->trk->sample_to_chunk[entry + 1].first_chunk < next_chunk ) {
+        next_chunk = run_end = mp4->trk->sample_to_chunk[entry + 1].first_chunk;
+      }
+
+      if (next_chunk <= c) {
+        // Entry covers no chunks
+        entry++;
+        continue;
+      }
+
+      if (c == chunk) {
+        // The first chunk may have less samples in it due to seeking within a chunk
+        samples_in_chunk -= skipped_samples;
+        run_end = c + 1;
+      }
+
+      if ( !cur_samples_per_chunk || cur_samples_per_chunk != samples_in_chunk ) {
+        stsc[mp4->num_new_sample_to_chunks].first_chunk = c - chunk + 1;
+        stsc[mp4->num_new_sample_to_chunks].samples_per_chunk = samples_in_chunk;
+        mp4->num_new_sample_to_chunks++;
+        cur_samples_per_chunk = samples_in_chunk;
+      }
+      // else same as previous entry, combine together
+
+      c = run_end;
+      if (c == next_chunk) {
+        entry++;
+      }
     }
   }
 
-  mp4->new_stco = newSVpv("", 0);
-  put_u32( tmp_size, buffer_len(&tmp_buf) + 12 );
-  sv_catpvn( mp4->new_stco, tmp_size, 4 );
-  sv_catpvn( mp4->new_stco, "stco", 4 );
-  sv_catpvn( mp4->new_stco, "\0\0\0\0", 4 );
-  sv_catpvn( mp4->new_stco, (char *)buffer_ptr(&tmp_buf), buffer_len(&tmp_buf) );
-  DEBUG_TRACE("Created new stco\n");
-  //buffer_dump(&tmp_buf, 0);
-  buffer_clear(&tmp_buf);
+  // Total up size of 4 new st* boxes
+  mp4->new_st_size
+    = 16 + 8 * mp4->num_new_time_to_samples
+    + 16 + 12 * mp4->num_new_sample_to_chunks
+    + _mp4_new_stsz_size(mp4)
+    + _mp4_new_stco_size(mp4);
+
+  DEBUG_TRACE("new_st_size: %d, old_st_size: %d\n", mp4->new_st_size, mp4->trk->st_size);
 
-  DEBUG_TRACE("real st size: %ld\n",
-      sv_len(mp4->new_stts)
-    + sv_len(mp4->new_stsc)
-    + sv_len(mp4->new_stsz)
-    + sv_len(mp4->new_stco)
-  );
+  // Calculate offset for each chunk
+  // The new boxes can be larger than the old ones
+  chunk_offset = SvIV( *( my_hv_fetch(info, "audio_offset") ) );
+  chunk_offset += mp4->new_st_size;
+  chunk_offset -= mp4->trk->st_size;
+  chunk_offset -= mp4->dropped_size;
+  chunk_offset += 8; // mdat size + fourcc
+  mp4->new_chunk_offset = chunk_offset;
+
+  DEBUG_TRACE("chunk_offset: %llu\n", chunk_offset);
 
   // Make second pass through header, reducing size of all parent boxes by st* size difference
-  // Copy all boxes, replacing st* boxes with new ones
-  mp4->seekhdr = newSVpv("", 0);
+  // Copy all boxes, replacing st* boxes with new ones. The new header ends
+  // where the audio now starts, so it is allocated once at its final size
+  // (files with mdat before moov don't fit this and grow as needed)
+  mp4->seekhdr = newSV( chunk_offset <= mp4->file_size ? chunk_offset : 0 );
+  sv_setpvn(mp4->seekhdr, "", 0);
 
   PerlIO_seek(mp4->infile, 0, SEEK_SET);
 
   // XXX this is ugly, because we are reading a second time we have to reset
   // various things in the mp4 struct
-  Newz(0, mp4->buf, sizeof(Buffer), Buffer);
+  scan_newz(mp4->buf, 1, Buffer);
   buffer_init(mp4->buf, MP4_BLOCK_SIZE);
 
   mp4->audio_offset  = 0;
   mp4->current_track = 0;
   mp4->track_count   = 0;
+  mp4->num_mdats     = 0;
 
-  // free seek structs because we will be reading them a second time
-  if (mp4->time_to_sample) Safefree(mp4->time_to_sample);
-  if (mp4->sample_to_chunk) Safefree(mp4->sample_to_chunk);
-  if (mp4->sample_byte_size) Safefree(mp4->sample_byte_size);
-  if (mp4->chunk_offset) Safefree(mp4->chunk_offset);
-
-  mp4->time_to_sample   = NULL;
-  mp4->sample_to_chunk  = NULL;
-  mp4->sample_byte_size = NULL;
-  mp4->chunk_offset     = NULL;
+  // Skip the st* boxes, they are written from the tables we already have
+  mp4->seeking = 0;
 
   while ( (box_size = _mp4_read_box(mp4)) > 0 ) {
     mp4->audio_offset += box_size;
@@ -426,34 +772,24 @@ mp4_find_frame_return_info(PerlIO *infile, char *file, int offset, HV *info)
       break;
   }
 
-  my_hv_store( info, "seek_offset", newSVuv(file_offset) );
+  DEBUG_TRACE("seek header: %ld bytes, expected %llu\n", SvCUR(mp4->seekhdr), chunk_offset);
+
+  my_hv_store( info, "seek_offset", newSVuv(pos.file_offset) );
   my_hv_store( info, "seek_header", mp4->seekhdr );
 
+  // Where the target is in the first sample, for files with gapless info
+  if ( _mp4_seek_delay(mp4) ) {
+    my_hv_store( info, "seek_skip_samples", newSVuv(pos.trim) );
+  }
+
   if (mp4->buf) {
     buffer_free(mp4->buf);
-    Safefree(mp4->buf);
   }
 
 out:
   // Don't leak
   SvREFCNT_dec(tags);
 
-  if (mp4->new_stts) SvREFCNT_dec(mp4->new_stts);
-  if (mp4->new_stsc) SvREFCNT_dec(mp4->new_stsc);
-  if (mp4->new_stsz) SvREFCNT_dec(mp4->new_stsz);
-  if (mp4->new_stco) SvREFCNT_dec(mp4->new_stco);
-
-  // free seek structs
-  if (mp4->time_to_sample) Safefree(mp4->time_to_sample);
-  if (mp4->sample_to_chunk) Safefree(mp4->sample_to_chunk);
-  if (mp4->sample_byte_size) Safefree(mp4->sample_byte_size);
-  if (mp4->chunk_offset) Safefree(mp4->chunk_offset);
-
-  // free seek buffer
-  buffer_free(&tmp_buf);
-
-  Safefree(mp4);
-
   if (ret == -1) {
     my_hv_store( info, "seek_offset", newSViv(-1) );
   }
@@ -462,14 +798,15 @@ out:
 }
 
 mp4info *
-_mp4_parse(PerlIO *infile, char *file, HV *info, HV *tags, uint8_t seeking)
+_mp4_parse(PerlIO *infile, char *file, HV *info, HV *tags, uint8_t flags, uint32_t track)
 {
   off_t file_size;
   uint32_t box_size = 0;
+  uint32_t i;
 
   mp4info *mp4;
-  Newz(0, mp4, sizeof(mp4info), mp4info);
-  Newz(0, mp4->buf, sizeof(Buffer), Buffer);
+  scan_newz(mp4, 1, mp4info);
+  scan_newz(mp4->buf, 1, Buffer);
 
   mp4->audio_offset  = 0;
   mp4->infile        = infile;
@@ -479,12 +816,17 @@ _mp4_parse(PerlIO *infile, char *file, HV *info, HV *tags, uint8_t seeking)
   mp4->current_track = 0;
   mp4->track_count   = 0;
   mp4->seen_moov     = 0;
-  mp4->seeking       = seeking ? 1 : 0;
+  mp4->seeking       = (flags & MP4_SEEK) ? 1 : 0;
 
-  mp4->time_to_sample   = NULL;
-  mp4->sample_to_chunk  = NULL;
-  mp4->sample_byte_size = NULL;
-  mp4->chunk_offset     = NULL;
+  // Seeking never returns the tags, so skips the artwork too
+  mp4->no_artwork    = (flags & (MP4_SEEK | MP4_COVER_POS)) || _env_true("AUDIO_SCAN_NO_ARTWORK");
+  mp4->seek_track    = track;
+  mp4->tracks        = NULL;
+  mp4->num_tracks    = 0;
+  mp4->trk           = NULL;
+
+  // Fragments are indexed for the track being seeked in
+  mp4->frag_track    = track;
 
   buffer_init(mp4->buf, MP4_BLOCK_SIZE);
 
@@ -496,16 +838,118 @@ _mp4_parse(PerlIO *infile, char *file, HV *info, HV *tags, uint8_t seeking)
   // Create empty tracks array
   my_hv_store( info, "tracks", newRV_noinc( (SV *)newAV() ) );
 
-  while ( (box_size = _mp4_read_box(mp4)) > 0 ) {
-    mp4->audio_offset += box_size;
-    DEBUG_TRACE("read box of size %d / audio_offset %llu\n", box_size, mp4->audio_offset);
+  // Find the top-level boxes first, then read only the ones with metadata
+  // in them. mdat and padding are never read, wherever they are in the file
+  _mp4_map_boxes(mp4);
 
-    if (mp4->audio_offset >= file_size)
-      break;
+  for (i = 0; i < mp4->num_boxes; i++) {
+    struct mp4_box *box = &mp4->boxes[i];
+    uint64_t box_end = box->offset + box->size;
+
+    if ( FOURCC_EQ(box->type, "mdat") ) {
+      _mp4_found_mdat(mp4, box->offset, box->size);
+      continue;
+    }
+
+    if ( FOURCC_EQ(box->type, "free") || FOURCC_EQ(box->type, "skip") || FOURCC_EQ(box->type, "wide") ) {
+      continue;
+    }
+
+    PerlIO_seek(infile, box->offset, SEEK_SET);
+    buffer_clear(mp4->buf);
+    mp4->audio_offset = box->offset;
+
+    while ( mp4->audio_offset < box_end && (box_size = _mp4_read_box(mp4)) > 0 ) {
+      mp4->audio_offset += box_size;
+      DEBUG_TRACE("read box of size %d / audio_offset %llu\n", box_size, mp4->audio_offset);
+    }
+
+    if (!box_size) {
+      goto done;
+    }
   }
 
+  // Fragments, or whatever the map couldn't make sense of
+  if (mp4->boxes_end < file_size) {
+    PerlIO_seek(infile, mp4->boxes_end, SEEK_SET);
+    buffer_clear(mp4->buf);
+    mp4->audio_offset = mp4->boxes_end;
+
+    while ( (box_size = _mp4_read_box(mp4)) > 0 ) {
+      mp4->audio_offset += box_size;
+      DEBUG_TRACE("read box of size %d / audio_offset %llu\n", box_size, mp4->audio_offset);
+
+      if (mp4->audio_offset >= file_size)
+        break;
+    }
+  }
+
+done:
+
   // XXX: if no ftyp was found, assume it is brand 'mp41'
 
+  if (mp4->seeking) {
+    mp4->trk = _mp4_select_track(mp4);
+  }
+
+  // Fragmented files have an empty moov, the audio is spread over the fragments
+  if (mp4->fragmented) {
+    SV **entry = my_hv_fetch(info, "song_length_ms");
+
+    my_hv_store( info, "audio_offset", newSVuv(mp4->first_moof) );
+    my_hv_store( info, "audio_size", newSVuv(mp4->frags_end > mp4->first_moof ? mp4->frags_end - mp4->first_moof : 0) );
+    mp4->audio_offset = mp4->first_moof;
+    mp4->audio_size   = mp4->frags_end > mp4->first_moof ? mp4->frags_end - mp4->first_moof : 0;
+
+    if ( !entry || !SvIV(*entry) ) {
+      uint32_t song_length_ms = 0;
+      SV **mv_timescale = my_hv_fetch(info, "mv_timescale");
+
+      if (mp4->mehd_duration && mv_timescale && SvIV(*mv_timescale)) {
+        song_length_ms = (mp4->mehd_duration * 1.0 / SvIV(*mv_timescale)) * 1000;
+      }
+      else if (mp4->frag_timescale) {
+        song_length_ms = (mp4->frag_time * 1.0 / mp4->frag_timescale) * 1000;
+      }
+
+      if (song_length_ms) {
+        AV *tracks = (AV *)SvRV( *(my_hv_fetch(info, "tracks")) );
+        int i;
+
+        my_hv_store( info, "song_length_ms", newSVuv(song_length_ms) );
+
+        for (i = 0; i <= av_len(tracks); i++) {
+          SV **track = av_fetch(tracks, i, 0);
+          if (track) {
+            HV *trackinfo = (HV *)SvRV(*track);
+            SV **id = my_hv_fetch(trackinfo, "id");
+            if ( id && SvIV(*id) == mp4->frag_track ) {
+              my_hv_store( trackinfo, "duration", newSVuv(song_length_ms) );
+            }
+          }
+        }
+      }
+    }
+  }
+
+  // Gapless info, an edit list wins over iTunSMPB
+  if ( !mp4->has_gapless && mp4->has_smpb ) {
+    mp4->has_gapless      = 1;
+    mp4->encoder_delay    = mp4->smpb_delay;
+    mp4->encoder_padding  = mp4->smpb_padding;
+    mp4->original_samples = mp4->smpb_samples;
+  }
+
+  if (mp4->has_gapless) {
+    my_hv_store( info, "encoder_delay", newSVuv(mp4->encoder_delay) );
+
+    // Unknown if the edit has no duration
+    if (mp4->original_samples) {
+      my_hv_store( info, "encoder_padding", newSVuv(mp4->encoder_padding) );
+      my_hv_store( info, "original_samples", newSVuv(mp4->original_samples) );
+    }
+  }
+
   // if no bitrate was found (i.e. ALAC), calculate based on file_size/song_length_ms
   if ( !my_hv_exists(info, "avg_bitrate") ) {
     SV **entry = my_hv_fetch(info, "song_length_ms");
@@ -655,7 +1099,6 @@ _mp4_parse(PerlIO *infile, char *file, HV *info, HV *tags, uint8_t seeking)
   }
 
   buffer_free(mp4->buf);
-  Safefree(mp4->buf);
 
   return mp4;
 }
@@ -715,54 +1158,72 @@ _mp4_read_box(mp4info *mp4)
     char tmp_size[4];
 
     if (
-         FOURCC_EQ(type, "moov")
-      || FOURCC_EQ(type, "trak")
+         FOURCC_EQ(type, "trak")
+      && mp4->track_count < mp4->num_tracks
+      && mp4->tracks[mp4->track_count] != mp4->trk
+    ) {
+      // Only the track we seeked in is kept
+      DEBUG_TRACE("  Leaving out track %d\n", mp4->track_count + 1);
+      mp4->track_count++;
+      _mp4_skip(mp4, mp4->rsize);
+      return size;
+    }
+    else if ( FOURCC_EQ(type, "moov") ) {
+      // Also loses the other tracks
+      put_u32(tmp_size, size - (mp4->trk->st_size - mp4->new_st_size) - mp4->dropped_size);
+      _mp4_seekhdr_put( mp4, tmp_size, 4 );
+      _mp4_seekhdr_put( mp4, type, 4 );
+    }
+    else if (
+         FOURCC_EQ(type, "trak")
       || FOURCC_EQ(type, "mdia")
       || FOURCC_EQ(type, "minf")
       || FOURCC_EQ(type, "stbl")
     ) {
       // Container box, adjust size
-      put_u32(tmp_size, size - (mp4->old_st_size - mp4->new_st_size));
-      DEBUG_TRACE("  Box is parent of st*, changed size to %llu\n", size - (mp4->old_st_size - mp4->new_st_size));
-      sv_catpvn( mp4->seekhdr, tmp_size, 4 );
-      sv_catpvn( mp4->seekhdr, type, 4 );
+      put_u32(tmp_size, size - (mp4->trk->st_size - mp4->new_st_size));
+      DEBUG_TRACE("  Box is parent of st*, changed size to %llu\n", size - (mp4->trk->st_size - mp4->new_st_size));
+      _mp4_seekhdr_put( mp4, tmp_size, 4 );
+      _mp4_seekhdr_put( mp4, type, 4 );
     }
     // Replace st* boxes with our new versions
     else if ( FOURCC_EQ(type, "stts") ) {
-      DEBUG_TRACE("adding new stts of size %ld\n", sv_len(mp4->new_stts));
-      sv_catsv( mp4->seekhdr, mp4->new_stts );
+      _mp4_put_new_stts(mp4);
     }
     else if ( FOURCC_EQ(type, "stsc") ) {
-      DEBUG_TRACE("adding new stsc of size %ld\n", sv_len(mp4->new_stsc));
-      sv_catsv( mp4->seekhdr, mp4->new_stsc );
+      _mp4_put_new_stsc(mp4);
     }
     else if ( FOURCC_EQ(type, "stsz") ) {
-      DEBUG_TRACE("adding new stsz of size %ld\n", sv_len(mp4->new_stsz));
-      sv_catsv( mp4->seekhdr, mp4->new_stsz );
+      _mp4_put_new_stsz(mp4);
     }
-    else if ( FOURCC_EQ(type, "stco") ) {
-      DEBUG_TRACE("adding new stco of size %ld\n", sv_len(mp4->new_stco));
-      sv_catsv( mp4->seekhdr, mp4->new_stco );
+    else if ( FOURCC_EQ(type, "stco") || FOURCC_EQ(type, "co64") ) {
+      _mp4_put_new_stco(mp4);
+    }
+    else if ( FOURCC_EQ(type, "elst") ) {
+      // Same size, with the edit moved to the new start
+      if ( !_mp4_put_new_elst(mp4, size) ) {
+        return 0;
+      }
     }
     else {
       // Normal box, copy it
       put_u32(tmp_size, size);
-      sv_catpvn( mp4->seekhdr, tmp_size, 4 );
-      sv_catpvn( mp4->seekhdr, type, 4 );
+      _mp4_seekhdr_put( mp4, tmp_size, 4 );
+      _mp4_seekhdr_put( mp4, type, 4 );
 
       // stsd is special and contains real bytes and is also a container
       if ( FOURCC_EQ(type, "stsd") ) {
-        sv_catpvn( mp4->seekhdr, (char *)buffer_ptr(mp4->buf), 8 );
+        _mp4_seekhdr_put( mp4, (char *)buffer_ptr(mp4->buf), 8 );
       }
 
       // mp4a is special, ugh
       else if ( FOURCC_EQ(type, "mp4a") ) {
-        sv_catpvn( mp4->seekhdr, (char *)buffer_ptr(mp4->buf), 28 );
+        _mp4_seekhdr_put( mp4, (char *)buffer_ptr(mp4->buf), 28 );
       }
 
       // and so is meta
       else if ( FOURCC_EQ(type, "meta") ) {
-        sv_catpvn( mp4->seekhdr, (char *)buffer_ptr(mp4->buf), mp4->meta_size );
+        _mp4_seekhdr_put( mp4, (char *)buffer_ptr(mp4->buf), mp4->meta_size );
       }
 
       // Copy contents unless it's a container
@@ -770,6 +1231,7 @@ _mp4_read_box(mp4info *mp4)
            !FOURCC_EQ(type, "edts")
         && !FOURCC_EQ(type, "dinf")
         && !FOURCC_EQ(type, "udta")
+        && !FOURCC_EQ(type, "mvex")
         && !FOURCC_EQ(type, "mdat")
       ) {
         if ( !_check_buf(mp4->infile, mp4->buf, size - 8, MP4_BLOCK_SIZE) ) {
@@ -780,7 +1242,7 @@ _mp4_read_box(mp4info *mp4)
         // to avoid useless copying of artwork.  Will require adjusting offsets
         // differently.
 
-        sv_catpvn( mp4->seekhdr, (char *)buffer_ptr(mp4->buf), size - 8 );
+        _mp4_seekhdr_put( mp4, (char *)buffer_ptr(mp4->buf), size - 8 );
       }
     }
 
@@ -803,6 +1265,8 @@ _mp4_read_box(mp4info *mp4)
     || FOURCC_EQ(type, "stbl")
     || FOURCC_EQ(type, "udta")
     || FOURCC_EQ(type, "trak")
+    || FOURCC_EQ(type, "mvex")
+    || FOURCC_EQ(type, "traf")
   ) {
     // These boxes are containers for nested boxes, return only the fact that
     // we read the header size of the container. Read the nested box the next call to this fn.
@@ -811,7 +1275,48 @@ _mp4_read_box(mp4info *mp4)
     if ( FOURCC_EQ(type, "trak") ) {
       // Also a container, but we need to increment track_count too
       mp4->track_count++;
+
+      // Edit lists are per track
+      mp4->has_edit = 0;
+
+      if (mp4->seeking) {
+        _mp4_add_track(mp4);
+        mp4->trk->trak_size = mp4->size ? mp4->size : mp4->file_size - mp4->audio_offset;
+      }
     }
+    else if ( FOURCC_EQ(type, "traf") ) {
+      // Defaults until tfhd says otherwise
+      mp4->traf_track    = 0;
+      mp4->traf_duration = mp4->trex_duration;
+    }
+  }
+  else if ( FOURCC_EQ(type, "moof") ) {
+    // Fragment of a fragmented file, a container like traf
+    if ( !mp4->fragmented ) {
+      mp4->fragmented = 1;
+      mp4->first_moof = mp4->audio_offset;
+      _mp4_load_mfra(mp4);
+    }
+
+    mp4->moof_offset    = mp4->audio_offset;
+    mp4->moof_has_track = 0;
+
+    if (mp4->frags_from_mfra) {
+      struct mp4_frag *last = &mp4->frags[mp4->num_frags - 1];
+
+      if (mp4->audio_offset < last->offset) {
+        // The mfra index already has every fragment, skip to the last one
+        // to find where the audio ends
+        DEBUG_TRACE("  skipping to last fragment at %llu\n", last->offset);
+        PerlIO_seek(mp4->infile, last->offset, SEEK_SET);
+        buffer_clear(mp4->buf);
+        return last->offset - mp4->audio_offset;
+      }
+
+      mp4->frag_time = last->time;
+    }
+
+    size = mp4->hsize;
   }
   else if ( FOURCC_EQ(type, "mvhd") ) {
     mp4->seen_moov = 1;
@@ -827,6 +1332,12 @@ _mp4_read_box(mp4info *mp4)
       return 0;
     }
   }
+  else if ( FOURCC_EQ(type, "elst") ) {
+    if ( !_mp4_parse_elst(mp4) ) {
+      PerlIO_printf(PerlIO_stderr(), "Invalid MP4 file (bad elst box): %s\n", mp4->file);
+      return 0;
+    }
+  }
   else if ( FOURCC_EQ(type, "mdhd") ) {
     if ( !_mp4_parse_mdhd(mp4) ) {
       PerlIO_printf(PerlIO_stderr(), "Invalid MP4 file (bad mdhd box): %s\n", mp4->file);
@@ -883,53 +1394,95 @@ _mp4_read_box(mp4info *mp4)
     }
   }
   else if ( FOURCC_EQ(type, "stts") ) {
-    if ( mp4->seeking && mp4->track_count == 1 ) {
+    if ( mp4->seeking && mp4->trk ) {
       if ( !_mp4_parse_stts(mp4) ) {
         PerlIO_printf(PerlIO_stderr(), "Invalid MP4 file (bad stts box): %s\n", mp4->file);
         return 0;
       }
-      mp4->old_st_size += size;
+      mp4->trk->st_size += size;
     }
     else {
       skip = 1;
     }
   }
   else if ( FOURCC_EQ(type, "stsc") ) {
-    if ( mp4->seeking && mp4->track_count == 1 ) {
+    if ( mp4->seeking && mp4->trk ) {
       if ( !_mp4_parse_stsc(mp4) ) {
         PerlIO_printf(PerlIO_stderr(), "Invalid MP4 file (bad stsc box): %s\n", mp4->file);
         return 0;
       }
-      mp4->old_st_size += size;
+      mp4->trk->st_size += size;
     }
     else {
       skip = 1;
     }
   }
   else if ( FOURCC_EQ(type, "stsz") ) {
-    if ( mp4->seeking && mp4->track_count == 1 ) {
+    if ( mp4->seeking && mp4->trk ) {
       if ( !_mp4_parse_stsz(mp4) ) {
         PerlIO_printf(PerlIO_stderr(), "Invalid MP4 file (bad stsz box): %s\n", mp4->file);
         return 0;
       }
-      mp4->old_st_size += size;
+      mp4->trk->st_size += size;
     }
     else {
       skip = 1;
     }
   }
   else if ( FOURCC_EQ(type, "stco") ) {
-    if ( mp4->seeking && mp4->track_count == 1 ) {
+    if ( mp4->seeking && mp4->trk ) {
       if ( !_mp4_parse_stco(mp4) ) {
         PerlIO_printf(PerlIO_stderr(), "Invalid MP4 file (bad stco box): %s\n", mp4->file);
         return 0;
       }
-      mp4->old_st_size += size;
+      mp4->trk->st_size += size;
     }
     else {
       skip = 1;
     }
   }
+  else if ( FOURCC_EQ(type, "co64") ) {
+    if ( mp4->seeking && mp4->trk ) {
+      if ( !_mp4_parse_co64(mp4) ) {
+        PerlIO_printf(PerlIO_stderr(), "Invalid MP4 file (bad co64 box): %s\n", mp4->file);
+        return 0;
+      }
+      mp4->trk->st_size += size;
+    }
+    else {
+      skip = 1;
+    }
+  }
+  else if ( FOURCC_EQ(type, "mehd") ) {
+    if ( !_mp4_parse_mehd(mp4) ) {
+      PerlIO_printf(PerlIO_stderr(), "Invalid MP4 file (bad mehd box): %s\n", mp4->file);
+      return 0;
+    }
+  }
+  else if ( FOURCC_EQ(type, "trex") ) {
+    if ( !_mp4_parse_trex(mp4) ) {
+      PerlIO_printf(PerlIO_stderr(), "Invalid MP4 file (bad trex box): %s\n", mp4->file);
+      return 0;
+    }
+  }
+  else if ( FOURCC_EQ(type, "tfhd") ) {
+    if ( !_mp4_parse_tfhd(mp4) ) {
+      PerlIO_printf(PerlIO_stderr(), "Invalid MP4 file (bad tfhd box): %s\n", mp4->file);
+      return 0;
+    }
+  }
+  else if ( FOURCC_EQ(type, "tfdt") ) {
+    if ( !_mp4_parse_tfdt(mp4) ) {
+      PerlIO_printf(PerlIO_stderr(), "Invalid MP4 file (bad tfdt box): %s\n", mp4->file);
+      return 0;
+    }
+  }
+  else if ( FOURCC_EQ(type, "trun") ) {
+    if ( !_mp4_parse_trun(mp4) ) {
+      PerlIO_printf(PerlIO_stderr(), "Invalid MP4 file (bad trun box): %s\n", mp4->file);
+      return 0;
+    }
+  }
   else if ( FOURCC_EQ(type, "meta") ) {
     uint8_t meta_size = _mp4_parse_meta(mp4);
     if ( !meta_size ) {
@@ -948,21 +1501,16 @@ _mp4_read_box(mp4info *mp4)
       return 0;
     }
   }
+  else if ( FOURCC_EQ(type, "mdat") && mp4->fragmented ) {
+    // Audio of a fragment, audio_offset and audio_size cover all of them
+    mp4->frags_end = mp4->audio_offset + size;
+    skip = 1;
+  }
   else if ( FOURCC_EQ(type, "mdat") ) {
     // Audio data here, there may be boxes after mdat, so we have to skip it
     skip = 1;
 
-    // If we haven't seen moov yet, set a flag so we can print a warning
-    // or handle it some other way
-    if ( !mp4->seen_moov ) {
-      my_hv_store( mp4->info, "leading_mdat", newSVuv(1) );
-      mp4->dlna_invalid = 1; // DLNA 8.6.34.8, moov must be before mdat
-    }
-
-    // Record audio offset and length
-    my_hv_store( mp4->info, "audio_offset", newSVuv(mp4->audio_offset) );
-    my_hv_store( mp4->info, "audio_size", newSVuv(size) );
-    mp4->audio_size = size;
+    _mp4_found_mdat(mp4, mp4->audio_offset, size);
   }
   else {
     DEBUG_TRACE("  Unhandled box, skipping\n");
@@ -976,6 +1524,120 @@ _mp4_read_box(mp4info *mp4)
   return size;
 }
 
+// Record an mdat box. The audio starts at the first one, and audio_size
+// totals all of them, which are listed in mdat_boxes if there are several
+void
+_mp4_found_mdat(mp4info *mp4, uint64_t offset, uint64_t size)
+{
+  HV *mdat;
+
+  // If we haven't seen moov yet, set a flag so we can print a warning
+  // or handle it some other way
+  if ( !mp4->seen_moov ) {
+    my_hv_store( mp4->info, "leading_mdat", newSVuv(1) );
+    mp4->dlna_invalid = 1; // DLNA 8.6.34.8, moov must be before mdat
+  }
+
+  mp4->num_mdats++;
+
+  if (offset + size > mp4->audio_end) {
+    mp4->audio_end = offset + size;
+  }
+
+  if (mp4->num_mdats == 1) {
+    // Record audio offset and length
+    my_hv_store( mp4->info, "audio_offset", newSVuv(offset) );
+    my_hv_store( mp4->info, "audio_size", newSVuv(size) );
+    mp4->audio_size = size;
+    mp4->first_mdat = offset;
+    return;
+  }
+
+  if (mp4->num_mdats == 2) {
+    AV *mdats = newAV();
+
+    mdat = newHV();
+    my_hv_store( mdat, "offset", newSVuv(mp4->first_mdat) );
+    my_hv_store( mdat, "size", newSVuv(mp4->audio_size) );
+    av_push( mdats, newRV_noinc( (SV *)mdat ) );
+
+    my_hv_store( mp4->info, "mdat_boxes", newRV_noinc( (SV *)mdats ) );
+  }
+
+  mdat = newHV();
+  my_hv_store( mdat, "offset", newSVuv(offset) );
+  my_hv_store( mdat, "size", newSVuv(size) );
+  av_push( (AV *)SvRV( *(my_hv_fetch(mp4->info, "mdat_boxes")) ), newRV_noinc( (SV *)mdat ) );
+
+  mp4->audio_size += size;
+  my_hv_store( mp4->info, "audio_size", newSVuv(mp4->audio_size) );
+}
+
+// Walk the top-level boxes reading only their headers. Stops at the first
+// moof, fragments are read as they come so the mfra index can skip them.
+void
+_mp4_map_boxes(mp4info *mp4)
+{
+  uint64_t offset = 0;
+  unsigned char hdr[16];
+
+  while (offset + 8 <= mp4->file_size) {
+    uint64_t size;
+    uint8_t hsize = 8;
+
+    PerlIO_seek(mp4->infile, offset, SEEK_SET);
+    if ( PerlIO_read(mp4->infile, hdr, 8) != 8 ) {
+      break;
+    }
+
+    size = ((uint32_t)hdr[0] << 24) | (hdr[1] << 16) | (hdr[2] << 8) | hdr[3];
+
+    if (size == 1) {
+      if ( PerlIO_read(mp4->infile, hdr + 8, 8) != 8 ) {
+        break;
+      }
+
+      size = ((uint64_t)hdr[8] << 56) | ((uint64_t)hdr[9] << 48)
+        | ((uint64_t)hdr[10] << 40) | ((uint64_t)hdr[11] << 32)
+        | ((uint64_t)hdr[12] << 24) | (hdr[13] << 16) | (hdr[14] << 8) | hdr[15];
+      hsize = 16;
+    }
+    else if (size == 0) {
+      // Extends to end of file
+      size = mp4->file_size - offset;
+    }
+
+    // Anything odd is left to _mp4_read_box to report
+    if ( size <= hsize || FOURCC_EQ((char *)hdr + 4, "moof") ) {
+      break;
+    }
+
+    if (mp4->num_boxes == mp4->max_boxes) {
+      struct mp4_box *boxes;
+
+      mp4->max_boxes = mp4->max_boxes ? mp4->max_boxes * 2 : 8;
+      scan_newz(boxes, mp4->max_boxes, struct mp4_box);
+
+      if (mp4->num_boxes) {
+        memcpy(boxes, mp4->boxes, mp4->num_boxes * sizeof(struct mp4_box));
+      }
+
+      mp4->boxes = boxes;
+    }
+
+    memcpy(mp4->boxes[mp4->num_boxes].type, hdr + 4, 4);
+    mp4->boxes[mp4->num_boxes].offset = offset;
+    mp4->boxes[mp4->num_boxes].size   = size;
+    mp4->num_boxes++;
+
+    DEBUG_TRACE("map: %.4s at %llu, size %llu\n", hdr + 4, offset, size);
+
+    offset += size;
+  }
+
+  mp4->boxes_end = offset;
+}
+
 uint8_t
 _mp4_parse_ftyp(mp4info *mp4)
 {
@@ -1027,6 +1689,7 @@ _mp4_parse_mvhd(mp4info *mp4)
 
     timescale = buffer_get_int(mp4->buf);
     my_hv_store( mp4->info, "mv_timescale", newSVuv(timescale) );
+    mp4->mv_timescale = timescale;
 
     my_hv_store( mp4->info, "song_length_ms", newSVuv( (buffer_get_int(mp4->buf) * 1.0 / timescale ) * 1000 ) );
   }
@@ -1036,6 +1699,7 @@ _mp4_parse_mvhd(mp4info *mp4)
 
     timescale = buffer_get_int(mp4->buf);
     my_hv_store( mp4->info, "mv_timescale", newSVuv(timescale) );
+    mp4->mv_timescale = timescale;
 
     my_hv_store( mp4->info, "song_length_ms", newSVuv( (buffer_get_int64(mp4->buf) * 1.0 / timescale ) * 1000 ) );
   }
@@ -1122,6 +1786,70 @@ _mp4_parse_tkhd(mp4info *mp4)
   // Remember the current track we're dealing with
   mp4->current_track = id;
 
+  if (mp4->seeking && mp4->trk) {
+    mp4->trk->id = id;
+  }
+
+  // Fragments are followed for the first track unless another was asked for
+  if ( !mp4->frag_track ) {
+    mp4->frag_track = id;
+  }
+
+  return 1;
+}
+
+// Keeps the first non-empty edit, which skips the encoder delay and gives
+// the length of the original audio. Empty edits (media_time -1) only delay
+// the presentation and are ignored
+uint8_t
+_mp4_parse_elst(mp4info *mp4)
+{
+  uint32_t entry_count;
+  uint32_t i;
+  uint8_t version;
+  uint64_t used;
+
+  if ( !_check_buf(mp4->infile, mp4->buf, mp4->rsize, MP4_BLOCK_SIZE) ) {
+    return 0;
+  }
+
+  version = buffer_get_char(mp4->buf);
+  buffer_consume(mp4->buf, 3); // flags
+
+  entry_count = buffer_get_int(mp4->buf);
+
+  used = 8 + (uint64_t)entry_count * (version == 1 ? 20 : 12);
+  if (mp4->rsize < used) {
+    return 0;
+  }
+
+  for (i = 0; i < entry_count; i++) {
+    uint64_t segment_duration;
+    int64_t media_time;
+
+    if (version == 1) {
+      segment_duration = buffer_get_int64(mp4->buf);
+      media_time = (int64_t)buffer_get_int64(mp4->buf);
+    }
+    else {
+      segment_duration = buffer_get_int(mp4->buf);
+      media_time = (int32_t)buffer_get_int(mp4->buf);
+    }
+
+    buffer_consume(mp4->buf, 4); // media_rate
+
+    if ( media_time >= 0 && !mp4->has_edit ) {
+      mp4->has_edit        = 1;
+      mp4->edit_media_time = media_time;
+      mp4->edit_duration   = segment_duration;
+
+      DEBUG_TRACE("  edit: media_time %lld, duration %llu\n", media_time, segment_duration);
+    }
+  }
+
+  // Skip any trailing bytes
+  buffer_consume(mp4->buf, mp4->rsize - used);
+
   return 1;
 }
 
@@ -1145,12 +1873,11 @@ _mp4_parse_mdhd(mp4info *mp4)
     timescale = buffer_get_int(mp4->buf);
     my_hv_store( mp4->info, "samplerate", newSVuv(timescale) );
 
-    // Skip duration, if have song_length_ms from mvhd
-    if ( my_hv_exists( mp4->info, "song_length_ms" ) ) {
-      buffer_consume(mp4->buf, 4);
-    }
-    else {
-      my_hv_store( mp4->info, "song_length_ms", newSVuv( (buffer_get_int(mp4->buf) * 1.0 / timescale ) * 1000 ) );
+    mp4->media_duration = buffer_get_int(mp4->buf);
+
+    // Use duration only if we don't have song_length_ms from mvhd
+    if ( !my_hv_exists( mp4->info, "song_length_ms" ) ) {
+      my_hv_store( mp4->info, "song_length_ms", newSVuv( (mp4->media_duration * 1.0 / timescale ) * 1000 ) );
     }
   }
   else if (version == 1) { // 64-bit values
@@ -1160,12 +1887,11 @@ _mp4_parse_mdhd(mp4info *mp4)
     timescale = buffer_get_int(mp4->buf);
     my_hv_store( mp4->info, "samplerate", newSVuv(timescale) );
 
-    // Skip duration, if have song_length_ms from mvhd
-    if ( my_hv_exists( mp4->info, "song_length_ms" ) ) {
-      buffer_consume(mp4->buf, 8);
-    }
-    else {
-      my_hv_store( mp4->info, "song_length_ms", newSVuv( (buffer_get_int64(mp4->buf) * 1.0 / timescale ) * 1000 ) );
+    mp4->media_duration = buffer_get_int64(mp4->buf);
+
+    // Use duration only if we don't have song_length_ms from mvhd
+    if ( !my_hv_exists( mp4->info, "song_length_ms" ) ) {
+      my_hv_store( mp4->info, "song_length_ms", newSVuv( (mp4->media_duration * 1.0 / timescale ) * 1000 ) );
     }
   }
   else {
@@ -1174,6 +1900,14 @@ _mp4_parse_mdhd(mp4info *mp4)
 
   mp4->samplerate = timescale;
 
+  if (mp4->seeking && mp4->trk) {
+    mp4->trk->timescale = timescale;
+  }
+
+  if (mp4->current_track == mp4->frag_track) {
+    mp4->frag_timescale = timescale;
+  }
+
   // Skip rest
   buffer_consume(mp4->buf, 4);
 
@@ -1186,18 +1920,52 @@ _mp4_parse_hdlr(mp4info *mp4)
   HV *trackinfo = _mp4_get_current_trackinfo(mp4);
   SV *handler_name;
 
-  if (!trackinfo) {
-    return 0;
-  }
+  if (!trackinfo) {
+    return 0;
+  }
+
+  if ( !_check_buf(mp4->infile, mp4->buf, mp4->rsize, MP4_BLOCK_SIZE) ) {
+    return 0;
+  }
+
+  // Skip version, flags, pre_defined
+  buffer_consume(mp4->buf, 8);
+
+  my_hv_store( trackinfo, "handler_type", newSVpvn( buffer_ptr(mp4->buf), 4 ) );
+
+  if ( mp4->seeking && mp4->trk && FOURCC_EQ((char *)buffer_ptr(mp4->buf), "soun") ) {
+    mp4->trk->is_audio = 1;
+  }
+
+  // mdhd has been read by now, so the trak's edit list can be put in samples
+  if ( mp4->has_edit && mp4->edit_media_time >= 0 ) {
+    uint32_t delay = (uint32_t)mp4->edit_media_time;
+
+    if (mp4->seeking && mp4->trk) {
+      mp4->trk->has_edit      = 1;
+      mp4->trk->edit_delay    = delay;
+      mp4->trk->edit_duration = mp4->edit_duration;
+    }
+
+    if (mp4->current_track == mp4->frag_track) {
+      mp4->frag_delay = delay;
+    }
+
+    if ( !mp4->has_gapless && FOURCC_EQ((char *)buffer_ptr(mp4->buf), "soun") ) {
+      mp4->has_gapless   = 1;
+      mp4->encoder_delay = delay;
 
-  if ( !_check_buf(mp4->infile, mp4->buf, mp4->rsize, MP4_BLOCK_SIZE) ) {
-    return 0;
-  }
+      // Fragmented files may leave the duration at 0 for unknown
+      if (mp4->edit_duration && mp4->mv_timescale) {
+        mp4->original_samples = mp4->edit_duration * mp4->samplerate / mp4->mv_timescale;
 
-  // Skip version, flags, pre_defined
-  buffer_consume(mp4->buf, 8);
+        if (mp4->media_duration > delay + mp4->original_samples) {
+          mp4->encoder_padding = mp4->media_duration - delay - mp4->original_samples;
+        }
+      }
+    }
+  }
 
-  my_hv_store( trackinfo, "handler_type", newSVpvn( buffer_ptr(mp4->buf), 4 ) );
   buffer_consume(mp4->buf, 4);
 
   // Skip reserved
@@ -1399,209 +2167,719 @@ _mp4_parse_esds(mp4info *mp4)
 
   _mp4_descr_length(mp4->buf);
 
-  // verify SL value
-  if (buffer_get_char(mp4->buf) != 0x02) {
+  // verify SL value
+  if (buffer_get_char(mp4->buf) != 0x02) {
+    return 0;
+  }
+
+  return 1;
+}
+
+uint8_t
+_mp4_parse_alac(mp4info *mp4)
+{
+  HV *trackinfo = _mp4_get_current_trackinfo(mp4);
+
+  if ( !_check_buf(mp4->infile, mp4->buf, 28, MP4_BLOCK_SIZE) ) {
+    return 0;
+  }
+
+  my_hv_store( trackinfo, "encoding", newSVpvn("alac", 4) );
+
+  // Skip reserved
+  buffer_consume(mp4->buf, 16);
+
+  mp4->channels = buffer_get_short(mp4->buf);
+  my_hv_store( trackinfo, "channels", newSVuv(mp4->channels) );
+  my_hv_store( trackinfo, "bits_per_sample", newSVuv( buffer_get_short(mp4->buf) ) );
+
+  // Skip reserved
+  buffer_consume(mp4->buf, 4);
+
+  // Skip bogus samplerate
+  buffer_consume(mp4->buf, 2);
+
+  // Skip reserved
+  buffer_consume(mp4->buf, 2);
+
+  return 1;
+}
+
+uint8_t
+_mp4_parse_stts(mp4info *mp4)
+{
+  int i;
+
+  if ( !_check_buf(mp4->infile, mp4->buf, mp4->rsize, MP4_BLOCK_SIZE) ) {
+    return 0;
+  }
+
+  // Skip version/flags
+  buffer_consume(mp4->buf, 4);
+
+  mp4->trk->num_time_to_samples = buffer_get_int(mp4->buf);
+  DEBUG_TRACE("  num_time_to_samples %d\n", mp4->trk->num_time_to_samples);
+
+  scan_newz(mp4->trk->time_to_sample, mp4->trk->num_time_to_samples, struct tts);
+
+  if ( !mp4->trk->time_to_sample ) {
+    PerlIO_printf(PerlIO_stderr(), "Unable to parse stts: too large\n");
+    return 0;
+  }
+
+  // Running totals for binary searches by sample or time
+  scan_newz(mp4->trk->stts_first_sample, (size_t)mp4->trk->num_time_to_samples + 1, uint32_t);
+  scan_newz(mp4->trk->stts_first_time, (size_t)mp4->trk->num_time_to_samples + 1, uint64_t);
+
+  for (i = 0; i < mp4->trk->num_time_to_samples; i++) {
+    mp4->trk->time_to_sample[i].sample_count    = buffer_get_int(mp4->buf);
+    mp4->trk->time_to_sample[i].sample_duration = buffer_get_int(mp4->buf);
+
+    mp4->trk->stts_first_sample[i + 1] = mp4->trk->stts_first_sample[i]
+      + mp4->trk->time_to_sample[i].sample_count;
+    mp4->trk->stts_first_time[i + 1] = mp4->trk->stts_first_time[i]
+      + (uint64_t)mp4->trk->time_to_sample[i].sample_count * mp4->trk->time_to_sample[i].sample_duration;
+
+    DEBUG_TRACE(
+      "  sample_count %d sample_duration %d\n",
+      mp4->trk->time_to_sample[i].sample_count,
+      mp4->trk->time_to_sample[i].sample_duration
+    );
+  }
+
+  return 1;
+}
+
+uint8_t
+_mp4_parse_stsc(mp4info *mp4)
+{
+  int i;
+
+  if ( !_check_buf(mp4->infile, mp4->buf, mp4->rsize, MP4_BLOCK_SIZE) ) {
+    return 0;
+  }
+
+  // Skip version/flags
+  buffer_consume(mp4->buf, 4);
+
+  mp4->trk->num_sample_to_chunks = buffer_get_int(mp4->buf);
+  DEBUG_TRACE("  num_sample_to_chunks %d\n", mp4->trk->num_sample_to_chunks);
+
+  scan_newz(mp4->trk->sample_to_chunk, mp4->trk->num_sample_to_chunks, struct stc);
+
+  if ( !mp4->trk->sample_to_chunk ) {
+    PerlIO_printf(PerlIO_stderr(), "Unable to parse stsc: too large\n");
+    return 0;
+  }
+
+  scan_newz(mp4->trk->stsc_first_sample, mp4->trk->num_sample_to_chunks, uint32_t);
+
+  for (i = 0; i < mp4->trk->num_sample_to_chunks; i++) {
+    mp4->trk->sample_to_chunk[i].first_chunk = buffer_get_int(mp4->buf);
+    mp4->trk->sample_to_chunk[i].samples_per_chunk = buffer_get_int(mp4->buf);
+
+    // Skip sample desc index
+    buffer_consume(mp4->buf, 4);
+
+    // Samples before this entry, first_chunk should only ever grow
+    if (i > 0 && mp4->trk->sample_to_chunk[i].first_chunk > mp4->trk->sample_to_chunk[i - 1].first_chunk) {
+      mp4->trk->stsc_first_sample[i] = mp4->trk->stsc_first_sample[i - 1]
+        + (mp4->trk->sample_to_chunk[i].first_chunk - mp4->trk->sample_to_chunk[i - 1].first_chunk)
+        * mp4->trk->sample_to_chunk[i - 1].samples_per_chunk;
+    }
+    else if (i > 0) {
+      mp4->trk->stsc_first_sample[i] = mp4->trk->stsc_first_sample[i - 1];
+    }
+
+    DEBUG_TRACE("  first_chunk %d samples_per_chunk %d\n",
+      mp4->trk->sample_to_chunk[i].first_chunk,
+      mp4->trk->sample_to_chunk[i].samples_per_chunk
+    );
+  }
+
+  return 1;
+}
+
+uint8_t
+_mp4_parse_stsz(mp4info *mp4)
+{
+  uint32_t i;
+  unsigned char *bptr;
+
+  if ( !_check_buf(mp4->infile, mp4->buf, mp4->rsize, MP4_BLOCK_SIZE) ) {
+    return 0;
+  }
+
+  if (mp4->rsize < 12) {
+    return 0;
+  }
+
+  // Skip version/flags
+  buffer_consume(mp4->buf, 4);
+
+  mp4->trk->sample_size = buffer_get_int(mp4->buf);
+  mp4->trk->num_sample_byte_sizes = buffer_get_int(mp4->buf);
+  mp4->trk->sample_byte_size = NULL;
+  mp4->trk->sample_byte_size32 = NULL;
+
+  DEBUG_TRACE("  sample_size %d, num_sample_byte_sizes %d\n", mp4->trk->sample_size, mp4->trk->num_sample_byte_sizes);
+
+  if (mp4->trk->sample_size) {
+    // Every sample has the same size, there is no table
+    return 1;
+  }
+
+  if ( mp4->trk->num_sample_byte_sizes > (mp4->rsize - 12) / 4 ) {
+    PerlIO_printf(PerlIO_stderr(), "Unable to parse stsz: too many entries\n");
+    return 0;
+  }
+
+  // Sizes over 64KB (ALAC, hi-res PCM) need 32-bit entries, most files
+  // can use half the memory
+  bptr = buffer_ptr(mp4->buf);
+  for (i = 0; i < mp4->trk->num_sample_byte_sizes; i++, bptr += 4) {
+    // Any size over 0xFFFF has a non-zero high 16 bits
+    if ( bptr[0] || bptr[1] )
+      break;
+  }
+
+  if (i < mp4->trk->num_sample_byte_sizes) {
+    DEBUG_TRACE("  stsz[%d] > 64KB, using 32-bit sizes\n", i);
+
+    scan_newz(mp4->trk->sample_byte_size32, mp4->trk->num_sample_byte_sizes, uint32_t);
+
+    for (i = 0; i < mp4->trk->num_sample_byte_sizes; i++) {
+      mp4->trk->sample_byte_size32[i] = buffer_get_int(mp4->buf);
+    }
+  }
+  else {
+    scan_newz(mp4->trk->sample_byte_size, mp4->trk->num_sample_byte_sizes, uint16_t);
+
+    for (i = 0; i < mp4->trk->num_sample_byte_sizes; i++) {
+      mp4->trk->sample_byte_size[i] = buffer_get_int(mp4->buf);
+    }
+  }
+
+  return 1;
+}
+
+uint8_t
+_mp4_parse_stco(mp4info *mp4)
+{
+  int i;
+
+  if ( !_check_buf(mp4->infile, mp4->buf, mp4->rsize, MP4_BLOCK_SIZE) ) {
+    return 0;
+  }
+
+  if (mp4->rsize < 8) {
+    return 0;
+  }
+
+  // Skip version/flags
+  buffer_consume(mp4->buf, 4);
+
+  mp4->trk->num_chunk_offsets = buffer_get_int(mp4->buf);
+  DEBUG_TRACE("  num_chunk_offsets %d\n", mp4->trk->num_chunk_offsets);
+
+  if ( mp4->trk->num_chunk_offsets > (mp4->rsize - 8) / 4 ) {
+    PerlIO_printf(PerlIO_stderr(), "Unable to parse stco: too many entries\n");
+    return 0;
+  }
+
+  scan_newz(mp4->trk->chunk_offset, mp4->trk->num_chunk_offsets, uint32_t);
+  mp4->trk->chunk_offset64 = NULL;
+
+  for (i = 0; i < mp4->trk->num_chunk_offsets; i++) {
+    mp4->trk->chunk_offset[i] = buffer_get_int(mp4->buf);
+
+    //DEBUG_TRACE("  chunk_offset %d\n", mp4->trk->chunk_offset[i]);
+  }
+
+  return 1;
+}
+
+// 64-bit chunk offsets, used by files over 4GB
+uint8_t
+_mp4_parse_co64(mp4info *mp4)
+{
+  uint32_t i;
+
+  if ( !_check_buf(mp4->infile, mp4->buf, mp4->rsize, MP4_BLOCK_SIZE) ) {
+    return 0;
+  }
+
+  if (mp4->rsize < 8) {
+    return 0;
+  }
+
+  // Skip version/flags
+  buffer_consume(mp4->buf, 4);
+
+  mp4->trk->num_chunk_offsets = buffer_get_int(mp4->buf);
+  DEBUG_TRACE("  num_chunk_offsets %d (64-bit)\n", mp4->trk->num_chunk_offsets);
+
+  if ( mp4->trk->num_chunk_offsets > (mp4->rsize - 8) / 8 ) {
+    PerlIO_printf(PerlIO_stderr(), "Unable to parse co64: too many entries\n");
+    return 0;
+  }
+
+  scan_newz(mp4->trk->chunk_offset64, mp4->trk->num_chunk_offsets, uint64_t);
+  mp4->trk->chunk_offset = NULL;
+
+  for (i = 0; i < mp4->trk->num_chunk_offsets; i++) {
+    mp4->trk->chunk_offset64[i] = buffer_get_int64(mp4->buf);
+  }
+
+  return 1;
+}
+
+// Overall duration of a fragmented file, in the movie timescale
+uint8_t
+_mp4_parse_mehd(mp4info *mp4)
+{
+  uint8_t version;
+
+  if ( !_check_buf(mp4->infile, mp4->buf, mp4->rsize, MP4_BLOCK_SIZE) ) {
+    return 0;
+  }
+
+  if (mp4->rsize < 8) {
+    return 0;
+  }
+
+  version = buffer_get_char(mp4->buf);
+  buffer_consume(mp4->buf, 3); // flags
+
+  if (version == 1) {
+    if (mp4->rsize < 12) {
+      return 0;
+    }
+
+    mp4->mehd_duration = buffer_get_int64(mp4->buf);
+    buffer_consume(mp4->buf, mp4->rsize - 12);
+  }
+  else {
+    mp4->mehd_duration = buffer_get_int(mp4->buf);
+    buffer_consume(mp4->buf, mp4->rsize - 8);
+  }
+
+  DEBUG_TRACE("  mehd duration %llu\n", mp4->mehd_duration);
+
+  return 1;
+}
+
+// Per-track defaults for fragments
+uint8_t
+_mp4_parse_trex(mp4info *mp4)
+{
+  uint32_t track_id;
+
+  if ( !_check_buf(mp4->infile, mp4->buf, mp4->rsize, MP4_BLOCK_SIZE) ) {
+    return 0;
+  }
+
+  if (mp4->rsize < 24) {
+    return 0;
+  }
+
+  // Skip version/flags
+  buffer_consume(mp4->buf, 4);
+
+  track_id = buffer_get_int(mp4->buf);
+
+  // Skip default_sample_description_index
+  buffer_consume(mp4->buf, 4);
+
+  if ( !mp4->frag_track || track_id == mp4->frag_track ) {
+    mp4->trex_duration = buffer_get_int(mp4->buf);
+    DEBUG_TRACE("  trex track %d default duration %d\n", track_id, mp4->trex_duration);
+  }
+  else {
+    buffer_consume(mp4->buf, 4);
+  }
+
+  // Skip default size and flags
+  buffer_consume(mp4->buf, mp4->rsize - 16);
+
+  return 1;
+}
+
+uint8_t
+_mp4_parse_tfhd(mp4info *mp4)
+{
+  uint32_t flags;
+  uint32_t need = 8;
+  uint32_t used = 8;
+
+  if ( !_check_buf(mp4->infile, mp4->buf, mp4->rsize, MP4_BLOCK_SIZE) ) {
+    return 0;
+  }
+
+  if (mp4->rsize < 8) {
     return 0;
   }
 
-  return 1;
-}
+  flags = buffer_get_int(mp4->buf) & 0xffffff;
 
-uint8_t
-_mp4_parse_alac(mp4info *mp4)
-{
-  HV *trackinfo = _mp4_get_current_trackinfo(mp4);
+  mp4->traf_track = buffer_get_int(mp4->buf);
 
-  if ( !_check_buf(mp4->infile, mp4->buf, 28, MP4_BLOCK_SIZE) ) {
+  if (flags & 0x1)  need += 8; // base_data_offset
+  if (flags & 0x2)  need += 4; // sample_description_index
+  if (flags & 0x8)  need += 4; // default_sample_duration
+  if (flags & 0x10) need += 4; // default_sample_size
+  if (flags & 0x20) need += 4; // default_sample_flags
+
+  if (mp4->rsize < need) {
     return 0;
   }
 
-  my_hv_store( trackinfo, "encoding", newSVpvn("alac", 4) );
-
-  // Skip reserved
-  buffer_consume(mp4->buf, 16);
+  if (flags & 0x1) {
+    buffer_consume(mp4->buf, 8);
+    used += 8;
+  }
 
-  mp4->channels = buffer_get_short(mp4->buf);
-  my_hv_store( trackinfo, "channels", newSVuv(mp4->channels) );
-  my_hv_store( trackinfo, "bits_per_sample", newSVuv( buffer_get_short(mp4->buf) ) );
+  if (flags & 0x2) {
+    buffer_consume(mp4->buf, 4);
+    used += 4;
+  }
 
-  // Skip reserved
-  buffer_consume(mp4->buf, 4);
+  if (flags & 0x8) {
+    mp4->traf_duration = buffer_get_int(mp4->buf);
+    used += 4;
+  }
 
-  // Skip bogus samplerate
-  buffer_consume(mp4->buf, 2);
+  DEBUG_TRACE("  tfhd track %d default duration %d\n", mp4->traf_track, mp4->traf_duration);
 
-  // Skip reserved
-  buffer_consume(mp4->buf, 2);
+  // Skip default size/flags
+  buffer_consume(mp4->buf, mp4->rsize - used);
 
   return 1;
 }
 
+// Decode time of the first sample in the fragment
 uint8_t
-_mp4_parse_stts(mp4info *mp4)
+_mp4_parse_tfdt(mp4info *mp4)
 {
-  int i;
+  uint8_t version;
+  uint64_t time;
 
   if ( !_check_buf(mp4->infile, mp4->buf, mp4->rsize, MP4_BLOCK_SIZE) ) {
     return 0;
   }
 
-  // Skip version/flags
-  buffer_consume(mp4->buf, 4);
+  if (mp4->rsize < 8) {
+    return 0;
+  }
 
-  mp4->num_time_to_samples = buffer_get_int(mp4->buf);
-  DEBUG_TRACE("  num_time_to_samples %d\n", mp4->num_time_to_samples);
+  version = buffer_get_char(mp4->buf);
+  buffer_consume(mp4->buf, 3); // flags
 
-  New(0,
-    mp4->time_to_sample,
-    mp4->num_time_to_samples * sizeof(*mp4->time_to_sample),
-    struct tts
-  );
+  if (version == 1) {
+    if (mp4->rsize < 12) {
+      return 0;
+    }
 
-  if ( !mp4->time_to_sample ) {
-    PerlIO_printf(PerlIO_stderr(), "Unable to parse stts: too large\n");
-    return 0;
+    time = buffer_get_int64(mp4->buf);
+    buffer_consume(mp4->buf, mp4->rsize - 12);
+  }
+  else {
+    time = buffer_get_int(mp4->buf);
+    buffer_consume(mp4->buf, mp4->rsize - 8);
   }
 
-  for (i = 0; i < mp4->num_time_to_samples; i++) {
-    mp4->time_to_sample[i].sample_count    = buffer_get_int(mp4->buf);
-    mp4->time_to_sample[i].sample_duration = buffer_get_int(mp4->buf);
-
-    DEBUG_TRACE(
-      "  sample_count %d sample_duration %d\n",
-      mp4->time_to_sample[i].sample_count,
-      mp4->time_to_sample[i].sample_duration
-    );
+  if (mp4->traf_track == mp4->frag_track) {
+    mp4->frag_time = time;
   }
 
   return 1;
 }
 
+// Only the sample durations are used, to keep track of the time
+// each fragment starts at
 uint8_t
-_mp4_parse_stsc(mp4info *mp4)
+_mp4_parse_trun(mp4info *mp4)
 {
-  int i;
+  uint32_t flags;
+  uint32_t sample_count;
+  uint32_t fields = 8;
+  uint32_t record = 0;
+  uint32_t i;
 
   if ( !_check_buf(mp4->infile, mp4->buf, mp4->rsize, MP4_BLOCK_SIZE) ) {
     return 0;
   }
 
-  // Skip version/flags
-  buffer_consume(mp4->buf, 4);
+  if (mp4->rsize < 8) {
+    return 0;
+  }
 
-  mp4->num_sample_to_chunks = buffer_get_int(mp4->buf);
-  DEBUG_TRACE("  num_sample_to_chunks %d\n", mp4->num_sample_to_chunks);
+  flags = buffer_get_int(mp4->buf) & 0xffffff;
+  sample_count = buffer_get_int(mp4->buf);
 
-  New(0,
-    mp4->sample_to_chunk,
-    mp4->num_sample_to_chunks * sizeof(*mp4->sample_to_chunk),
-    struct stc
-  );
+  if (flags & 0x1)   fields += 4; // data_offset
+  if (flags & 0x4)   fields += 4; // first_sample_flags
+  if (flags & 0x100) record += 4; // sample_duration
+  if (flags & 0x200) record += 4; // sample_size
+  if (flags & 0x400) record += 4; // sample_flags
+  if (flags & 0x800) record += 4; // sample_composition_time_offset
 
-  if ( !mp4->sample_to_chunk ) {
-    PerlIO_printf(PerlIO_stderr(), "Unable to parse stsc: too large\n");
+  if ( mp4->rsize < fields || (record && sample_count > (mp4->rsize - fields) / record) ) {
+    PerlIO_printf(PerlIO_stderr(), "Unable to parse trun: too many entries\n");
     return 0;
   }
 
-  for (i = 0; i < mp4->num_sample_to_chunks; i++) {
-    mp4->sample_to_chunk[i].first_chunk = buffer_get_int(mp4->buf);
-    mp4->sample_to_chunk[i].samples_per_chunk = buffer_get_int(mp4->buf);
+  buffer_consume(mp4->buf, fields - 8);
 
-    // Skip sample desc index
-    buffer_consume(mp4->buf, 4);
+  if (mp4->traf_track != mp4->frag_track) {
+    buffer_consume(mp4->buf, mp4->rsize - fields);
+    return 1;
+  }
 
-    DEBUG_TRACE("  first_chunk %d samples_per_chunk %d\n",
-      mp4->sample_to_chunk[i].first_chunk,
-      mp4->sample_to_chunk[i].samples_per_chunk
-    );
+  // The first run of the track in each moof starts a fragment
+  if ( !mp4->moof_has_track ) {
+    mp4->moof_has_track = 1;
+
+    if ( mp4->seeking && !mp4->frags_from_mfra ) {
+      _mp4_add_frag(mp4, mp4->frag_time, mp4->moof_offset);
+    }
+  }
+
+  if (flags & 0x100) {
+    for (i = 0; i < sample_count; i++) {
+      mp4->frag_time += buffer_get_int(mp4->buf);
+      buffer_consume(mp4->buf, record - 4);
+    }
+
+    buffer_consume(mp4->buf, mp4->rsize - fields - (uint64_t)sample_count * record);
+  }
+  else {
+    mp4->frag_time += (uint64_t)sample_count * mp4->traf_duration;
+    buffer_consume(mp4->buf, mp4->rsize - fields);
   }
 
   return 1;
 }
 
-uint8_t
-_mp4_parse_stsz(mp4info *mp4)
+// Start the sample tables of a new trak, they are read into mp4->trk
+void
+_mp4_add_track(mp4info *mp4)
 {
-  int i;
+  if (mp4->num_tracks == mp4->max_tracks) {
+    mp4_track **tracks;
 
-  if ( !_check_buf(mp4->infile, mp4->buf, mp4->rsize, MP4_BLOCK_SIZE) ) {
-    return 0;
-  }
+    mp4->max_tracks = mp4->max_tracks ? mp4->max_tracks * 2 : 4;
+    scan_newz(tracks, mp4->max_tracks, mp4_track *);
 
-  // Skip version/flags
-  buffer_consume(mp4->buf, 4);
+    if (mp4->num_tracks) {
+      memcpy(tracks, mp4->tracks, mp4->num_tracks * sizeof(mp4_track *));
+    }
 
-  // Check sample size is 0
-  if ( buffer_get_int(mp4->buf) != 0 ) {
-    DEBUG_TRACE("  stsz uses fixed sample size\n");
-    buffer_consume(mp4->buf, 4);
-    return 1;
+    mp4->tracks = tracks;
   }
 
-  mp4->num_sample_byte_sizes = buffer_get_int(mp4->buf);
+  scan_newz(mp4->trk, 1, mp4_track);
+  mp4->tracks[mp4->num_tracks++] = mp4->trk;
+}
 
-  DEBUG_TRACE("  num_sample_byte_sizes %d\n", mp4->num_sample_byte_sizes);
+// The track to seek in: the one with id seek_track, or else the first audio
+// track with sample tables. Also totals the size of the others, which are
+// left out of the seek header.
+mp4_track *
+_mp4_select_track(mp4info *mp4)
+{
+  mp4_track *trk = NULL;
+  uint32_t i;
 
-  New(0,
-    mp4->sample_byte_size,
-    mp4->num_sample_byte_sizes * sizeof(*mp4->sample_byte_size),
-    uint16_t
-  );
+  for (i = 0; i < mp4->num_tracks; i++) {
+    mp4_track *t = mp4->tracks[i];
 
-  if ( !mp4->sample_byte_size ) {
-    PerlIO_printf(PerlIO_stderr(), "Unable to parse stsz: too large\n");
-    return 0;
+    if (mp4->seek_track) {
+      if (t->id == mp4->seek_track) {
+        trk = t;
+        break;
+      }
+    }
+    else if (t->is_audio && t->num_time_to_samples) {
+      trk = t;
+      break;
+    }
   }
 
-  for (i = 0; i < mp4->num_sample_byte_sizes; i++) {
-    uint32_t v = buffer_get_int(mp4->buf);
+  // Not an audio file as far as the handlers go, try the first track
+  if ( !trk && !mp4->seek_track && mp4->num_tracks ) {
+    trk = mp4->tracks[0];
+  }
 
-    if (v > 0x0000ffff) {
-      DEBUG_TRACE("stsz[%d] > 65 kB (%ld)\n", i, (long)v);
-      return 0;
+  mp4->dropped_size = 0;
+
+  for (i = 0; i < mp4->num_tracks; i++) {
+    if (mp4->tracks[i] != trk) {
+      mp4->dropped_size += mp4->tracks[i]->trak_size;
     }
+  }
+
+  DEBUG_TRACE("Seeking in track %d of %d\n", trk ? trk->id : 0, mp4->num_tracks);
+
+  return trk;
+}
+
+void
+_mp4_add_frag(mp4info *mp4, uint64_t time, uint64_t offset)
+{
+  if (mp4->num_frags == mp4->max_frags) {
+    struct mp4_frag *frags;
 
-    mp4->sample_byte_size[i] = v;
+    mp4->max_frags = mp4->max_frags ? mp4->max_frags * 2 : 64;
+    scan_newz(frags, mp4->max_frags, struct mp4_frag);
 
-    //DEBUG_TRACE("  sample_byte_size %d\n", v);
+    if (mp4->num_frags) {
+      memcpy(frags, mp4->frags, mp4->num_frags * sizeof(struct mp4_frag));
+    }
+
+    mp4->frags = frags;
   }
 
-  return 1;
+  mp4->frags[mp4->num_frags].time   = time;
+  mp4->frags[mp4->num_frags].offset = offset;
+  mp4->num_frags++;
 }
 
-uint8_t
-_mp4_parse_stco(mp4info *mp4)
+// Load the fragment index from the mfra box at the end of the file,
+// located through the mfro box which must be the last 16 bytes.
+// Leaves frags empty if there is no usable index.
+void
+_mp4_load_mfra(mp4info *mp4)
 {
-  int i;
+  Buffer buf;
+  off_t saved = PerlIO_tell(mp4->infile);
+  uint32_t mfra_size;
+  uint32_t box_size;
 
-  if ( !_check_buf(mp4->infile, mp4->buf, mp4->rsize, MP4_BLOCK_SIZE) ) {
-    return 0;
+  if (mp4->file_size < 16 + 8) {
+    return;
   }
 
-  // Skip version/flags
-  buffer_consume(mp4->buf, 4);
+  buffer_init(&buf, 16);
+
+  PerlIO_seek(mp4->infile, mp4->file_size - 16, SEEK_SET);
 
-  mp4->num_chunk_offsets = buffer_get_int(mp4->buf);
-  DEBUG_TRACE("  num_chunk_offsets %d\n", mp4->num_chunk_offsets);
+  if ( !_check_buf(mp4->infile, &buf, 16, 16) ) {
+    goto out;
+  }
+
+  if ( buffer_get_int(&buf) != 16 || !FOURCC_EQ((char *)buffer_ptr(&buf), "mfro") ) {
+    DEBUG_TRACE("  no mfro box, hopping fragments\n");
+    goto out;
+  }
 
-  New(0,
-    mp4->chunk_offset,
-    mp4->num_chunk_offsets * sizeof(*mp4->chunk_offset),
-    uint32_t
-  );
+  // Skip type and version/flags
+  buffer_consume(&buf, 8);
 
-  if ( !mp4->chunk_offset ) {
-    PerlIO_printf(PerlIO_stderr(), "Unable to parse stco: too large\n");
-    return 0;
+  mfra_size = buffer_get_int(&buf);
+
+  if (mfra_size < 8 + 16 || mfra_size > mp4->file_size - mp4->first_moof) {
+    goto out;
   }
 
-  for (i = 0; i < mp4->num_chunk_offsets; i++) {
-    mp4->chunk_offset[i] = buffer_get_int(mp4->buf);
+  buffer_clear(&buf);
+  PerlIO_seek(mp4->infile, mp4->file_size - mfra_size, SEEK_SET);
 
-    //DEBUG_TRACE("  chunk_offset %d\n", mp4->chunk_offset[i]);
+  if ( !_check_buf(mp4->infile, &buf, mfra_size, mfra_size) ) {
+    goto out;
   }
 
-  return 1;
+  if ( !FOURCC_EQ((char *)buffer_ptr(&buf) + 4, "mfra") ) {
+    goto out;
+  }
+
+  buffer_consume(&buf, 8);
+
+  // The trailing mfro is not a tfra, leave it be
+  while ( buffer_len(&buf) > 16 ) {
+    uint8_t version;
+    uint32_t track_id;
+    uint32_t lengths;
+    uint32_t num_entries;
+    uint32_t entry_size;
+    uint32_t skip;
+    uint32_t i;
+
+    box_size = buffer_get_int(&buf);
+
+    if (box_size < 8 || box_size - 4 > buffer_len(&buf)) {
+      break;
+    }
+
+    if ( !FOURCC_EQ((char *)buffer_ptr(&buf), "tfra") || box_size < 24 ) {
+      buffer_consume(&buf, box_size - 4);
+      continue;
+    }
+
+    buffer_consume(&buf, 4);
+
+    version = buffer_get_char(&buf);
+    buffer_consume(&buf, 3); // flags
+
+    track_id    = buffer_get_int(&buf);
+    lengths     = buffer_get_int(&buf);
+    num_entries = buffer_get_int(&buf);
+
+    if (track_id != mp4->frag_track) {
+      buffer_consume(&buf, box_size - 24);
+      continue;
+    }
+
+    // traf, trun and sample numbers are 1-4 bytes each
+    skip = ((lengths >> 4) & 0x3) + ((lengths >> 2) & 0x3) + (lengths & 0x3) + 3;
+    entry_size = (version == 1 ? 16 : 8) + skip;
+
+    if ( num_entries > (box_size - 24) / entry_size ) {
+      break;
+    }
+
+    DEBUG_TRACE("  tfra track %d, %d entries\n", track_id, num_entries);
+
+    for (i = 0; i < num_entries; i++) {
+      uint64_t time;
+      uint64_t offset;
+
+      if (version == 1) {
+        time   = buffer_get_int64(&buf);
+        offset = buffer_get_int64(&buf);
+      }
+      else {
+        time   = buffer_get_int(&buf);
+        offset = buffer_get_int(&buf);
+      }
+
+      buffer_consume(&buf, skip);
+
+      // Several random access points may share a moof, keep the first
+      if ( mp4->num_frags && offset == mp4->frags[mp4->num_frags - 1].offset ) {
+        continue;
+      }
+
+      if ( offset >= mp4->file_size
+        || offset < mp4->first_moof
+        || ( mp4->num_frags && offset < mp4->frags[mp4->num_frags - 1].offset )
+      ) {
+        DEBUG_TRACE("  bad tfra entry, ignoring index\n");
+        mp4->num_frags = 0;
+        goto out;
+      }
+
+      _mp4_add_frag(mp4, time, offset);
+    }
+
+    break;
+  }
+
+out:
+  mp4->frags_from_mfra = mp4->num_frags > 0;
+
+  buffer_free(&buf);
+  PerlIO_seek(mp4->infile, saved, SEEK_SET);
 }
 
 uint8_t
@@ -1663,7 +2941,18 @@ _mp4_parse_ilst(mp4info *mp4)
 
     upcase(key);
 
-    if ( FOURCC_EQ(key, "----") ) {
+    if ( _offsets_option() && !FOURCC_EQ(key, "----") ) {
+      if ( !_mp4_ilst_offset(mp4, (unsigned char)key[0] == 0xA9 ? key + 1 : key, mp4->audio_offset + (mp4->size - mp4->rsize) + 8, size - 8) ) {
+        return 0;
+      }
+    }
+
+    // Text tags are stored without the copyright symbol
+    if ( !FOURCC_EQ(key, "----") && !_tag_wanted( (unsigned char)key[0] == 0xA9 ? key + 1 : key, -1 ) ) {
+      DEBUG_TRACE("    not requested, skipping\n");
+      _mp4_skip(mp4, size - 8);
+    }
+    else if ( FOURCC_EQ(key, "----") ) {
       // user-specified key/value pair
       if ( !_mp4_parse_ilst_custom(mp4, size - 8) ) {
         return 0;
@@ -1702,7 +2991,39 @@ _mp4_parse_ilst(mp4info *mp4)
 
         SvREFCNT_dec(skey);
 
-        // XXX: bug 14476, files with multiple COVR images aren't handled here, just skipped for now
+        // XXX: bug 14476, files with multiple COVR images only return the first one as
+        // a tag. When skipping artwork the others are recorded for get_artwork
+        if ( FOURCC_EQ(key, "COVR") && mp4->no_artwork ) {
+          uint64_t offset = mp4->audio_offset + (mp4->size - mp4->rsize) + 8 + bsize;
+          uint32_t left = size - 8 - bsize;
+
+          while (left >= 16) {
+            uint32_t dsize;
+
+            if ( !_check_buf(mp4->infile, mp4->buf, 8, MP4_BLOCK_SIZE) ) {
+              return 0;
+            }
+
+            dsize = buffer_get_int(mp4->buf);
+
+            if ( dsize < 16 || dsize > left || !FOURCC_EQ((char *)buffer_ptr(mp4->buf), "data") ) {
+              buffer_consume(mp4->buf, 4);
+              left -= 8;
+              break;
+            }
+
+            buffer_consume(mp4->buf, 4);
+            _mp4_skip(mp4, dsize - 8);
+
+            _mp4_add_cover(mp4, offset + 16, dsize - 16);
+
+            offset += dsize;
+            left   -= dsize;
+          }
+
+          bsize = size - 8 - left;
+        }
+
         if ( bsize < size - 8 ) {
           DEBUG_TRACE("    skipping rest of box, %d\n", size - 8 - bsize );
           _mp4_skip(mp4, size - 8 - bsize);
@@ -1728,11 +3049,15 @@ _mp4_parse_ilst_data(mp4info *mp4, uint32_t size, SV *key)
   SV *value;
 
   ckey = (unsigned char *)SvPVX(key);
-  if ( FOURCC_EQ(ckey, "COVR") && _env_true("AUDIO_SCAN_NO_ARTWORK") ) {
+  if ( FOURCC_EQ(ckey, "COVR") && mp4->no_artwork ) {
     // Skip artwork if requested and avoid the memory cost
+    uint64_t offset = mp4->audio_offset + (mp4->size - mp4->rsize) + 24;
+
     value = newSVuv(size - 8);
 
-    my_hv_store( mp4->tags, "COVR_offset", newSVuv(mp4->audio_offset + (mp4->size - mp4->rsize) + 24) );
+    my_hv_store( mp4->tags, "COVR_offset", newSVuv(offset) );
+
+    _mp4_add_cover(mp4, offset, size - 8);
 
     _mp4_skip(mp4, size);
   }
@@ -1849,15 +3174,50 @@ _mp4_parse_ilst_data(mp4info *mp4, uint32_t size, SV *key)
   return 1;
 }
 
+void
+_mp4_add_cover(mp4info *mp4, uint64_t offset, uint32_t length)
+{
+  // Not all there in a truncated file
+  if (offset + length > mp4->file_size) {
+    return;
+  }
+
+  if (mp4->num_covers == mp4->max_covers) {
+    struct mp4_cover *covers;
+
+    mp4->max_covers = mp4->max_covers ? mp4->max_covers * 2 : 4;
+    scan_newz(covers, mp4->max_covers, struct mp4_cover);
+
+    if (mp4->num_covers) {
+      memcpy(covers, mp4->covers, mp4->num_covers * sizeof(struct mp4_cover));
+    }
+
+    mp4->covers = covers;
+  }
+
+  mp4->covers[mp4->num_covers].offset = offset;
+  mp4->covers[mp4->num_covers].length = length;
+  mp4->num_covers++;
+}
+
 uint8_t
 _mp4_parse_ilst_custom(mp4info *mp4, uint32_t size)
 {
   SV *key = NULL;
+  uint64_t offset = mp4->audio_offset + (mp4->size - mp4->rsize) + 8 + size;
 
   while (size) {
     char type[5];
     uint32_t bsize;
 
+    // The name box comes first, so the key is known by the time of the data box
+    if ( key && _offsets_option() ) {
+      if ( !_mp4_ilst_offset(mp4, SvPVX(key), offset - size, size) ) {
+        SvREFCNT_dec(key);
+        return 0;
+      }
+    }
+
     // Ensure we have 8 bytes to get the size and type
     if ( !_check_buf(mp4->infile, mp4->buf, 8, MP4_BLOCK_SIZE) ) {
       return 0;
@@ -1891,7 +3251,16 @@ _mp4_parse_ilst_custom(mp4info *mp4, uint32_t size)
         return 0;
       }
 
-      if ( !_mp4_parse_ilst_data(mp4, bsize - 8, key) ) {
+      // Gapless info is needed even if the tag itself isn't
+      if ( !strcmp(SvPVX(key), "ITUNSMPB") ) {
+        _mp4_parse_smpb(mp4, bsize - 8);
+      }
+
+      if ( !_tag_wanted(SvPVX(key), sv_len(key)) ) {
+        DEBUG_TRACE("      not requested, skipping\n");
+        _mp4_skip(mp4, bsize - 8);
+      }
+      else if ( !_mp4_parse_ilst_data(mp4, bsize - 8, key) ) {
         SvREFCNT_dec(key);
         return 0;
       }
@@ -1913,6 +3282,69 @@ _mp4_parse_ilst_custom(mp4info *mp4, uint32_t size)
   return 1;
 }
 
+// With the offsets option, record where the value of the ilst data box at the
+// front of the buffer lies in the file.  offset is where the box starts and
+// size how much of its parent is left
+uint8_t
+_mp4_ilst_offset(mp4info *mp4, char const *name, uint64_t offset, uint32_t size)
+{
+  unsigned char *bptr;
+  uint32_t bsize;
+
+  if (size < 16) {
+    return 1;
+  }
+
+  if ( !_check_buf(mp4->infile, mp4->buf, 16, MP4_BLOCK_SIZE) ) {
+    return 0;
+  }
+
+  bptr  = buffer_ptr(mp4->buf);
+  bsize = (bptr[0] << 24) | (bptr[1] << 16) | (bptr[2] << 8) | bptr[3];
+
+  // Type 1 is UTF-8 text, everything else is left to the caller
+  if ( FOURCC_EQ(bptr + 4, "data") && bsize >= 16 && bsize <= size ) {
+    _store_tag_offset(mp4->info, name, offset + 16, bsize - 16, bptr[11] == 1 ? "utf8" : "binary");
+  }
+
+  return 1;
+}
+
+// iTunSMPB is a string of hex values, the 2nd to 4th are the encoder
+// delay, the padding and the length of the original audio, in samples:
+// " 00000000 00000840 000001E4 00000000000001DC 00000000 ..."
+void
+_mp4_parse_smpb(mp4info *mp4, uint32_t size)
+{
+  char smpb[64];
+  uint32_t len;
+  unsigned int delay;
+  unsigned int padding;
+  unsigned long long samples;
+
+  // Version/flags and reserved, then the text
+  if ( size <= 8 || !_check_buf(mp4->infile, mp4->buf, size, MP4_BLOCK_SIZE) ) {
+    return;
+  }
+
+  len = size - 8;
+  if (len > sizeof(smpb) - 1) {
+    len = sizeof(smpb) - 1;
+  }
+
+  memcpy(smpb, (char *)buffer_ptr(mp4->buf) + 8, len);
+  smpb[len] = '\0';
+
+  if ( sscanf(smpb, "%*x %x %x %llx", &delay, &padding, &samples) == 3 ) {
+    DEBUG_TRACE("      iTunSMPB delay %u, padding %u, samples %llu\n", delay, padding, samples);
+
+    mp4->has_smpb     = 1;
+    mp4->smpb_delay   = delay;
+    mp4->smpb_padding = padding;
+    mp4->smpb_samples = samples;
+  }
+}
+
 HV *
 _mp4_get_current_trackinfo(mp4info *mp4)
 {
@@ -1984,44 +3416,88 @@ _mp4_skip(mp4info *mp4, uint32_t size)
 uint32_t
 _mp4_samples_in_chunk(mp4info *mp4, uint32_t chunk)
 {
-  int i;
+  return mp4->trk->sample_to_chunk[ _mp4_stsc_entry(mp4, chunk) ].samples_per_chunk;
+}
 
-  for (i = mp4->num_sample_to_chunks - 1; i >= 0; i--) {
-    if (mp4->sample_to_chunk[i].first_chunk <= chunk) {
-      return mp4->sample_to_chunk[i].samples_per_chunk;
-    }
-  }
+uint32_t
+_mp4_total_samples(mp4info *mp4)
+{
+  return mp4->trk->stts_first_sample[mp4->trk->num_time_to_samples];
+}
+
+uint32_t
+_mp4_sample_size(mp4info *mp4, uint32_t sample)
+{
+  if (mp4->trk->sample_byte_size)
+    return mp4->trk->sample_byte_size[sample];
+
+  if (mp4->trk->sample_byte_size32)
+    return mp4->trk->sample_byte_size32[sample];
+
+  return mp4->trk->sample_size;
+}
+
+// chunk starts from 0 here, unlike in the seek code
+uint64_t
+_mp4_chunk_offset(mp4info *mp4, uint32_t chunk)
+{
+  if (mp4->trk->chunk_offset64)
+    return mp4->trk->chunk_offset64[chunk];
 
-  return mp4->sample_to_chunk[0].samples_per_chunk;
+  return mp4->trk->chunk_offset[chunk];
 }
 
 uint32_t
-_mp4_total_samples(mp4info *mp4)
+_mp4_get_sample_duration(mp4info *mp4, uint32_t sample)
 {
-  int i;
-  uint32_t total = 0;
+  uint32_t i = _mp4_stts_entry(mp4, sample);
+
+  if (i == mp4->trk->num_time_to_samples)
+    return 0;
+
+  return mp4->trk->time_to_sample[i].sample_duration;
+}
+
+// Returns the stts entry holding sample, or num_time_to_samples if
+// sample is past the end
+uint32_t
+_mp4_stts_entry(mp4info *mp4, uint32_t sample)
+{
+  uint32_t lo = 0;
+  uint32_t hi = mp4->trk->num_time_to_samples;
+
+  if (sample >= mp4->trk->stts_first_sample[hi])
+    return hi;
+
+  // Empty entries start where the next one does, so taking the last
+  // entry that starts at or before sample passes over them
+  while (hi - lo > 1) {
+    uint32_t mid = lo + (hi - lo) / 2;
 
-  for (i = 0; i < mp4->num_time_to_samples; i++) {
-    total += mp4->time_to_sample[i].sample_count;
+    if (mp4->trk->stts_first_sample[mid] <= sample)
+      lo = mid;
+    else
+      hi = mid;
   }
 
-  return total;
+  return lo;
 }
 
+// Returns the last stsc entry starting at or before chunk (from 1)
 uint32_t
-_mp4_get_sample_duration(mp4info *mp4, uint32_t sample)
+_mp4_stsc_entry(mp4info *mp4, uint32_t chunk)
 {
-  int i;
-  uint32_t co = 0;
+  uint32_t lo = 0;
+  uint32_t hi = mp4->trk->num_sample_to_chunks;
 
-  for (i = 0; i < mp4->num_time_to_samples; i++) {
-    uint32_t delta = mp4->time_to_sample[i].sample_count;
-    if (sample < co + delta) {
-      return mp4->time_to_sample[i].sample_duration;
-    }
+  while (hi - lo > 1) {
+    uint32_t mid = lo + (hi - lo) / 2;
 
-    co += delta;
+    if (mp4->trk->sample_to_chunk[mid].first_chunk <= chunk)
+      lo = mid;
+    else
+      hi = mid;
   }
 
-  return 0;
+  return lo;
 }
@@ -272,7 +272,7 @@ get_mpcfileinfo(PerlIO *infile, char *file, HV *info)
 
   mpc_streaminfo *si;
 
-  Newz(0, si, sizeof(mpc_streaminfo), mpc_streaminfo);
+  scan_newz(si, 1, mpc_streaminfo);
   buffer_init(&buf, MPC_BLOCK_SIZE);
 
   si->buf    = &buf;
@@ -353,7 +353,6 @@ get_mpcfileinfo(PerlIO *infile, char *file, HV *info)
   }
 
 out:
-  Safefree(si);
   buffer_free(&buf);
 
   return ret;
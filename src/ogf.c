@@ -113,8 +113,8 @@ _ogf_parse(PerlIO *infile, char *file, HV *info, HV *tags, uint8_t seeking)
   unsigned char TOC_byte = 0;
 
   flacinfo *flac;
-  Newz(0, flac, sizeof(flacinfo), flacinfo);
-  Newz(0, flac->buf, sizeof(Buffer), Buffer);
+  scan_newz(flac, 1, flacinfo);
+  scan_newz(flac->buf, 1, Buffer);
 
   flac->infile         = infile;
   flac->file           = file;
@@ -318,7 +318,7 @@ _ogf_parse(PerlIO *infile, char *file, HV *info, HV *tags, uint8_t seeking)
 
         if (type == FLAC_TYPE_VORBIS_COMMENT) {
           DEBUG_TRACE("Parsing vorbis_comment\n");
-          _parse_vorbis_comments(infile, flac->buf, tags, 0);
+          _parse_vorbis_comments(infile, flac->buf, tags, 0, NULL, info);
         } else if (type == FLAC_TYPE_PICTURE) {
           DEBUG_TRACE("Parsing picture\n");
           if (!_flac_parse_picture(flac)) {
@@ -428,7 +428,6 @@ out:
   buffer_free(&ogg_buf);
 
   buffer_free(flac->buf);
-  Safefree(flac->buf);
 
   DEBUG_TRACE("Err %d\n", err);
   return err;
@@ -457,16 +456,37 @@ out:
 
 static off_t
 _ogf_find_frame(PerlIO *infile, char *file, int offset, HV *info, HV *tags)
+{
+  DEBUG_TRACE("Find_frame %d in %s\n", offset, file);
+
+  // We need to read all metadata first to get some data we need to calculate
+  if ( ogf_seek_open(infile, file, info, tags) == NULL ) {
+    return -1;
+  }
+
+  return ogf_seek(info, infile, file, info, offset);
+}
+
+// Everything ogf_seek needs ends up in info, which doubles as the state
+void *
+ogf_seek_open(PerlIO *infile, char *file, HV *info, HV *tags)
+{
+  if ( _ogf_parse(infile, file, info, tags, 1) != 0 ) {
+    return NULL;
+  }
+
+  return info;
+}
+
+off_t
+ogf_seek(void *state, PerlIO *infile, char *file, HV *info, int offset)
 {
   int frame_offset = -1;
   uint32_t samplerate;
   uint32_t song_length_ms;
   uint64_t target_sample;
 
-  DEBUG_TRACE("Find_frame %d in %s\n", offset, file);
-
-  // We need to read all metadata first to get some data we need to calculate
-  if ( _ogf_parse(infile, file, info, tags, 1) != 0 ) {
+  if (offset < 0) {
     goto out;
   }
 
@@ -56,12 +56,19 @@ _ogg_parse(PerlIO *infile, char *file, HV *info, HV *tags, uint8_t seeking)
 
   unsigned char vorbis_type = 0;
 
+  // Where the bytes in vorbis_buf came from, for the offsets option
+  offsetmap *map = NULL;
+
   int i;
   int err = 0;
 
   buffer_init(&ogg_buf, OGG_BLOCK_SIZE);
   buffer_init(&vorbis_buf, 0);
 
+  if ( _offsets_option() ) {
+    scan_newz(map, 1, offsetmap);
+  }
+
   file_size = _file_size(infile);
   my_hv_store( info, "file_size", newSVuv(file_size) );
 
@@ -162,7 +169,7 @@ _ogg_parse(PerlIO *infile, char *file, HV *info, HV *tags, uint8_t seeking)
 
       // Parse comments, but only if we have any extra data in the buffer
       if ( buffer_len(&vorbis_buf) > 0 ) {
-        _parse_vorbis_comments(infile, &vorbis_buf, tags, 1);
+        _parse_vorbis_comments(infile, &vorbis_buf, tags, 1, map, info);
         DEBUG_TRACE("  parsed vorbis comments\n");
       }
 
@@ -208,6 +215,11 @@ _ogg_parse(PerlIO *infile, char *file, HV *info, HV *tags, uint8_t seeking)
 
     audio_offset += pagelen;
 
+    if (map) {
+      _offset_map_add(map, map->len, audio_offset - pagelen);
+      map->len += pagelen;
+    }
+
     // Copy page into vorbis buffer
     buffer_append( &vorbis_buf, buffer_ptr(&ogg_buf), pagelen );
     DEBUG_TRACE("  Read %d into vorbis buffer\n", pagelen);
@@ -356,8 +368,85 @@ out:
   return 0;
 }
 
+// Whether a comment's key is in the requested tags projection,
+// pictures are returned as ALLPICTURES
+static int
+_vorbis_comment_wanted(char *comment, unsigned int len)
+{
+  char *half = memchr(comment, '=', len);
+  int klen;
+
+  if (half == NULL) {
+    // Let _split_vorbis_comment report it
+    return 1;
+  }
+
+  klen = half - comment;
+
+  if (
+#ifdef _MSC_VER
+    (klen == 22 && !strnicmp(comment, "METADATA_BLOCK_PICTURE", 22))
+    || (klen == 8 && !strnicmp(comment, "COVERART", 8))
+#else
+    (klen == 22 && !strncasecmp(comment, "METADATA_BLOCK_PICTURE", 22))
+    || (klen == 8 && !strncasecmp(comment, "COVERART", 8))
+#endif
+  ) {
+    return _tag_wanted("ALLPICTURES", 11);
+  }
+
+  return _tag_wanted(comment, klen);
+}
+
+// With the offsets option, record where the value of the comment at the
+// front of vorbis_buf lies in the file.  The map positions count every byte
+// added to vorbis_buf, so the front of the buffer is at map->len - buffer_len
+static void
+_vorbis_comment_offset(offsetmap *map, Buffer *vorbis_buf, HV *info, char *comment, unsigned int len)
+{
+  char *half = memchr(comment, '=', len);
+  char *key;
+  int klen;
+  off_t offset;
+  uint64_t length;
+  char encoding[16];
+
+  if (half == NULL)
+    return;
+
+  klen = half - comment;
+
+  strcpy(encoding, "ogg+");
+  if ( _offset_map_range(map, map->len - buffer_len(vorbis_buf) + klen + 1, len - klen - 1, &offset, &length) ) {
+    encoding[0] = 0;
+  }
+
+  if (
+#ifdef _MSC_VER
+    (klen == 22 && !strnicmp(comment, "METADATA_BLOCK_PICTURE", 22))
+    || (klen == 8 && !strnicmp(comment, "COVERART", 8))
+#else
+    (klen == 22 && !strncasecmp(comment, "METADATA_BLOCK_PICTURE", 22))
+    || (klen == 8 && !strncasecmp(comment, "COVERART", 8))
+#endif
+  ) {
+    strcat(encoding, "base64");
+  }
+  else {
+    strcat(encoding, "utf8");
+  }
+
+  New(0, key, klen + 1, char);
+  Move(comment, key, klen, char);
+  key[klen] = '\0';
+
+  _store_tag_offset(info, upcase(key), offset, length, encoding);
+
+  Safefree(key);
+}
+
 void
-_parse_vorbis_comments(PerlIO *infile, Buffer *vorbis_buf, HV *tags, int has_framing)
+_parse_vorbis_comments(PerlIO *infile, Buffer *vorbis_buf, HV *tags, int has_framing, offsetmap *map, HV *info)
 {
   unsigned int len;
   unsigned int num_comments;
@@ -386,6 +475,15 @@ _parse_vorbis_comments(PerlIO *infile, Buffer *vorbis_buf, HV *tags, int has_fra
 
     bptr = buffer_ptr(vorbis_buf);
 
+    if (map) {
+      _vorbis_comment_offset(map, vorbis_buf, info, bptr, len);
+    }
+
+    if ( !_vorbis_comment_wanted(bptr, len) ) {
+      buffer_consume(vorbis_buf, len);
+      continue;
+    }
+
     if (
 #ifdef _MSC_VER
       !strnicmp(bptr, "METADATA_BLOCK_PICTURE=", 23)
@@ -503,18 +601,42 @@ _parse_vorbis_comments(PerlIO *infile, Buffer *vorbis_buf, HV *tags, int has_fra
 static off_t
 ogg_find_frame(PerlIO *infile, char *file, int offset)
 {
-  int frame_offset = -1;
-  uint32_t samplerate;
-  uint32_t song_length_ms;
-  uint64_t target_sample;
+  off_t frame_offset = -1;
 
   // We need to read all metadata first to get some data we need to calculate
   HV *info = newHV();
   HV *tags = newHV();
+
+  if ( ogg_seek_open(infile, file, info, tags) != NULL ) {
+    frame_offset = ogg_seek(info, infile, file, info, offset);
+  }
+
+  // Don't leak
+  SvREFCNT_dec(info);
+  SvREFCNT_dec(tags);
+
+  return frame_offset;
+}
+
+// Everything ogg_seek needs ends up in info, which doubles as the state
+void *
+ogg_seek_open(PerlIO *infile, char *file, HV *info, HV *tags)
+{
   if ( _ogg_parse(infile, file, info, tags, 1) != 0 ) {
-    goto out;
+    return NULL;
   }
 
+  return info;
+}
+
+off_t
+ogg_seek(void *state, PerlIO *infile, char *file, HV *info, int offset)
+{
+  int frame_offset = -1;
+  uint32_t samplerate;
+  uint32_t song_length_ms;
+  uint64_t target_sample;
+
   song_length_ms = SvIV( *(my_hv_fetch( info, "song_length_ms" )) );
   if (offset >= song_length_ms) {
     goto out;
@@ -529,10 +651,6 @@ ogg_find_frame(PerlIO *infile, char *file, int offset)
   frame_offset = _ogg_binary_search_sample(infile, file, info, target_sample);
 
 out:
-  // Don't leak
-  SvREFCNT_dec(info);
-  SvREFCNT_dec(tags);
-
   return frame_offset;
 }
 
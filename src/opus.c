@@ -58,11 +58,18 @@ _opus_parse(PerlIO *infile, char *file, HV *info, HV *tags, uint8_t seeking)
   
   unsigned char TOC_byte = 0;
 
+  // Where the bytes in vorbis_buf came from, for the offsets option
+  offsetmap *map = NULL;
+
   int i;
   int err = 0;
   
   buffer_init(&ogg_buf, OGG_BLOCK_SIZE);
   buffer_init(&vorbis_buf, 0);
+
+  if ( _offsets_option() ) {
+    scan_newz(map, 1, offsetmap);
+  }
   
   file_size = _file_size(infile);
   my_hv_store( info, "file_size", newSVuv(file_size) );
@@ -191,6 +198,11 @@ _opus_parse(PerlIO *infile, char *file, HV *info, HV *tags, uint8_t seeking)
     
     audio_offset += pagelen;
 
+    if (map) {
+      _offset_map_add(map, map->len, audio_offset - pagelen);
+      map->len += pagelen;
+    }
+
     // Copy page into vorbis buffer
     buffer_append( &vorbis_buf, buffer_ptr(&ogg_buf), pagelen );
     DEBUG_TRACE("  Read %d into vorbis buffer\n", pagelen);
@@ -212,7 +224,7 @@ _opus_parse(PerlIO *infile, char *file, HV *info, HV *tags, uint8_t seeking)
         buffer_consume(&vorbis_buf, 7);
         DEBUG_TRACE("  Found Opus tags TOC packet type\n");
       	if ( !seeking ) {
-                _parse_vorbis_comments(infile, &vorbis_buf, tags, 0);
+                _parse_vorbis_comments(infile, &vorbis_buf, tags, 0, map, info);
       	}
         DEBUG_TRACE("  parsed vorbis comments\n");
 
@@ -351,24 +363,54 @@ out:
 
 static off_t
 opus_find_frame(PerlIO *infile, char *file, int offset)
+{
+  off_t frame_offset = -1;
+  HV *info;
+  HV *tags;
+
+  if (offset < 0) {
+    return -1;
+  }
+
+  // We need to read all metadata first to get some data we need to calculate
+  info = newHV();
+  tags = newHV();
+
+  if ( opus_seek_open(infile, file, info, tags) != NULL ) {
+    frame_offset = opus_seek(info, infile, file, info, offset);
+  }
+
+  // Don't leak
+  SvREFCNT_dec(info);
+  SvREFCNT_dec(tags);
+
+  return frame_offset;
+}
+
+// Everything opus_seek needs ends up in info, which doubles as the state
+void *
+opus_seek_open(PerlIO *infile, char *file, HV *info, HV *tags)
+{
+  if ( _opus_parse(infile, file, info, tags, 1) != 0 ) {
+    return NULL;
+  }
+
+  return info;
+}
+
+off_t
+opus_seek(void *state, PerlIO *infile, char *file, HV *info, int offset)
 {
   int frame_offset = -1;
   uint16_t preskip;
   uint32_t samplerate;
   uint32_t song_length_ms;
   uint64_t target_sample;
-  HV *info = newHV();
-  HV *tags = newHV();
 
   if (offset < 0) {
     return -1;
   }
 
-  // We need to read all metadata first to get some data we need to calculate
-  if ( _opus_parse(infile, file, info, tags, 1) != 0 ) {
-    goto out;
-  }
-
   song_length_ms = SvUV( *(my_hv_fetch( info, "song_length_ms" )) );
   if (offset >= song_length_ms) {
     goto out;
@@ -383,10 +425,6 @@ opus_find_frame(PerlIO *infile, char *file, int offset)
   DEBUG_TRACE("Looking for target sample %llu\n", target_sample);
   frame_offset = _ogg_binary_search_sample(infile, file, info, target_sample);
 
-out:  
-  // Don't leak
-  SvREFCNT_dec(info);
-  SvREFCNT_dec(tags);
-
+out:
   return frame_offset;
 }
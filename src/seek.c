@@ -0,0 +1,88 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "seek.h"
+
+static void
+_seek_context_abandon(pTHX_ void *ctx)
+{
+  if ( ((seekctx *)ctx)->state == NULL ) {
+    seek_context_free((seekctx *)ctx);
+  }
+}
+
+// Parses infile, which then belongs to the context.  Returns NULL if the
+// file can't be seeked in, in which case infile has been closed.
+seekctx *
+seek_context_new(seekhandler *hdl, PerlIO *infile, char *file)
+{
+  dMY_CXT;
+  seekctx *ctx;
+  HV *tags;
+  int len = strlen(file);
+
+  Newxz(ctx, 1, seekctx);
+  arena_init(&ctx->arena);
+  ctx->hdl    = hdl;
+  ctx->infile = infile;
+  ctx->file   = arena_strndup(&ctx->arena, file, len);
+  ctx->info   = newHV();
+
+  ENTER;
+
+  // Freed at LEAVE if the open function fails or croaks
+  SAVEDESTRUCTOR_X(_seek_context_abandon, ctx);
+
+  // Keep the parser's allocations, and don't decode any tags
+  SAVEVPTR(MY_CXT.seek_arena);
+  SAVEVPTR(MY_CXT.want_tags);
+  MY_CXT.seek_arena = &ctx->arena;
+  MY_CXT.want_tags  = (HV *)sv_2mortal( (SV *)newHV() );
+
+  tags = (HV *)sv_2mortal( (SV *)newHV() );
+
+  ctx->state = hdl->open(infile, ctx->file, ctx->info, tags);
+
+  if (ctx->state == NULL) {
+    ctx = NULL;
+  }
+
+  LEAVE;
+
+  return ctx;
+}
+
+off_t
+seek_context_find(seekctx *ctx, int offset)
+{
+  off_t frame_offset;
+
+  ENTER;
+  _scan_enter();
+  frame_offset = ctx->hdl->seek(ctx->state, ctx->infile, ctx->file, ctx->info, offset);
+  LEAVE;
+
+  return frame_offset;
+}
+
+void
+seek_context_free(seekctx *ctx)
+{
+  PerlIO_close(ctx->infile);
+  SvREFCNT_dec(ctx->info);
+  arena_free(&ctx->arena);
+  Safefree(ctx);
+}
@@ -0,0 +1,88 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "sync.h"
+
+uint32_t
+sync_find(const unsigned char *buf, uint32_t len, uint8_t mask)
+{
+  uint32_t i = 0;
+  const unsigned char *p;
+
+#if defined(AUDIO_SCAN_SSE2)
+  {
+    const __m128i ff = _mm_set1_epi8( (char)0xFF );
+    const __m128i m  = _mm_set1_epi8( (char)mask );
+
+    // Compare each byte and the one after it, 16 pairs per step
+    for ( ; i + 17 <= len; i += 16) {
+      __m128i a   = _mm_loadu_si128( (const __m128i *)(buf + i) );
+      __m128i b   = _mm_loadu_si128( (const __m128i *)(buf + i + 1) );
+      __m128i hit = _mm_and_si128( _mm_cmpeq_epi8(a, ff), _mm_cmpeq_epi8( _mm_and_si128(b, m), m ) );
+      int bits    = _mm_movemask_epi8(hit);
+
+      if (bits) {
+        while ( !(bits & 1) ) {
+          bits >>= 1;
+          i++;
+        }
+
+        return i;
+      }
+    }
+  }
+#elif defined(AUDIO_SCAN_NEON)
+  {
+    const uint8x16_t ff = vdupq_n_u8(0xFF);
+    const uint8x16_t m  = vdupq_n_u8(mask);
+
+    // Find the block of 16 pairs holding the first one, the loop below finds
+    // its position
+    for ( ; i + 17 <= len; i += 16) {
+      uint8x16_t a   = vld1q_u8(buf + i);
+      uint8x16_t b   = vld1q_u8(buf + i + 1);
+      uint64x2_t hit = vreinterpretq_u64_u8( vandq_u8( vceqq_u8(a, ff), vceqq_u8( vandq_u8(b, m), m ) ) );
+
+      if ( vgetq_lane_u64(hit, 0) | vgetq_lane_u64(hit, 1) ) {
+        break;
+      }
+    }
+  }
+#endif
+
+  // The C library's memchr is vectorized on most platforms too
+  while ( i + 1 < len ) {
+    if ( (p = memchr(buf + i, 0xFF, len - 1 - i)) == NULL ) {
+      i = len - 1;
+      break;
+    }
+
+    i = p - buf;
+
+    if ( (buf[i + 1] & mask) == mask ) {
+      return i;
+    }
+
+    i++;
+  }
+
+  // A trailing 0xFF may be completed by the next read
+  if ( i < len && buf[i] == 0xFF ) {
+    return i;
+  }
+
+  return len;
+}
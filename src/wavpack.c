@@ -19,9 +19,7 @@
 static int
 get_wavpack_info(PerlIO *infile, char *file, HV *info)
 {
-  wvpinfo *wvp = _wavpack_parse(infile, file, info, 0);
-
-  Safefree(wvp);
+  _wavpack_parse(infile, file, info, 0);
 
   return 0;
 }
@@ -34,9 +32,9 @@ _wavpack_parse(PerlIO *infile, char *file, HV *info, uint8_t seeking)
   u_char *bptr;
 
   wvpinfo *wvp;
-  Newz(0, wvp, sizeof(wvpinfo), wvpinfo);
-  Newz(0, wvp->buf, sizeof(Buffer), Buffer);
-  Newz(0, wvp->header, sizeof(WavpackHeader), WavpackHeader);
+  scan_newz(wvp, 1, wvpinfo);
+  scan_newz(wvp->buf, 1, Buffer);
+  scan_newz(wvp->header, 1, WavpackHeader);
 
   wvp->infile         = infile;
   wvp->file           = file;
@@ -96,8 +94,6 @@ _wavpack_parse(PerlIO *infile, char *file, HV *info, uint8_t seeking)
 
 out:
   buffer_free(wvp->buf);
-  Safefree(wvp->buf);
-  Safefree(wvp->header);
 
   return wvp;
 }
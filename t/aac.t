@@ -2,7 +2,7 @@ use strict;
 
 use File::Spec::Functions;
 use FindBin ();
-use Test::More tests => 44;
+use Test::More tests => 52;
 use Test::Warn;
 
 use Audio::Scan;
@@ -117,6 +117,30 @@ use Audio::Scan;
     is( $info->{song_length_ms}, 128, 'Duration ok' );
 }
 
+# Radio capture with a glitch in the middle, the frames after it still count
+{
+    my $s = Audio::Scan->scan( _f('glitch.aac') );
+
+    my $info = $s->{info};
+
+    is( $info->{song_length_ms}, 1393, 'Glitch duration ok' );
+    is( $info->{bitrate}, 58000, 'Glitch bitrate ok' );
+}
+
+# Find frame
+{
+    is( Audio::Scan->find_frame( _f('stereo.aac'), 0 ), 0, 'Find frame start ok' );
+    is( Audio::Scan->find_frame( _f('stereo.aac'), 1000 ), 602, 'Find frame ok' );
+    is( Audio::Scan->find_frame( _f('stereo.aac'), 5000 ), -1, 'Find frame past the end ok' );
+    is( Audio::Scan->find_frame( _f('id3v2.aac'), 100 ), 3669, 'Find frame after ID3v2 ok' );
+
+    # Frame 58 is after the glitch
+    is( Audio::Scan->find_frame( _f('glitch.aac'), 1300 ), 6545, 'Find frame after glitch ok' );
+
+    my $ctx = Audio::Scan->seek_context( _f('glitch.aac') );
+    is( $ctx->find_frame(1300), 6545, 'Seek context find frame ok' );
+}
+
 sub _f {
     return catfile( $FindBin::Bin, 'aac', shift );
 }
@@ -2,7 +2,7 @@ use strict;
 
 use File::Spec::Functions;
 use FindBin ();
-use Test::More tests => 142;
+use Test::More tests => 145;
 
 use Audio::Scan;
 
@@ -354,6 +354,29 @@ eval {
     is( $offset, 6679, 'Find frame CBR without ASF_Index ok' );
 }
 
+# offsets option, header objects and attributes
+{
+    my $path = _f('wma92-multiple-tags.wma');
+    my $s = Audio::Scan->scan( $path, { offsets => 1 } );
+    my $offsets = $s->{info}->{tag_offsets};
+
+    is( $offsets->{File_Properties}->[0]->{length}, 80, 'Offsets File_Properties ok' );
+    is( _read_range( $path, $offsets->{'WM/Year'}->[0] ), pack( 'v*', ( map { ord } split //, $s->{tags}->{'WM/Year'} ), 0 ), 'Offsets Unicode attribute ok' );
+    is( unpack( 'V', _read_range( $path, $offsets->{'WM/TrackNumber'}->[0] ) ), 1, 'Offsets DWORD attribute ok' );
+}
+
+sub _read_range {
+    my ( $path, $range ) = @_;
+
+    open my $fh, '<', $path;
+    binmode $fh;
+    seek $fh, $range->{offset}, 0;
+    read $fh, my $data, $range->{length};
+    close $fh;
+
+    return $data;
+}
+
 sub _f {
     return catfile( $FindBin::Bin, 'asf', shift );
 }
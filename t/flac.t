@@ -2,7 +2,7 @@ use strict;
 
 use File::Spec::Functions;
 use FindBin ();
-use Test::More tests => 71;
+use Test::More tests => 74;
 
 use Audio::Scan;
 
@@ -199,6 +199,30 @@ use Audio::Scan;
     is( $tags->{ALBUM}, 'Quod Libet Test Data', 'CVE-2007-4619 handled ok' );
 }
 
+# offsets option, metadata blocks and comments
+{
+    my $path = _f('picture.flac');
+    my $s = Audio::Scan->scan( $path, { offsets => 1 } );
+    my $offsets = $s->{info}->{tag_offsets};
+
+    is( $offsets->{STREAMINFO}->[0]->{offset}, 8, 'Offsets STREAMINFO ok' );
+    my $image = $s->{tags}->{ALLPICTURES}->[0]->{image_data};
+    is( substr( _read_range( $path, $offsets->{PICTURE}->[0] ), -length $image ), $image, 'Offsets PICTURE ok' );
+    is( _read_range( $path, $offsets->{ALBUM}->[0] ), $s->{tags}->{ALBUM}, 'Offsets ALBUM comment ok' );
+}
+
+sub _read_range {
+    my ( $path, $range ) = @_;
+
+    open my $fh, '<', $path;
+    binmode $fh;
+    seek $fh, $range->{offset}, 0;
+    read $fh, my $data, $range->{length};
+    close $fh;
+
+    return $data;
+}
+
 sub _f {
     return catfile( $FindBin::Bin, 'flac', shift );
 }
@@ -3,7 +3,7 @@ use strict;
 use Digest::MD5 qw(md5_hex);
 use File::Spec::Functions;
 use FindBin ();
-use Test::More tests => 413;
+use Test::More tests => 446;
 use Test::Warn;
 
 use Audio::Scan;
@@ -852,6 +852,59 @@ eval {
     is( $offset, 15403, 'Find frame with Xing TOC ok' );
 }
 
+# A 0xFF byte without the rest of the 11 sync bits isn't taken for a frame
+{
+    my $offset = Audio::Scan->find_frame( _f('no-tags-mp1l2.mp3'), 1 );
+    is( $offset, 627, 'Find frame skips false sync ok' );
+}
+
+# Seeking with a frame index
+{
+    my $s = Audio::Scan->scan_info( _f('no-tags-no-xing-vbr.mp3'), { frame_index => 1 } );
+    my $info = $s->{info};
+
+    is( $info->{song_length_ms}, 4963, 'Frame index song length counted from the frames ok' );
+    is_deeply( $info->{frame_index}, [ [ 0, 0 ], [ 73728, 39822 ], [ 147456, 87437 ] ], 'Frame index ok' );
+
+    ok( !exists Audio::Scan->scan_info( _f('no-tags-no-xing-vbr.mp3') )->{info}->{frame_index}, 'No frame index by default ok' );
+
+    is( Audio::Scan->find_frame( _f('no-tags-no-xing-vbr.mp3'), 1000, { frame_index => 1 } ), 21971, 'Find frame with frame index ok' );
+    is( Audio::Scan->find_frame( _f('no-tags-no-xing-vbr.mp3'), 2500, { frame_index => $info->{frame_index} } ), 62586, 'Find frame with frame index from scan ok' );
+    is( Audio::Scan->find_frame( _f('no-tags-no-xing-vbr.mp3'), 6000, { frame_index => 1 } ), -1, 'Find frame with frame index past the end ok' );
+
+    my $ctx = Audio::Scan->seek_context( _f('no-tags-no-xing-vbr.mp3'), { frame_index => 1 } );
+    is( $ctx->find_frame(2500), 62586, 'Seek context with frame index ok' );
+
+    # The Xing frame holds no audio and is left out
+    $s = Audio::Scan->scan_info( _f('v2.3-itunes81.mp3'), { frame_index => 1 } );
+    is_deeply( $s->{info}->{frame_index}->[0], [ 0, 13131 ], 'Frame index skips Xing frame ok' );
+
+    eval { Audio::Scan->find_frame( _f('no-tags-no-xing-vbr.mp3'), 1000, { frame_index => [ 1 ] } ) };
+    like( $@, qr/frame_index must be a list of \[ sample, offset \] pairs/, 'Invalid frame index croaks ok' );
+}
+
+# Sampled VBR bitrate, on a VBR file without a Xing header large enough to be sampled,
+# no-tags-no-xing-vbr.mp3 10 times over (1900 frames, 49632 ms)
+{
+    my $path = _f('no-tags-no-xing-vbr-long.mp3');
+    my $info = Audio::Scan->scan_info( $path, { vbr_scan => 'sample' } )->{info};
+
+    is( $info->{estimated_frames}, 1910, 'Sampled VBR frame count ok' );
+    ok( $info->{song_length_error_ms} > 0, 'Sampled VBR error bound ok' );
+    ok( abs( $info->{song_length_ms} - 49632 ) <= $info->{song_length_error_ms}, 'Sampled VBR song length within error bound ok' );
+
+    $info = Audio::Scan->scan_info( $path, { vbr_scan => 'full' } )->{info};
+    is( $info->{song_length_ms}, 49746, 'Full VBR scan song length ok' );
+    ok( !exists $info->{estimated_frames}, 'Full VBR scan is not an estimate ok' );
+
+    # Too small to be worth sampling
+    $info = Audio::Scan->scan_info( _f('no-tags-no-xing-vbr.mp3'), { vbr_scan => 'sample' } )->{info};
+    is( $info->{song_length_ms}, 4974, 'Small VBR file read in full ok' );
+
+    eval { Audio::Scan->scan_info( $path, { vbr_scan => 'fast' } ) };
+    like( $@, qr/vbr_scan must be 'full' or 'sample'/, 'Invalid vbr_scan croaks ok' );
+}
+
 # Bug 12409, file with just enough junk data before first audio frame
 # to require a second buffer read
 {
@@ -1032,6 +1085,25 @@ eval {
     is( $tags->{RGAD}->{album_gain}, '-5.600000 dB', 'RGAD album gain ok' );
 }
 
+# v2.3 whole tag unsynchronisation larger than one read block, with 0xFF bytes in
+# the artwork and text frames after it
+{
+    my $path  = _f('v2.3-unsync-large.mp3');
+    my $image = "\xFF\xD8" . ( "\xFF\xFF\xFF\x00\x01\xE0" x 3000 );
+
+    my $tags = Audio::Scan->scan_tags($path)->{tags};
+
+    is( $tags->{TIT2}, "Title \xFF", 'v2.3 large unsync TIT2 ok' );
+    is( $tags->{APIC}->[3], $image, 'v2.3 large unsync APIC data ok' );
+    is( $tags->{TPE1}, 'Artist', 'v2.3 large unsync TPE1 after APIC ok' );
+
+    local $ENV{AUDIO_SCAN_NO_ARTWORK} = 1;
+    $tags = Audio::Scan->scan_tags($path)->{tags};
+
+    is( $tags->{APIC}->[3], length $image, 'v2.3 large unsync APIC length ok (NO_ARTWORK mode)' );
+    is( $tags->{TPE1}, 'Artist', 'v2.3 large unsync TPE1 after APIC ok (NO_ARTWORK mode)' );
+}
+
 # v2.4 per-frame unsynchronisation
 {
     my $s = Audio::Scan->scan( _f('v2.4-unsync.mp3') );
@@ -1407,6 +1479,69 @@ eval {
     is( $tags->{ALBUMARTISTS}->[1], 'Artist3', 'ID3v2.4 TXXX value after empty slot ok' );
 }
 
+# UTF-16 surrogate pairs and long ISO-8859-1/UTF-16 strings
+{
+    my $tags = Audio::Scan->scan_tags( _f('v2.3-utf16-surrogates.mp3') )->{tags};
+
+    is( $tags->{TIT2}, "A longer ASCII title \x{1F3B5}", 'UTF-16 surrogate pair ok' );
+    is( $tags->{TPE1}, "Artist \x{FFFD}x", 'UTF-16 unpaired surrogate ok' );
+    is( $tags->{TALB}, "An album title longer than sixteen \x{E9}", 'Long ISO-8859-1 string ok' );
+}
+
+# offsets option, where each frame's data is stored
+{
+    my $path = _f('v2.3-unsync.mp3');
+    my $s = Audio::Scan->scan( $path, { offsets => 1 } );
+    my $offsets = $s->{info}->{tag_offsets};
+
+    is( substr( _read_range( $path, $offsets->{TIT2}->[0] ), 1 ), $s->{tags}->{TIT2}, 'Offsets TIT2 ok' );
+    is( $offsets->{TPE2}->[0]->{encoding}, 'unsync', 'Offsets unsync frame encoding ok' );
+
+    my $data = _read_range( $path, $offsets->{TPE2}->[0] );
+    $data =~ s/\xFF\x00/\xFF/g;
+    is( $data, "\x01\xFF\xFE" . pack( 'v*', map { ord } split //, $s->{tags}->{TPE2} ), 'Offsets unsync frame data ok' );
+
+    ok( !exists Audio::Scan->scan($path)->{info}->{tag_offsets}, 'No offsets without option ok' );
+}
+
+# offsets option with a v2.3 unsync tag that is read in blocks
+{
+    my $path = _f('v2.3-unsync-apic-bad-offset.mp3');
+    my $s = Audio::Scan->scan( $path, { offsets => 1 } );
+    my $apic = $s->{info}->{tag_offsets}->{APIC}->[0];
+
+    my $data = _read_range( $path, $apic );
+    $data =~ s/\xFF\x00/\xFF/g;
+    is( md5_hex( substr( $data, -10377 ) ), '4c2fbdab0d4c81d95017896d23e1e391', 'Offsets streamed unsync APIC data ok' );
+}
+
+# offsets option with a compressed frame
+{
+    my $s = Audio::Scan->scan( _f('v2.3-compressed-frame.mp3'), { offsets => 1 } );
+
+    is( $s->{info}->{tag_offsets}->{TIT2}->[0]->{encoding}, 'zlib', 'Offsets compressed frame encoding ok' );
+}
+
+# offsets option with an extended header before the frames
+for my $file ( 'v2.3-ext-header.mp3', 'v2.4-ext-header.mp3' ) {
+    my $path = _f($file);
+    my $s = Audio::Scan->scan_tags( $path, { offsets => 1 } );
+
+    is( _read_range( $path, $s->{info}->{tag_offsets}->{TCON}->[0] ), "\0(0)Blues", "Offsets after extended header ok ($file)" );
+}
+
+sub _read_range {
+    my ( $path, $range ) = @_;
+
+    open my $fh, '<', $path;
+    binmode $fh;
+    seek $fh, $range->{offset}, 0;
+    read $fh, my $data, $range->{length};
+    close $fh;
+
+    return $data;
+}
+
 sub _f {
     return catfile( $FindBin::Bin, 'mp3', shift );
 }
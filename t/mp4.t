@@ -2,7 +2,7 @@ use strict;
 
 use File::Spec::Functions;
 use FindBin ();
-use Test::More tests => 120;
+use Test::More tests => 179;
 
 use Audio::Scan;
 
@@ -48,6 +48,9 @@ use Audio::Scan;
     is( $info->{song_length_ms}, 69, 'Song length ok' );
     is( $info->{samplerate}, 44100, 'Sample rate ok' );
     is( $info->{avg_bitrate}, 96000, 'Avg bitrate ok' );
+    is( $info->{encoder_delay}, 2112, 'iTunSMPB encoder delay ok' );
+    is( $info->{encoder_padding}, 484, 'iTunSMPB encoder padding ok' );
+    is( $info->{original_samples}, 476, 'iTunSMPB original samples ok' );
     is( $info->{dlna_profile}, 'AAC_ISO_192', 'DLNA profile AAC_ISO_192 ok' );
 
     is( $track->{audio_object_type}, 2, 'Audio object type ok' );
@@ -135,6 +138,25 @@ use Audio::Scan;
     is( $tags->{TOO}, 'avc2.0.11.1110', 'Leading MDAT TOO ok' );
 }
 
+# File with more than one mdat box, bug 15875
+{
+    my $s = Audio::Scan->scan( _f('multiple-mdat.m4a') );
+
+    my $info = $s->{info};
+
+    is( $info->{audio_offset}, 6169, 'Multiple MDAT offset is the first mdat ok' );
+    is( $info->{audio_size}, 344, 'Multiple MDAT size covers all mdats ok' );
+    is( scalar @{ $info->{mdat_boxes} }, 2, 'Multiple MDAT mdat_boxes count ok' );
+    is( $info->{mdat_boxes}->[1]->{offset}, 6489, 'Multiple MDAT second mdat offset ok' );
+}
+
+# moov after the mdat boxes, found from the top-level box map
+{
+    my $offset = Audio::Scan->find_frame( _f('heaac.mp4'), 30000 );
+
+    is( $offset, 48779, 'Trailing moov find_frame ok' );
+}
+
 # File with array keys, bug 13486
 {
     my $s = Audio::Scan->scan( _f('array-keys.m4a') );
@@ -182,6 +204,19 @@ use Audio::Scan;
 	is( $tags->{COVR_offset}, 1926, 'COVR with AUDIO_SCAN_NO_ARTWORK offset ok' );
 }
 
+# Read cover art on demand
+{
+    my $s = Audio::Scan->scan( _f('multiple-covers.m4a') );
+
+    is( Audio::Scan->get_artwork( _f('multiple-covers.m4a'), 0 ), $s->{tags}->{COVR}, 'get_artwork first cover ok' );
+
+    my $second = Audio::Scan->get_artwork( _f('multiple-covers.m4a'), 1 );
+
+    is( length($second), 2103, 'get_artwork second cover ok' );
+    is( substr( $second, 0, 2 ), "\xff\xd8", 'get_artwork second cover is JPEG ok' );
+    ok( !defined Audio::Scan->get_artwork( _f('multiple-covers.m4a'), 2 ), 'get_artwork missing cover ok' );
+}
+
 # File with array keys that are integers, bug 14462
 {
     my $s = Audio::Scan->scan( _f('array-keys-int.m4a') );
@@ -256,19 +291,38 @@ use Audio::Scan;
     #is( $info->{tracks}->[0]->{channels}, 2, 'HE-AAC track 1 channels 2 ok' );
 }
 
-# Find frame
+# Find frame, 30ms after the 2112 priming samples is in the last of 3 frames
 {
     my $offset = Audio::Scan->find_frame( _f('itunes811.m4a'), 30 );
 
-    is( $offset, 6183, 'Find frame ok' );
+    is( $offset, 6347, 'Find frame ok' );
 }
 
 # Find frame with info
 {
     my $info = Audio::Scan->find_frame_return_info( _f('itunes811.m4a'), 30 );
 
-    is( $info->{seek_offset}, 6183, 'Find frame return info offset ok' );
-    is( length( $info->{seek_header} ), 6173, 'Find frame return info header rewrite ok' );
+    is( $info->{seek_offset}, 6347, 'Find frame return info offset ok' );
+    is( length( $info->{seek_header} ), 6169, 'Find frame return info header rewrite ok' );
+    is( $info->{seek_skip_samples}, 1023, 'Find frame return info skip samples ok' );
+}
+
+# Edit list with encoder delay and padding
+{
+    my $s = Audio::Scan->scan( _f('edit-list.mp4') );
+
+    my $info = $s->{info};
+
+    is( $info->{encoder_delay}, 2112, 'Edit list encoder delay ok' );
+    is( $info->{encoder_padding}, 1056, 'Edit list encoder padding ok' );
+    is( $info->{original_samples}, 1237920, 'Edit list original samples ok' );
+
+    # 30s is sample 480000 + 2112, 832 into the 2048 sample frame 235
+    $info = Audio::Scan->find_frame_return_info( _f('edit-list.mp4'), 30000 );
+
+    is( $info->{seek_offset}, 48972, 'Edit list find_frame ok' );
+    is( $info->{seek_skip_samples}, 832, 'Edit list skip samples ok' );
+    ok( index( $info->{seek_header}, pack( 'a4N5', 'elst', 0, 1, 46422 - 18000, 832, 0x10000 ) ) > 0, 'Edit list rewrite ok' );
 }
 
 # Find frame in ALAC file with unusual stts values
@@ -279,11 +333,129 @@ use Audio::Scan;
     is( length( $info->{seek_header} ), 34274, 'Find frame in ALAC multiple stts header ok' );
 }
 
-# Find frame in HD-AAC file (2 tracks) (not yet supported)
+# Find frame where the rewritten st* boxes are larger than the originals,
+# the first chunk offset must point just past the new header
+{
+    my $info = Audio::Scan->find_frame_return_info( _f('alac-multiple-stts.m4a'), 100 );
+    my $hdr  = $info->{seek_header};
+    my $stco = unpack( 'N', substr( $hdr, index( $hdr, 'stco' ) + 12, 4 ) );
+
+    is( length($hdr), 35814, 'Find frame with larger st* boxes header ok' );
+    is( $stco, length($hdr), 'Find frame with larger st* boxes chunk offset ok' );
+}
+
+# Find frame in the last of multiple stts entries
+{
+    my $info = Audio::Scan->find_frame_return_info( _f('alac-multiple-stts.m4a'), 618210 );
+
+    is( $info->{seek_offset}, 64756946, 'Find frame in last stts entry ok' );
+    ok( index( $info->{seek_header}, pack( 'Na4N4', 24, 'stts', 0, 1, 1, 1996 ) ) > 0, 'Find frame in last stts entry rewrite ok' );
+}
+
+# Find frame in HD-AAC file (2 tracks), the first audio track by default
 {
     my $info = Audio::Scan->find_frame_return_info( _f('hd-aac.m4a'), 10 );
 
-    is( $info->{seek_offset}, -1, 'Find frame in HD-AAC ok' );
+    is( $info->{seek_offset}, 312206, 'Find frame in HD-AAC ok' );
+    is( Audio::Scan->find_frame( _f('hd-aac.m4a'), 30000 ), 7047982, 'Find frame in HD-AAC default track ok' );
+    is( Audio::Scan->find_frame( _f('hd-aac.m4a'), 30000, { track => 2 } ), 7048322, 'Find frame in HD-AAC track 2 ok' );
+    is( Audio::Scan->find_frame( _f('hd-aac.m4a'), 30000, { track => 3 } ), -1, 'Find frame in HD-AAC missing track ok' );
+
+    # The seek header only has the chosen track
+    $info = Audio::Scan->find_frame_return_info( _f('hd-aac.m4a'), 30000, { track => 2 } );
+
+    my $hdr = $info->{seek_header};
+    my $stco = index( $hdr, 'stco' );
+
+    is( $info->{seek_offset}, 7048322, 'Find frame return info in HD-AAC track 2 ok' );
+    is( unpack( 'N', substr( $hdr, $stco + 12, 4 ) ), length($hdr), 'Find frame in HD-AAC track 2 chunk offset ok' );
+    is( index( $hdr, 'trak', index( $hdr, 'trak' ) + 4 ), -1, 'Find frame in HD-AAC track 2 header has one track ok' );
+}
+
+# Find frame in file with a hint track, which is ignored
+{
+    is( Audio::Scan->find_frame( _f('hint-track.m4a'), 30000 ), 1046447, 'Find frame with hint track ok' );
+}
+
+# Find frame in file with sample sizes over 64KB (32-bit stsz entries)
+{
+    my $info = Audio::Scan->find_frame_return_info( _f('stsz-32bit-no-delay.m4a'), 30 );
+
+    is( $info->{seek_offset}, 6183, 'Find frame with 32-bit sample sizes ok' );
+    ok( index( $info->{seek_header}, pack( 'a4N5', 'stsz', 0, 0, 2, 0xa4, 0x1008e ) ) > 0, 'Find frame with 32-bit sample sizes rewrite ok' );
+
+    # 30ms after the 2112 priming samples is in the last of 3 frames
+    $info = Audio::Scan->find_frame_return_info( _f('stsz-32bit.m4a'), 30 );
+
+    is( $info->{seek_offset}, 6347, 'Find frame with 32-bit sample sizes and delay ok' );
+    is( $info->{seek_skip_samples}, 1023, 'Find frame with 32-bit sample sizes and delay skip samples ok' );
+    ok( index( $info->{seek_header}, pack( 'a4N4', 'stsz', 0, 0, 1, 0x1008e ) ) > 0, 'Find frame with 32-bit sample sizes and delay rewrite ok' );
+}
+
+# Find frame in file where every sample has the same size (no stsz table)
+{
+    my $info = Audio::Scan->find_frame_return_info( _f('stsz-constant-no-delay.m4a'), 30 );
+
+    is( $info->{seek_offset}, 1601, 'Find frame with constant sample size ok' );
+    ok( index( $info->{seek_header}, pack( 'a4N3', 'stsz', 0, 912, 59 ) ) > 0, 'Find frame with constant sample size rewrite ok' );
+
+    my $s = Audio::Scan->scan( _f('stsz-constant.m4a') );
+
+    is( $s->{info}->{encoder_delay}, 2112, 'Constant sample size encoder delay ok' );
+
+    # 500ms plus the delay is sample 24162, in the 24th frame of the second chunk
+    $info = Audio::Scan->find_frame_return_info( _f('stsz-constant.m4a'), 500 );
+
+    is( $info->{seek_offset}, 21853, 'Find frame with constant sample size and delay ok' );
+    is( $info->{seek_skip_samples}, 610, 'Find frame with constant sample size and delay skip samples ok' );
+    ok( index( $info->{seek_header}, pack( 'a4N3', 'stsz', 0, 912, 37 ) ) > 0, 'Find frame with constant sample size and delay rewrite ok' );
+}
+
+# Find frame in file with 64-bit chunk offsets (co64)
+{
+    my $offset = Audio::Scan->find_frame( _f('co64-no-delay.m4a'), 30 );
+
+    is( $offset, 6183, 'Find frame with co64 ok' );
+
+    my $info = Audio::Scan->find_frame_return_info( _f('co64-no-delay.m4a'), 30 );
+
+    is( $info->{seek_offset}, 6183, 'Find frame return info with co64 ok' );
+    ok( index( $info->{seek_header}, pack( 'a4N4', 'co64', 0, 1, 0, 6173 ) ) > 0, 'Find frame with co64 rewrite ok' );
+
+    $info = Audio::Scan->find_frame_return_info( _f('co64.m4a'), 30 );
+
+    is( $info->{seek_offset}, 6347, 'Find frame return info with co64 and delay ok' );
+    is( $info->{seek_skip_samples}, 1023, 'Find frame return info with co64 and delay skip samples ok' );
+    ok( index( $info->{seek_header}, pack( 'a4N4', 'co64', 0, 1, 0, 6169 ) ) > 0, 'Find frame with co64 and delay rewrite ok' );
+}
+
+# Fragmented file with an mfra index
+{
+    my $s = Audio::Scan->scan( _f('fragmented-mfra.mp4') );
+
+    my $info = $s->{info};
+
+    is( $info->{song_length_ms}, 77568, 'Fragmented mfra song_length_ms ok' );
+    is( $info->{audio_offset}, 606, 'Fragmented mfra audio_offset ok' );
+
+    is( Audio::Scan->find_frame( _f('fragmented-mfra.mp4'), 10000 ), 13254, 'Fragmented mfra find_frame ok' );
+    is( Audio::Scan->find_frame( _f('fragmented-mfra.mp4'), 77000 ), 114367, 'Fragmented mfra find_frame last fragment ok' );
+
+    my $ret = Audio::Scan->find_frame_return_info( _f('fragmented-mfra.mp4'), 10000 );
+
+    is( $ret->{seek_offset}, 13254, 'Fragmented mfra find_frame_return_info ok' );
+    is( length( $ret->{seek_header} ), 606, 'Fragmented mfra seek_header is the init segment ok' );
+}
+
+# Fragmented file without mfra, durations from tfhd and trun
+{
+    my $s = Audio::Scan->scan( _f('fragmented.mp4') );
+
+    is( $s->{info}->{song_length_ms}, 77568, 'Fragmented song_length_ms ok' );
+    is( Audio::Scan->find_frame( _f('fragmented.mp4'), 10000 ), 13238, 'Fragmented find_frame ok' );
+
+    my $ctx = Audio::Scan->seek_context( _f('fragmented.mp4') );
+    is( $ctx->find_frame(8192), 13238, 'Fragmented seek context fragment boundary ok' );
 }
 
 # Find frame with info from filehandle
@@ -292,10 +464,33 @@ use Audio::Scan;
 
     my $info = Audio::Scan->find_frame_fh_return_info( mp4 => $fh, 30 );
 
-    is( $info->{seek_offset}, 6183, 'Find frame return info via filehandle ok' );
-    is( length( $info->{seek_header} ), 6173, 'Find frame return info via filehandle rewrite ok' );
+    is( $info->{seek_offset}, 6347, 'Find frame return info via filehandle ok' );
+    is( length( $info->{seek_header} ), 6169, 'Find frame return info via filehandle rewrite ok' );
+
+    close $fh;
+}
+
+# offsets option, text, artwork and custom ilst atoms
+{
+    my $path = _f('itunes811.m4a');
+    my $s = Audio::Scan->scan( $path, { offsets => 1 } );
+    my $offsets = $s->{info}->{tag_offsets};
+
+    is( _read_range( $path, $offsets->{NAM}->[0] ), $s->{tags}->{NAM}, 'Offsets NAM ok' );
+    is( _read_range( $path, $offsets->{COVR}->[0] ), $s->{tags}->{COVR}, 'Offsets COVR ok' );
+    is( _read_range( $path, $offsets->{ITUNSMPB}->[0] ), $s->{tags}->{ITUNSMPB}, 'Offsets custom atom ok' );
+}
 
+sub _read_range {
+    my ( $path, $range ) = @_;
+
+    open my $fh, '<', $path;
+    binmode $fh;
+    seek $fh, $range->{offset}, 0;
+    read $fh, my $data, $range->{length};
     close $fh;
+
+    return $data;
 }
 
 sub _f {
@@ -2,7 +2,7 @@ use strict;
 
 use File::Spec::Functions;
 use FindBin ();
-use Test::More tests => 72;
+use Test::More tests => 75;
 
 use Audio::Scan;
 
@@ -278,6 +278,29 @@ eval {
     is( $info->{song_length_ms}, 387, 'Incorrect terminal header page song_length_ms ok' );
 }
 
+# offsets option, comments on the first page, on a later page and across pages
+{
+    my $path = _f('large-pagesize.ogg');
+    my $s = Audio::Scan->scan( $path, { offsets => 1 } );
+    my $offsets = $s->{info}->{tag_offsets};
+
+    is( _read_range( $path, $offsets->{ALBUM}->[0] ), $s->{tags}->{ALBUM}, 'Offsets ALBUM comment ok' );
+    is( _read_range( $path, $offsets->{ARTISTSORT}->[0] ), $s->{tags}->{ARTISTSORT}, 'Offsets comment on later page ok' );
+    is( $offsets->{COVERART}->[0]->{encoding}, 'ogg+base64', 'Offsets comment across pages encoding ok' );
+}
+
+sub _read_range {
+    my ( $path, $range ) = @_;
+
+    open my $fh, '<', $path;
+    binmode $fh;
+    seek $fh, $range->{offset}, 0;
+    read $fh, my $data, $range->{length};
+    close $fh;
+
+    return $data;
+}
+
 sub _f {
     return catfile( $FindBin::Bin, 'ogg', shift );
 }
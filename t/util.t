@@ -2,7 +2,7 @@ use strict;
 
 use File::Spec::Functions;
 use FindBin ();
-use Test::More tests => 7;
+use Test::More tests => 52;
 
 use Audio::Scan;
 
@@ -32,6 +32,274 @@ use Audio::Scan;
     is( Audio::Scan->type_for('wma'), 'asf', 'type_for ok' );
 }
 
+# Test for scan_many
+{
+    my @files = map { catfile( $FindBin::Bin, split m{/} ) } qw(
+        mp3/v2.3-unsync.mp3
+        flac/picture.flac
+        mp4/itunes811.m4a
+    );
+
+    my @warnings;
+    local $SIG{__WARN__} = sub { push @warnings, shift };
+
+    my $results = Audio::Scan->scan_many(
+        [ @files, _f('missing.mp3'), _f('foo.dat'), 'no-suffix' ],
+        { md5_size => 4096 },
+    );
+
+    is( scalar @{$results}, 6, 'scan_many result count ok' );
+    is_deeply( [ @{$results}[0..2] ], [ map { Audio::Scan->scan( $_, { md5_size => 4096 } ) } @files ], 'scan_many results ok' );
+    is_deeply( [ @{$results}[3..5] ], [ undef, undef, undef ], 'scan_many failures are undef ok' );
+    like( $warnings[0], qr/Could not open .*missing\.mp3 for reading/, 'scan_many open warning ok' );
+    like( $warnings[1], qr/unsupported file type: dat/, 'scan_many unsupported warning ok' );
+    like( $warnings[2], qr/unsupported file type: no extension \(no-suffix\)/, 'scan_many no extension warning ok' );
+
+    my @seen;
+    my $ret = Audio::Scan->scan_many( \@files, {
+        filter   => Audio::Scan::FILTER_INFO_ONLY,
+        callback => sub { push @seen, [ $_[0], $_[1]->{info}->{song_length_ms} ] },
+    } );
+
+    ok( !defined $ret, 'scan_many with callback returns undef ok' );
+    is_deeply( \@seen, [ map { [ $_, Audio::Scan->scan_info($_)->{info}->{song_length_ms} ] } @files ], 'scan_many callback ok' );
+}
+
+# Test for fields/tags projection
+{
+    my $path = _f('v2.3-xsop.mp3');
+    my $full = Audio::Scan->scan($path);
+    my $s = Audio::Scan->scan( $path, {
+        fields => [ 'song_length_ms', 'BITRATE' ],
+        tags   => [ 'tit2', 'TDRC', 'MusicBrainz Album Id', 'TFOO' ],
+    } );
+
+    is_deeply( $s->{info}, { map { $_ => $full->{info}->{$_} } qw(song_length_ms bitrate) }, 'projection info fields ok' );
+    is_deeply( $s->{tags}, { map { $_ => $full->{tags}->{$_} } ( 'TIT2', 'TDRC', 'MUSICBRAINZ ALBUM ID' ) }, 'projection ID3 frames, TXXX and TDRC ok' );
+
+    $s = Audio::Scan->scan( $path, { fields => [ 'jenkins_hash' ], tags => [] } );
+    is_deeply( [ keys %{ $s->{info} } ], [ 'jenkins_hash' ], 'projection jenkins_hash on request ok' );
+    ok( !exists $s->{tags}, 'projection empty tags list skips tag parsing ok' );
+
+    my $ogg = catfile( $FindBin::Bin, 'ogg', 'test.ogg' );
+    $s = Audio::Scan->scan( $ogg, { tags => [ 'Artist', 'trackNumber' ] } );
+    is_deeply( $s->{tags}, { ARTIST => 'Test Artist', TRACKNUMBER => 1 }, 'projection Vorbis comments ok' );
+    ok( exists $s->{info}->{samplerate}, 'projection without fields keeps info ok' );
+
+    my $mp4 = catfile( $FindBin::Bin, 'mp4', 'itunes811.m4a' );
+    $full = Audio::Scan->scan($mp4);
+    $s = Audio::Scan->scan( $mp4, { tags => [ 'nam', 'trkn', 'iTunSMPB' ] } );
+    is_deeply( $s->{tags}, { map { $_ => $full->{tags}->{$_} } qw(NAM TRKN ITUNSMPB) }, 'projection MP4 ilst ok' );
+
+    {
+        local $ENV{AUDIO_SCAN_NO_ARTWORK} = 1;
+        $s = Audio::Scan->scan( $mp4, { tags => [ 'COVR_offset' ] } );
+        is_deeply( [ keys %{ $s->{tags} } ], [ 'COVR_offset' ], 'projection companion key on its own ok' );
+    }
+
+    my $asf = catfile( $FindBin::Bin, 'asf', 'wma92-vbr.wma' );
+    $full = Audio::Scan->scan($asf);
+    $s = Audio::Scan->scan( $asf, { tags => [ 'title', 'wm/picture', 'IsVBR' ] } );
+    is_deeply( $s->{tags}, { map { $_ => $full->{tags}->{$_} } qw(Title WM/Picture IsVBR) }, 'projection ASF attributes ok' );
+
+    my $mpc = catfile( $FindBin::Bin, 'musepack', 'apev2-cover.mpc' );
+    $full = Audio::Scan->scan($mpc);
+    my $many = Audio::Scan->scan_many( [ $mpc ], { tags => [ 'Artist', 'Media Jukebox: Date' ] } );
+    is_deeply( $many->[0]->{tags}, { map { $_ => $full->{tags}->{$_} } ( 'ARTIST', 'MEDIA JUKEBOX: DATE' ) }, 'scan_many projection APE items ok' );
+
+    eval { Audio::Scan->scan( $path, { tags => 'TIT2' } ) };
+    like( $@, qr/tags option must be an array reference/, 'projection option type checked ok' );
+}
+
+# Test for the scan result cache
+SKIP:
+{
+    skip 'cache not supported on Windows', 8 if $^O =~ /Win32/;
+
+    require File::Copy;
+    require File::Temp;
+    my $dir   = File::Temp::tempdir( CLEANUP => 1 );
+    my $cache = catfile( $dir, 'scan.cache' );
+    my $path  = catfile( $dir, 'v2.3-xsop.mp3' );
+    File::Copy::copy( _f('v2.3-xsop.mp3'), $path );
+
+    my $full = Audio::Scan->scan($path);
+    is_deeply( Audio::Scan->scan( $path, { cache => $cache } ), $full, 'cache miss result ok' );
+    my $size = -s $cache;
+
+    # A hit must not read the file again, so its content can be anything as
+    # long as the path, size and mtime are the same
+    my $mtime = ( stat $path )[9];
+    open my $fh, '>', $path;
+    binmode $fh;
+    print $fh "\0" x -s _f('v2.3-xsop.mp3');
+    close $fh;
+    utime $mtime, $mtime, $path;
+    is_deeply( Audio::Scan->scan( $path, { cache => $cache } ), $full, 'cache hit result ok' );
+    is( -s $cache, $size, 'cache hit does not grow the cache ok' );
+    File::Copy::copy( _f('v2.3-xsop.mp3'), $path );
+
+    # Other options are stored separately
+    my $s = Audio::Scan->scan( $path, { cache => $cache, tags => [ 'TIT2' ] } );
+    is_deeply( [ keys %{ $s->{tags} } ], [ 'TIT2' ], 'cache keyed by projection ok' );
+
+    # A changed file is scanned again
+    utime time + 10, time + 10, $path;
+    $full = Audio::Scan->scan($path);
+    is_deeply( Audio::Scan->scan( $path, { cache => $cache } ), $full, 'cache rescans modified file ok' );
+    ok( -s $cache > $size, 'cache stores rescanned file ok' );
+
+    my $many = Audio::Scan->scan_many( [ $path, _f('v1.mp3') ], { cache => $cache } );
+    is_deeply( $many, [ $full, Audio::Scan->scan( _f('v1.mp3') ) ], 'scan_many with cache ok' );
+
+    # Processes creating and filling a new cache at the same time
+    my $shared = catfile( $dir, 'shared.cache' );
+    my @files  = map { _f($_) } qw(v1.mp3 v2.3-xsop.mp3 v2.4-apic-jpg.mp3 no-tags-no-xing-vbr.mp3);
+    my @pids;
+    for ( 1 .. 4 ) {
+        my $pid = fork;
+        if ( defined $pid && !$pid ) {
+            Audio::Scan->scan_many( \@files, { cache => $shared } );
+            require POSIX;
+            POSIX::_exit(0);
+        }
+        push @pids, $pid if $pid;
+    }
+    waitpid $_, 0 for @pids;
+
+    my @warnings;
+    local $SIG{__WARN__} = sub { push @warnings, @_ };
+    Audio::Scan->scan_many( \@files, { cache => $shared } );
+    is_deeply( \@warnings, [], 'cache shared by concurrent writers ok' );
+}
+
+# Test for detect_type
+{
+    my %files = (
+        mp3 => _f('v2.4-apic-jpg.mp3'),
+        flc => catfile( $FindBin::Bin, 'flac', 'id3tagged.flac' ),
+        ogg => catfile( $FindBin::Bin, 'ogg', 'test.ogg' ),
+        wvp => catfile( $FindBin::Bin, 'wavpack', 'v3.wv' ),
+        wav => catfile( $FindBin::Bin, 'wav', 'id3.wav' ),
+    );
+
+    my %got;
+    for my $type ( keys %files ) {
+        open my $fh, '<', $files{$type} or die "$files{$type}: $!";
+        $got{$type} = Audio::Scan->detect_type($fh);
+    }
+    is_deeply( \%got, { map { $_ => $_ } keys %files }, 'detect_type ok' );
+
+    open my $fh, '<', $files{flc};
+    seek $fh, 100, 0;
+    Audio::Scan->detect_type($fh);
+    is( tell $fh, 100, 'detect_type keeps file position ok' );
+
+    open $fh, '<', catfile( $FindBin::Bin, 'util.t' );
+    is( Audio::Scan->detect_type($fh), undef, 'detect_type unknown content ok' );
+
+    open $fh, '<', $files{flc};
+    my $s = Audio::Scan->scan_fh( undef, $fh );
+    open $fh, '<', $files{flc};
+    is_deeply( $s, Audio::Scan->scan_fh( flc => $fh ), 'scan_fh without type ok' );
+
+    # Misnamed files are scanned by their content
+    require File::Copy;
+    require File::Temp;
+    my $dir = File::Temp::tempdir( CLEANUP => 1 );
+    my $misnamed = catfile( $dir, 'really-flac.mp3' );
+    File::Copy::copy( $files{flc}, $misnamed );
+
+    $s = Audio::Scan->scan($misnamed);
+    is( $s->{info}->{samplerate}, Audio::Scan->scan( $files{flc} )->{info}->{samplerate}, 'scan misnamed file ok' );
+    is( $s->{info}->{md5}, Audio::Scan->scan( $files{flc} )->{info}->{md5}, 'scan misnamed file used FLAC parser ok' );
+
+    my $many = Audio::Scan->scan_many( [ $misnamed ] );
+    is_deeply( $many->[0]->{tags}, $s->{tags}, 'scan_many misnamed file ok' );
+
+    # An unknown extension is unsupported whatever the content
+    my $unknown = catfile( $dir, 'flac.xyz' );
+    File::Copy::copy( $files{flc}, $unknown );
+
+    eval { Audio::Scan->scan($unknown) };
+    like( $@, qr/unsupported file type: xyz/, 'scan unknown extension ok' );
+    eval { Audio::Scan->scan( $unknown, { cache => catfile( $dir, 'scan.cache' ) } ) };
+    like( $@, qr/unsupported file type: xyz/, 'scan cached unknown extension ok' );
+    {
+        my @warnings;
+        local $SIG{__WARN__} = sub { push @warnings, @_ };
+        is( Audio::Scan->scan_many( [ $unknown ] )->[0], undef, 'scan_many unknown extension ok' );
+        like( $warnings[0], qr/unsupported file type: xyz/, 'scan_many unknown extension warning ok' );
+    }
+
+    # MP3 in a RIFF wrapper keeps the parser of its extension
+    open my $in, '<', _f('no-tags-mp1l3.mp3');
+    binmode $in;
+    my $mp3 = do { local $/; <$in> };
+    close $in;
+
+    my $fmt  = pack( 'a4V vvVVvv', 'fmt ', 16, 0x55, 2, 44100, 16000, 1, 0 );
+    my $data = pack( 'a4V', 'data', length $mp3 ) . $mp3;
+    my $riff = catfile( $dir, 'riff.mp3' );
+    open my $out, '>', $riff;
+    binmode $out;
+    print $out pack( 'a4Va4', 'RIFF', 4 + length($fmt) + length($data), 'WAVE' ) . $fmt . $data;
+    close $out;
+
+    $s = Audio::Scan->scan($riff);
+    is( $s->{info}->{layer}, 1, 'scan RIFF-wrapped MP3 used MP3 parser ok' );
+    is( $s->{info}->{audio_offset}, 44, 'scan RIFF-wrapped MP3 audio offset ok' );
+}
+
+# Test for seek_context
+{
+    my @files = (
+        _f('v2.4-apic-jpg.mp3'),
+        map { catfile( $FindBin::Bin, @{$_} ) }
+            [ 'mp4', 'itunes811.m4a' ],
+            [ 'aac', 'stereo.aac' ],
+            [ 'flac', 'id3tagged.flac' ],
+            [ 'asf', 'wma92-vbr.wma' ],
+            [ 'ogg', 'normal.ogg' ],
+            [ 'opus', '3min_noise.opus' ],
+            [ 'ogf', 'test.ogf' ],
+    );
+    my @offsets = ( 0, 1, 500, 999, 2500, 60000 );
+
+    my $ctx = Audio::Scan->seek_context( $files[0] );
+    isa_ok( $ctx, 'Audio::Scan::SeekContext' );
+
+    my ( @got, @expected );
+    {
+        local $SIG{__WARN__} = sub {};
+        for my $file (@files) {
+            my $c = Audio::Scan->seek_context($file);
+            push @got, [ map { $c->find_frame($_) } @offsets, reverse @offsets ];
+            push @expected, [ map { Audio::Scan->find_frame( $file, $_ ) } @offsets, reverse @offsets ];
+        }
+    }
+    is_deeply( \@got, \@expected, 'seek_context find_frame matches find_frame ok' );
+
+    # A seek context keeps working after the file is gone
+    require File::Copy;
+    require File::Temp;
+    my $dir  = File::Temp::tempdir( CLEANUP => 1 );
+    my $copy = catfile( $dir, 'seek.m4a' );
+    File::Copy::copy( $files[1], $copy );
+    $ctx = Audio::Scan->seek_context($copy);
+    unlink $copy;
+    is( $ctx->find_frame(0), Audio::Scan->find_frame( $files[1], 0 ), 'seek_context holds the file open ok' );
+
+    is( Audio::Scan->seek_context( catfile( $FindBin::Bin, 'wav', 'id3.wav' ) ), undef, 'seek_context unsupported type ok' );
+
+    {
+        my $warning;
+        local $SIG{__WARN__} = sub { $warning = shift };
+        Audio::Scan->seek_context( catfile( $dir, 'missing.mp3' ) );
+        like( $warning, qr/Could not open/, 'seek_context missing file ok' );
+    }
+}
+
 sub _f {
     return catfile( $FindBin::Bin, 'mp3', shift );
 }